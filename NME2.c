@@ -16,6 +16,19 @@
 #include "utils.h"
 #include "wwriff.h"
 #include "bitmanip.h"
+#include "bnk.h"
+#include "cpk.h"
+#include "manifest.h"
+#include "dedup.h"
+#include "cache.h"
+#include "logger.h"
+#include "timing.h"
+#include "trace.h"
+#include "progress.h"
+#include "metrics.h"
+#include "process.h"
+#include "stage.h"
+#include "writer.h"
 
 // Parses arguments for video files
 void ParseVideoArgs(char* video_codec_opt, char* video_quality_opt, char* video_filter_opt, File* file, bool verbose);
@@ -23,10 +36,312 @@ void ParseVideoArgs(char* video_codec_opt, char* video_quality_opt, char* video_
 // Parses arguments for audio files
 void ParseAudioArgs(char* audio_codec_opt, char* audio_quality_opt, char* audio_sample_format_opt, File* file, bool verbose);
 
+// State shared by all conversions of a run
+typedef struct Session {
+    // NULL if the manifest couldn't be opened, nothing is skipped or recorded then
+    manifest* manifest;
+
+    // Converts everything again, but still records the outputs
+    bool force;
+
+    uint32_t success;
+    uint32_t failure;
+    uint32_t skipped;
+
+    // Tracks converted so far, identical ones are linked to the first output
+    dedup dedup;
+
+    // Outputs of earlier runs, NULL if no cache directory was given
+    cache* cache;
+
+    // Last job ID handed out, every conversion gets its own for the log
+    volatile LONG jobs;
+
+    // Reads the inputs converted from memory ahead of their turn
+    stage reader;
+
+    // Renders tracks into what their encoder or output takes, on all cores
+    stage rebuild;
+
+    // Encoders of the tracks still being converted, drained when no further input fits next to the ones converting
+    process_pool processes;
+
+    // Small tracks rendered and waiting to share an encoder, at most batch_size of them
+    struct TrackJob** batch;
+    membuf* batch_data;
+    uint32_t batched;
+    uint32_t batch_size;
+} Session;
+
+// Everything an output's manifest entry is compared against
+typedef struct InputStamp {
+    char* path;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t args_hash;
+
+    // The content hash is only computed when the write time changed or an output is recorded
+    uint64_t hash;
+    bool hashed;
+
+    // Outputs that are done, they're recorded again with the final count once the whole input succeeded
+    char** outputs;
+    uint32_t output_count;
+    uint32_t failures;
+
+    // Tracks handed on to be converted and not finished yet, the input is only finished once there are none
+    uint32_t pending;
+} InputStamp;
+
+// Reads the input's size and write time
+void StampInput(File* file, uint64_t args_hash, InputStamp* stamp);
+
+// Frees the stamp's path and output list
+void FreeStamp(InputStamp* stamp);
+
+// Returns true if every output of the input is up to date, so the input doesn't even have to be read
+bool SkipInput(Session* session, InputStamp* stamp);
+
+// Returns true if the file's current output is up to date
+bool SkipOutput(Session* session, InputStamp* stamp, File* file);
+
+// Records the file's current output as converted
+void RecordOutput(Session* session, InputStamp* stamp, File* file);
+
+// Counts a failed output, the input stays incomplete in the manifest
+void RecordFailure(Session* session, InputStamp* stamp);
+
+// Hands the session's tallies to the metrics file
+void PublishMetrics(Session* session);
+
+// Marks the input as complete if none of its outputs failed
+void FinishInput(Session* session, InputStamp* stamp);
+
+// Returns the input's content hash, reading the file the first time
+uint64_t StampHash(InputStamp* stamp);
+
+// Checks a manifest entry against the input
+bool EntryMatches(const manifest_entry* e, InputStamp* stamp);
+
+// Checks if the output file is still there
+bool OutputExists(const char* path);
+
+// Adds an output to the stamp's list of finished outputs
+void AddStampOutput(InputStamp* stamp, const char* output);
+
+// A track on its way to its output, finished once its encoder exited if it needed one
+typedef struct TrackJob {
+    Session* session;
+    InputStamp* stamp;
+
+    // A copy, the caller moves on to the next track with its own
+    File file;
+    char* output;
+
+    // Cache and dedup key, and the size of the WEM
+    uint64_t key;
+    uint64_t size;
+
+    // The next duplicate waiting for the same track's first conversion
+    struct TrackJob* next_duplicate;
+
+    // Length of the audio, for the status line
+    double seconds;
+
+    // Identifies the job in the log
+    uint32_t job;
+    int64_t started;
+
+    // NULL unless the track went to ffmpeg
+    char* cmd;
+
+    // The WEM and what the rebuild workers render from it, a WAV for PCM outputs and for ffmpeg or an Ogg for ffmpeg
+    membuf data;
+    format format;
+    pcm_format pcm_fmt;
+    membuf out;
+
+    // Small tracks for ffmpeg are decoded to WAV and share an encoder with other ones
+    bool batched;
+    errno_t err;
+    timing* timing;
+} TrackJob;
+
+// Hands one WEM held in memory to the rebuild workers, buf has to stay valid until the rebuild stage is drained
+void ConvertTrack(TrackJob* t, membuf* buf, pcm_format pcm_fmt);
+
+// Renders the track on a rebuild worker
+void RebuildTrack(void* item);
+
+// Hands a rendered track to its output, its encoder or its batch
+void TrackRebuilt(void* item);
+
+// Receives a track decoded in-process once its output is written
+void OutputWritten(void* ctx, errno_t err);
+
+// Receives the exit of a track's encoder
+void EncoderExited(void* ctx, int exit_code, errno_t write_err);
+
+// Tracks sharing one encoder
+typedef struct TrackBatch {
+    TrackJob** jobs;
+    uint32_t count;
+    char* cmd;
+    int64_t started;
+} TrackBatch;
+
+// Adds a rendered track to the session's batch, which is started once it's full
+void BatchTrack(TrackJob* t, membuf* data);
+
+// Starts one encoder for all batched tracks
+void FlushBatch(Session* session);
+
+// Receives the exit of a batch's encoder, its exit code stands for every track in it
+void BatchExited(void* ctx, int exit_code, errno_t write_err);
+
+// Waits for the rebuilds, starts the batched tracks and waits for every encoder and output, which finishes every input converting
+void FinishEncodes(Session* session);
+
+// Caches and remembers a newly converted output, then finishes the job
+void TrackConverted(TrackJob* t, errno_t err);
+
+// Records the job's output or failure and frees it
+void FinishTrack(TrackJob* t, errno_t err);
+
+// Converts the track, or links the output of an identical track converted earlier in this run
+void ConvertOrLinkTrack(Session* session, InputStamp* stamp, File* file, membuf* buf, pcm_format pcm_fmt);
+
+// Returns the hash of the file's resolved encoder arguments
+uint64_t ArgsHash(const File* file);
+
+// Copies the file's output from the cache, false if it's disabled or doesn't hold the key
+bool FetchCached(Session* session, File* file, uint64_t key, uint64_t size);
+
+// Adds the file's finished output to the cache if it's enabled
+void StoreCached(Session* session, File* file, uint64_t key, uint64_t size);
+
+// Prints the batch's time per stage and writes the per file reports that were asked for
+void ReportTimings(File* files, timing* timings, int n_files, char* csv_path, char* json_path);
+
+// Converts every WEM embedded in a WSP held in memory, outputs are named after the input with the track index
+void ConvertWsp(File* file, char* data, uint64_t size, Session* session, InputStamp* stamp);
+
+// Encoder options from the command line, NULL where the fallback is used
+typedef struct Options {
+    char* video_codec;
+    char* video_quality;
+    char* video_filter;
+    char* audio_codec;
+    char* audio_quality;
+    char* audio_sample_fmt;
+} Options;
+
+// An input read into memory by the read stage, ready once it's collected
+typedef struct InputRead {
+    fpath path;
+    char* data;
+    uint64_t size;
+
+    // Computed by the reader too, while the data is still in its cache
+    uint64_t hash;
+
+    // Only brings the file into the system cache for ffmpeg or the mapping, data stays NULL
+    bool warm;
+
+    timing* timing;
+    bool ready;
+} InputRead;
+
+// One input from its admission to its conversion
+typedef struct InputJob {
+    File* file;
+    int index;
+    timing* timing;
+
+    // Up to date, or not convertible, nothing is left to do then
+    bool skipped;
+    InputStamp stamp;
+
+    // Set unless the input is skipped, USMs and CPKs are only read into the system cache
+    InputRead* read;
+
+    // The read was handed to the reader, it waits for the input's turn or for room in the budgets until then
+    bool reading;
+
+    // Estimated peak memory of converting the input
+    uint64_t memory;
+
+    // Its tracks were handed on, it converts next to the other inputs until the last of them is finished
+    bool converting;
+    bool finished;
+    int64_t started;
+    uint64_t size;
+} InputJob;
+
+// Reads the input on the read stage's thread
+void ReadInput(void* item);
+
+// Marks the read as ready to convert
+void InputReady(void* item);
+
+// Parses the input's arguments, decides whether it's up to date and estimates its memory, reads are started by StartRead
+void AdmitInput(Session* session, const Options* options, InputJob* job);
+
+// Hands the input's read to the reader
+void StartRead(Session* session, InputJob* job);
+
+// Estimates the peak memory of converting the file from its size and format, once its arguments are parsed
+uint64_t EstimateMemory(const File* file, uint64_t size);
+
+// Splits an admitted input and hands its tracks on to be converted, returns the bytes read from it
+uint64_t ConvertInput(Session* session, const Options* options, InputJob* job);
+
+// Records the input in the manifest and frees it once its last track is finished, returns false while tracks are left
+bool FinishConvertedInput(Session* session, InputJob* job);
+
+// Where an input starts on its volume, inputs are converted in this order with --disk-order
+typedef struct DiskPosition {
+    uint64_t lcn;
+    uint64_t file_id;
+    int index;
+} DiskPosition;
+
+// Orders disk positions by their first cluster, then by file ID for files without one
+int CompareDiskPositions(const void* a, const void* b);
+
+// Returns the order to convert the inputs in, the order they were found in unless disk_order is set
+int* OrderInputs(File* files, int n_files, bool disk_order);
+
+// Options and counters shared by all entries of a CPK
+typedef struct CpkContext {
+    Session* session;
+    InputStamp* stamp;
+
+    // The archive with its video and audio arguments resolved once, the entries are copies of these
+    File video;
+    File audio;
+} CpkContext;
+
+// Sets up the entry's own File from the archive's video or audio one, named after the entry's directory and name
+void MakeCpkTrack(CpkContext* ctx, const cpk_entry* entry, File* track);
+
+// Converts one extracted CPK entry, USMs are piped into ffmpeg and WSPs and WEMs converted like loose files
+errno_t ConvertCpkEntry(void* ctx, const cpk_entry* entry, const uint8_t* data, uint64_t size);
+
 int main(int argc, char* argv[]) {
     VersionInfo version_info = PrintVersionInfo();
     UNUSED(version_info);
 
+#ifdef NME_MEMSTATS
+    // Has to happen before the first ffmpeg is started
+    mem_track_processes();
+#endif
+
+    // Lines are queued from here on, the flusher writes them until the process exits
+    if (logger_open(LOGGER_PATH) == 0) {
+        atexit(logger_close);
+    }
+
     // Check if ffmpeg is available
     if (system("where ffmpeg > nul 2>&1") != 0) {
         perrf("Exiting: ffmpeg not found");
@@ -64,6 +379,19 @@ int main(int argc, char* argv[]) {
     char* audio_quality_opt     = NULL;
     char* audio_sample_fmt_opt = NULL;
     char* pattern_opt           = NULL;
+    bool force                  = false;
+    char* cache_dir_opt         = NULL;
+    uint64_t cache_limit        = CACHE_DEFAULT_LIMIT;
+    char* timing_csv_opt        = NULL;
+    char* timing_json_opt       = NULL;
+    char* trace_opt             = NULL;
+    char* metrics_opt           = NULL;
+    uint32_t encoders           = 0;
+    uint32_t batch_size         = 1;
+    uint32_t rebuilders         = 0;
+    uint64_t read_ahead_limit   = READ_AHEAD_DEFAULT_BUDGET;
+    bool disk_order             = false;
+    uint64_t mem_limit          = UINT64_MAX;
     for (int i = 2; i < argc; i++) {
         if (strcmp(argv[i], "-vc") == 0) {
             if (i + 1 >= argc) {
@@ -121,6 +449,98 @@ int main(int argc, char* argv[]) {
             }
 
             pattern_opt = argv[++i];
+        } else if (strcmp(argv[i], "-f") == 0) {
+            force = true;
+        } else if (strcmp(argv[i], "-cd") == 0) {
+            if (i + 1 >= argc) {
+                perrf("-cd needs a value\n");
+
+                return 1;
+            }
+
+            cache_dir_opt = argv[++i];
+        } else if (strcmp(argv[i], "-cs") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                perrf("-cs needs a size in MiB\n");
+
+                return 1;
+            }
+
+            cache_limit = (uint64_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "-tc") == 0) {
+            if (i + 1 >= argc) {
+                perrf("-tc needs a value\n");
+
+                return 1;
+            }
+
+            timing_csv_opt = argv[++i];
+        } else if (strcmp(argv[i], "-tj") == 0) {
+            if (i + 1 >= argc) {
+                perrf("-tj needs a value\n");
+
+                return 1;
+            }
+
+            timing_json_opt = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) {
+                perrf("--trace needs a value\n");
+
+                return 1;
+            }
+
+            trace_opt = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (i + 1 >= argc) {
+                perrf("--metrics needs a value\n");
+
+                return 1;
+            }
+
+            metrics_opt = argv[++i];
+        } else if (strcmp(argv[i], "--read-ahead") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                perrf("--read-ahead needs a size in MiB\n");
+
+                return 1;
+            }
+
+            read_ahead_limit = (uint64_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--mem-limit") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                perrf("--mem-limit needs a size in MiB\n");
+
+                return 1;
+            }
+
+            mem_limit = (uint64_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--disk-order") == 0) {
+            disk_order = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                perrf("-j needs a number of encoders\n");
+
+                return 1;
+            }
+
+            encoders = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0 || atoi(argv[i + 1]) > BATCH_TRACKS_MAX) {
+                perrf("-b needs a number of tracks between 1 and %i\n", BATCH_TRACKS_MAX);
+
+                return 1;
+            }
+
+            batch_size = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                perrf("-w needs a number of threads\n");
+
+                return 1;
+            }
+
+            rebuilders = (uint32_t)atoi(argv[++i]);
         } else {
             perrf("Unknown option '%s'\n", argv[i]);
 
@@ -150,11 +570,21 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Like the log, the trace is finished when the process exits
+    if (trace_opt && trace_open(trace_opt) == 0) {
+        atexit(trace_close);
+    }
+
+    // Written a last time on exit, so a monitor also sees runs that stopped early
+    if (metrics_opt && metrics_open(metrics_opt) == 0) {
+        atexit(metrics_close);
+    }
+
     wchar_t* input_path_w = MakePathW(input_path);
     WIN32_FIND_DATA find_data;
     HANDLE h_find;
 
-    
+    int64_t discovery_started = trace_clock();
 
     // Continue if a file is found, display error message if not
     if ((h_find = FindFirstFile(input_path_w, &find_data)) != INVALID_HANDLE_VALUE) {
@@ -165,6 +595,10 @@ int main(int argc, char* argv[]) {
         } while (FindNextFile(h_find, &find_data) != 0);
 
         File* files = calloc(n, sizeof(File));
+
+        // Sizes from the directory listing, they drive the ETA of the status line
+        uint64_t* input_sizes = calloc(n, sizeof(uint64_t));
+        uint64_t total_bytes = 0;
         // Loop through all files
         bool overwrite_all = false;
         FindClose(h_find);
@@ -199,7 +633,10 @@ int main(int argc, char* argv[]) {
             if (strcmp(current_file.input.ext, ".") == 0) {
                 continue;
             }
+            int64_t sniff_started = trace_clock();
             current_file.format = GetFileFormat(current_file.input);
+            trace_span("input", "sniff", sniff_started, "%s%s format %i", current_file.input.fname, current_file.input.ext, current_file.format);
+            current_file.piped = false;
 #if 0
             if (!overwrite_all) {
                 DWORD attr = GetFileAttributes(MakePathW(current_file.output));
@@ -218,157 +655,268 @@ int main(int argc, char* argv[]) {
 #endif
 
             files[n_files] = current_file;
+            input_sizes[n_files] = (uint64_t)find_data.nFileSizeHigh << 32 | find_data.nFileSizeLow;
+            total_bytes += input_sizes[n_files];
             n_files++;
         } while (FindNextFile(h_find, &find_data) != 0);
 
         FindClose(h_find);
 
-        uint32_t success = 0;
-        uint32_t failure = 0;
-        for (int i = 0; i < n_files; i++) {
-            switch(files[i].format) {
-                case FORMAT_USM: {
-                        ParseVideoArgs(video_codec_opt, video_quality_opt, video_filter_opt, &files[i], i == 0);
-                        char* cmd = ConstructCommand(&files[i]);
+        trace_span("input", "discover", discovery_started, "%i files", n_files);
 
-                        WriteToLog(cmd);
+        // The manifest lives next to the inputs and remembers what was converted with which settings
+        fpath manifest_path = input_path;
+        strcpy_s(manifest_path.fname, _MAX_FNAME, MANIFEST_NAME);
+        strcpy_s(manifest_path.ext, _MAX_EXT, "");
 
-                        printf("\nStarting conversion %i of %i\n\n", i + 1, n_files);
+        char* manifest_path_str = MakePath(manifest_path);
+        manifest mf;
 
-                        int ffmpeg = system(cmd);
+        Session session;
+        session.manifest = manifest_open(&mf, manifest_path_str) == 0 ? &mf : NULL;
+        session.force = force;
+        session.success = 0;
+        session.failure = 0;
+        session.skipped = 0;
+        session.jobs = 0;
 
-                        free(cmd);
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
 
-                        if (ffmpeg != 0) {
-                            perrf("\nConversion %i failed with status code %i\n", i + 1, ffmpeg);
-                            failure++;
-                        } else {
-                            printf("\nConversion %i succesful\n", i + 1);
-                            success++;
-                        }
+        // One encoder per processor keeps them all busy, most audio encoders only use one thread
+        if (encoders == 0) {
+            encoders = info.dwNumberOfProcessors;
+        }
 
-                        char* finished_msg = malloc(37);
+        if (rebuilders == 0) {
+            rebuilders = info.dwNumberOfProcessors;
+        }
 
-                        sprintf_s(finished_msg, 37, "Conversion finished with exit code %i", ffmpeg);
+        if (process_pool_open(&session.processes, encoders) != 0) {
+            return 1;
+        }
 
-                        finished_msg = TRIM(finished_msg);
+        // A single reader keeps the reads sequential, the rebuild queue holds enough tracks to keep every worker busy
+        if (stage_open(&session.reader, "reader", 1, READ_AHEAD_INPUTS + 1, ReadInput, InputReady) != 0 ||
+            stage_open(&session.rebuild, "rebuild", rebuilders, rebuilders * REBUILD_QUEUE_PER_THREAD, RebuildTrack, TrackRebuilt) != 0) {
+            return 1;
+        }
 
-                        WriteToLog(finished_msg);
+        if (writer_open() != 0) {
+            return 1;
+        }
 
-                        free(finished_msg);
+        session.batch = malloc(batch_size * sizeof(TrackJob*));
+        session.batch_data = malloc(batch_size * sizeof(membuf));
+        session.batched = 0;
+        session.batch_size = batch_size;
 
-                        break;
-                    }
+        dedup_init(&session.dedup);
 
-                case FORMAT_WSP: {
-                        ParseAudioArgs(audio_codec_opt, audio_quality_opt, audio_sample_fmt_opt, &files[i], i == 0);
+        cache transcode_cache;
+        session.cache = NULL;
 
-                        strcpy_s(files[i].output.drive, _MAX_DRIVE, files[i].input.drive);
-                        strcpy_s(files[i].output.dir, _MAX_DIR, files[i].input.dir);
+        if (cache_dir_opt) {
+            if (cache_open(&transcode_cache, cache_dir_opt, cache_limit) == 0) {
+                session.cache = &transcode_cache;
+            } else {
+                pwarnf("Continuing without a cache\n");
+            }
+        }
 
-                        // Read the entire input file into memory
-                        FILE* infile;
-                        fopen_s(&infile, MakePath(files[i].input), "rb");
+        free(manifest_path_str);
 
-                        fseek(infile, 0, SEEK_END);
-                        long file_size = ftell(infile);
-                        fseek(infile, 0, SEEK_SET);
+        if (!session.manifest) {
+            pwarnf("Continuing without a manifest, nothing will be skipped\n");
+        }
 
-                        char* data = malloc(file_size);
-                        size_t read = fread(data, file_size, 1, infile);
+        // One record per input, the stages of everything it contains are charged to it
+        timing* timings = calloc(n_files ? n_files : 1, sizeof(timing));
 
-                        fclose(infile);
+        // Per job messages only go to the log from here on, the console gets a single status line
+        progress_open(n_files, total_bytes);
 
-                        // Shouldn't happen, could happen
-                        if (read < 4) {
-                            perrf("Error reading file %s\n", MakePath(files[i].input));
+        Options options = { video_codec_opt, video_quality_opt, video_filter_opt, audio_codec_opt, audio_quality_opt, audio_sample_fmt_opt };
+        InputJob* jobs = calloc(n_files ? n_files : 1, sizeof(InputJob));
+        int admitted = 0;
 
-                            exit(1);
-                        }
+        // Jobs are kept in the order they're converted in, the inputs, their timings and the reports keep the order they were found in
+        int* order = OrderInputs(files, n_files, disk_order);
 
-                        // Count the occurences of the RIFF header
-                        bool end_reached = false;
-                        uint64_t start = 0;
-                        uint64_t count = 0;
-                        while (!end_reached) {
-                            uint64_t end = split_bytes(data, file_size, "RIFF", 4, start + 1);
+        // Inputs convert side by side while their estimates fit under the memory limit, the ones before first are all finished
+        int first = 0;
+        int next = 0;
+        uint64_t converting = 0;
+        uint32_t in_flight = 0;
 
-                            if (end == -1) {
-                                end_reached = true;
-                            }
+        while (next < n_files) {
+            // Admitting only parses the arguments and checks the manifest, so the window is always full
+            for (; admitted < n_files && admitted <= next + READ_AHEAD_INPUTS; admitted++) {
+                int index = order[admitted];
 
-                            start = end + 1;
-                            count++;
-                        }
+                jobs[admitted].file = &files[index];
+                jobs[admitted].index = index;
+                jobs[admitted].timing = &timings[index];
+                jobs[admitted].size = input_sizes[index];
 
-                        // Save each embeded file individually in memory
-                        char** files_mem = malloc(count * sizeof(char*));
-                        uint64_t* sizes = calloc(count, sizeof(uint64_t));
-                        start = 0;
-                        for (uint64_t j = 0; j < count; j++) {
-                            uint64_t end = split_bytes(data, file_size, "RIFF", 4, start + 1);
+                AdmitInput(&session, &options, &jobs[admitted]);
+            }
 
-                            if (end == -1) {
-                                end = file_size;
-                            }
+            // Inputs whose last track finished meanwhile give their estimate back
+            for (int j = first; j < admitted; j++) {
+                if (jobs[j].converting && FinishConvertedInput(&session, &jobs[j])) {
+                    converting -= jobs[j].memory;
+                    in_flight--;
+                }
+            }
 
-                            char* f = malloc(end - start);
-                            memcpy_s(f, end - start, &data[start], end - start);
+            while (first < next && jobs[first].finished) {
+                first++;
+            }
 
-                            files_mem[j] = f;
-                            sizes[j] = end - start;
+            // Bytes of the inputs waiting for their turn that are read already or being read, and the part of them held in memory
+            uint64_t read_ahead = 0;
+            uint64_t read_held = 0;
 
-                            start = end + 1;
-                        }
+            for (int j = next; j < admitted; j++) {
+                if (jobs[j].reading && !jobs[j].converting && !jobs[j].finished) {
+                    read_ahead += jobs[j].size;
+                    read_held += jobs[j].read->warm ? 0 : jobs[j].size;
+                }
+            }
 
-                        free(data);
+            // The next input converts if its estimate fits next to the ones converting, otherwise a smaller one after it fills the gap
+            InputJob* job = NULL;
 
-                        // Convert all files
-                        for (uint64_t j = 0; j < count; j++) {
-                            sprintf_s(files[i].output.fname, _MAX_FNAME, "%s_[%lli]", files[i].input.fname, j);
-                            char* cmd = ConstructCommand(&files[i]);
-                            WriteToLog(cmd);
+            for (int j = next; j < admitted && !job; j++) {
+                if (jobs[j].converting || jobs[j].finished) {
+                    continue;
+                }
 
-                            printf("\nStarting conversion %lli of %lli\n\n", j + 1, count);
+                // Its own read is part of its estimate
+                uint64_t held = jobs[j].reading && !jobs[j].read->warm ? jobs[j].size : 0;
 
-                            FILE* conversion = _popen(cmd, "wb");
+                if (in_flight == 0 || converting + read_held - held + jobs[j].memory <= mem_limit) {
+                    job = &jobs[j];
+                }
+            }
 
-                            free(cmd);
+            // Nothing fits until the inputs converting are finished
+            if (!job) {
+                FinishEncodes(&session);
 
-                            membuf buf;
-                            buf.data = files_mem[j];
-                            buf.size = sizes[j];
-                            buf.pos = 0;
+                continue;
+            }
 
-                            errno_t err = create_ogg(&buf, conversion);
+            if (job->memory > mem_limit) {
+                logger_write(LOGGER_NO_JOB, "admit", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "%s%s needs about %llu MiB, more than the memory limit",
+                    job->file->input.fname, job->file->input.ext, job->memory >> 20);
+            }
 
-                            _pclose(conversion);
+            if (job->reading) {
+                read_ahead -= job->size;
+                read_held -= job->read->warm ? 0 : job->size;
+            } else if (job->read && job->read->warm) {
+                // Filling the cache right before ffmpeg or the mapping reads the file gains nothing
+                free(job->read);
+                job->read = NULL;
+            } else if (job->read) {
+                // Read right here, so the input never waits behind the reads of the inputs after it
+                ReadInput(job->read);
+                InputReady(job->read);
+            }
 
-                            free(files_mem[j]);
+            job->converting = true;
+            converting += job->memory;
+            in_flight++;
 
-                            if (err != 0) {
-                                perrf("\nConversion %lli failed with status code %lli\n", j + 1, err);
-                                failure++;
-                            } else {
-                                printf("\nConversion %lli succesful\n", j + 1);
-                                success++;
-                            }
-                        }
+            // The inputs waiting are read while they fit next to everything converting, one that doesn't lets the smaller ones after it go first
+            for (int j = next; j < admitted; j++) {
+                InputJob* ahead = &jobs[j];
 
-                        free(files_mem);
-                        free(sizes);
-                        break;
-                    }
-                default:
-                    perrf("Unknown format %i for '%s'\n", files[i].format, MakePath(files[i].input));
+                if (!ahead->read || ahead->reading || ahead->converting || ahead->finished) {
+                    continue;
+                }
+
+                uint64_t held = ahead->read->warm ? 0 : ahead->size;
+
+                if (read_ahead + ahead->size > read_ahead_limit || converting + read_held + held > mem_limit) {
+                    continue;
+                }
+
+                StartRead(&session, ahead);
+
+                read_ahead += ahead->size;
+                read_held += held;
+            }
 
-                    failure++;
+            // Inputs that are up to date are never read
+            uint64_t bytes_read = 0;
+
+            timing_bind(job->timing);
+
+            job->started = trace_clock();
+
+            if (!job->skipped) {
+                bytes_read = ConvertInput(&session, &options, job);
+            }
+
+            timing_bind(NULL);
+            metrics_input(job->file->format, bytes_read);
+
+            while (next < admitted && (jobs[next].converting || jobs[next].finished)) {
+                next++;
+            }
+        }
+
+        // The inputs still converting are finished along with their last tracks
+        FinishEncodes(&session);
+
+        for (int j = first; j < n_files; j++) {
+            if (jobs[j].converting) {
+                FinishConvertedInput(&session, &jobs[j]);
             }
         }
 
+        free(jobs);
+        free(order);
+
+        stage_close(&session.reader);
+        stage_close(&session.rebuild);
+        process_pool_close(&session.processes);
+        writer_close();
+        free(session.batch);
+        free(session.batch_data);
+        progress_close();
+        free(input_sizes);
+
+        if (session.manifest) {
+            manifest_close(session.manifest);
+        }
+
+        if (session.dedup.duplicates != 0) {
+            printf("\n%u duplicate tracks were linked instead of converted, saving %.1f MiB of input\n",
+                session.dedup.duplicates, session.dedup.duplicate_bytes / (1024. * 1024.));
+        }
+
+        dedup_free(&session.dedup);
+
+        if (session.cache) {
+            uint32_t lookups = session.cache->hits + session.cache->misses;
+
+            printf("Cache: %u hits, %u misses (%.0f%% hit rate), %u stored, %u evicted, %.1f MiB in use\n",
+                session.cache->hits, session.cache->misses, lookups ? 100. * session.cache->hits / lookups : 0.,
+                session.cache->stores, session.cache->evictions, session.cache->size / (1024. * 1024.));
+
+            cache_close(session.cache);
+        }
+
+        // Everything charged to the records is freed by now, so they can go last
+        ReportTimings(files, timings, n_files, timing_csv_opt, timing_json_opt);
+        free(timings);
         free(files);
 
-        printf("\nConverted %i files. Success: %u, failures: %u\n", n_files, success, failure);
+        printf("\nConverted %i files. Success: %u, failures: %u, up to date: %u\n", n_files, session.success, session.failure, session.skipped);
     } else {
         if (GetLastError() == ERROR_FILE_NOT_FOUND) {
             perrf("No files found");
@@ -499,7 +1047,7 @@ void ParseVideoArgs(char* video_codec_opt, char* video_quality_opt, char* video_
         }
     } else {
         if (verbose) {
-            puts("Filters not specified, using fallback 'crop=1600:900:0:0'");
+            pwarnf("Filters not specified, using fallback 'crop=1600:900:0:0'\n");
         }
 
         file->args.video_args.filters = "-vf crop=1600:900:0:0";
@@ -764,7 +1312,7 @@ void ParseAudioArgs(char* audio_codec_opt, char* audio_quality_opt, char* audio_
         }
 
         if (strlen(sample_fmt) > 0 && strcmp(sample_fmt, "-sample_fmt fltp") != 0 && strcmp(sample_fmt, "-sample_fmt flt") != 0 && verbose) {
-            printf("Sample format not specified, using fallback '%s'\n", sample_fmt);
+            pwarnf("Sample format not specified, using fallback '%s'\n", sample_fmt);
         }
     }
 
@@ -783,4 +1331,1193 @@ void ParseAudioArgs(char* audio_codec_opt, char* audio_quality_opt, char* audio_
         strcmp(file->args.audio_args.encoder, PCM_S32_CODEC) == 0 || strcmp(file->args.audio_args.encoder, PCM_S64_CODEC) == 0) {
         strcpy_s(file->output.ext, _MAX_EXT, ".wav");
     }
-}
\ No newline at end of file
+}
+
+void ConvertTrack(TrackJob* t, membuf* buf, pcm_format pcm_fmt) {
+    wem_info info;
+
+    t->started = logger_clock_us();
+
+    // Embedded files can each use a different codec
+    t->format = read_wem_info(buf, &info) == 0 ? GetWemFormat(info.codec) : FORMAT_WSP;
+    t->pcm_fmt = pcm_fmt;
+    t->data = *buf;
+    t->data.pos = 0;
+    t->out.data = NULL;
+    t->out.size = 0;
+    t->out.pos = 0;
+    t->err = 0;
+    t->batched = pcm_fmt == PCM_FMT_NIL && t->session->batch_size > 1 && buf->size <= BATCH_TRACK_SIZE;
+
+    // The workers charge the rendering to the input the track belongs to
+    t->timing = timing_bound();
+
+    // PCM outputs are decoded in-process, everything else goes through ffmpeg
+    if (pcm_fmt != PCM_FMT_NIL) {
+        logger_write(t->job, "decode", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Decoding in-process to %s", t->output);
+    }
+
+    // Waiting for room in the queue hands the tracks that are done to their encoders meanwhile
+    stage_submit(&t->session->rebuild, t);
+}
+
+void RebuildTrack(void* item) {
+    TrackJob* t = item;
+    int64_t started = trace_clock();
+
+    timing_bind(t->timing);
+
+    // The whole input is built in memory first, so a slow encoder never holds up the next track
+    // PCM and ADPCM are handed to ffmpeg as WAV, without a Vorbis rebuild, and so are the Vorbis tracks of a batch
+    if (t->pcm_fmt == PCM_FMT_NIL && t->format == FORMAT_WSP && !t->batched) {
+        t->err = create_ogg_buffer(&t->data, &t->out);
+
+        trace_span("track", "rebuild", started, "%s", t->output);
+    } else {
+        timing_stage previous = timing_enter(TIMING_DECODE);
+        t->err = create_wav_buffer(&t->data, &t->out, t->pcm_fmt);
+        timing_leave(previous);
+
+        trace_span("track", "decode", started, "%s", t->output);
+    }
+
+    timing_bind(NULL);
+}
+
+void TrackRebuilt(void* item) {
+    TrackJob* t = item;
+
+    if (t->pcm_fmt != PCM_FMT_NIL) {
+        if (t->err != 0) {
+            free(t->out.data);
+            OutputWritten(t, t->err);
+
+            return;
+        }
+
+        // The writer threads open, write and close the file while the next tracks are decoded
+        writer_submit(t->output, t->out.data, t->out.pos, OutputWritten, t);
+
+        return;
+    }
+
+    // Small WAV tracks wait for others, so one ffmpeg start is shared by many of them
+    if (t->err == 0 && t->batched) {
+        BatchTrack(t, &t->out);
+
+        return;
+    }
+
+    process* encoder;
+    File track = t->file;
+    track.format = t->format;
+    t->cmd = ConstructCommand(&track);
+
+    if (t->err != 0 || process_start(&t->session->processes, t->cmd, EncoderExited, t, &encoder) != 0) {
+        free(t->out.data);
+        TrackConverted(t, t->err != 0 ? t->err : 1);
+
+        return;
+    }
+
+    logger_write(t->job, "encode", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "%s", t->cmd);
+
+    // The pool frees the buffer once the pipe took all of it
+    process_write(encoder, t->out.data, t->out.pos, t->out.data);
+    process_end_input(encoder);
+}
+
+void OutputWritten(void* ctx, errno_t err) {
+    TrackJob* t = ctx;
+    int64_t duration = logger_clock_us() - t->started;
+
+    logger_write(t->job, "decode", duration, err, "Finished %s", t->output);
+    metrics_encode(t->file.args.audio_args.encoder, duration);
+
+    TrackConverted(t, err);
+}
+
+void EncoderExited(void* ctx, int exit_code, errno_t write_err) {
+    TrackJob* t = ctx;
+    int64_t duration = logger_clock_us() - t->started;
+
+    trace_exit("encoder", "ffmpeg", t->started, exit_code, "%s", t->cmd);
+    logger_write(t->job, "encode", duration, exit_code, "Finished %s", t->output);
+    metrics_encode(t->file.args.audio_args.encoder, duration);
+
+    // An encoder that stopped reading early may still exit cleanly, but its output is cut short
+    TrackConverted(t, write_err != 0 ? write_err : exit_code);
+}
+
+void BatchTrack(TrackJob* t, membuf* data) {
+    Session* session = t->session;
+
+    session->batch[session->batched] = t;
+    session->batch_data[session->batched] = *data;
+    session->batched++;
+
+    if (session->batched == session->batch_size) {
+        FlushBatch(session);
+    }
+}
+
+void FlushBatch(Session* session) {
+    uint32_t count = session->batched;
+
+    if (count == 0) {
+        return;
+    }
+
+    session->batched = 0;
+
+    TrackBatch* b = malloc(sizeof(TrackBatch));
+    b->jobs = malloc(count * sizeof(TrackJob*));
+    b->count = count;
+    b->cmd = NULL;
+    b->started = logger_clock_us();
+
+    memcpy(b->jobs, session->batch, count * sizeof(TrackJob*));
+
+    // Waiting for a slot may finish earlier tracks, but never starts another batch
+    process* encoder;
+    errno_t err = process_prepare(&session->processes, count, &encoder);
+
+    if (err == 0) {
+        File** files = malloc(count * sizeof(File*));
+        const char** inputs = malloc(count * sizeof(char*));
+
+        for (uint32_t i = 0; i < count; i++) {
+            files[i] = &b->jobs[i]->file;
+            inputs[i] = process_input_path(encoder, i);
+        }
+
+        b->cmd = ConstructBatchCommand(files, inputs, count);
+
+        free(files);
+        free(inputs);
+
+        err = process_launch(encoder, b->cmd, BatchExited, b);
+    }
+
+    if (err != 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            free(session->batch_data[i].data);
+            TrackConverted(b->jobs[i], err);
+        }
+
+        free(b->cmd);
+        free(b->jobs);
+        free(b);
+
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        logger_write(b->jobs[i]->job, "encode", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Batched with %u tracks: %s", count, b->cmd);
+
+        process_write_input(encoder, i, session->batch_data[i].data, session->batch_data[i].pos, session->batch_data[i].data);
+    }
+
+    process_end_input(encoder);
+}
+
+void BatchExited(void* ctx, int exit_code, errno_t write_err) {
+    TrackBatch* b = ctx;
+    int64_t duration = logger_clock_us() - b->started;
+
+    trace_exit("encoder", "ffmpeg", b->started, exit_code, "%u tracks", b->count);
+
+    for (uint32_t i = 0; i < b->count; i++) {
+        TrackJob* t = b->jobs[i];
+
+        logger_write(t->job, "encode", duration, exit_code, "Finished %s", t->output);
+
+        // The tracks share the encode, each is charged its part
+        metrics_encode(t->file.args.audio_args.encoder, duration / b->count);
+
+        TrackConverted(t, write_err != 0 ? write_err : exit_code);
+    }
+
+    free(b->cmd);
+    free(b->jobs);
+    free(b);
+}
+
+void FinishEncodes(Session* session) {
+    stage_drain(&session->rebuild);
+    FlushBatch(session);
+    process_drain(&session->processes);
+    writer_drain();
+}
+
+void TrackConverted(TrackJob* t, errno_t err) {
+    Session* session = t->session;
+
+    if (err == 0) {
+        StoreCached(session, &t->file, t->key, t->size);
+    }
+
+    TrackJob* w = dedup_end(&session->dedup, t->key, t->size, err == 0 ? t->output : NULL);
+
+    // The duplicates queued behind this conversion share its result
+    while (w) {
+        TrackJob* next = w->next_duplicate;
+
+        if (strcmp(w->output, t->output) == 0) {
+            FinishTrack(w, err);
+        } else if (err == 0 && LinkOrCopyFile(t->output, w->output)) {
+            logger_write(w->job, "link", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Linked %s to %s", w->output, t->output);
+
+            session->dedup.duplicates++;
+            session->dedup.duplicate_bytes += w->size;
+
+            FinishTrack(w, 0);
+        } else {
+            FinishTrack(w, err != 0 ? err : 1);
+        }
+
+        w = next;
+    }
+
+    FinishTrack(t, err);
+}
+
+void FinishTrack(TrackJob* t, errno_t err) {
+    progress_end(err == 0, t->size, t->seconds);
+
+    if (err != 0) {
+        perrf("\nConversion of %s failed with status code %i\n", t->output, err);
+        RecordFailure(t->session, t->stamp);
+    } else {
+        RecordOutput(t->session, t->stamp, &t->file);
+    }
+
+    t->stamp->pending--;
+
+    free(t->cmd);
+    free(t->output);
+    free(t);
+}
+
+void ConvertOrLinkTrack(Session* session, InputStamp* stamp, File* file, membuf* buf, pcm_format pcm_fmt) {
+    TrackJob* t = malloc(sizeof(TrackJob));
+    wem_info info;
+
+    t->session = session;
+    t->stamp = stamp;
+    t->file = *file;
+    t->output = MakePath(file->output);
+    t->size = buf->size;
+    t->job = InterlockedIncrement(&session->jobs);
+    t->started = logger_clock_us();
+    t->cmd = NULL;
+    t->next_duplicate = NULL;
+
+    stamp->pending++;
+
+    // Identical bytes converted with identical settings give identical outputs
+    t->key = hash64(buf->data, buf->size, ArgsHash(file));
+
+    // Linked and cached tracks count as converted audio as well
+    t->seconds = read_wem_info(buf, &info) == 0 && info.sample_rate != 0 ? (double)info.sample_count / info.sample_rate : 0;
+
+    dedup_entry* e = dedup_find(&session->dedup, t->key, buf->size);
+
+    progress_begin();
+
+    // The first copy is still converting, this one is linked to it once it's done
+    if (e && e->pending) {
+        t->next_duplicate = e->waiters;
+        e->waiters = t;
+
+        return;
+    }
+
+    if (e && e->output && strcmp(e->output, t->output) != 0 && LinkOrCopyFile(e->output, t->output)) {
+        logger_write(t->job, "link", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Linked %s to %s", t->output, e->output);
+
+        session->dedup.duplicates++;
+        session->dedup.duplicate_bytes += buf->size;
+
+        FinishTrack(t, 0);
+
+        return;
+    }
+
+    // Breaks a hard link from an earlier run, so the new output doesn't overwrite the linked copies
+    DeleteFileA(t->output);
+
+    if (FetchCached(session, file, t->key, buf->size)) {
+        dedup_add(&session->dedup, t->key, buf->size, t->output);
+        FinishTrack(t, 0);
+
+        return;
+    }
+
+    dedup_begin(&session->dedup, t->key, buf->size);
+    ConvertTrack(t, buf, pcm_fmt);
+}
+
+uint64_t ArgsHash(const File* file) {
+    hash_state h;
+
+    hash_init(&h, 0);
+    HashArgs(&h, file);
+
+    return hash_digest(&h);
+}
+
+bool FetchCached(Session* session, File* file, uint64_t key, uint64_t size) {
+    if (!session->cache) {
+        return false;
+    }
+
+    char* output = MakePath(file->output);
+    bool hit = cache_fetch(session->cache, key, size, file->output.ext, output);
+
+    if (hit) {
+        logger_write(LOGGER_NO_JOB, "cache", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Copied %s from the cache", output);
+    }
+
+    free(output);
+
+    return hit;
+}
+
+void StoreCached(Session* session, File* file, uint64_t key, uint64_t size) {
+    if (!session->cache) {
+        return;
+    }
+
+    char* output = MakePath(file->output);
+
+    cache_store(session->cache, key, size, file->output.ext, output);
+
+    free(output);
+}
+
+void ReportTimings(File* files, timing* timings, int n_files, char* csv_path, char* json_path) {
+    timing total;
+    timing_reset(&total);
+
+    for (int i = 0; i < n_files; i++) {
+        timing_add(&total, &timings[i]);
+    }
+
+    timing_print(&total, n_files);
+
+#ifdef NME_MEMSTATS
+    mem_print();
+
+    int largest = 0;
+    for (int i = 1; i < n_files; i++) {
+        if (timings[i].memory.peak > timings[largest].memory.peak) {
+            largest = i;
+        }
+    }
+
+    if (n_files != 0) {
+        printf("Largest job: '%s%s' with %.1f MiB allocated at its peak\n", files[largest].input.fname, files[largest].input.ext,
+            timings[largest].memory.peak / (1024. * 1024.));
+    }
+#endif
+
+    if (!csv_path && !json_path) {
+        return;
+    }
+
+    char** names = malloc((n_files ? n_files : 1) * sizeof(char*));
+
+    for (int i = 0; i < n_files; i++) {
+        names[i] = MakePath(files[i].input);
+    }
+
+    if (csv_path && timing_write_csv(csv_path, names, timings, n_files) == 0) {
+        printf("Wrote the timings to '%s'\n", csv_path);
+    }
+
+    if (json_path && timing_write_json(json_path, names, timings, n_files) == 0) {
+        printf("Wrote the timings to '%s'\n", json_path);
+    }
+
+    for (int i = 0; i < n_files; i++) {
+        free(names[i]);
+    }
+
+    free(names);
+}
+
+void ConvertWsp(File* file, char* data, uint64_t size, Session* session, InputStamp* stamp) {
+    // Count the occurences of the RIFF header
+    bool end_reached = false;
+    uint64_t start = 0;
+    uint64_t count = 0;
+    timing_stage previous = timing_enter(TIMING_SPLIT);
+    while (!end_reached) {
+        uint64_t end = split_bytes(data, size, "RIFF", 4, start + 1);
+
+        if (end == -1) {
+            end_reached = true;
+        }
+
+        start = end + 1;
+        count++;
+    }
+    timing_leave(previous);
+
+    progress_queue((uint32_t)count);
+
+    pcm_format pcm_fmt = GetPcmFormat(file->args.audio_args.encoder);
+
+    // Convert all files, each one is a view into the WSP
+    start = 0;
+    for (uint64_t j = 0; j < count; j++) {
+        previous = timing_enter(TIMING_SPLIT);
+        uint64_t end = split_bytes(data, size, "RIFF", 4, start + 1);
+        timing_leave(previous);
+
+        if (end == -1) {
+            end = size;
+        }
+
+        sprintf_s(file->output.fname, _MAX_FNAME, "%s_[%lli]", file->input.fname, j);
+
+        membuf buf;
+        buf.data = &data[start];
+        buf.size = end - start;
+        buf.pos = 0;
+
+        start = end + 1;
+
+        if (SkipOutput(session, stamp, file)) {
+            progress_skip();
+
+            continue;
+        }
+
+        ConvertOrLinkTrack(session, stamp, file, &buf, pcm_fmt);
+    }
+}
+
+void ReadInput(void* item) {
+    InputRead* read = item;
+
+    timing_bind(read->timing);
+
+    timing_stage previous = timing_enter(TIMING_READ);
+
+    if (read->warm) {
+        read->size = WarmFile(read->path);
+    } else {
+        read->data = ReadFileToMemory(read->path, &read->size);
+    }
+
+    timing_leave(previous);
+
+    // The file is in memory anyway, so the content hash comes almost for free
+    if (read->data) {
+        read->hash = hash64(read->data, read->size, 0);
+    }
+
+    timing_bind(NULL);
+}
+
+void InputReady(void* item) {
+    InputRead* read = item;
+
+    read->ready = true;
+}
+
+void AdmitInput(Session* session, const Options* options, InputJob* job) {
+    File* file = job->file;
+    hash_state args;
+
+    hash_init(&args, 0);
+    timing_bind(job->timing);
+
+    job->skipped = true;
+    job->read = NULL;
+    job->reading = false;
+    job->memory = 0;
+
+    switch (file->format) {
+        case FORMAT_USM:
+            ParseVideoArgs(options->video_codec, options->video_quality, options->video_filter, file, job->index == 0);
+            HashArgs(&args, file);
+            break;
+        case FORMAT_WSP:
+        case FORMAT_WEM_PCM:
+        case FORMAT_WEM_ADPCM:
+        case FORMAT_BNK:
+            ParseAudioArgs(options->audio_codec, options->audio_quality, options->audio_sample_fmt, file, job->index == 0);
+
+            strcpy_s(file->output.drive, _MAX_DRIVE, file->input.drive);
+            strcpy_s(file->output.dir, _MAX_DIR, file->input.dir);
+
+            HashArgs(&args, file);
+            break;
+        case FORMAT_CPK: {
+                // Archives hold both videos and audio, so both sets of arguments count
+                File video = *file;
+                File audio = *file;
+
+                video.format = FORMAT_USM;
+                ParseVideoArgs(options->video_codec, options->video_quality, options->video_filter, &video, false);
+                HashArgs(&args, &video);
+
+                audio.format = FORMAT_WSP;
+                ParseAudioArgs(options->audio_codec, options->audio_quality, options->audio_sample_fmt, &audio, false);
+                HashArgs(&args, &audio);
+                break;
+            }
+        default: {
+                char* path = MakePath(file->input);
+
+                perrf("Unknown format %i for '%s'\n", file->format, path);
+                free(path);
+
+                session->failure++;
+                PublishMetrics(session);
+
+                timing_bind(NULL);
+
+                return;
+            }
+    }
+
+    StampInput(file, hash_digest(&args), &job->stamp);
+
+    if (SkipInput(session, &job->stamp)) {
+        FreeStamp(&job->stamp);
+    } else {
+        job->skipped = false;
+
+        job->memory = EstimateMemory(file, job->stamp.size);
+
+        // USMs are read by ffmpeg and CPKs are mapped, reading them ahead only fills the system cache
+        job->read = calloc(1, sizeof(InputRead));
+        job->read->path = file->input;
+        job->read->timing = job->timing;
+        job->read->warm = file->format == FORMAT_USM || file->format == FORMAT_CPK;
+    }
+
+    timing_bind(NULL);
+}
+
+void StartRead(Session* session, InputJob* job) {
+    job->reading = true;
+
+    stage_submit(&session->reader, job->read);
+}
+
+uint64_t EstimateMemory(const File* file, uint64_t size) {
+    uint64_t expansion;
+
+    switch (file->format) {
+        case FORMAT_WSP:
+        case FORMAT_BNK:
+            expansion = MEM_EXPANSION_VORBIS;
+            break;
+        case FORMAT_WEM_ADPCM:
+            expansion = MEM_EXPANSION_ADPCM;
+            break;
+        case FORMAT_WEM_PCM:
+            expansion = 1;
+            break;
+        case FORMAT_CPK:
+            // The view is backed by the file, only the decompressed entries are held, at most the whole archive
+            return size;
+        default:
+            // ffmpeg reads USMs itself
+            return 0;
+    }
+
+    // Tracks for ffmpeg are rebuilt or passed on at about their own size, only PCM outputs are decoded in-process
+    if (GetPcmFormat(file->args.audio_args.encoder) == PCM_FMT_NIL) {
+        expansion = 1;
+    }
+
+    // The input is held whole, next to its tracks when all of them are rendered at once
+    return size + size * expansion;
+}
+
+uint64_t ConvertInput(Session* session, const Options* options, InputJob* job) {
+    File* file = job->file;
+    InputStamp* stamp = &job->stamp;
+    InputRead* read = job->read;
+    uint64_t bytes_read = 0;
+
+    // The ones collected meanwhile belong to the other inputs read ahead
+    while (read && !read->ready) {
+        stage_collect(&session->reader);
+    }
+
+    switch (file->format) {
+        case FORMAT_USM: {
+                bytes_read = stamp->size;
+
+                progress_queue(1);
+                progress_begin();
+
+                // Videos are cached by their whole content
+                uint64_t key = 0;
+                if (session->cache) {
+                    timing_stage previous = timing_enter(TIMING_READ);
+
+                    if (!HashFile(stamp->path, ArgsHash(file), &key)) {
+                        key = 0;
+                    }
+
+                    timing_leave(previous);
+                }
+
+                if (FetchCached(session, file, key, stamp->size)) {
+                    progress_end(true, stamp->size, 0);
+
+                    RecordOutput(session, stamp, file);
+
+                    break;
+                }
+
+                uint32_t job_id = InterlockedIncrement(&session->jobs);
+                char* cmd = ConstructCommand(file);
+
+                logger_write(job_id, "encode", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "%s", cmd);
+
+                // ffmpeg reads the file itself, its stdin is closed right away
+                int64_t started = logger_clock_us();
+                int ffmpeg = process_run(&session->processes, cmd, NULL, 0);
+
+                trace_exit("encoder", "ffmpeg", started, ffmpeg, "%s", cmd);
+                metrics_encode(file->args.video_args.encoder, logger_clock_us() - started);
+
+                logger_write(job_id, "encode", logger_clock_us() - started, ffmpeg, "Finished %s", stamp->path);
+
+                free(cmd);
+
+                progress_end(ffmpeg == 0, stamp->size, 0);
+
+                if (ffmpeg != 0) {
+                    perrf("\nConversion %i failed with status code %i\n", job->index + 1, ffmpeg);
+                    RecordFailure(session, stamp);
+                } else {
+                    RecordOutput(session, stamp, file);
+                    StoreCached(session, file, key, stamp->size);
+                }
+
+                break;
+            }
+        case FORMAT_WSP:
+        case FORMAT_WEM_PCM:
+        case FORMAT_WEM_ADPCM: {
+                bytes_read = read->data ? read->size : 0;
+
+                if (!read->data) {
+                    RecordFailure(session, stamp);
+
+                    break;
+                }
+
+                stamp->hash = read->hash;
+                stamp->hashed = true;
+
+                // The data stays until the input is finished, the tracks are views into it
+                ConvertWsp(file, read->data, read->size, session, stamp);
+                break;
+            }
+        case FORMAT_BNK: {
+                bytes_read = read->data ? read->size : 0;
+
+                if (!read->data) {
+                    RecordFailure(session, stamp);
+
+                    break;
+                }
+
+                stamp->hash = read->hash;
+                stamp->hashed = true;
+
+                membuf bank_buf;
+                bank_buf.data = read->data;
+                bank_buf.size = read->size;
+                bank_buf.pos = 0;
+
+                bnk bank;
+                if (read_bnk(&bank_buf, &bank) != 0) {
+                    perrf("Could not read the SoundBank %s\n", stamp->path);
+
+                    RecordFailure(session, stamp);
+
+                    break;
+                }
+
+                pcm_format pcm_fmt = GetPcmFormat(file->args.audio_args.encoder);
+
+                progress_queue(bank.count);
+
+                // The WEMs are converted straight from the DATA section, named by their ID
+                for (uint32_t j = 0; j < bank.count; j++) {
+                    sprintf_s(file->output.fname, _MAX_FNAME, "%u", bank.entries[j].id);
+
+                    if (SkipOutput(session, stamp, file)) {
+                        progress_skip();
+
+                        continue;
+                    }
+
+                    membuf buf = bnk_entry_data(&bank, j);
+
+                    ConvertOrLinkTrack(session, stamp, file, &buf, pcm_fmt);
+                }
+
+                free_bnk(&bank);
+                break;
+            }
+        case FORMAT_CPK: {
+                CpkContext ctx;
+                ctx.session = session;
+                ctx.stamp = stamp;
+
+                // Parsing allocates the argument strings, so it happens once for the archive and not for every entry
+                ctx.video = *file;
+                ctx.video.format = FORMAT_USM;
+                ctx.video.piped = true;
+                ParseVideoArgs(options->video_codec, options->video_quality, options->video_filter, &ctx.video, false);
+
+                ctx.audio = *file;
+                ctx.audio.format = FORMAT_WSP;
+                ParseAudioArgs(options->audio_codec, options->audio_quality, options->audio_sample_fmt, &ctx.audio, false);
+
+                bytes_read = stamp->size;
+
+                cpk archive;
+                if (cpk_open(&archive, stamp->path) != 0) {
+                    perrf("Could not read the CPK %s\n", stamp->path);
+
+                    RecordFailure(session, stamp);
+
+                    break;
+                }
+
+                // Only entries we can convert are extracted, finished videos aren't even decompressed
+                uint32_t* indices = malloc((archive.count ? archive.count : 1) * sizeof(uint32_t));
+                uint32_t count = 0;
+                uint32_t videos = 0;
+                for (uint32_t j = 0; j < archive.count; j++) {
+                    const char* ext = strrchr(archive.entries[j].name, '.');
+
+                    if (ext && _stricmp(ext, ".usm") == 0) {
+                        File track;
+                        MakeCpkTrack(&ctx, &archive.entries[j], &track);
+
+                        if (!SkipOutput(session, stamp, &track)) {
+                            indices[count++] = j;
+                            videos++;
+                        }
+                    } else if (ext && (_stricmp(ext, ".wsp") == 0 || _stricmp(ext, ".wem") == 0)) {
+                        indices[count++] = j;
+                    }
+                }
+
+                // The tracks of the audio entries are queued once they're split
+                progress_queue(videos);
+
+                logger_write(LOGGER_NO_JOB, "extract", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Extracting %u of %u files from %s",
+                    count, archive.count, stamp->path);
+
+                if (cpk_extract(&archive, indices, count, ConvertCpkEntry, &ctx) != 0) {
+                    // Entries that failed to decompress never reach the handler
+                    stamp->failures++;
+                }
+
+                // Every entry's tracks were rendered before its handler returned, only their encoders may still run
+                free(indices);
+                cpk_close(&archive);
+                break;
+            }
+    }
+
+    return bytes_read;
+}
+
+bool FinishConvertedInput(Session* session, InputJob* job) {
+    if (job->stamp.pending != 0) {
+        return false;
+    }
+
+    FinishInput(session, &job->stamp);
+    FreeStamp(&job->stamp);
+
+    if (job->read) {
+        free(job->read->data);
+        free(job->read);
+        job->read = NULL;
+    }
+
+    job->converting = false;
+    job->finished = true;
+
+    progress_input_done(job->size);
+    trace_span("input", "file", job->started, "%s%s", job->file->input.fname, job->file->input.ext);
+
+    return true;
+}
+
+int CompareDiskPositions(const void* a, const void* b) {
+    const DiskPosition* pa = a;
+    const DiskPosition* pb = b;
+
+    if (pa->lcn != pb->lcn) {
+        return pa->lcn < pb->lcn ? -1 : 1;
+    }
+
+    if (pa->file_id != pb->file_id) {
+        return pa->file_id < pb->file_id ? -1 : 1;
+    }
+
+    return pa->index - pb->index;
+}
+
+int* OrderInputs(File* files, int n_files, bool disk_order) {
+    int* order = malloc((n_files ? n_files : 1) * sizeof(int));
+
+    for (int i = 0; i < n_files; i++) {
+        order[i] = i;
+    }
+
+    if (!disk_order || n_files < 2) {
+        return order;
+    }
+
+    int64_t started = trace_clock();
+    DiskPosition* positions = malloc(n_files * sizeof(DiskPosition));
+    int located = 0;
+
+    for (int i = 0; i < n_files; i++) {
+        char* path = MakePath(files[i].input);
+
+        positions[i].index = i;
+
+        // Inputs that can't be opened go last, their conversion reports the error
+        if (!GetFileDiskPosition(path, &positions[i].lcn, &positions[i].file_id)) {
+            positions[i].lcn = UINT64_MAX;
+            positions[i].file_id = UINT64_MAX;
+        }
+
+        if (positions[i].lcn != UINT64_MAX) {
+            located++;
+        }
+
+        free(path);
+    }
+
+    // Files in the MFT and on shares have no clusters, file IDs at least keep the ones created together next to each other
+    qsort(positions, n_files, sizeof(DiskPosition), CompareDiskPositions);
+
+    for (int i = 0; i < n_files; i++) {
+        order[i] = positions[i].index;
+    }
+
+    free(positions);
+
+    logger_write(LOGGER_NO_JOB, "order", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Ordered %i inputs by their first cluster and %i by their file ID",
+        located, n_files - located);
+    trace_span("input", "order", started, "%i files", n_files);
+
+    return order;
+}
+
+void MakeCpkTrack(CpkContext* ctx, const cpk_entry* entry, File* track) {
+    // Outputs go next to the CPK, named after the entry's directory and name
+    char name[_MAX_FNAME];
+    sprintf_s(name, _MAX_FNAME, "%s%s%s", entry->dir, entry->dir[0] ? "_" : "", entry->name);
+
+    for (char* c = name; *c; c++) {
+        if (*c == '/' || *c == '\\') {
+            *c = '_';
+        }
+    }
+
+    char* ext = strrchr(name, '.');
+    bool video = _stricmp(ext, ".usm") == 0;
+
+    *track = video ? ctx->video : ctx->audio;
+
+    strcpy_s(track->input.ext, _MAX_EXT, ext);
+    *ext = '\0';
+    strcpy_s(track->input.fname, _MAX_FNAME, name);
+
+    strcpy_s(track->output.drive, _MAX_DRIVE, track->input.drive);
+    strcpy_s(track->output.dir, _MAX_DIR, track->input.dir);
+
+    // Videos keep the extension their container was given, only the name is the entry's
+    if (video) {
+        strcpy_s(track->output.fname, _MAX_FNAME, track->input.fname);
+    }
+}
+
+errno_t ConvertCpkEntry(void* ctx, const cpk_entry* entry, const uint8_t* data, uint64_t size) {
+    CpkContext* cpk_ctx = ctx;
+    File track;
+
+    MakeCpkTrack(cpk_ctx, entry, &track);
+
+    if (track.format == FORMAT_USM) {
+        uint64_t key = hash64(data, size, ArgsHash(&track));
+
+        progress_begin();
+
+        if (FetchCached(cpk_ctx->session, &track, key, size)) {
+            progress_end(true, size, 0);
+            RecordOutput(cpk_ctx->session, cpk_ctx->stamp, &track);
+
+            return 0;
+        }
+
+        uint32_t job = InterlockedIncrement(&cpk_ctx->session->jobs);
+        char* cmd = ConstructCommand(&track);
+
+        logger_write(job, "encode", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "%s", cmd);
+
+        // The entry is piped from the mapped archive, which is only valid until we return
+        int64_t started = logger_clock_us();
+        int ffmpeg = process_run(&cpk_ctx->session->processes, cmd, data, size);
+
+        trace_exit("encoder", "ffmpeg", started, ffmpeg, "%s/%s", entry->dir, entry->name);
+        metrics_encode(track.args.video_args.encoder, logger_clock_us() - started);
+
+        free(cmd);
+
+        logger_write(job, "encode", logger_clock_us() - started, ffmpeg, "Finished %s/%s", entry->dir, entry->name);
+
+        progress_end(ffmpeg == 0, size, 0);
+
+        if (ffmpeg != 0) {
+            perrf("\nConversion of %s/%s failed with status code %i\n", entry->dir, entry->name, ffmpeg);
+            RecordFailure(cpk_ctx->session, cpk_ctx->stamp);
+
+            return 1;
+        }
+
+        RecordOutput(cpk_ctx->session, cpk_ctx->stamp, &track);
+        StoreCached(cpk_ctx->session, &track, key, size);
+
+        return 0;
+    }
+
+    // ConvertTrack never writes to the track data, the mapped view stays read-only
+    if (_stricmp(track.input.ext, ".wem") == 0) {
+        // A WEM entry is a single track and keeps the entry's name
+        strcpy_s(track.output.fname, _MAX_FNAME, track.input.fname);
+
+        progress_queue(1);
+
+        if (SkipOutput(cpk_ctx->session, cpk_ctx->stamp, &track)) {
+            progress_skip();
+        } else {
+            membuf buf;
+            buf.data = (char*)data;
+            buf.size = size;
+            buf.pos = 0;
+
+            ConvertOrLinkTrack(cpk_ctx->session, cpk_ctx->stamp, &track, &buf, GetPcmFormat(track.args.audio_args.encoder));
+        }
+    } else {
+        ConvertWsp(&track, (char*)data, size, cpk_ctx->session, cpk_ctx->stamp);
+    }
+
+    // The entry is only valid until we return, its tracks have to be rendered by then
+    stage_drain(&cpk_ctx->session->rebuild);
+
+    return 0;
+}
+
+void StampInput(File* file, uint64_t args_hash, InputStamp* stamp) {
+    memset(stamp, 0, sizeof(InputStamp));
+
+    stamp->path = MakePath(file->input);
+    stamp->args_hash = args_hash;
+
+    if (!GetFileStamp(stamp->path, &stamp->size, &stamp->mtime)) {
+        stamp->size = 0;
+        stamp->mtime = 0;
+    }
+}
+
+void FreeStamp(InputStamp* stamp) {
+    for (uint32_t i = 0; i < stamp->output_count; i++) {
+        free(stamp->outputs[i]);
+    }
+
+    free(stamp->outputs);
+    free(stamp->path);
+
+    memset(stamp, 0, sizeof(InputStamp));
+}
+
+uint64_t StampHash(InputStamp* stamp) {
+    if (!stamp->hashed) {
+        // An unreadable input never matches, the conversion reports the actual error
+        if (!HashFile(stamp->path, 0, &stamp->hash)) {
+            stamp->hash = 0;
+        }
+
+        stamp->hashed = true;
+    }
+
+    return stamp->hash;
+}
+
+bool EntryMatches(const manifest_entry* e, InputStamp* stamp) {
+    if (strcmp(e->input, stamp->path) != 0 || e->args_hash != stamp->args_hash || e->input_size != stamp->size) {
+        return false;
+    }
+
+    // The content is only hashed if the write time changed
+    if (e->input_mtime == stamp->mtime) {
+        return true;
+    }
+
+    return e->input_hash == StampHash(stamp);
+}
+
+bool OutputExists(const char* path) {
+    DWORD attr = GetFileAttributesA(path);
+
+    return attr != INVALID_FILE_ATTRIBUTES && !(attr & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+void AddStampOutput(InputStamp* stamp, const char* output) {
+    stamp->outputs = realloc(stamp->outputs, (stamp->output_count + 1) * sizeof(char*));
+    stamp->outputs[stamp->output_count++] = _strdup(output);
+}
+
+bool SkipInput(Session* session, InputStamp* stamp) {
+    if (!session->manifest || session->force) {
+        return false;
+    }
+
+    uint32_t count;
+    const uint32_t* indices = manifest_outputs(session->manifest, stamp->path, &count);
+
+    // Inputs are only complete once they recorded the number of outputs they produce
+    if (count == 0 || session->manifest->entries[indices[0]].outputs != count) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const manifest_entry* e = &session->manifest->entries[indices[i]];
+
+        if (e->outputs != count || !EntryMatches(e, stamp) || !OutputExists(e->output)) {
+            return false;
+        }
+    }
+
+    // Only the write time changed, refresh it so the next run doesn't hash again
+    if (stamp->hashed) {
+        for (uint32_t i = 0; i < count; i++) {
+            manifest_entry e = session->manifest->entries[indices[i]];
+            e.input_mtime = stamp->mtime;
+
+            manifest_record(session->manifest, &e);
+        }
+    }
+
+    logger_write(LOGGER_NO_JOB, "skip", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Skipping %s, its %u output%s up to date",
+        stamp->path, count, count == 1 ? " is" : "s are");
+
+    session->skipped += count;
+    PublishMetrics(session);
+
+    return true;
+}
+
+bool SkipOutput(Session* session, InputStamp* stamp, File* file) {
+    if (!session->manifest || session->force) {
+        return false;
+    }
+
+    char* output = MakePath(file->output);
+    const manifest_entry* e = manifest_find(session->manifest, output);
+    bool skip = e && EntryMatches(e, stamp) && OutputExists(output);
+
+    if (skip) {
+        logger_write(LOGGER_NO_JOB, "skip", LOGGER_NO_DURATION, LOGGER_NO_EXIT, "Skipping %s, it's up to date", output);
+
+        AddStampOutput(stamp, output);
+        session->skipped++;
+        PublishMetrics(session);
+    }
+
+    free(output);
+
+    return skip;
+}
+
+void RecordOutput(Session* session, InputStamp* stamp, File* file) {
+    char* output = MakePath(file->output);
+
+    session->success++;
+    PublishMetrics(session);
+    metrics_written(output);
+
+    if (session->manifest) {
+        manifest_entry e;
+        e.output = output;
+        e.input = stamp->path;
+        e.input_size = stamp->size;
+        e.input_mtime = stamp->mtime;
+        e.input_hash = StampHash(stamp);
+        e.args_hash = stamp->args_hash;
+
+        // The total isn't known until the whole input is done
+        e.outputs = 0;
+
+        manifest_record(session->manifest, &e);
+    }
+
+    AddStampOutput(stamp, output);
+
+    free(output);
+}
+
+void RecordFailure(Session* session, InputStamp* stamp) {
+    session->failure++;
+    stamp->failures++;
+
+    PublishMetrics(session);
+}
+
+void PublishMetrics(Session* session) {
+    metrics_tallies t;
+
+    t.success = session->success;
+    t.failure = session->failure;
+    t.skipped = session->skipped;
+    t.duplicates = session->dedup.duplicates;
+    t.duplicate_bytes = session->dedup.duplicate_bytes;
+    t.cache = session->cache != NULL;
+    t.cache_hits = session->cache ? session->cache->hits : 0;
+    t.cache_misses = session->cache ? session->cache->misses : 0;
+
+    metrics_publish(&t);
+}
+
+void FinishInput(Session* session, InputStamp* stamp) {
+    if (!session->manifest || stamp->failures != 0 || stamp->output_count == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < stamp->output_count; i++) {
+        manifest_entry e;
+        e.output = stamp->outputs[i];
+        e.input = stamp->path;
+        e.input_size = stamp->size;
+        e.input_mtime = stamp->mtime;
+        e.input_hash = StampHash(stamp);
+        e.args_hash = stamp->args_hash;
+        e.outputs = stamp->output_count;
+
+        manifest_record(session->manifest, &e);
+    }
+}
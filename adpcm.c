@@ -0,0 +1,187 @@
+#include "adpcm.h"
+
+// Each channel in a block starts with a 16 bit sample, the step index and a reserved byte
+#define IMA_HEADER_SIZE 4
+#define IMA_MAX_INDEX   88
+
+static const int32_t ima_steps[IMA_MAX_INDEX + 1] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+    107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428,
+    4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350,
+    22385, 24623, 27086, 29794, 32767
+};
+
+static const int32_t ima_index_adjust[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+uint32_t wwise_ima_block_samples(uint32_t block_align, uint16_t channels) {
+    if (channels == 0 || block_align <= IMA_HEADER_SIZE * channels || (block_align - IMA_HEADER_SIZE * channels) % channels != 0) {
+        return 0;
+    }
+
+    // One sample from the header and one per nibble, minus the last nibble which Wwise never uses
+    return (block_align - IMA_HEADER_SIZE * channels) * 2 / channels;
+}
+
+static inline int32_t clamp_index(int32_t index) {
+    return index < 0 ? 0 : (index > IMA_MAX_INDEX ? IMA_MAX_INDEX : index);
+}
+
+static inline int32_t ima_expand(int32_t hist, int32_t* index, uint32_t nibble) {
+    int32_t step = ima_steps[*index];
+    int32_t delta = step >> 3;
+
+    if (nibble & 1) {
+        delta += step >> 2;
+    }
+    if (nibble & 2) {
+        delta += step >> 1;
+    }
+    if (nibble & 4) {
+        delta += step;
+    }
+    if (nibble & 8) {
+        delta = -delta;
+    }
+
+    hist += delta;
+    hist = hist < INT16_MIN ? INT16_MIN : (hist > INT16_MAX ? INT16_MAX : hist);
+    *index = clamp_index(*index + ima_index_adjust[nibble]);
+
+    return hist;
+}
+
+// Decodes one channel of one block, the nibbles of a channel are stored together, low nibble first
+static void decode_stream(const uint8_t* header, const uint8_t* nibbles, uint32_t samples, int16_t* out, uint16_t stride) {
+    int32_t hist = (int16_t)(header[0] | header[1] << 8);
+    int32_t index = clamp_index(header[2]);
+
+    out[0] = (int16_t)hist;
+
+    for (uint32_t i = 1; i < samples; i++) {
+        uint32_t nibble = (nibbles[(i - 1) / 2] >> (((i - 1) & 1) * 4)) & 0xF;
+
+        hist = ima_expand(hist, &index, nibble);
+        out[(size_t)i * stride] = (int16_t)hist;
+    }
+}
+
+#ifdef NME_SSE2
+static inline uint32_t read_u32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+
+    return v;
+}
+
+// Decodes four independent channel streams at once, one per lane, the nibble data has to be a multiple of 4 bytes
+static void decode_streams_sse(const uint8_t* headers[4], const uint8_t* nibbles[4], uint32_t samples, int16_t* out[4], uint16_t stride) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i two = _mm_set1_epi32(2);
+    const __m128i four = _mm_set1_epi32(4);
+    const __m128i eight = _mm_set1_epi32(8);
+    const __m128i three = _mm_set1_epi32(3);
+    const __m128i minus_one = _mm_set1_epi32(-1);
+    const __m128i max_index = _mm_set1_epi32(IMA_MAX_INDEX);
+    const __m128i low_nibble = _mm_set1_epi32(0xF);
+
+    int32_t lanes[4];
+
+    for (int k = 0; k < 4; k++) {
+        lanes[k] = (int16_t)(headers[k][0] | headers[k][1] << 8);
+        out[k][0] = (int16_t)lanes[k];
+    }
+    __m128i hist = _mm_loadu_si128((const __m128i*)lanes);
+
+    for (int k = 0; k < 4; k++) {
+        lanes[k] = clamp_index(headers[k][2]);
+    }
+    __m128i index = _mm_loadu_si128((const __m128i*)lanes);
+
+    for (uint32_t i = 1, offset = 0; i < samples; offset += 4) {
+        __m128i word = _mm_set_epi32(read_u32(&nibbles[3][offset]), read_u32(&nibbles[2][offset]),
+            read_u32(&nibbles[1][offset]), read_u32(&nibbles[0][offset]));
+
+        for (int j = 0; j < 8 && i < samples; j++, i++) {
+            __m128i nibble = _mm_and_si128(word, low_nibble);
+            word = _mm_srli_epi32(word, 4);
+
+            // SSE2 has no gather, the step table lookup stays scalar
+            _mm_storeu_si128((__m128i*)lanes, index);
+            __m128i step = _mm_set_epi32(ima_steps[lanes[3]], ima_steps[lanes[2]], ima_steps[lanes[1]], ima_steps[lanes[0]]);
+
+            __m128i delta = _mm_srai_epi32(step, 3);
+            delta = _mm_add_epi32(delta, _mm_and_si128(_mm_srai_epi32(step, 2), _mm_cmpeq_epi32(_mm_and_si128(nibble, one), one)));
+            delta = _mm_add_epi32(delta, _mm_and_si128(_mm_srai_epi32(step, 1), _mm_cmpeq_epi32(_mm_and_si128(nibble, two), two)));
+
+            __m128i has_four = _mm_cmpeq_epi32(_mm_and_si128(nibble, four), four);
+            delta = _mm_add_epi32(delta, _mm_and_si128(step, has_four));
+
+            __m128i negative = _mm_cmpeq_epi32(_mm_and_si128(nibble, eight), eight);
+            delta = _mm_sub_epi32(_mm_xor_si128(delta, negative), negative);
+
+            // Saturate to 16 bits and sign extend back
+            __m128i packed = _mm_packs_epi32(_mm_add_epi32(hist, delta), zero);
+            hist = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+
+            // The index moves by -1, or by 2, 4, 6 or 8 when the 4 bit is set
+            __m128i up = _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(nibble, three), 1), two);
+            __m128i adjust = _mm_or_si128(_mm_and_si128(has_four, up), _mm_andnot_si128(has_four, minus_one));
+
+            // The index never leaves 16 bits, so the 16 bit min and max clamp it
+            index = _mm_min_epi16(_mm_max_epi16(_mm_add_epi32(index, adjust), zero), max_index);
+
+            _mm_storeu_si128((__m128i*)lanes, hist);
+            for (int k = 0; k < 4; k++) {
+                out[k][(size_t)i * stride] = (int16_t)lanes[k];
+            }
+        }
+    }
+}
+#endif
+
+void wwise_ima_decode(const uint8_t* data, uint32_t blocks, uint32_t block_align, uint16_t channels, int16_t* out) {
+    uint32_t samples = wwise_ima_block_samples(block_align, channels);
+    uint32_t channel_bytes = samples / 2;
+    uint32_t streams = blocks * channels;
+    uint32_t s = 0;
+
+    if (samples == 0) {
+        return;
+    }
+
+#ifdef NME_SSE2
+    // Blocks are independent, so the lanes take channels from consecutive blocks
+    if (channel_bytes % 4 == 0) {
+        for (; s + 4 <= streams; s += 4) {
+            const uint8_t* headers[4];
+            const uint8_t* nibbles[4];
+            int16_t* outs[4];
+
+            for (uint32_t k = 0; k < 4; k++) {
+                uint32_t b = (s + k) / channels;
+                uint32_t c = (s + k) % channels;
+                const uint8_t* block = &data[(size_t)b * block_align];
+
+                headers[k] = &block[IMA_HEADER_SIZE * c];
+                nibbles[k] = &block[IMA_HEADER_SIZE * channels + channel_bytes * c];
+                outs[k] = &out[(size_t)b * samples * channels + c];
+            }
+
+            decode_streams_sse(headers, nibbles, samples, outs, channels);
+        }
+    }
+#endif
+
+    for (; s < streams; s++) {
+        uint32_t b = s / channels;
+        uint32_t c = s % channels;
+        const uint8_t* block = &data[(size_t)b * block_align];
+
+        decode_stream(&block[IMA_HEADER_SIZE * c], &block[IMA_HEADER_SIZE * channels + channel_bytes * c], samples,
+            &out[(size_t)b * samples * channels + c], channels);
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "defs.h"
+
+// Returns the number of samples per channel in one Wwise IMA ADPCM block, 0 if the block size is invalid
+uint32_t wwise_ima_block_samples(uint32_t block_align, uint16_t channels);
+
+// Decodes whole blocks to interleaved 16 bit samples, out needs room for blocks * block samples * channels
+void wwise_ima_decode(const uint8_t* data, uint32_t blocks, uint32_t block_align, uint16_t channels, int16_t* out);
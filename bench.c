@@ -0,0 +1,458 @@
+#include "defs.h"
+#include "utils.h"
+#include "bitmanip.h"
+#include "wwriff.h"
+
+// Each benchmark is sampled this often, the median sample is reported
+#define BENCH_SAMPLES 5
+
+// Default minimum length of one sample in seconds
+#define BENCH_SAMPLE_SECONDS 0.5
+
+// Size of the random input for the bit level benchmarks
+#define BENCH_BUFFER_SIZE (1 << 20)
+
+// Payload of the pages written by the page benchmarks, a typical audio packet
+#define BENCH_PAGE_PAYLOAD 512
+
+// Work done by one iteration of a benchmark
+typedef struct bench_work {
+    uint64_t bytes;
+    uint64_t items;
+} bench_work;
+
+typedef bench_work (*bench_fn)(void* ctx);
+
+typedef struct bench_result {
+    const char* name;
+
+    // What an item is, like packets or pages
+    const char* unit;
+
+    uint64_t iterations;
+    double median_mb_s;
+    double best_mb_s;
+    double median_items_s;
+    double best_items_s;
+} bench_result;
+
+// Embedded Vorbis tracks of the inputs given on the command line
+typedef struct bench_tracks {
+    membuf* tracks;
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t packets;
+
+    // Output of the end to end benchmark, the null device keeps the disk out of it
+    FILE* null;
+} bench_tracks;
+
+// Keeps the compiler from dropping work whose result is never used
+static volatile uint32_t bench_sink;
+
+static uint8_t* random_buffer;
+
+static double now(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    QueryPerformanceCounter(&counter);
+
+    return (double)counter.QuadPart / frequency.QuadPart;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Runs fn until a sample lasts at least sample_seconds, BENCH_SAMPLES times
+static bench_result run(const char* name, const char* unit, bench_fn fn, void* ctx, double sample_seconds) {
+    double mb_s[BENCH_SAMPLES];
+    double items_s[BENCH_SAMPLES];
+    bench_result r;
+
+    r.name = name;
+    r.unit = unit;
+    r.iterations = 0;
+
+    // Warms up the caches and the branch predictors
+    fn(ctx);
+
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        uint64_t bytes = 0;
+        uint64_t items = 0;
+        double start = now();
+        double elapsed;
+
+        do {
+            bench_work w = fn(ctx);
+
+            bytes += w.bytes;
+            items += w.items;
+            r.iterations++;
+        } while ((elapsed = now() - start) < sample_seconds);
+
+        mb_s[s] = bytes / elapsed / 1e6;
+        items_s[s] = items / elapsed;
+    }
+
+    qsort(mb_s, BENCH_SAMPLES, sizeof(double), compare_doubles);
+    qsort(items_s, BENCH_SAMPLES, sizeof(double), compare_doubles);
+
+    r.median_mb_s = mb_s[BENCH_SAMPLES / 2];
+    r.best_mb_s = mb_s[BENCH_SAMPLES - 1];
+    r.median_items_s = items_s[BENCH_SAMPLES / 2];
+    r.best_items_s = items_s[BENCH_SAMPLES - 1];
+
+    printf("  %-16s %12.1f MB/s %14.0f %s/s   (best %.1f MB/s)\n", r.name, r.median_mb_s, r.median_items_s, r.unit, r.best_mb_s);
+
+    return r;
+}
+
+static void discard_packet(void* ctx, const uint8_t* data, uint32_t size, uint32_t granule) {
+    UNUSED(ctx);
+    UNUSED(granule);
+
+    bench_sink += data[0] + size;
+}
+
+static void count_packet(void* ctx, const uint8_t* data, uint32_t size, uint32_t granule) {
+    UNUSED(data);
+    UNUSED(size);
+    UNUSED(granule);
+
+    (*(uint64_t*)ctx)++;
+}
+
+// Reads the random buffer in fields of 1 to 32 bits, like the setup and packet headers
+static bench_work bench_bs_read(void* ctx) {
+    UNUSED(ctx);
+
+    membuf buf;
+    buf.data = (char*)random_buffer;
+    buf.size = BENCH_BUFFER_SIZE;
+    buf.pos = 0;
+
+    bit_stream bs = new_bit_stream(&buf);
+    uint64_t reads = 0;
+    uint32_t sum = 0;
+
+    // Stops a field short of the end, bs_read doesn't check the size
+    while (bs.total_bits_read + 32 <= (uint64_t)BENCH_BUFFER_SIZE * 8) {
+        uint_var v = new_uint_var(0, reads % 32 + 1);
+
+        bs_read(&bs, &v);
+
+        sum += v.value;
+        reads++;
+    }
+
+    bench_sink += sum;
+
+    bench_work w = { bs.total_bits_read / 8, reads };
+    return w;
+}
+
+// Writes fields of 1 to 32 bits, handing each full page to a sink that drops it
+static bench_work bench_ogg_write(void* ctx) {
+    UNUSED(ctx);
+
+    ogg_output_stream os = new_ogg_packet_stream(discard_packet, NULL);
+    uint64_t bits = 0;
+    uint64_t writes = 0;
+    const uint32_t* values = (const uint32_t*)random_buffer;
+
+    while (bits < (uint64_t)BENCH_BUFFER_SIZE * 8) {
+        uint32_t n = writes % 32 + 1;
+
+        ogg_write(&os, new_uint_var(values[writes % (BENCH_BUFFER_SIZE / 4)], n));
+
+        bits += n;
+        writes++;
+
+        // Leaves room for the largest field before the payload runs out
+        if (os.payload_bytes >= SEGMENT_SIZE * MAX_SEGMENTS - 8) {
+            flush_page(&os, false, false);
+        }
+    }
+
+    flush_page(&os, false, true);
+
+    bench_work w = { bits / 8, writes };
+    return w;
+}
+
+// Checksums the random buffer in page sized pieces
+static bench_work bench_checksum(void* ctx) {
+    UNUSED(ctx);
+
+    uint32_t page = HEADER_BYTES + 2 + BENCH_PAGE_PAYLOAD;
+    uint64_t pages = 0;
+    uint32_t sum = 0;
+
+    for (uint32_t offset = 0; offset + page <= BENCH_BUFFER_SIZE; offset += page) {
+        sum ^= checksum(&random_buffer[offset], page);
+        pages++;
+    }
+
+    bench_sink += sum;
+
+    bench_work w = { pages * page, pages };
+    return w;
+}
+
+// Builds, checksums and writes whole pages to the null device
+static bench_work bench_flush_page(void* ctx) {
+    bench_tracks* t = ctx;
+    ogg_output_stream os = new_ogg_output_stream(t->null);
+    uint64_t pages = 0;
+
+    for (uint32_t offset = 0; offset + BENCH_PAGE_PAYLOAD <= BENCH_BUFFER_SIZE; offset += BENCH_PAGE_PAYLOAD) {
+        memcpy(&os.page_buffer[HEADER_BYTES + MAX_SEGMENTS], &random_buffer[offset], BENCH_PAGE_PAYLOAD);
+        os.payload_bytes = BENCH_PAGE_PAYLOAD;
+
+        flush_page(&os, false, false);
+        pages++;
+    }
+
+    bench_work w = { pages * BENCH_PAGE_PAYLOAD, pages };
+    return w;
+}
+
+// Expands every codebook of the packed library to its standard form
+static bench_work bench_parse_codebook(void* ctx) {
+    UNUSED(ctx);
+
+    ogg_output_stream os = new_ogg_packet_stream(discard_packet, NULL);
+    uint64_t bytes = 0;
+
+    for (long i = 0; i < CODEBOOK_COUNT - 1; i++) {
+        long start = read_32_buf((unsigned char*)&pcb[OFFSET_OFFSET + i * 4]);
+        long end = read_32_buf((unsigned char*)&pcb[OFFSET_OFFSET + (i + 1) * 4]);
+
+        membuf buf;
+        buf.data = (char*)&pcb[start];
+        buf.size = end - start;
+        buf.pos = 0;
+
+        bit_stream bs = new_bit_stream(&buf);
+
+        parse_codebook(&bs, end - start, &os);
+        flush_page(&os, false, false);
+
+        bytes += end - start;
+    }
+
+    bench_work w = { bytes, CODEBOOK_COUNT - 1 };
+    return w;
+}
+
+// Rebuilds every track of the inputs into Ogg pages written to the null device
+static bench_work bench_create_ogg(void* ctx) {
+    bench_tracks* t = ctx;
+
+    for (uint32_t i = 0; i < t->count; i++) {
+        t->tracks[i].pos = 0;
+
+        create_ogg(&t->tracks[i], t->null);
+    }
+
+    bench_work w = { t->bytes, t->packets };
+    return w;
+}
+
+// Adds one embedded track if it's a Vorbis WEM that rebuilds cleanly
+static void add_track(bench_tracks* t, char* data, uint64_t size) {
+    membuf buf;
+    buf.data = data;
+    buf.size = size;
+    buf.pos = 0;
+
+    wem_info info;
+    if (read_wem_info(&buf, &info) != 0 || info.codec != WEM_CODEC_VORBIS) {
+        return;
+    }
+
+    uint64_t packets = 0;
+
+    buf.pos = 0;
+    if (create_ogg_packets(&buf, count_packet, &packets) != 0) {
+        return;
+    }
+
+    t->tracks = realloc(t->tracks, (t->count + 1) * sizeof(membuf));
+    t->tracks[t->count++] = buf;
+    t->bytes += size;
+    t->packets += packets;
+}
+
+// Loads a WEM or WSP and adds its Vorbis tracks, the file stays in memory until the end
+static void load_input(bench_tracks* t, const char* path) {
+    fpath p;
+
+    if (_splitpath_s(path, p.drive, _MAX_DRIVE, p.dir, _MAX_DIR, p.fname, _MAX_FNAME, p.ext, _MAX_EXT) != 0) {
+        perrf("Could not split path '%s'\n", path);
+
+        return;
+    }
+
+    uint64_t size;
+    char* data = ReadFileToMemory(p, &size);
+
+    if (!data) {
+        return;
+    }
+
+    // Tracks of a WSP are concatenated RIFF files, split the same way ConvertWsp does
+    uint64_t start = 0;
+    while (start < size) {
+        uint64_t end = split_bytes(data, size, "RIFF", 4, start + 1);
+
+        if (end == -1) {
+            end = size;
+        }
+
+        add_track(t, &data[start], end - start);
+
+        start = end + 1;
+    }
+}
+
+static void write_json(const char* path, const char* label, const bench_result* results, int count, double sample_seconds) {
+    FILE* out;
+
+    if (fopen_s(&out, path, "w") != 0) {
+        perrf("Could not open '%s' for writing\n", path);
+
+        return;
+    }
+
+    SYSTEMTIME t;
+    GetSystemTime(&t);
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    fprintf(out, "{\n  \"label\": \"");
+
+    // Labels are commit hashes or short names, only quotes and backslashes need escaping
+    for (const char* c = label; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+        }
+
+        fputc(*c, out);
+    }
+
+    fprintf(out, "\",\n  \"date\": \"%04d-%02d-%02dT%02d:%02d:%02dZ\",\n", t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond);
+    fprintf(out, "  \"processors\": %lu,\n  \"samples\": %d,\n  \"sample_seconds\": %.3f,\n  \"results\": [\n",
+        info.dwNumberOfProcessors, BENCH_SAMPLES, sample_seconds);
+
+    for (int i = 0; i < count; i++) {
+        const bench_result* r = &results[i];
+
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"iterations\": %llu, \"median_mb_s\": %.3f, \"best_mb_s\": %.3f, "
+            "\"median_items_s\": %.1f, \"best_items_s\": %.1f}%s\n", r->name, r->unit, r->iterations, r->median_mb_s, r->best_mb_s,
+            r->median_items_s, r->best_items_s, i + 1 < count ? "," : "");
+    }
+
+    fputs("  ]\n}\n", out);
+    fclose(out);
+
+    printf("\nWrote the results to '%s'\n", path);
+}
+
+int main(int argc, char* argv[]) {
+    char* output_opt = NULL;
+    char* label_opt = "";
+    double sample_seconds = BENCH_SAMPLE_SECONDS;
+
+    bench_tracks tracks;
+    tracks.tracks = NULL;
+    tracks.count = 0;
+    tracks.bytes = 0;
+    tracks.packets = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) {
+                perrf("-o needs a value\n");
+
+                return 1;
+            }
+
+            output_opt = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0) {
+            if (i + 1 >= argc) {
+                perrf("-l needs a value\n");
+
+                return 1;
+            }
+
+            label_opt = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 >= argc || atof(argv[i + 1]) <= 0) {
+                perrf("-t needs a time in seconds\n");
+
+                return 1;
+            }
+
+            sample_seconds = atof(argv[++i]);
+        } else {
+            load_input(&tracks, argv[i]);
+        }
+    }
+
+    if (fopen_s(&tracks.null, "NUL", "wb") != 0) {
+        perrf("Could not open the null device\n");
+
+        return 1;
+    }
+
+    // Fixed seed, so every run reads the same bits
+    random_buffer = malloc(BENCH_BUFFER_SIZE);
+
+    uint32_t state = 0x9E3779B9;
+    for (uint32_t i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        random_buffer[i] = (uint8_t)state;
+    }
+
+    bench_result results[6];
+    int count = 0;
+
+    printf("Median of %d samples of at least %.2f s each:\n", BENCH_SAMPLES, sample_seconds);
+
+    results[count++] = run("bs_read", "reads", bench_bs_read, NULL, sample_seconds);
+    results[count++] = run("ogg_write", "writes", bench_ogg_write, NULL, sample_seconds);
+    results[count++] = run("checksum", "pages", bench_checksum, NULL, sample_seconds);
+    results[count++] = run("flush_page", "pages", bench_flush_page, &tracks, sample_seconds);
+    results[count++] = run("parse_codebook", "codebooks", bench_parse_codebook, NULL, sample_seconds);
+
+    if (tracks.count != 0) {
+        printf("\n%u Vorbis tracks, %.1f MB, %llu packets:\n", tracks.count, tracks.bytes / 1e6, tracks.packets);
+
+        results[count++] = run("create_ogg", "packets", bench_create_ogg, &tracks, sample_seconds);
+    } else {
+        pwarnf("\nNo Vorbis WEM or WSP inputs given, skipping create_ogg\n");
+    }
+
+    if (output_opt) {
+        write_json(output_opt, label_opt, results, count, sample_seconds);
+    }
+
+    fclose(tracks.null);
+    free(random_buffer);
+
+    return 0;
+}
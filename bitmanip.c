@@ -1,4 +1,5 @@
 #include "bitmanip.h"
+#include "timing.h"
 
 uint64_t split_bytes(char* search, uint64_t search_len, char* delimiter, uint64_t delimiter_len, uint64_t start) {
     uint64_t pointer = start;
@@ -45,6 +46,36 @@ uint32_t read_32_membuf(membuf* buf) {
     return val;
 }
 
+void membuf_reserve(membuf* buf, uint64_t capacity) {
+    if (capacity <= buf->size) {
+        return;
+    }
+
+    // Only a hint, a size from a broken header is left to grow as it's written
+    char* data = realloc(buf->data, capacity);
+
+    if (data) {
+        buf->data = data;
+        buf->size = capacity;
+    }
+}
+
+void membuf_write(membuf* buf, const void* src, uint64_t size) {
+    if (buf->pos + size > buf->size) {
+        uint64_t capacity = buf->size ? buf->size * 2 : MEMBUF_MIN_CAPACITY;
+
+        while (capacity < buf->pos + size) {
+            capacity *= 2;
+        }
+
+        buf->data = realloc(buf->data, capacity);
+        buf->size = capacity;
+    }
+
+    memcpy(&buf->data[buf->pos], src, size);
+    buf->pos += size;
+}
+
 uint_var new_uint_var(uint32_t v, uint64_t bit_size) {
     uint_var bit;
     bit.value = v;
@@ -55,6 +86,9 @@ uint_var new_uint_var(uint32_t v, uint64_t bit_size) {
 ogg_output_stream new_ogg_output_stream(FILE* stream) {
     ogg_output_stream s;
     s.out_stream = stream;
+    s.sink = NULL;
+    s.sink_ctx = NULL;
+    s.out_buffer = NULL;
     s.bit_buffer = 0;
     s.bits_stored = 0;
     s.payload_bytes = 0;
@@ -66,6 +100,21 @@ ogg_output_stream new_ogg_output_stream(FILE* stream) {
     return s;
 }
 
+ogg_output_stream new_ogg_packet_stream(packet_sink sink, void* ctx) {
+    ogg_output_stream s = new_ogg_output_stream(NULL);
+    s.sink = sink;
+    s.sink_ctx = ctx;
+
+    return s;
+}
+
+ogg_output_stream new_ogg_buffer_stream(membuf* out) {
+    ogg_output_stream s = new_ogg_output_stream(NULL);
+    s.out_buffer = out;
+
+    return s;
+}
+
 void ogg_write(ogg_output_stream* os, uint_var bits) {
     for (unsigned int i = 0; i < bits.n_bits; i++) {
         put_bit(os, (bits.value & (1U << i)) != 0);
@@ -104,7 +153,14 @@ void flush_page(ogg_output_stream* os, bool next_continued, bool last) {
     if (os->payload_bytes != SEGMENT_SIZE * MAX_SEGMENTS) {
         flush_bits(os);
     }
-    if (os->payload_bytes != 0) {
+    if (os->payload_bytes != 0 && os->sink) {
+        os->sink(os->sink_ctx, &os->page_buffer[HEADER_BYTES + MAX_SEGMENTS], os->payload_bytes, os->granule);
+
+        os->seqno += 1;
+        os->first = false;
+        os->continued = next_continued;
+        os->payload_bytes = 0;
+    } else if (os->payload_bytes != 0) {
         unsigned int segments = (os->payload_bytes + SEGMENT_SIZE) / SEGMENT_SIZE;
         if (segments == MAX_SEGMENTS + 1) {
             segments = MAX_SEGMENTS;
@@ -141,8 +197,17 @@ void flush_page(ogg_output_stream* os, bool next_continued, bool last) {
 
         write_32(&os->page_buffer[22], checksum(os->page_buffer, HEADER_BYTES + segments + os->payload_bytes));
 
-        for (unsigned int i = 0; i < 27 + segments + os->payload_bytes; i++) {
-            fputc(os->page_buffer[i], os->out_stream);
+        if (os->out_buffer) {
+            membuf_write(os->out_buffer, os->page_buffer, 27 + segments + os->payload_bytes);
+        } else {
+            // Blocks once ffmpeg falls behind and the pipe is full
+            timing_stage previous = timing_enter(TIMING_PIPE);
+
+            for (unsigned int i = 0; i < 27 + segments + os->payload_bytes; i++) {
+                fputc(os->page_buffer[i], os->out_stream);
+            }
+
+            timing_leave(previous);
         }
 
         os->seqno += 1;
@@ -244,7 +309,7 @@ bool get_bit(bit_stream* bs) {
     return ((bs->bit_buffer & (0x80 >> bs->bits_left)) != 0);
 }
 
-void parse_codebook(bit_stream* bs, int size, ogg_output_stream* os) {
+errno_t parse_codebook(bit_stream* bs, int size, ogg_output_stream* os) {
     uint_var dimensions = new_uint_var(0, 4);
     uint_var entries = new_uint_var(0, 14);
 
@@ -258,30 +323,53 @@ void parse_codebook(bit_stream* bs, int size, ogg_output_stream* os) {
     uint_var ordered = new_uint_var(0, 1);
     bs_read(bs, &ordered);
     ogg_write(os, ordered);
-    uint_var codeword_length_length = new_uint_var(0, 3);
-    uint_var sparse = new_uint_var(0, 1);
 
-    bs_read(bs, &codeword_length_length);
-    bs_read(bs, &sparse);
+    if (ordered.value) {
+        // Ordered books store how many codewords there are of each length, both forms are the same
+        uint_var initial_length = new_uint_var(0, 5);
+        bs_read(bs, &initial_length);
+        ogg_write(os, initial_length);
 
-    ogg_write(os, sparse);
+        unsigned int current_entry = 0;
+        while (current_entry < entries.value) {
+            uint_var number = new_uint_var(0, ilog(entries.value - current_entry));
+            bs_read(bs, &number);
+            ogg_write(os, number);
 
-    for (unsigned int i = 0; i < entries.value; i++) {
-        bool present_bool = true;
+            current_entry += number.value;
+        }
 
-        if (sparse.value) {
-            uint_var present = new_uint_var(0, 1);
-            bs_read(bs, &present);
-            ogg_write(os, present);
+        if (current_entry > entries.value) {
+            perrf("Codebook entry %u out of range, the book has %u\n", current_entry, entries.value);
 
-            present_bool = present.value != 0;
+            return 1;
         }
+    } else {
+        uint_var codeword_length_length = new_uint_var(0, 3);
+        uint_var sparse = new_uint_var(0, 1);
+
+        bs_read(bs, &codeword_length_length);
+        bs_read(bs, &sparse);
+
+        ogg_write(os, sparse);
 
-        if (present_bool) {
-            uint_var codeword_length = new_uint_var(0, codeword_length_length.value);
-            bs_read(bs, &codeword_length);
-            ogg_write(os, new_uint_var(codeword_length.value, 5));
+        for (unsigned int i = 0; i < entries.value; i++) {
+            bool present_bool = true;
 
+            if (sparse.value) {
+                uint_var present = new_uint_var(0, 1);
+                bs_read(bs, &present);
+                ogg_write(os, present);
+
+                present_bool = present.value != 0;
+            }
+
+            if (present_bool) {
+                uint_var codeword_length = new_uint_var(0, codeword_length_length.value);
+                bs_read(bs, &codeword_length);
+                ogg_write(os, new_uint_var(codeword_length.value, 5));
+
+            }
         }
     }
 
@@ -313,6 +401,8 @@ void parse_codebook(bit_stream* bs, int size, ogg_output_stream* os) {
             ogg_write(os, val);
         }
     }
+
+    return 0;
 }
 
 int ilog(unsigned int v) {
@@ -7,6 +7,9 @@
 #define MAX_SEGMENTS 255
 #define SEGMENT_SIZE 255
 
+// First allocation of a membuf that is written to
+#define MEMBUF_MIN_CAPACITY (1 << 16)
+
 // Variable width unsigned integer
 typedef struct uint_var {
     // The value to represent
@@ -16,10 +19,20 @@ typedef struct uint_var {
     uint64_t n_bits;
 } uint_var;
 
+// Receives each finished packet in place of a written Ogg page
+typedef void (*packet_sink)(void* ctx, const uint8_t* data, uint32_t size, uint32_t granule);
+
 typedef struct ogg_output_stream {
     // Final output stream
     FILE* out_stream;
 
+    // If set, packets are handed to the sink instead of being written to out_stream
+    packet_sink sink;
+    void* sink_ctx;
+
+    // If set, pages are appended to out_buffer instead of being written to out_stream
+    struct membuf* out_buffer;
+
     // Buffer for individual bits and the final page
     uint8_t bit_buffer;
     uint8_t page_buffer[HEADER_BYTES + MAX_SEGMENTS + SEGMENT_SIZE * MAX_SEGMENTS];
@@ -103,12 +116,25 @@ uint32_t read_32_buf(unsigned char b[4]);
 // Reads 32 bits from a membuf struct
 uint32_t read_32_membuf(membuf* buf);
 
+// Appends size bytes at the write position, growing the buffer as needed, size is its capacity when written this way
+void membuf_write(membuf* buf, const void* src, uint64_t size);
+
+// Grows a membuf that is written to to at least capacity bytes, so writes up to it never move the data again
+// The membuf is left as it is if that much can't be allocated
+void membuf_reserve(membuf* buf, uint64_t capacity);
+
 // Creates a uint_var with value v and size bit_size
 uint_var new_uint_var(uint32_t v, uint64_t bit_size);
 
 // A bit stream to write a variable number of bits to, instead of bytes at a time
 ogg_output_stream new_ogg_output_stream(FILE* stream);
 
+// Same as new_ogg_output_stream, but each packet is passed to sink instead of being paged
+ogg_output_stream new_ogg_packet_stream(packet_sink sink, void* ctx);
+
+// Same as new_ogg_output_stream, but the pages are appended to out with membuf_write
+ogg_output_stream new_ogg_buffer_stream(membuf* out);
+
 // Write bits.value to the output stream in bits.n_bits bits
 void ogg_write(ogg_output_stream* os, uint_var bits);
 
@@ -148,8 +174,8 @@ void bs_read(bit_stream* bstream, uint_var* uv);
 // Gets a single bit from the stream
 bool get_bit(bit_stream* bs);
 
-// Parses the codebook from buf, with size size, and writes output into os
-void parse_codebook(bit_stream* buf, int size, ogg_output_stream* os);
+// Parses the codebook from buf, with size size, and writes output into os, fails on codeword counts past the book's entries
+errno_t parse_codebook(bit_stream* buf, int size, ogg_output_stream* os);
 
 // Returns the number of bits required to represent v
 int ilog(unsigned int v);
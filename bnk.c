@@ -0,0 +1,94 @@
+#include "bnk.h"
+
+// Each DIDX entry holds the WEM ID, offset and size
+#define DIDX_ENTRY_SIZE 12
+
+errno_t read_bnk(membuf* data, bnk* bank) {
+    uint64_t offset = 0;
+    int64_t didx_offset = -1;
+    uint32_t didx_size = 0;
+    int64_t data_offset = -1;
+    uint32_t data_size = 0;
+
+    memset(bank, 0, sizeof(bnk));
+
+    if (data->size < 8 || memcmp(data->data, "BKHD", 4) != 0) {
+        perrf("Missing BKHD section\n");
+
+        return 1;
+    }
+
+    // Sections are a tag and a length followed by the payload
+    while (offset + 8 <= data->size) {
+        data->pos = offset + 4;
+        uint32_t section_size = read_32_membuf(data);
+
+        if (offset + 8 + section_size > data->size) {
+            perrf("Section %.4s at %llu truncated\n", &data->data[offset], offset);
+
+            return 1;
+        }
+
+        if (memcmp(&data->data[offset], "DIDX", 4) == 0) {
+            didx_offset = offset + 8;
+            didx_size = section_size;
+        } else if (memcmp(&data->data[offset], "DATA", 4) == 0) {
+            data_offset = offset + 8;
+            data_size = section_size;
+        }
+
+        offset += 8 + section_size;
+    }
+
+    // Banks that only hold events and structures have no media
+    if (didx_offset == -1) {
+        return 0;
+    }
+
+    if (data_offset == -1) {
+        perrf("DIDX without a DATA section\n");
+
+        return 1;
+    }
+
+    bank->data = &data->data[data_offset];
+    bank->data_size = data_size;
+    bank->count = didx_size / DIDX_ENTRY_SIZE;
+    bank->entries = malloc(bank->count * sizeof(bnk_entry));
+
+    data->pos = didx_offset;
+    for (uint32_t i = 0; i < bank->count; i++) {
+        bnk_entry* e = &bank->entries[i];
+
+        e->id = read_32_membuf(data);
+        e->offset = read_32_membuf(data);
+        e->size = read_32_membuf(data);
+
+        if ((uint64_t)e->offset + e->size > bank->data_size) {
+            perrf("WEM %u lies outside of the DATA section\n", e->id);
+
+            free_bnk(bank);
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+membuf bnk_entry_data(const bnk* bank, uint32_t i) {
+    membuf buf;
+
+    buf.data = &bank->data[bank->entries[i].offset];
+    buf.size = bank->entries[i].size;
+    buf.pos = 0;
+
+    return buf;
+}
+
+void free_bnk(bnk* bank) {
+    free(bank->entries);
+
+    bank->entries = NULL;
+    bank->count = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "defs.h"
+#include "bitmanip.h"
+
+// One media file from the DIDX table
+typedef struct bnk_entry {
+    uint32_t id;
+
+    // Offset relative to the start of the DATA section's payload
+    uint32_t offset;
+    uint32_t size;
+} bnk_entry;
+
+// Index of the WEMs embedded in a SoundBank, the entries refer to the bank's own buffer
+typedef struct bnk {
+    bnk_entry* entries;
+    uint32_t count;
+
+    // DATA section payload
+    char* data;
+    uint64_t data_size;
+} bnk;
+
+// Reads the DIDX table and locates the DATA section, banks without media have no entries
+errno_t read_bnk(membuf* data, bnk* bank);
+
+// Returns a view of one embedded WEM, nothing is copied so the bank's buffer has to outlive it
+membuf bnk_entry_data(const bnk* bank, uint32_t i);
+
+// Frees the index, the bank's buffer is left alone
+void free_bnk(bnk* bank);
@@ -0,0 +1,171 @@
+#include "cache.h"
+
+// One file found while scanning the cache directory
+typedef struct cache_file {
+    char name[_MAX_FNAME + _MAX_EXT];
+    uint64_t size;
+    uint64_t last_use;
+} cache_file;
+
+static void cache_path(const cache* c, uint64_t key, uint64_t size, const char* ext, char* path) {
+    sprintf_s(path, _MAX_PATH, "%s\\%016llx_%llx%s", c->dir, key, size, ext);
+}
+
+static int compare_last_use(const void* a, const void* b) {
+    const cache_file* fa = a;
+    const cache_file* fb = b;
+
+    return fa->last_use < fb->last_use ? -1 : (fa->last_use > fb->last_use ? 1 : 0);
+}
+
+// Lists all cached files and recounts the cache size
+static cache_file* scan(cache* c, uint32_t* count) {
+    char pattern[_MAX_PATH];
+    sprintf_s(pattern, _MAX_PATH, "%s\\*", c->dir);
+
+    cache_file* files = NULL;
+    uint32_t capacity = 0;
+    WIN32_FIND_DATAA find_data;
+    HANDLE h_find = FindFirstFileA(pattern, &find_data);
+
+    *count = 0;
+    c->size = 0;
+
+    if (h_find == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    do {
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            files = realloc(files, capacity * sizeof(cache_file));
+        }
+
+        cache_file* f = &files[(*count)++];
+        strcpy_s(f->name, sizeof(f->name), find_data.cFileName);
+        f->size = (uint64_t)find_data.nFileSizeHigh << 32 | find_data.nFileSizeLow;
+        f->last_use = (uint64_t)find_data.ftLastWriteTime.dwHighDateTime << 32 | find_data.ftLastWriteTime.dwLowDateTime;
+
+        c->size += f->size;
+    } while (FindNextFileA(h_find, &find_data) != 0);
+
+    FindClose(h_find);
+
+    return files;
+}
+
+// Deletes the least recently used files until the cache is at most target bytes
+static void evict(cache* c, uint64_t target) {
+    uint32_t count;
+    cache_file* files = scan(c, &count);
+
+    if (c->size > target) {
+        qsort(files, count, sizeof(cache_file), compare_last_use);
+
+        char path[_MAX_PATH];
+
+        for (uint32_t i = 0; i < count && c->size > target; i++) {
+            sprintf_s(path, _MAX_PATH, "%s\\%s", c->dir, files[i].name);
+
+            if (DeleteFileA(path)) {
+                c->size -= files[i].size;
+                c->evictions++;
+            }
+        }
+    }
+
+    free(files);
+}
+
+// Hits move a file to the back of the eviction order, the write time doubles as the last use
+static void touch(const char* path) {
+    HANDLE file = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file, NULL, NULL, &now);
+
+    CloseHandle(file);
+}
+
+errno_t cache_open(cache* c, const char* dir, uint64_t limit) {
+    memset(c, 0, sizeof(cache));
+
+    if (!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        perrf("Could not create the cache directory '%s'\n", dir);
+
+        return 1;
+    }
+
+    c->dir = _strdup(dir);
+    c->limit = limit;
+
+    // The limit may have been lowered since the last run
+    evict(c, c->limit);
+
+    return 0;
+}
+
+void cache_close(cache* c) {
+    free(c->dir);
+
+    memset(c, 0, sizeof(cache));
+}
+
+bool cache_fetch(cache* c, uint64_t key, uint64_t size, const char* ext, const char* output) {
+    char path[_MAX_PATH];
+    cache_path(c, key, size, ext, path);
+
+    touch(path);
+
+    // Copies rather than links, so editing an output can't change the cache
+    if (!CopyFileA(path, output, FALSE)) {
+        c->misses++;
+
+        return false;
+    }
+
+    c->hits++;
+
+    return true;
+}
+
+void cache_store(cache* c, uint64_t key, uint64_t size, const char* ext, const char* output) {
+    char path[_MAX_PATH];
+    char tmp_path[_MAX_PATH];
+    uint64_t output_size;
+    uint64_t mtime;
+
+    cache_path(c, key, size, ext, path);
+    sprintf_s(tmp_path, _MAX_PATH, "%s.tmp", path);
+
+    if (!GetFileStamp(output, &output_size, &mtime)) {
+        return;
+    }
+
+    // Goes through a temporary name so another run never picks up a half copied file
+    if (!CopyFileA(output, tmp_path, FALSE) || !MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileA(tmp_path);
+
+        pwarnf("Could not add '%s' to the cache\n", output);
+
+        return;
+    }
+
+    touch(path);
+
+    c->stores++;
+    c->size += output_size;
+
+    if (c->size > c->limit) {
+        evict(c, CACHE_EVICT_TARGET(c->limit));
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+#define CACHE_DEFAULT_LIMIT (4096ULL << 20)
+
+// Evicting goes a bit below the limit, so not every store has to scan the directory again
+#define CACHE_EVICT_TARGET(limit) ((limit) / 10 * 9)
+
+// Directory of finished outputs shared by all runs, named by a hash of the input and the encoder arguments
+typedef struct cache {
+    char* dir;
+
+    // Size limit and current size of all cached files in bytes
+    uint64_t limit;
+    uint64_t size;
+
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t stores;
+    uint32_t evictions;
+} cache;
+
+// Opens or creates the cache directory and evicts old files if it's over the limit
+errno_t cache_open(cache* c, const char* dir, uint64_t limit);
+
+// Frees the cache, the files stay
+void cache_close(cache* c);
+
+// Copies the cached output for the key to output, false on a miss
+bool cache_fetch(cache* c, uint64_t key, uint64_t size, const char* ext, const char* output);
+
+// Adds a finished output to the cache, evicting the least recently used files if needed
+void cache_store(cache* c, uint64_t key, uint64_t size, const char* ext, const char* output);
@@ -0,0 +1,482 @@
+#include "cpk.h"
+#include "timing.h"
+#include "trace.h"
+
+// CPK and TOC chunks start with a signature, a flag word and the table size
+#define CPK_CHUNK_HEADER 0x10
+
+#define CRILAYLA_HEADER   0x10
+#define CRILAYLA_RAW_SIZE 0x100
+
+static uint32_t le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t le64(const uint8_t* p) {
+    return (uint64_t)le32(p) | (uint64_t)le32(&p[4]) << 32;
+}
+
+// Opens the @UTF table of a chunk, its size is taken from the chunk header
+static errno_t open_chunk_table(const cpk* archive, uint64_t offset, const char* signature, utf_table* table) {
+    if (offset + CPK_CHUNK_HEADER > archive->size || memcmp(&archive->data[offset], signature, 4) != 0) {
+        perrf("Missing %.4s chunk at %llu\n", signature, offset);
+
+        return 1;
+    }
+
+    uint64_t size = le64(&archive->data[offset + 8]);
+    uint64_t available = archive->size - offset - CPK_CHUNK_HEADER;
+
+    return utf_open(table, &archive->data[offset + CPK_CHUNK_HEADER], size < available ? size : available);
+}
+
+errno_t cpk_open(cpk* archive, const char* path) {
+    memset(archive, 0, sizeof(cpk));
+    archive->file = INVALID_HANDLE_VALUE;
+
+    archive->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (archive->file == INVALID_HANDLE_VALUE) {
+        perrf("Could not open '%s'\n", path);
+
+        return 1;
+    }
+
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx(archive->file, &size) || size.QuadPart < CPK_CHUNK_HEADER) {
+        perrf("'%s' is too small to be a CPK\n", path);
+
+        cpk_close(archive);
+
+        return 1;
+    }
+
+    // Mapping the archive lets uncompressed entries be passed on without a copy
+    archive->size = size.QuadPart;
+    archive->mapping = CreateFileMapping(archive->file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (archive->mapping) {
+        archive->data = MapViewOfFile(archive->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    if (!archive->data) {
+        perrf("Could not map '%s'\n", path);
+
+        cpk_close(archive);
+
+        return 1;
+    }
+
+    if (open_chunk_table(archive, 0, "CPK ", &archive->header) != 0) {
+        cpk_close(archive);
+
+        return 1;
+    }
+
+    uint64_t toc_offset = 0;
+    uint64_t content_offset = 0;
+    bool has_content = utf_get_uint(&archive->header, 0, "ContentOffset", &content_offset);
+
+    if (!utf_get_uint(&archive->header, 0, "TocOffset", &toc_offset) || toc_offset == 0) {
+        perrf("CPKs without a TOC are not supported\n");
+
+        cpk_close(archive);
+
+        return 1;
+    }
+
+    if (open_chunk_table(archive, toc_offset, "TOC ", &archive->toc) != 0) {
+        cpk_close(archive);
+
+        return 1;
+    }
+
+    // File offsets are relative to whichever comes first, the TOC or the content
+    uint64_t base = (has_content && content_offset < toc_offset) ? content_offset : toc_offset;
+
+    archive->count = archive->toc.row_count;
+    archive->entries = malloc((archive->count ? archive->count : 1) * sizeof(cpk_entry));
+
+    for (uint32_t i = 0; i < archive->count; i++) {
+        cpk_entry* e = &archive->entries[i];
+        uint64_t offset;
+
+        if (!utf_get_string(&archive->toc, i, "DirName", &e->dir)) {
+            e->dir = "";
+        }
+
+        if (!utf_get_string(&archive->toc, i, "FileName", &e->name) ||
+            !utf_get_uint(&archive->toc, i, "FileOffset", &offset) ||
+            !utf_get_uint(&archive->toc, i, "FileSize", &e->size)) {
+            perrf("TOC row %u is incomplete\n", i);
+
+            cpk_close(archive);
+
+            return 1;
+        }
+
+        if (!utf_get_uint(&archive->toc, i, "ExtractSize", &e->extract_size)) {
+            e->extract_size = e->size;
+        }
+
+        e->offset = base + offset;
+
+        if (e->offset + e->size > archive->size) {
+            perrf("'%s/%s' lies outside of the archive\n", e->dir, e->name);
+
+            cpk_close(archive);
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void cpk_close(cpk* archive) {
+    utf_close(&archive->toc);
+    utf_close(&archive->header);
+    free(archive->entries);
+
+    if (archive->data) {
+        UnmapViewOfFile(archive->data);
+    }
+
+    if (archive->mapping) {
+        CloseHandle(archive->mapping);
+    }
+
+    if (archive->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(archive->file);
+    }
+
+    memset(archive, 0, sizeof(cpk));
+    archive->file = INVALID_HANDLE_VALUE;
+}
+
+// Reads CRILAYLA bits MSB first, walking from the end of the compressed data towards its start
+typedef struct crilayla_bits {
+    const uint8_t* begin;
+    const uint8_t* pos;
+    uint64_t acc;
+    int count;
+} crilayla_bits;
+
+static inline bool crilayla_take(crilayla_bits* b, int n, uint32_t* v) {
+    if (b->count < n) {
+        while (b->count <= 56 && b->pos > b->begin) {
+            b->acc |= (uint64_t)*--b->pos << (56 - b->count);
+            b->count += 8;
+        }
+
+        if (b->count < n) {
+            return false;
+        }
+    }
+
+    *v = (uint32_t)(b->acc >> (64 - n));
+    b->acc <<= n;
+    b->count -= n;
+
+    return true;
+}
+
+errno_t crilayla_decompress(const uint8_t* in, uint64_t in_size, uint8_t* out, uint64_t out_size) {
+    static const int length_bits[4] = { 2, 3, 5, 8 };
+
+    if (in_size < CRILAYLA_HEADER || memcmp(in, "CRILAYLA", 8) != 0) {
+        perrf("Missing CRILAYLA signature\n");
+
+        return 1;
+    }
+
+    uint32_t uncompressed_size = le32(&in[8]);
+    uint32_t compressed_size = le32(&in[12]);
+
+    if ((uint64_t)CRILAYLA_HEADER + compressed_size + CRILAYLA_RAW_SIZE > in_size || (uint64_t)uncompressed_size + CRILAYLA_RAW_SIZE != out_size) {
+        perrf("CRILAYLA sizes don't match the entry\n");
+
+        return 1;
+    }
+
+    // The first 0x100 bytes are stored uncompressed after the compressed data
+    memcpy(out, &in[CRILAYLA_HEADER + compressed_size], CRILAYLA_RAW_SIZE);
+
+    crilayla_bits b;
+    b.begin = &in[CRILAYLA_HEADER];
+    b.pos = &in[CRILAYLA_HEADER + compressed_size];
+    b.acc = 0;
+    b.count = 0;
+
+    // The output is also produced back to front
+    int64_t w = (int64_t)out_size - 1;
+    uint32_t v;
+
+    while (w >= CRILAYLA_RAW_SIZE) {
+        if (!crilayla_take(&b, 1, &v)) {
+            break;
+        }
+
+        if (v == 0) {
+            if (!crilayla_take(&b, 8, &v)) {
+                break;
+            }
+
+            out[w--] = (uint8_t)v;
+
+            continue;
+        }
+
+        if (!crilayla_take(&b, 13, &v)) {
+            break;
+        }
+
+        int64_t ref = w + v + 3;
+        int64_t length = 3;
+        int level;
+
+        for (level = 0; level < 4; level++) {
+            if (!crilayla_take(&b, length_bits[level], &v)) {
+                return 1;
+            }
+
+            length += v;
+
+            if (v != (1u << length_bits[level]) - 1) {
+                break;
+            }
+        }
+
+        if (level == 4) {
+            do {
+                if (!crilayla_take(&b, 8, &v)) {
+                    return 1;
+                }
+
+                length += v;
+            } while (v == 0xFF);
+        }
+
+        if (ref >= (int64_t)out_size || length > w - CRILAYLA_RAW_SIZE + 1) {
+            perrf("CRILAYLA back reference out of range\n");
+
+            return 1;
+        }
+
+        // Distances of at least the length don't overlap, shorter ones repeat the pattern byte by byte
+        if (ref - w >= length) {
+            memcpy(&out[w - length + 1], &out[ref - length + 1], (size_t)length);
+            w -= length;
+        } else {
+            for (int64_t i = 0; i < length; i++) {
+                out[w--] = out[ref--];
+            }
+        }
+    }
+
+    if (w >= CRILAYLA_RAW_SIZE) {
+        perrf("CRILAYLA data truncated\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// One entry handed from a worker to the consumer
+typedef struct cpk_slot {
+    uint8_t* buffer;
+    const uint8_t* data;
+    uint64_t size;
+    bool done;
+    errno_t err;
+} cpk_slot;
+
+typedef struct cpk_extraction {
+    const cpk* archive;
+    const uint32_t* indices;
+    uint32_t count;
+
+    // Ring of entries in flight, bounds the memory held by decompressed entries
+    cpk_slot* slots;
+    uint32_t window;
+
+    volatile LONG next;
+    uint32_t consumed;
+    bool abort;
+
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+
+    // Record of the calling thread, the workers' decompression is charged to it
+    timing* timing;
+} cpk_extraction;
+
+static errno_t extract_entry(const cpk* archive, const cpk_entry* e, cpk_slot* slot) {
+    const uint8_t* stored = &archive->data[e->offset];
+
+    slot->buffer = NULL;
+    slot->data = stored;
+    slot->size = e->size;
+
+    if (e->size == e->extract_size || e->size < CRILAYLA_HEADER || memcmp(stored, "CRILAYLA", 8) != 0) {
+        return 0;
+    }
+
+    slot->buffer = malloc(e->extract_size);
+
+    if (!slot->buffer) {
+        perrf("Out of memory extracting '%s/%s'\n", e->dir, e->name);
+
+        return 1;
+    }
+
+    if (crilayla_decompress(stored, e->size, slot->buffer, e->extract_size) != 0) {
+        perrf("Could not decompress '%s/%s'\n", e->dir, e->name);
+
+        return 1;
+    }
+
+    slot->data = slot->buffer;
+    slot->size = e->extract_size;
+
+    return 0;
+}
+
+static DWORD WINAPI extract_worker(LPVOID param) {
+    cpk_extraction* x = param;
+
+    trace_thread_name("cpk extract");
+
+    while (true) {
+        uint32_t r = (uint32_t)InterlockedIncrement(&x->next) - 1;
+
+        if (r >= x->count) {
+            break;
+        }
+
+        EnterCriticalSection(&x->lock);
+        while (r >= x->consumed + x->window && !x->abort) {
+            SleepConditionVariableCS(&x->changed, &x->lock, INFINITE);
+        }
+        bool abort = x->abort;
+        LeaveCriticalSection(&x->lock);
+
+        if (abort) {
+            break;
+        }
+
+        cpk_slot* slot = &x->slots[r % x->window];
+
+        // Only the decompression is charged, not the time spent waiting for the consumer
+        const cpk_entry* e = &x->archive->entries[x->indices[r]];
+        int64_t started = trace_clock();
+
+        timing_bind(x->timing);
+        timing_enter(TIMING_EXTRACT);
+
+        errno_t err = extract_entry(x->archive, e, slot);
+
+        timing_bind(NULL);
+
+        trace_span("cpk", "extract", started, "%s/%s", e->dir, e->name);
+
+        EnterCriticalSection(&x->lock);
+        slot->err = err;
+        slot->done = true;
+        WakeAllConditionVariable(&x->changed);
+        LeaveCriticalSection(&x->lock);
+    }
+
+    return 0;
+}
+
+errno_t cpk_extract(const cpk* archive, const uint32_t* indices, uint32_t count, cpk_entry_handler handler, void* ctx) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    uint32_t threads = info.dwNumberOfProcessors < CPK_MAX_THREADS ? info.dwNumberOfProcessors : CPK_MAX_THREADS;
+
+    if (threads > count) {
+        threads = count;
+    }
+
+    if (threads == 0) {
+        return 0;
+    }
+
+    cpk_extraction x;
+    x.archive = archive;
+    x.indices = indices;
+    x.count = count;
+    x.window = threads * 2;
+    x.slots = calloc(x.window, sizeof(cpk_slot));
+    x.next = 0;
+    x.consumed = 0;
+    x.abort = false;
+    x.timing = timing_bound();
+
+    InitializeCriticalSection(&x.lock);
+    InitializeConditionVariable(&x.changed);
+
+    HANDLE* workers = malloc(threads * sizeof(HANDLE));
+    uint32_t started = 0;
+
+    for (uint32_t i = 0; i < threads; i++) {
+        if ((workers[started] = CreateThread(NULL, 0, extract_worker, &x, 0, NULL)) != NULL) {
+            started++;
+        }
+    }
+
+    errno_t err = 0;
+
+    if (started == 0) {
+        perrf("Could not start any extraction threads\n");
+
+        err = 1;
+    }
+
+    // A failed entry is reported and skipped, the handler decides about its own errors
+    for (uint32_t r = 0; r < count && started != 0; r++) {
+        cpk_slot* slot = &x.slots[r % x.window];
+
+        EnterCriticalSection(&x.lock);
+        while (!slot->done) {
+            SleepConditionVariableCS(&x.changed, &x.lock, INFINITE);
+        }
+        LeaveCriticalSection(&x.lock);
+
+        const cpk_entry* e = &archive->entries[indices[r]];
+
+        if (slot->err != 0 || handler(ctx, e, slot->data, slot->size) != 0) {
+            err = 1;
+        }
+
+        free(slot->buffer);
+        slot->buffer = NULL;
+
+        EnterCriticalSection(&x.lock);
+        slot->done = false;
+        x.consumed++;
+        WakeAllConditionVariable(&x.changed);
+        LeaveCriticalSection(&x.lock);
+    }
+
+    EnterCriticalSection(&x.lock);
+    x.abort = true;
+    WakeAllConditionVariable(&x.changed);
+    LeaveCriticalSection(&x.lock);
+
+    WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+
+    for (uint32_t i = 0; i < started; i++) {
+        CloseHandle(workers[i]);
+    }
+
+    DeleteCriticalSection(&x.lock);
+    free(workers);
+    free(x.slots);
+
+    return err;
+}
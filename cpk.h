@@ -0,0 +1,49 @@
+#pragma once
+
+#include "defs.h"
+#include "utf.h"
+
+// Maximum number of threads decompressing entries
+#define CPK_MAX_THREADS 16
+
+// One file listed in the TOC, the strings point into the TOC table
+typedef struct cpk_entry {
+    const char* dir;
+    const char* name;
+
+    // Absolute offset in the archive
+    uint64_t offset;
+
+    // Stored and extracted size, they differ for CRILAYLA compressed entries
+    uint64_t size;
+    uint64_t extract_size;
+} cpk_entry;
+
+// A memory mapped CRI CPK archive
+typedef struct cpk {
+    HANDLE file;
+    HANDLE mapping;
+    const uint8_t* data;
+    uint64_t size;
+
+    utf_table header;
+    utf_table toc;
+
+    cpk_entry* entries;
+    uint32_t count;
+} cpk;
+
+// Receives each extracted entry, data is only valid during the call
+typedef errno_t (*cpk_entry_handler)(void* ctx, const cpk_entry* entry, const uint8_t* data, uint64_t size);
+
+// Maps the archive and reads its TOC
+errno_t cpk_open(cpk* archive, const char* path);
+
+// Unmaps the archive and frees the TOC
+void cpk_close(cpk* archive);
+
+// Decompresses a CRILAYLA stream into out, out_size has to match the stored size plus the 0x100 byte raw header
+errno_t crilayla_decompress(const uint8_t* in, uint64_t in_size, uint8_t* out, uint64_t out_size);
+
+// Decompresses the given entries on all cores and passes them to handler in the given order
+errno_t cpk_extract(const cpk* archive, const uint32_t* indices, uint32_t count, cpk_entry_handler handler, void* ctx);
@@ -0,0 +1,111 @@
+#include "dedup.h"
+
+#define DEDUP_INITIAL_CAPACITY 256
+
+// The key is already a hash, the size only tells apart the rare collision
+static uint32_t table_slot(const dedup* d, uint64_t key, uint64_t size) {
+    uint32_t mask = d->table_size - 1;
+    uint32_t slot = (uint32_t)key & mask;
+
+    while (d->table[slot] != UINT32_MAX && (d->entries[d->table[slot]].key != key || d->entries[d->table[slot]].size != size)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+// Keeps the table at most half full
+static void grow_table(dedup* d) {
+    free(d->table);
+
+    d->table_size = d->table_size ? d->table_size * 2 : DEDUP_INITIAL_CAPACITY * 2;
+    d->table = malloc(d->table_size * sizeof(uint32_t));
+    memset(d->table, 0xFF, d->table_size * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < d->count; i++) {
+        d->table[table_slot(d, d->entries[i].key, d->entries[i].size)] = i;
+    }
+}
+
+void dedup_init(dedup* d) {
+    memset(d, 0, sizeof(dedup));
+
+    grow_table(d);
+}
+
+void dedup_free(dedup* d) {
+    for (uint32_t i = 0; i < d->count; i++) {
+        free(d->entries[i].output);
+    }
+
+    free(d->entries);
+    free(d->table);
+
+    memset(d, 0, sizeof(dedup));
+}
+
+dedup_entry* dedup_find(dedup* d, uint64_t key, uint64_t size) {
+    uint32_t slot = table_slot(d, key, size);
+
+    return d->table[slot] == UINT32_MAX ? NULL : &d->entries[d->table[slot]];
+}
+
+// Returns the track's entry, a new one without an output if it has none yet
+static dedup_entry* get_entry(dedup* d, uint64_t key, uint64_t size) {
+    if ((d->count + 1) * 2 > d->table_size) {
+        grow_table(d);
+    }
+
+    uint32_t slot = table_slot(d, key, size);
+
+    if (d->table[slot] != UINT32_MAX) {
+        return &d->entries[d->table[slot]];
+    }
+
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : DEDUP_INITIAL_CAPACITY;
+        d->entries = realloc(d->entries, d->capacity * sizeof(dedup_entry));
+    }
+
+    dedup_entry* e = &d->entries[d->count];
+    e->key = key;
+    e->size = size;
+    e->output = NULL;
+    e->pending = false;
+    e->waiters = NULL;
+
+    d->table[slot] = d->count++;
+
+    return e;
+}
+
+void dedup_add(dedup* d, uint64_t key, uint64_t size, const char* output) {
+    dedup_entry* e = get_entry(d, key, size);
+
+    // A later conversion of the same track replaces the earlier output
+    free(e->output);
+    e->output = _strdup(output);
+}
+
+void dedup_begin(dedup* d, uint64_t key, uint64_t size) {
+    dedup_entry* e = get_entry(d, key, size);
+
+    e->pending = true;
+    e->waiters = NULL;
+}
+
+void* dedup_end(dedup* d, uint64_t key, uint64_t size, const char* output) {
+    dedup_entry* e = get_entry(d, key, size);
+    void* waiters = e->waiters;
+
+    // A failed conversion keeps an earlier output, the next duplicate is converted again if there is none
+    if (output) {
+        free(e->output);
+        e->output = _strdup(output);
+    }
+
+    e->pending = false;
+    e->waiters = NULL;
+
+    return waiters;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "defs.h"
+
+// An output converted from one distinct track
+typedef struct dedup_entry {
+    uint64_t key;
+    uint64_t size;
+
+    // NULL while the track's first conversion runs, and after it failed
+    char* output;
+
+    // The first conversion is still running, duplicates wait for it instead of being converted again
+    bool pending;
+
+    // The duplicates waiting for it, a list the caller links through its own jobs
+    void* waiters;
+} dedup_entry;
+
+// Tracks converted in this run, keyed by a hash of their bytes and the encoder arguments
+typedef struct dedup {
+    dedup_entry* entries;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Open addressing table of entry indices, UINT32_MAX marks a free slot
+    uint32_t* table;
+    uint32_t table_size;
+
+    // Duplicates that were linked or copied instead of converted, and their total input size
+    uint32_t duplicates;
+    uint64_t duplicate_bytes;
+} dedup;
+
+// Starts an empty table
+void dedup_init(dedup* d);
+
+// Frees all entries
+void dedup_free(dedup* d);
+
+// Returns the entry of a track with this key and size, NULL if there is none
+// It stays valid until the next dedup_add or dedup_begin
+dedup_entry* dedup_find(dedup* d, uint64_t key, uint64_t size);
+
+// Remembers the output converted from a track
+void dedup_add(dedup* d, uint64_t key, uint64_t size, const char* output);
+
+// Marks a track whose first conversion starts as pending, so its duplicates can wait for it
+void dedup_begin(dedup* d, uint64_t key, uint64_t size);
+
+// Finishes a pending track with its output, or NULL if its conversion failed, and returns its waiters
+void* dedup_end(dedup* d, uint64_t key, uint64_t size, const char* output);
@@ -8,11 +8,20 @@
 #include <stdint.h>
 #include <sys/stat.h>
 
+// Wraps the allocator in NME_MEMSTATS builds, so it comes right after the headers that declare it
+#include "memstats.h"
+
 // Yes this is stolen from Qt
 #define UNUSED(x) (void)x
 
 #define TRIM(c) realloc(c, strlen(c))
 
+// SSE2 is part of the x64 baseline, on x86 it depends on /arch
+#if defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define NME_SSE2 1
+#include <emmintrin.h>
+#endif
+
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 5
 
@@ -25,9 +34,26 @@
 #define RESPONSE_YES     2
 #define RESPONSE_YES_ALL 3
 
-#define FORMAT_NIL 0
-#define FORMAT_USM 1
-#define FORMAT_WSP 2
+#define FORMAT_NIL       0
+#define FORMAT_USM       1
+#define FORMAT_WSP       2
+#define FORMAT_WEM_PCM   3
+#define FORMAT_WEM_ADPCM 4
+#define FORMAT_BNK       5
+#define FORMAT_CPK       6
+
+#define WEM_CODEC_PCM       0x0001
+#define WEM_CODEC_IMA_ADPCM 0x0002
+#define WEM_CODEC_PCM_EX    0xFFFE
+#define WEM_CODEC_VORBIS    0xFFFF
+
+#define PCM_FMT_NIL 0
+#define PCM_FMT_F32 1
+#define PCM_FMT_F64 2
+#define PCM_FMT_S16 3
+#define PCM_FMT_S24 4
+#define PCM_FMT_S32 5
+#define PCM_FMT_S64 6
 
 #define VP9_CODEC     "libvpx-vp9"
 #define H265_CODEC    "libx265"
@@ -60,17 +86,49 @@
 #define AUDIO_QUALITY_FALLBACK_AAC    "-b:a 320k"
 #define AUDIO_QUALITY_FALLBACK_MP3    "-b:a 320k"
 
-#define CMD_BASE_VIDEO "ffmpeg -hide_banner -v fatal -stats -f mpegvideo -i \"%s\" -an -c:v %s %s %s -threads %i %s -y \"%s\""
-#define CMD_BASE_AUDIO "ffmpeg -hide_banner -v fatal -i - -c:a copy -f ogg - | revorb - - | ffmpeg -hide_banner -v fatal -stats -i - -c:a %s %s %s -threads %i -y \"%s\""
+#define HASH_FILE_CHUNK (1 << 20)
+
+#define CMD_BASE_VIDEO "ffmpeg -hide_banner -v fatal -nostats -f mpegvideo -i \"%s\" -an -c:v %s %s %s -threads %i %s -y \"%s\""
+#define CMD_BASE_VIDEO_PIPE "ffmpeg -hide_banner -v fatal -nostats -f mpegvideo -i - -an -c:v %s %s %s -threads %i %s -y \"%s\""
+#define CMD_BASE_AUDIO "ffmpeg -hide_banner -v fatal -i - -c:a copy -f ogg - | revorb - - | ffmpeg -hide_banner -v fatal -nostats -i - -c:a %s %s %s -threads %i -y \"%s\""
+#define CMD_BASE_AUDIO_WAV "ffmpeg -hide_banner -v fatal -nostats -f wav -i - -c:a %s %s %s -threads %i -y \"%s\""
 
 #define CMD_MAX_LENGTH 0x1FFF
 
+// One ffmpeg for many small WAV tracks, every track gets an input pipe and an output of its own
+#define CMD_BATCH_AUDIO_WAV "ffmpeg -hide_banner -v fatal -nostats -nostdin"
+#define CMD_BATCH_INPUT_WAV " -f wav -i \"%s\""
+#define CMD_BATCH_OUTPUT_AUDIO " -map %u:a -c:a %s %s %s -threads %i -y \"%s\""
+
+// WEMs up to this size share an encoder when batching, larger ones take longer to encode than ffmpeg takes to start
+#define BATCH_TRACK_SIZE (1 << 18)
+
+// Most tracks per batch, keeps the command line well below the 32767 characters CreateProcess takes
+#define BATCH_TRACKS_MAX 32
+
+// Most inputs read ahead of the one being converted
+#define READ_AHEAD_INPUTS 8
+
+// Bytes of inputs read ahead by default, inputs converted from memory are held whole until their turn
+#define READ_AHEAD_DEFAULT_BUDGET (256ULL << 20)
+
+// Size of the reads that only bring inputs read by ffmpeg or mapped into the system cache
+#define READ_AHEAD_CHUNK (1 << 20)
+
+// Bytes of PCM decoded in-process per byte of the input, for estimating an input's peak memory
+#define MEM_EXPANSION_VORBIS 10
+#define MEM_EXPANSION_ADPCM  4
+
+// Tracks queued per rebuild worker, so the workers never wait for the main thread to hand them the next one
+#define REBUILD_QUEUE_PER_THREAD 4
+
 #define OFFSET_OFFSET   71991
 #define CODEBOOK_COUNT  599
 
 typedef unsigned char format;
 typedef unsigned char path_t;
 typedef unsigned char yn_response;
+typedef unsigned char pcm_format;
 
 typedef struct fpath {
     char drive[_MAX_DRIVE];
@@ -103,6 +161,9 @@ typedef struct File {
     fpath output;
     format format;
     Args args;
+
+    // The input is written to the command's stdin instead of being read from the input path
+    bool piped;
 } File;
 
 typedef struct VersionInfo {
@@ -0,0 +1,1005 @@
+#include "defs.h"
+#include "utils.h"
+#include "bitmanip.h"
+#include "wwriff.h"
+
+// Codebooks in the packed library, the last offset only marks where the one before it ends
+#define GEN_CODEBOOKS (CODEBOOK_COUNT - 1)
+
+// Size of the vorb data of the Wwise versions with 2 byte packet headers, the only ones create_ogg reads
+#define GEN_VORB_SIZE 0x2A
+
+// fmt chunk with the vorb data embedded, as current Wwise versions write it
+#define GEN_FMT_EMBEDDED 0x42
+
+// Tracks in a WSP are padded to this, ConvertWsp drops the byte before each RIFF
+#define GEN_WSP_ALIGN 16
+
+// Default synthesized track
+#define GEN_SYNTH_SECONDS  10
+#define GEN_SYNTH_CHANNELS 2
+#define GEN_SYNTH_RATE     48000
+#define GEN_SYNTH_QUALITY  "4"
+
+// fmt chunk sizes create_ogg accepts, -f mix cycles through them
+static const uint16_t fmt_sizes[] = { GEN_FMT_EMBEDDED, 0x12, 0x18, 0x28 };
+
+// Speaker masks of the WAV channel layouts Wwise uses
+static const uint32_t channel_masks[8] = { 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F };
+
+// A growable byte buffer
+typedef struct gen_buffer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} gen_buffer;
+
+// Packets of the first logical stream of an Ogg file, stored back to back
+typedef struct ogg_packets {
+    gen_buffer data;
+    size_t* offsets;
+    uint32_t* sizes;
+    uint32_t count;
+    uint32_t max_count;
+
+    // Granule position of the last page that has one, the number of samples
+    uint64_t granule;
+} ogg_packets;
+
+// Reads the bits of a standard Vorbis packet, reading past its end sets overrun instead
+typedef struct packet_reader {
+    const uint8_t* data;
+    uint64_t bits;
+    uint64_t pos;
+    bool overrun;
+} packet_reader;
+
+// A codebook of the library expanded to its standard form, to be matched bit for bit
+typedef struct library_book {
+    gen_buffer data;
+    uint64_t bits;
+} library_book;
+
+// Everything the WEM needs from the identification header and the last page
+typedef struct stream_info {
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t bitrate_nominal;
+    uint8_t blocksize_0_pow;
+    uint8_t blocksize_1_pow;
+    uint32_t sample_count;
+} stream_info;
+
+typedef struct gen_options {
+    const char* out_dir;
+
+    // fmt chunk size of every WEM, 0 to cycle through all of them
+    uint16_t fmt_size;
+
+    // All tracks are concatenated into this WSP as well, if set
+    FILE* wsp;
+
+    double seconds;
+    uint16_t channels;
+    uint32_t rate;
+    const char* quality;
+} gen_options;
+
+static library_book library[GEN_CODEBOOKS];
+
+static void buffer_append(gen_buffer* b, const void* data, size_t size) {
+    if (b->size + size > b->capacity) {
+        while (b->size + size > b->capacity) {
+            b->capacity = b->capacity ? b->capacity * 2 : 0x10000;
+        }
+
+        b->data = realloc(b->data, b->capacity);
+    }
+
+    memcpy(&b->data[b->size], data, size);
+    b->size += size;
+}
+
+static void buffer_put_16(gen_buffer* b, uint16_t v) {
+    uint8_t bytes[2] = { v & 0xFF, v >> 8 };
+    buffer_append(b, bytes, 2);
+}
+
+static void buffer_put_32(gen_buffer* b, uint32_t v) {
+    uint8_t bytes[4];
+    write_32(bytes, v);
+    buffer_append(b, bytes, 4);
+}
+
+static uint32_t take(packet_reader* r, int n_bits) {
+    uint32_t v = 0;
+
+    for (int i = 0; i < n_bits; i++) {
+        if (r->pos >= r->bits) {
+            r->overrun = true;
+
+            return 0;
+        }
+
+        if ((r->data[r->pos >> 3] >> (r->pos & 7)) & 1) {
+            v |= 1U << i;
+        }
+
+        r->pos++;
+    }
+
+    return v;
+}
+
+// Fields the packed setup keeps as they are
+static uint32_t copy(packet_reader* r, ogg_output_stream* os, int n_bits) {
+    uint32_t v = take(r, n_bits);
+    ogg_write(os, new_uint_var(v, n_bits));
+
+    return v;
+}
+
+static void collect_book(void* ctx, const uint8_t* data, uint32_t size, uint32_t granule) {
+    UNUSED(granule);
+    buffer_append(ctx, data, size);
+}
+
+// Expands every codebook of the library the same way rebuild_vorbis does
+static void expand_library(void) {
+    for (long i = 0; i < GEN_CODEBOOKS; i++) {
+        long start = read_32_buf((unsigned char*)&pcb[OFFSET_OFFSET + i * 4]);
+        long end = read_32_buf((unsigned char*)&pcb[OFFSET_OFFSET + (i + 1) * 4]);
+
+        membuf buf;
+        buf.data = (char*)&pcb[start];
+        buf.size = end - start;
+        buf.pos = 0;
+
+        bit_stream bs = new_bit_stream(&buf);
+        ogg_output_stream os = new_ogg_packet_stream(collect_book, &library[i].data);
+
+        parse_codebook(&bs, end - start, &os);
+
+        library[i].bits = os.payload_bytes * 8ULL + os.bits_stored;
+        flush_page(&os, false, false);
+    }
+}
+
+static void free_library(void) {
+    for (long i = 0; i < GEN_CODEBOOKS; i++) {
+        free(library[i].data.data);
+    }
+}
+
+// Finds the library codebook that matches the bits of the packet from start, -1 if there is none
+static long find_book(const packet_reader* r, uint64_t start) {
+    uint64_t bits = r->pos - start;
+
+    for (long i = 0; i < GEN_CODEBOOKS; i++) {
+        if (library[i].bits != bits) {
+            continue;
+        }
+
+        uint64_t j = 0;
+        for (; j < bits; j++) {
+            uint64_t p = start + j;
+
+            if (((r->data[p >> 3] >> (p & 7)) & 1) != ((library[i].data.data[j >> 3] >> (j & 7)) & 1)) {
+                break;
+            }
+        }
+
+        if (j == bits) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Reads past a standard codebook
+static errno_t skip_codebook(packet_reader* r) {
+    if (take(r, 24) != 0x564342) {
+        perrf("Invalid codebook sync\n");
+
+        return 1;
+    }
+
+    uint32_t dimensions = take(r, 16);
+    uint32_t entries = take(r, 24);
+
+    if (take(r, 1)) {
+        // Ordered books store runs of equal lengths
+        take(r, 5);
+
+        for (uint32_t current = 0; current < entries && !r->overrun;) {
+            current += take(r, ilog(entries - current));
+        }
+    } else {
+        bool sparse = take(r, 1) != 0;
+
+        for (uint32_t i = 0; i < entries && !r->overrun; i++) {
+            if (!sparse || take(r, 1)) {
+                take(r, 5);
+            }
+        }
+    }
+
+    uint32_t lookup_type = take(r, 4);
+
+    if (lookup_type == 1 || lookup_type == 2) {
+        if (dimensions == 0) {
+            perrf("Codebook without dimensions\n");
+
+            return 1;
+        }
+
+        take(r, 32);
+        take(r, 32);
+        uint32_t value_length = take(r, 4) + 1;
+        take(r, 1);
+
+        uint64_t values = lookup_type == 1 ? _book_maptype1_quantvals(entries, dimensions) : (uint64_t)entries * dimensions;
+
+        r->pos += values * value_length;
+    } else if (lookup_type != 0) {
+        perrf("Invalid codebook lookup type %u\n", lookup_type);
+
+        return 1;
+    }
+
+    if (r->pos > r->bits) {
+        r->overrun = true;
+    }
+
+    return 0;
+}
+
+// Packs the setup header the way rebuild_vorbis unpacks it, codebooks become library IDs and implied fields are left out
+static errno_t pack_setup(const uint8_t* data, uint32_t size, uint16_t channels, ogg_output_stream* os, bool** mode_blockflag, uint32_t* mode_count) {
+    packet_reader r = { data, size * 8ULL, 0, false };
+
+    if (size < 7 || data[0] != 5 || memcmp(&data[1], "vorbis", 6) != 0) {
+        perrf("Missing Vorbis setup header\n");
+
+        return 1;
+    }
+
+    r.pos = 7 * 8;
+
+    uint32_t codebook_count = copy(&r, os, 8) + 1;
+
+    for (uint32_t i = 0; i < codebook_count; i++) {
+        uint64_t start = r.pos;
+
+        if (skip_codebook(&r) != 0 || r.overrun) {
+            perrf("Codebook %u is truncated or invalid\n", i);
+
+            return 1;
+        }
+
+        long id = find_book(&r, start);
+
+        if (id < 0) {
+            perrf("Codebook %u is not in the packed codebook library\n", i);
+
+            return 1;
+        }
+
+        ogg_write(os, new_uint_var(id, 10));
+    }
+
+    // Time domain transforms are placeholders, the packed form drops them
+    uint32_t time_count = take(&r, 6) + 1;
+
+    for (uint32_t i = 0; i < time_count; i++) {
+        if (take(&r, 16) != 0) {
+            perrf("Invalid time domain transform\n");
+
+            return 1;
+        }
+    }
+
+    // Floors
+    uint32_t floor_count = copy(&r, os, 6) + 1;
+
+    for (uint32_t i = 0; i < floor_count; i++) {
+        if (take(&r, 16) != 1) {
+            perrf("Only floor type 1 can be packed\n");
+
+            return 1;
+        }
+
+        uint32_t partitions = copy(&r, os, 5);
+        uint32_t partition_class[31];
+        uint32_t maximum_class = 0;
+
+        for (uint32_t j = 0; j < partitions; j++) {
+            partition_class[j] = copy(&r, os, 4);
+
+            if (partition_class[j] > maximum_class) {
+                maximum_class = partition_class[j];
+            }
+        }
+
+        uint32_t class_dimensions[16];
+
+        for (uint32_t j = 0; j <= maximum_class; j++) {
+            class_dimensions[j] = copy(&r, os, 3) + 1;
+
+            uint32_t subclasses = copy(&r, os, 2);
+
+            if (subclasses != 0) {
+                copy(&r, os, 8);
+            }
+
+            for (uint32_t k = 0; k < (1U << subclasses); k++) {
+                copy(&r, os, 8);
+            }
+        }
+
+        copy(&r, os, 2);
+        uint32_t rangebits = copy(&r, os, 4);
+
+        for (uint32_t j = 0; j < partitions; j++) {
+            for (uint32_t k = 0; k < class_dimensions[partition_class[j]]; k++) {
+                copy(&r, os, rangebits);
+            }
+        }
+    }
+
+    // Residues
+    uint32_t residue_count = copy(&r, os, 6) + 1;
+
+    for (uint32_t i = 0; i < residue_count; i++) {
+        uint32_t residue_type = take(&r, 16);
+
+        if (residue_type > 2) {
+            perrf("Invalid residue type\n");
+
+            return 1;
+        }
+
+        ogg_write(os, new_uint_var(residue_type, 2));
+
+        copy(&r, os, 24);
+        copy(&r, os, 24);
+        copy(&r, os, 24);
+        uint32_t classifications = copy(&r, os, 6) + 1;
+        copy(&r, os, 8);
+
+        uint32_t cascade[64];
+
+        for (uint32_t j = 0; j < classifications; j++) {
+            uint32_t high_bits = 0;
+            uint32_t low_bits = copy(&r, os, 3);
+
+            if (copy(&r, os, 1)) {
+                high_bits = copy(&r, os, 5);
+            }
+
+            cascade[j] = high_bits * 8 + low_bits;
+        }
+
+        for (uint32_t j = 0; j < classifications; j++) {
+            for (uint32_t k = 0; k < 8; k++) {
+                if (cascade[j] & (1 << k)) {
+                    copy(&r, os, 8);
+                }
+            }
+        }
+    }
+
+    // Mappings
+    uint32_t mapping_count = copy(&r, os, 6) + 1;
+
+    for (uint32_t i = 0; i < mapping_count; i++) {
+        if (take(&r, 16) != 0) {
+            perrf("Invalid mapping type\n");
+
+            return 1;
+        }
+
+        uint32_t submaps = 1;
+
+        if (copy(&r, os, 1)) {
+            submaps = copy(&r, os, 4) + 1;
+        }
+
+        if (copy(&r, os, 1)) {
+            uint32_t coupling_steps = copy(&r, os, 8) + 1;
+
+            for (uint32_t j = 0; j < coupling_steps; j++) {
+                copy(&r, os, ilog(channels - 1));
+                copy(&r, os, ilog(channels - 1));
+            }
+        }
+
+        if (copy(&r, os, 2) != 0) {
+            perrf("Mapping reserved field nonzero\n");
+
+            return 1;
+        }
+
+        if (submaps > 1) {
+            for (uint32_t j = 0; j < channels; j++) {
+                copy(&r, os, 4);
+            }
+        }
+
+        for (uint32_t j = 0; j < submaps; j++) {
+            copy(&r, os, 8);
+            copy(&r, os, 8);
+            copy(&r, os, 8);
+        }
+    }
+
+    // Modes, only the block flags matter for the audio packets
+    *mode_count = copy(&r, os, 6) + 1;
+    *mode_blockflag = malloc(*mode_count * sizeof(bool));
+
+    for (uint32_t i = 0; i < *mode_count; i++) {
+        (*mode_blockflag)[i] = copy(&r, os, 1) != 0;
+
+        if (take(&r, 16) != 0 || take(&r, 16) != 0) {
+            perrf("Invalid mode window or transform type\n");
+
+            return 1;
+        }
+
+        copy(&r, os, 8);
+    }
+
+    if (take(&r, 1) != 1 || r.overrun) {
+        perrf("Setup header is truncated\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Packs an audio packet, dropping the packet type and the window flags rebuild_vorbis recreates from its neighbours
+static errno_t pack_audio(const uint8_t* data, uint32_t size, const bool* mode_blockflag, uint32_t mode_count, ogg_output_stream* os) {
+    packet_reader r = { data, size * 8ULL, 0, false };
+    int mode_bits = ilog(mode_count - 1);
+
+    if (take(&r, 1) != 0) {
+        perrf("Expected an audio packet\n");
+
+        return 1;
+    }
+
+    uint32_t mode = take(&r, mode_bits);
+
+    if (r.overrun || mode >= mode_count) {
+        perrf("Invalid audio packet mode\n");
+
+        return 1;
+    }
+
+    int window_bits = mode_blockflag[mode] ? 2 : 0;
+    take(&r, window_bits);
+
+    ogg_write(os, new_uint_var(mode, mode_bits));
+
+    // rebuild_vorbis pads the packet back to whole bytes, so zero bits that fall into its padding can be left out
+    uint64_t end = r.bits;
+
+    if (size >= 2 && (data[size - 1] >> (1 + window_bits)) == 0) {
+        end -= 7 - window_bits;
+    }
+
+    while (r.pos < end) {
+        int n_bits = end - r.pos < 8 ? (int)(end - r.pos) : 8;
+
+        copy(&r, os, n_bits);
+    }
+
+    return 0;
+}
+
+// Appends a packed packet with its 2 byte size header to the data chunk
+static void write_packet(void* ctx, const uint8_t* data, uint32_t size, uint32_t granule) {
+    UNUSED(granule);
+
+    buffer_put_16(ctx, (uint16_t)size);
+    buffer_append(ctx, data, size);
+}
+
+static void add_packet(ogg_packets* p, const uint8_t* data, size_t size) {
+    if (p->count == p->max_count) {
+        p->max_count = p->max_count ? p->max_count * 2 : 1024;
+        p->offsets = realloc(p->offsets, p->max_count * sizeof(size_t));
+        p->sizes = realloc(p->sizes, p->max_count * sizeof(uint32_t));
+    }
+
+    p->offsets[p->count] = p->data.size;
+    p->sizes[p->count] = (uint32_t)size;
+    p->count++;
+
+    buffer_append(&p->data, data, size);
+}
+
+// Splits the first logical stream of an Ogg file into packets
+static errno_t read_ogg_packets(const uint8_t* data, uint64_t size, ogg_packets* p) {
+    gen_buffer partial = { NULL, 0, 0 };
+    uint32_t serial = 0;
+    uint64_t pos = 0;
+
+    memset(p, 0, sizeof(ogg_packets));
+
+    while (pos + HEADER_BYTES <= size) {
+        if (memcmp(&data[pos], "OggS", 4) != 0) {
+            perrf("Missing Ogg page at %llu\n", pos);
+            free(partial.data);
+
+            return 1;
+        }
+
+        uint8_t segments = data[pos + 26];
+        uint64_t payload = pos + HEADER_BYTES + segments;
+        uint32_t page_serial = read_32_buf((unsigned char*)&data[pos + 14]);
+
+        if (payload > size) {
+            break;
+        }
+
+        uint64_t page_size = 0;
+        for (uint8_t i = 0; i < segments; i++) {
+            page_size += data[pos + HEADER_BYTES + i];
+        }
+
+        if (payload + page_size > size) {
+            break;
+        }
+
+        if (pos == 0) {
+            serial = page_serial;
+        }
+
+        // Other logical streams are skipped
+        if (page_serial == serial) {
+            uint64_t offset = payload;
+
+            for (uint8_t i = 0; i < segments; i++) {
+                uint8_t lacing = data[pos + HEADER_BYTES + i];
+
+                buffer_append(&partial, &data[offset], lacing);
+                offset += lacing;
+
+                if (lacing < SEGMENT_SIZE) {
+                    add_packet(p, partial.data, partial.size);
+                    partial.size = 0;
+                }
+            }
+
+            uint64_t granule = (uint64_t)read_32_buf((unsigned char*)&data[pos + 6]) | (uint64_t)read_32_buf((unsigned char*)&data[pos + 10]) << 32;
+
+            if (granule != UINT64_MAX) {
+                p->granule = granule;
+            }
+        }
+
+        pos = payload + page_size;
+    }
+
+    free(partial.data);
+
+    if (p->count < 3) {
+        perrf("Expected Vorbis headers and audio packets\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void free_ogg_packets(ogg_packets* p) {
+    free(p->data.data);
+    free(p->offsets);
+    free(p->sizes);
+}
+
+static errno_t read_identification(const uint8_t* data, uint32_t size, stream_info* info) {
+    if (size < 30 || data[0] != 1 || memcmp(&data[1], "vorbis", 6) != 0 || read_32_buf((unsigned char*)&data[7]) != 0) {
+        perrf("Missing Vorbis identification header\n");
+
+        return 1;
+    }
+
+    info->channels = data[11];
+    info->sample_rate = read_32_buf((unsigned char*)&data[12]);
+    info->bitrate_nominal = read_32_buf((unsigned char*)&data[20]);
+    info->blocksize_0_pow = data[28] & 0x0F;
+    info->blocksize_1_pow = data[28] >> 4;
+
+    if (info->channels == 0 || info->sample_rate == 0) {
+        perrf("Invalid channels or sample rate\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// The vorb data, in its own chunk or at the end of a 0x42 byte fmt chunk
+static void write_vorb(gen_buffer* wem, const stream_info* info, uint32_t setup_size, uint32_t uid) {
+    buffer_put_32(wem, info->sample_count);
+
+    // A mod signal that isn't one of the old ones tells ww2ogg the packets are modified as well
+    buffer_put_32(wem, 0);
+    buffer_put_32(wem, 0);
+    buffer_put_32(wem, 0);
+
+    // The setup packet is the first one in the data chunk, the audio packets follow it
+    buffer_put_32(wem, 0);
+    buffer_put_32(wem, setup_size + 2);
+
+    for (int i = 0; i < 3; i++) {
+        buffer_put_32(wem, 0);
+    }
+
+    buffer_put_32(wem, uid);
+    buffer_append(wem, &info->blocksize_0_pow, 1);
+    buffer_append(wem, &info->blocksize_1_pow, 1);
+}
+
+static void write_wem(gen_buffer* wem, const stream_info* info, const gen_buffer* packets, uint32_t setup_size, uint16_t fmt_size) {
+    const uint8_t format_guid[16] = {
+        1,    0,    0,    0,
+        0,    0,    0x10, 0,
+        0x80, 0,    0,    0xAA,
+        0,    0x38, 0x9B, 0x71
+    };
+
+    // Wwise takes the nominal bitrate from the encoder, an average has to do for streams without one
+    uint32_t avg_bytes_per_second = info->bitrate_nominal / 8;
+
+    if (avg_bytes_per_second == 0 && info->sample_count != 0) {
+        avg_bytes_per_second = (uint32_t)(packets->size * (uint64_t)info->sample_rate / info->sample_count);
+    }
+
+    uint32_t uid = checksum(packets->data, (int)(setup_size + 2));
+
+    buffer_append(wem, "RIFF", 4);
+    buffer_put_32(wem, 0);
+    buffer_append(wem, "WAVE", 4);
+
+    buffer_append(wem, "fmt ", 4);
+    buffer_put_32(wem, fmt_size);
+    buffer_put_16(wem, WEM_CODEC_VORBIS);
+    buffer_put_16(wem, info->channels);
+    buffer_put_32(wem, info->sample_rate);
+    buffer_put_32(wem, avg_bytes_per_second);
+    buffer_put_16(wem, 0);
+    buffer_put_16(wem, 0);
+    buffer_put_16(wem, fmt_size - 0x12);
+
+    if (fmt_size >= 0x18) {
+        buffer_put_16(wem, 0);
+        buffer_put_32(wem, info->channels <= 8 ? channel_masks[info->channels - 1] : 0);
+    }
+
+    if (fmt_size == 0x28) {
+        buffer_append(wem, format_guid, 16);
+    }
+
+    if (fmt_size == GEN_FMT_EMBEDDED) {
+        write_vorb(wem, info, setup_size, uid);
+    } else {
+        buffer_append(wem, "vorb", 4);
+        buffer_put_32(wem, GEN_VORB_SIZE);
+        write_vorb(wem, info, setup_size, uid);
+    }
+
+    buffer_append(wem, "data", 4);
+    buffer_put_32(wem, (uint32_t)packets->size);
+    buffer_append(wem, packets->data, packets->size);
+
+    // No pad byte after an odd data chunk, create_ogg reads it as a truncated chunk header
+
+    write_32(&wem->data[4], (uint32_t)(wem->size - 8));
+}
+
+// Converts a standard Ogg Vorbis stream into a WEM in wem
+static errno_t convert_ogg(const uint8_t* data, uint64_t size, uint16_t fmt_size, gen_buffer* wem) {
+    ogg_packets p;
+    stream_info info;
+
+    if (read_ogg_packets(data, size, &p) != 0) {
+        free_ogg_packets(&p);
+
+        return 1;
+    }
+
+    if (read_identification(&p.data.data[p.offsets[0]], p.sizes[0], &info) != 0) {
+        free_ogg_packets(&p);
+
+        return 1;
+    }
+
+    info.sample_count = p.granule > UINT32_MAX ? UINT32_MAX : (uint32_t)p.granule;
+
+    gen_buffer packets = { NULL, 0, 0 };
+    ogg_output_stream os = new_ogg_packet_stream(write_packet, &packets);
+    bool* mode_blockflag = NULL;
+    uint32_t mode_count = 0;
+
+    errno_t err = pack_setup(&p.data.data[p.offsets[2]], p.sizes[2], info.channels, &os, &mode_blockflag, &mode_count);
+    flush_page(&os, false, false);
+
+    uint32_t setup_size = (uint32_t)packets.size - 2;
+
+    for (uint32_t i = 3; i < p.count && err == 0; i++) {
+        // Empty packets carry no audio and have no mode to pack
+        if (p.sizes[i] == 0) {
+            continue;
+        }
+
+        if (p.sizes[i] > UINT16_MAX) {
+            perrf("Audio packet %u is too large for a 2 byte header\n", i);
+
+            err = 1;
+            break;
+        }
+
+        err = pack_audio(&p.data.data[p.offsets[i]], p.sizes[i], mode_blockflag, mode_count, &os);
+        flush_page(&os, false, false);
+    }
+
+    if (err == 0) {
+        write_wem(wem, &info, &packets, setup_size, fmt_size);
+    }
+
+    free(mode_blockflag);
+    free(packets.data);
+    free_ogg_packets(&p);
+
+    return err;
+}
+
+// Encodes a tone with ffmpeg's libvorbis and returns the Ogg stream, NULL on failure
+static uint8_t* synthesize(const gen_options* opts, uint32_t index, uint64_t* size) {
+    char cmd[512];
+
+    // Every track gets its own pitch, so no two of them hash alike
+    sprintf_s(cmd, sizeof(cmd), "ffmpeg -v error -f lavfi -i \"sine=frequency=%u:sample_rate=%u:duration=%g\" -ac %u -c:a libvorbis -q:a %s -f ogg -",
+        110 + index * 55, opts->rate, opts->seconds, opts->channels, opts->quality);
+
+    FILE* in = _popen(cmd, "rb");
+
+    if (!in) {
+        perrf("Could not start ffmpeg\n");
+
+        return NULL;
+    }
+
+    gen_buffer ogg = { NULL, 0, 0 };
+    uint8_t chunk[0x10000];
+    size_t read;
+
+    while ((read = fread(chunk, 1, sizeof(chunk), in)) != 0) {
+        buffer_append(&ogg, chunk, read);
+    }
+
+    int status = _pclose(in);
+
+    if (status != 0 || ogg.size == 0) {
+        perrf("ffmpeg failed with status code %i, it needs to be built with libvorbis\n", status);
+        free(ogg.data);
+
+        return NULL;
+    }
+
+    *size = ogg.size;
+
+    return ogg.data;
+}
+
+// Writes one WEM to the output directory and appends it to the WSP
+static errno_t write_output(const gen_options* opts, const char* name, const gen_buffer* wem) {
+    char path[_MAX_PATH];
+    FILE* out;
+
+    sprintf_s(path, _MAX_PATH, "%s\\%s.wem", opts->out_dir, name);
+
+    if (fopen_s(&out, path, "wb") != 0) {
+        perrf("Could not open '%s' for writing\n", path);
+
+        return 1;
+    }
+
+    size_t written = fwrite(wem->data, 1, wem->size, out);
+    fclose(out);
+
+    if (written != wem->size) {
+        perrf("Could not write '%s'\n", path);
+
+        return 1;
+    }
+
+    if (opts->wsp) {
+        const uint8_t padding[GEN_WSP_ALIGN] = { 0 };
+
+        fwrite(wem->data, 1, wem->size, opts->wsp);
+        fwrite(padding, 1, GEN_WSP_ALIGN - wem->size % GEN_WSP_ALIGN, opts->wsp);
+    }
+
+    printf("Wrote %s\n", path);
+
+    return 0;
+}
+
+static errno_t generate(const gen_options* opts, const char* name, const uint8_t* ogg, uint64_t size, uint32_t index) {
+    gen_buffer wem = { NULL, 0, 0 };
+    uint16_t fmt_size = opts->fmt_size ? opts->fmt_size : fmt_sizes[index % (sizeof(fmt_sizes) / sizeof(fmt_sizes[0]))];
+
+    errno_t err = convert_ogg(ogg, size, fmt_size, &wem);
+
+    if (err == 0) {
+        err = write_output(opts, name, &wem);
+    } else {
+        perrf("Could not convert %s\n", name);
+    }
+
+    free(wem.data);
+
+    return err;
+}
+
+static void print_usage(void) {
+    printf("Usage: nme_gen [options] [input.ogg ...]\n\n");
+    printf("Converts Ogg Vorbis files into Wwise Vorbis WEMs that nme reads\n\n");
+    printf("  -o <dir>       Output directory, the current one by default\n");
+    printf("  -w <file>      Also concatenate all tracks into this WSP\n");
+    printf("  -f <size>      fmt chunk size in hex: 42 (default), 12, 18, 28 or mix to cycle through them\n");
+    printf("  -s <count>     Synthesize count tones with ffmpeg's libvorbis\n");
+    printf("  -d <seconds>   Length of a synthesized track, %d by default\n", GEN_SYNTH_SECONDS);
+    printf("  -c <channels>  Channels of a synthesized track, %d by default\n", GEN_SYNTH_CHANNELS);
+    printf("  -r <rate>      Sample rate of a synthesized track, %d by default\n", GEN_SYNTH_RATE);
+    printf("  -q <quality>   libvorbis quality of a synthesized track, %s by default\n", GEN_SYNTH_QUALITY);
+}
+
+int main(int argc, char* argv[]) {
+    gen_options opts;
+    opts.out_dir = ".";
+    opts.fmt_size = GEN_FMT_EMBEDDED;
+    opts.wsp = NULL;
+    opts.seconds = GEN_SYNTH_SECONDS;
+    opts.channels = GEN_SYNTH_CHANNELS;
+    opts.rate = GEN_SYNTH_RATE;
+    opts.quality = GEN_SYNTH_QUALITY;
+
+    const char* wsp_path = NULL;
+    uint32_t synth_count = 0;
+    uint32_t failed = 0;
+    uint32_t index = 0;
+
+    if (argc < 2) {
+        print_usage();
+
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if (argv[i][0] != '-') {
+            continue;
+        }
+
+        if (strcmp(argv[i], "-h") == 0) {
+            print_usage();
+
+            return 0;
+        }
+
+        if (!has_value) {
+            perrf("%s needs a value\n", argv[i]);
+
+            return 1;
+        }
+
+        const char* value = argv[++i];
+
+        if (strcmp(argv[i - 1], "-o") == 0) {
+            opts.out_dir = value;
+        } else if (strcmp(argv[i - 1], "-w") == 0) {
+            wsp_path = value;
+        } else if (strcmp(argv[i - 1], "-f") == 0) {
+            opts.fmt_size = strcmp(value, "mix") == 0 ? 0 : (uint16_t)strtoul(value, NULL, 16);
+
+            if (opts.fmt_size != 0 && opts.fmt_size != GEN_FMT_EMBEDDED && opts.fmt_size != 0x12 && opts.fmt_size != 0x18 && opts.fmt_size != 0x28) {
+                perrf("-f needs 42, 12, 18, 28 or mix\n");
+
+                return 1;
+            }
+        } else if (strcmp(argv[i - 1], "-s") == 0) {
+            synth_count = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i - 1], "-d") == 0 && atof(value) > 0) {
+            opts.seconds = atof(value);
+        } else if (strcmp(argv[i - 1], "-c") == 0 && atoi(value) >= 1 && atoi(value) <= 255) {
+            opts.channels = (uint16_t)atoi(value);
+        } else if (strcmp(argv[i - 1], "-r") == 0 && atoi(value) > 0) {
+            opts.rate = atoi(value);
+        } else if (strcmp(argv[i - 1], "-q") == 0) {
+            opts.quality = value;
+        } else {
+            perrf("Invalid option %s %s\n", argv[i - 1], value);
+
+            return 1;
+        }
+    }
+
+    if (!CreateDirectoryA(opts.out_dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        perrf("Could not create '%s'\n", opts.out_dir);
+
+        return 1;
+    }
+
+    if (wsp_path && fopen_s(&opts.wsp, wsp_path, "wb") != 0) {
+        perrf("Could not open '%s' for writing\n", wsp_path);
+
+        return 1;
+    }
+
+    expand_library();
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            i++;
+
+            continue;
+        }
+
+        fpath p;
+
+        if (_splitpath_s(argv[i], p.drive, _MAX_DRIVE, p.dir, _MAX_DIR, p.fname, _MAX_FNAME, p.ext, _MAX_EXT) != 0) {
+            perrf("Could not split path '%s'\n", argv[i]);
+            failed++;
+
+            continue;
+        }
+
+        uint64_t size;
+        char* data = ReadFileToMemory(p, &size);
+
+        if (!data || generate(&opts, p.fname, (uint8_t*)data, size, index++) != 0) {
+            failed++;
+        }
+
+        free(data);
+    }
+
+    for (uint32_t i = 0; i < synth_count; i++) {
+        char name[32];
+        uint64_t size;
+
+        sprintf_s(name, sizeof(name), "synth_%03u", i);
+
+        uint8_t* ogg = synthesize(&opts, i, &size);
+
+        if (!ogg || generate(&opts, name, ogg, size, index++) != 0) {
+            failed++;
+        }
+
+        free(ogg);
+    }
+
+    if (opts.wsp) {
+        fclose(opts.wsp);
+
+        printf("Wrote %s\n", wsp_path);
+    }
+
+    free_library();
+
+    if (failed != 0) {
+        perrf("%u tracks failed\n", failed);
+
+        return 1;
+    }
+
+    return 0;
+}
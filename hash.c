@@ -0,0 +1,164 @@
+#include "hash.h"
+
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_3 0x165667B19E3779F9ULL
+#define PRIME_4 0x85EBCA77C2B2AE63ULL
+#define PRIME_5 0x27D4EB2F165667C5ULL
+
+#define STRIPE_SIZE 32
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t read_64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+
+    return v;
+}
+
+static inline uint32_t read_32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME_2;
+    acc = rotl64(acc, 31);
+
+    return acc * PRIME_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t v) {
+    acc ^= hash_round(0, v);
+
+    return acc * PRIME_1 + PRIME_4;
+}
+
+// Consumes whole stripes and returns the number of bytes used
+static size_t consume_stripes(uint64_t acc[4], const uint8_t* p, size_t size) {
+    const uint8_t* start = p;
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+
+    // The four lanes are independent, which keeps several multiplies in flight
+    for (; size >= STRIPE_SIZE; size -= STRIPE_SIZE, p += STRIPE_SIZE) {
+        a0 = hash_round(a0, read_64(p));
+        a1 = hash_round(a1, read_64(p + 8));
+        a2 = hash_round(a2, read_64(p + 16));
+        a3 = hash_round(a3, read_64(p + 24));
+    }
+
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+
+    return p - start;
+}
+
+void hash_init(hash_state* h, uint64_t seed) {
+    h->acc[0] = seed + PRIME_1 + PRIME_2;
+    h->acc[1] = seed + PRIME_2;
+    h->acc[2] = seed;
+    h->acc[3] = seed - PRIME_1;
+    h->total = 0;
+    h->pending_size = 0;
+    h->seed = seed;
+}
+
+void hash_update(hash_state* h, const void* data, size_t size) {
+    const uint8_t* p = data;
+
+    h->total += size;
+
+    if (h->pending_size + size < STRIPE_SIZE) {
+        if (size != 0) {
+            memcpy(&h->pending[h->pending_size], p, size);
+        }
+        h->pending_size += (uint32_t)size;
+
+        return;
+    }
+
+    // Complete the pending stripe first
+    if (h->pending_size != 0) {
+        size_t fill = STRIPE_SIZE - h->pending_size;
+
+        memcpy(&h->pending[h->pending_size], p, fill);
+        consume_stripes(h->acc, h->pending, STRIPE_SIZE);
+
+        p += fill;
+        size -= fill;
+        h->pending_size = 0;
+    }
+
+    size_t used = consume_stripes(h->acc, p, size);
+
+    h->pending_size = (uint32_t)(size - used);
+    if (h->pending_size != 0) {
+        memcpy(h->pending, &p[used], h->pending_size);
+    }
+}
+
+void hash_update_string(hash_state* h, const char* str) {
+    hash_update(h, str, strlen(str) + 1);
+}
+
+uint64_t hash_digest(const hash_state* h) {
+    uint64_t v;
+
+    if (h->total >= STRIPE_SIZE) {
+        v = rotl64(h->acc[0], 1) + rotl64(h->acc[1], 7) + rotl64(h->acc[2], 12) + rotl64(h->acc[3], 18);
+
+        for (int i = 0; i < 4; i++) {
+            v = hash_merge(v, h->acc[i]);
+        }
+    } else {
+        v = h->seed + PRIME_5;
+    }
+
+    v += h->total;
+
+    const uint8_t* p = h->pending;
+    uint32_t left = h->pending_size;
+
+    for (; left >= 8; left -= 8, p += 8) {
+        v ^= hash_round(0, read_64(p));
+        v = rotl64(v, 27) * PRIME_1 + PRIME_4;
+    }
+
+    if (left >= 4) {
+        v ^= (uint64_t)read_32(p) * PRIME_1;
+        v = rotl64(v, 23) * PRIME_2 + PRIME_3;
+
+        left -= 4;
+        p += 4;
+    }
+
+    for (; left > 0; left--, p++) {
+        v ^= *p * PRIME_5;
+        v = rotl64(v, 11) * PRIME_1;
+    }
+
+    // Final avalanche
+    v ^= v >> 33;
+    v *= PRIME_2;
+    v ^= v >> 29;
+    v *= PRIME_3;
+    v ^= v >> 32;
+
+    return v;
+}
+
+uint64_t hash64(const void* data, size_t size, uint64_t seed) {
+    hash_state h;
+
+    hash_init(&h, seed);
+    hash_update(&h, data, size);
+
+    return hash_digest(&h);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "defs.h"
+
+// Incremental state of the 64 bit hash, an implementation of XXH64
+typedef struct hash_state {
+    uint64_t acc[4];
+    uint64_t total;
+
+    // Input that doesn't fill a whole 32 byte stripe yet
+    uint8_t pending[32];
+    uint32_t pending_size;
+
+    uint64_t seed;
+} hash_state;
+
+// Starts a new hash, different seeds give unrelated hashes for the same input
+void hash_init(hash_state* h, uint64_t seed);
+
+// Adds size bytes to the hash
+void hash_update(hash_state* h, const void* data, size_t size);
+
+// Adds a NUL terminated string including its terminator, so consecutive strings can't run into each other
+void hash_update_string(hash_state* h, const char* str);
+
+// Returns the hash of everything added so far, the state can still be updated afterwards
+uint64_t hash_digest(const hash_state* h);
+
+// Hashes a whole buffer at once
+uint64_t hash64(const void* data, size_t size, uint64_t seed);
@@ -0,0 +1,284 @@
+#include "logger.h"
+
+#define LOGGER_RING_MASK (LOGGER_RING_SIZE - 1)
+#define LOGGER_LINE_MAX  (LOGGER_MESSAGE_MAX + 128)
+
+// Wakes the flusher early once the ring is this full
+#define LOGGER_WAKE_FILL (LOGGER_RING_SIZE / 2)
+
+// One queued line, the sequence tells producers and the flusher whose turn it is
+typedef struct logger_record {
+    volatile LONG64 sequence;
+
+    SYSTEMTIME time;
+    uint32_t job;
+    const char* stage;
+    int64_t duration_us;
+    int32_t exit_code;
+    char message[LOGGER_MESSAGE_MAX];
+
+    // Messages that don't fit, like long ffmpeg command lines, are copied to the heap instead, NULL otherwise
+    char* long_message;
+} logger_record;
+
+// Bounded multi-producer ring with a single consumer, producers only contend on head
+static struct {
+    logger_record* ring;
+
+    volatile LONG64 head;
+    volatile LONG64 tail;
+
+    FILE* file;
+    HANDLE flusher;
+    HANDLE wake;
+    volatile LONG stop;
+} logger;
+
+// Formats the fields before the message, returns the length
+static int format_prefix(char* line, size_t size, const logger_record* r) {
+    int n = sprintf_s(line, size, "[%04d-%02d-%02d %02d:%02d:%02d.%03d]", r->time.wYear, r->time.wMonth, r->time.wDay,
+        r->time.wHour, r->time.wMinute, r->time.wSecond, r->time.wMilliseconds);
+
+    if (r->job != LOGGER_NO_JOB) {
+        n += sprintf_s(&line[n], size - n, " job=%u", r->job);
+    }
+
+    if (r->stage) {
+        n += sprintf_s(&line[n], size - n, " stage=%s", r->stage);
+    }
+
+    if (r->duration_us != LOGGER_NO_DURATION) {
+        n += sprintf_s(&line[n], size - n, " duration_ms=%.3f", r->duration_us / 1000.);
+    }
+
+    if (r->exit_code != LOGGER_NO_EXIT) {
+        n += sprintf_s(&line[n], size - n, " exit=%i", r->exit_code);
+    }
+
+    return n;
+}
+
+static int format_record(char* line, size_t size, const logger_record* r) {
+    int n = format_prefix(line, size, r);
+
+    n += sprintf_s(&line[n], size - n, " %s\n", r->message);
+
+    return n;
+}
+
+// Writes a record with a long message straight to file, then frees the message
+static void write_long_record(FILE* file, logger_record* r) {
+    char prefix[LOGGER_LINE_MAX];
+
+    format_prefix(prefix, sizeof(prefix), r);
+    fprintf(file, "%s %s\n", prefix, r->long_message);
+
+    free(r->long_message);
+    r->long_message = NULL;
+}
+
+// Moves all published records to the file in one write, returns the number of records
+static uint32_t drain(void) {
+    static char buffer[LOGGER_RING_SIZE / 8 * LOGGER_LINE_MAX];
+    size_t used = 0;
+    uint32_t drained = 0;
+
+    while (true) {
+        logger_record* r = &logger.ring[logger.tail & LOGGER_RING_MASK];
+
+        if (r->sequence != logger.tail + 1) {
+            break;
+        }
+
+        if (sizeof(buffer) - used < LOGGER_LINE_MAX || r->long_message) {
+            fwrite(buffer, 1, used, logger.file);
+            used = 0;
+        }
+
+        if (r->long_message) {
+            write_long_record(logger.file, r);
+        } else {
+            used += format_record(&buffer[used], sizeof(buffer) - used, r);
+        }
+
+        // Hands the slot back to the producers one lap later
+        InterlockedExchange64(&r->sequence, logger.tail + LOGGER_RING_SIZE);
+        InterlockedIncrement64(&logger.tail);
+        drained++;
+    }
+
+    if (used != 0) {
+        fwrite(buffer, 1, used, logger.file);
+    }
+
+    if (drained != 0) {
+        fflush(logger.file);
+    }
+
+    return drained;
+}
+
+static DWORD WINAPI flusher(LPVOID param) {
+    UNUSED(param);
+
+    while (true) {
+        WaitForSingleObject(logger.wake, LOGGER_FLUSH_INTERVAL);
+
+        bool stopping = logger.stop != 0;
+
+        // Records published before stop was set are all drained here
+        if (drain() == 0 && stopping) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+errno_t logger_open(const char* path) {
+    if (logger.ring) {
+        return 0;
+    }
+
+    if (fopen_s(&logger.file, path, "a") != 0) {
+        perrf("Could not open the log '%s'\n", path);
+
+        return 1;
+    }
+
+    logger.ring = malloc(LOGGER_RING_SIZE * sizeof(logger_record));
+
+    for (LONG64 i = 0; i < LOGGER_RING_SIZE; i++) {
+        logger.ring[i].sequence = i;
+        logger.ring[i].long_message = NULL;
+    }
+
+    logger.head = 0;
+    logger.tail = 0;
+    logger.stop = 0;
+    logger.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    logger.flusher = CreateThread(NULL, 0, flusher, NULL, 0, NULL);
+
+    if (!logger.wake || !logger.flusher) {
+        perrf("Could not start the log flusher\n");
+
+        if (logger.wake) {
+            CloseHandle(logger.wake);
+        }
+
+        fclose(logger.file);
+        free(logger.ring);
+        memset(&logger, 0, sizeof(logger));
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void logger_close(void) {
+    if (!logger.ring) {
+        return;
+    }
+
+    InterlockedExchange(&logger.stop, 1);
+    SetEvent(logger.wake);
+    WaitForSingleObject(logger.flusher, INFINITE);
+
+    CloseHandle(logger.flusher);
+    CloseHandle(logger.wake);
+    fclose(logger.file);
+    free(logger.ring);
+
+    memset(&logger, 0, sizeof(logger));
+}
+
+void logger_write(uint32_t job, const char* stage, int64_t duration_us, int32_t exit_code, const char* f, ...) {
+    logger_record local;
+    logger_record* r = &local;
+    LONG64 pos = logger.head;
+
+    // Claims a slot, without the flusher running there's nothing to claim
+    while (logger.ring) {
+        r = &logger.ring[pos & LOGGER_RING_MASK];
+        LONG64 diff = r->sequence - pos;
+
+        if (diff == 0) {
+            if (InterlockedCompareExchange64(&logger.head, pos + 1, pos) == pos) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The ring is full, lines are never dropped so wait for the flusher
+            SetEvent(logger.wake);
+            Sleep(1);
+        }
+
+        pos = logger.head;
+    }
+
+    GetSystemTime(&r->time);
+    r->job = job;
+    r->stage = stage;
+    r->duration_us = duration_us;
+    r->exit_code = exit_code;
+
+    va_list args;
+    va_list measure;
+    va_start(args, f);
+    va_copy(measure, args);
+
+    int length = _vscprintf(f, measure);
+
+    va_end(measure);
+
+    r->long_message = NULL;
+
+    if (length >= LOGGER_MESSAGE_MAX) {
+        r->long_message = malloc((size_t)length + 1);
+        vsnprintf(r->long_message, (size_t)length + 1, f, args);
+    } else {
+        vsnprintf(r->message, LOGGER_MESSAGE_MAX, f, args);
+    }
+
+    va_end(args);
+
+    if (!logger.ring) {
+        char line[LOGGER_LINE_MAX];
+        FILE* file;
+
+        if (fopen_s(&file, LOGGER_PATH, "a") == 0) {
+            if (r->long_message) {
+                write_long_record(file, r);
+            } else {
+                format_record(line, sizeof(line), r);
+                fputs(line, file);
+            }
+
+            fclose(file);
+        }
+
+        free(r->long_message);
+
+        return;
+    }
+
+    // Publishes the record, the flusher only reads it once the sequence moved on
+    InterlockedExchange64(&r->sequence, pos + 1);
+
+    if (pos - logger.tail >= LOGGER_WAKE_FILL) {
+        SetEvent(logger.wake);
+    }
+}
+
+int64_t logger_clock_us(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    QueryPerformanceCounter(&now);
+
+    return (int64_t)(now.QuadPart / frequency.QuadPart * 1000000 + now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
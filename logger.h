@@ -0,0 +1,33 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+#define LOGGER_PATH "conversion.log"
+
+// Number of records the ring holds, a power of two
+#define LOGGER_RING_SIZE   4096
+
+// Messages up to this long are kept in the ring, longer ones are copied to the heap and written whole
+#define LOGGER_MESSAGE_MAX 480
+
+// How long the flusher sleeps when nobody wakes it, in milliseconds
+#define LOGGER_FLUSH_INTERVAL 100
+
+// Field values that are left out of the line
+#define LOGGER_NO_JOB      0
+#define LOGGER_NO_DURATION -1
+#define LOGGER_NO_EXIT     INT32_MIN
+
+// Starts the background flusher, which keeps the log file open until logger_close
+errno_t logger_open(const char* path);
+
+// Writes everything still in the ring and stops the flusher
+void logger_close(void);
+
+// Queues one log line without touching the file, stage has to be a string literal or NULL
+// Before logger_open, or after logger_close, the line is appended to LOGGER_PATH directly
+void logger_write(uint32_t job, const char* stage, int64_t duration_us, int32_t exit_code, const char* f, ...);
+
+// Microseconds on a monotonic clock, for measuring durations
+int64_t logger_clock_us(void);
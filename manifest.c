@@ -0,0 +1,231 @@
+#include "manifest.h"
+#include "hash.h"
+
+#define MANIFEST_INITIAL_CAPACITY 256
+#define MANIFEST_LINE_MAX         (2 * _MAX_PATH + 128)
+
+static uint32_t table_slot(const manifest* m, const char* output) {
+    uint32_t mask = m->table_size - 1;
+    uint32_t slot = (uint32_t)hash64(output, strlen(output), 0) & mask;
+
+    while (m->table[slot] != UINT32_MAX && strcmp(m->entries[m->table[slot]].output, output) != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+// Keeps the table at most half full
+static void grow_table(manifest* m) {
+    free(m->table);
+
+    m->table_size = m->table_size ? m->table_size * 2 : MANIFEST_INITIAL_CAPACITY * 2;
+    m->table = malloc(m->table_size * sizeof(uint32_t));
+    memset(m->table, 0xFF, m->table_size * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < m->count; i++) {
+        m->table[table_slot(m, m->entries[i].output)] = i;
+    }
+}
+
+// Adds or replaces an entry in memory only
+static void put_entry(manifest* m, const manifest_entry* e) {
+    if ((m->count + 1) * 2 > m->table_size) {
+        grow_table(m);
+    }
+
+    uint32_t slot = table_slot(m, e->output);
+
+    if (m->table[slot] != UINT32_MAX) {
+        manifest_entry* old = &m->entries[m->table[slot]];
+        char* output = _strdup(e->output);
+        char* input = _strdup(e->input);
+
+        free(old->output);
+        free(old->input);
+
+        *old = *e;
+        old->output = output;
+        old->input = input;
+
+        return;
+    }
+
+    if (m->count == m->capacity) {
+        m->capacity = m->capacity ? m->capacity * 2 : MANIFEST_INITIAL_CAPACITY;
+        m->entries = realloc(m->entries, m->capacity * sizeof(manifest_entry));
+    }
+
+    manifest_entry* n = &m->entries[m->count];
+
+    *n = *e;
+    n->output = _strdup(e->output);
+    n->input = _strdup(e->input);
+
+    m->table[slot] = m->count++;
+}
+
+static void write_entry(FILE* f, const manifest_entry* e) {
+    fprintf(f, "%s\t%s\t%llu\t%llu\t%016llx\t%016llx\t%u\n", e->output, e->input, e->input_size, e->input_mtime,
+        e->input_hash, e->args_hash, e->outputs);
+}
+
+// Parses one tab separated line, false if it's malformed
+static bool parse_entry(char* line, manifest_entry* e) {
+    char* fields[7];
+    char* context = NULL;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    for (int i = 0; i < 7; i++) {
+        fields[i] = strtok_s(i == 0 ? line : NULL, "\t", &context);
+
+        if (!fields[i]) {
+            return false;
+        }
+    }
+
+    e->output = fields[0];
+    e->input = fields[1];
+    e->input_size = _strtoui64(fields[2], NULL, 10);
+    e->input_mtime = _strtoui64(fields[3], NULL, 10);
+    e->input_hash = _strtoui64(fields[4], NULL, 16);
+    e->args_hash = _strtoui64(fields[5], NULL, 16);
+    e->outputs = strtoul(fields[6], NULL, 10);
+
+    return true;
+}
+
+static const manifest* sort_context;
+
+static int compare_input(const void* a, const void* b) {
+    const manifest_entry* ea = &sort_context->entries[*(const uint32_t*)a];
+    const manifest_entry* eb = &sort_context->entries[*(const uint32_t*)b];
+
+    return strcmp(ea->input, eb->input);
+}
+
+errno_t manifest_open(manifest* m, const char* path) {
+    memset(m, 0, sizeof(manifest));
+    m->path = _strdup(path);
+
+    grow_table(m);
+
+    // Later lines replace earlier ones, the file is an append-only log between compactions
+    FILE* f;
+    if (fopen_s(&f, path, "r") == 0) {
+        char* line = malloc(MANIFEST_LINE_MAX);
+
+        while (fgets(line, MANIFEST_LINE_MAX, f)) {
+            manifest_entry e;
+
+            if (parse_entry(line, &e)) {
+                put_entry(m, &e);
+            }
+        }
+
+        free(line);
+        fclose(f);
+    }
+
+    m->by_input_count = m->count;
+    m->by_input = malloc((m->count ? m->count : 1) * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < m->count; i++) {
+        m->by_input[i] = i;
+    }
+
+    sort_context = m;
+    qsort(m->by_input, m->count, sizeof(uint32_t), compare_input);
+
+    // Rewrite the manifest without replaced lines, then keep appending to it
+    char* tmp_path = malloc(_MAX_PATH);
+    sprintf_s(tmp_path, _MAX_PATH, "%s.tmp", path);
+
+    if (fopen_s(&f, tmp_path, "w") == 0) {
+        for (uint32_t i = 0; i < m->count; i++) {
+            write_entry(f, &m->entries[i]);
+        }
+
+        fclose(f);
+
+        if (!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileA(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+
+    if (fopen_s(&m->log, path, "a") != 0) {
+        perrf("Could not open the manifest '%s'\n", path);
+
+        manifest_close(m);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void manifest_close(manifest* m) {
+    if (m->log) {
+        fclose(m->log);
+    }
+
+    for (uint32_t i = 0; i < m->count; i++) {
+        free(m->entries[i].output);
+        free(m->entries[i].input);
+    }
+
+    free(m->entries);
+    free(m->table);
+    free(m->by_input);
+    free(m->path);
+
+    memset(m, 0, sizeof(manifest));
+}
+
+const manifest_entry* manifest_find(const manifest* m, const char* output) {
+    uint32_t slot = table_slot(m, output);
+
+    return m->table[slot] == UINT32_MAX ? NULL : &m->entries[m->table[slot]];
+}
+
+const uint32_t* manifest_outputs(const manifest* m, const char* input, uint32_t* count) {
+    uint32_t lo = 0;
+    uint32_t hi = m->by_input_count;
+
+    // Lower bound of the input
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(m->entries[m->by_input[mid]].input, input) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    uint32_t end = lo;
+    while (end < m->by_input_count && strcmp(m->entries[m->by_input[end]].input, input) == 0) {
+        end++;
+    }
+
+    *count = end - lo;
+
+    return &m->by_input[lo];
+}
+
+errno_t manifest_record(manifest* m, const manifest_entry* e) {
+    // Written first, e may point into the entry put_entry replaces
+    write_entry(m->log, e);
+    put_entry(m, e);
+
+    if (fflush(m->log) != 0) {
+        perrf("Could not update the manifest '%s'\n", m->path);
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+#define MANIFEST_NAME "nme.manifest"
+
+// What an output was converted from, one line per output in the manifest file
+typedef struct manifest_entry {
+    char* output;
+    char* input;
+
+    // Input size and last write time, the content hash is only checked when the time changed
+    uint64_t input_size;
+    uint64_t input_mtime;
+    uint64_t input_hash;
+
+    // Hash of the resolved encoder arguments
+    uint64_t args_hash;
+
+    // Number of outputs the whole input produces, an input is complete once it has this many entries
+    uint32_t outputs;
+} manifest_entry;
+
+typedef struct manifest {
+    char* path;
+
+    // Append handle, every recorded output is flushed right away so an interrupted batch can resume
+    FILE* log;
+
+    manifest_entry* entries;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Open addressing table of entry indices keyed by output path, UINT32_MAX marks a free slot
+    uint32_t* table;
+    uint32_t table_size;
+
+    // Entries loaded from disk sorted by input path, for finding all outputs of an input
+    uint32_t* by_input;
+    uint32_t by_input_count;
+} manifest;
+
+// Loads the manifest at path if it exists, compacts it and opens it for appending
+errno_t manifest_open(manifest* m, const char* path);
+
+// Closes the manifest and frees all entries
+void manifest_close(manifest* m);
+
+// Returns the entry for the output, NULL if it was never converted
+const manifest_entry* manifest_find(const manifest* m, const char* output);
+
+// Returns the indices of all entries of the input as loaded from disk, sets count to 0 if there are none
+const uint32_t* manifest_outputs(const manifest* m, const char* input, uint32_t* count);
+
+// Adds or replaces the entry for e->output and appends it to the manifest file
+errno_t manifest_record(manifest* m, const manifest_entry* e);
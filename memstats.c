@@ -0,0 +1,208 @@
+#include "defs.h"
+
+#ifdef NME_MEMSTATS
+#include "utils.h"
+#include "timing.h"
+#include <psapi.h>
+
+// The wrappers themselves call the real allocator
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#undef _strdup
+#undef _aligned_malloc
+#undef _aligned_free
+
+// Sits in front of every allocation and remembers whose counters it was charged to, so a free in another stage balances them
+typedef struct mem_header {
+    size_t size;
+    mem_usage* job;
+    mem_usage* stage;
+} mem_header;
+
+// Room for the header that keeps the 16 byte alignment of the allocations behind it
+#define MEM_HEADER 32
+
+static mem_usage total;
+static mem_usage stages[TIMING_COUNT];
+
+// Job object holding nme and every process it starts, NULL if it couldn't be set up
+static HANDLE processes;
+
+static void count_alloc(mem_usage* u, size_t size) {
+    InterlockedExchangeAdd64(&u->allocated, size);
+    InterlockedIncrement64(&u->allocations);
+
+    LONG64 live = InterlockedExchangeAdd64(&u->live, size) + size;
+    LONG64 peak = u->peak;
+
+    while (live > peak) {
+        LONG64 seen = InterlockedCompareExchange64(&u->peak, live, peak);
+
+        if (seen == peak) {
+            break;
+        }
+
+        peak = seen;
+    }
+}
+
+// Charges a new block to the process, the running stage and the bound job, returns the pointer handed out
+static void* track(void* block, size_t size) {
+    if (!block) {
+        return NULL;
+    }
+
+    mem_header* h = block;
+    timing* t = timing_bound();
+
+    h->size = size;
+    h->job = t ? &t->memory : NULL;
+    h->stage = &stages[timing_current()];
+
+    count_alloc(&total, size);
+    count_alloc(h->stage, size);
+
+    if (h->job) {
+        count_alloc(h->job, size);
+    }
+
+    return (uint8_t*)block + MEM_HEADER;
+}
+
+// Takes a block off the counters it was charged to, returns the block to free
+static mem_header* untrack(void* p) {
+    mem_header* h = (mem_header*)((uint8_t*)p - MEM_HEADER);
+
+    InterlockedExchangeAdd64(&total.live, -(LONG64)h->size);
+    InterlockedExchangeAdd64(&h->stage->live, -(LONG64)h->size);
+
+    if (h->job) {
+        InterlockedExchangeAdd64(&h->job->live, -(LONG64)h->size);
+    }
+
+    return h;
+}
+
+void* mem_malloc(size_t size) {
+    return track(malloc(MEM_HEADER + size), size);
+}
+
+void* mem_calloc(size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - MEM_HEADER) / size) {
+        return NULL;
+    }
+
+    return track(calloc(1, MEM_HEADER + count * size), count * size);
+}
+
+void* mem_realloc(void* p, size_t size) {
+    if (!p) {
+        return mem_malloc(size);
+    }
+
+    // Like the CRT's realloc, a size of 0 frees the block
+    if (size == 0) {
+        mem_free(p);
+
+        return NULL;
+    }
+
+    mem_header* h = (mem_header*)((uint8_t*)p - MEM_HEADER);
+    mem_header old = *h;
+    void* block = realloc(h, MEM_HEADER + size);
+
+    // The old block stays valid and counted
+    if (!block) {
+        return NULL;
+    }
+
+    // The moved block is charged to whoever grew it
+    InterlockedExchangeAdd64(&total.live, -(LONG64)old.size);
+    InterlockedExchangeAdd64(&old.stage->live, -(LONG64)old.size);
+
+    if (old.job) {
+        InterlockedExchangeAdd64(&old.job->live, -(LONG64)old.size);
+    }
+
+    return track(block, size);
+}
+
+void mem_free(void* p) {
+    if (p) {
+        free(untrack(p));
+    }
+}
+
+char* mem_strdup(const char* s) {
+    size_t size = strlen(s) + 1;
+    char* copy = mem_malloc(size);
+
+    if (copy) {
+        memcpy(copy, s, size);
+    }
+
+    return copy;
+}
+
+void* mem_aligned_malloc(size_t size, size_t alignment) {
+    // The offset variant aligns the pointer behind the header instead of the header itself
+    return track(_aligned_offset_malloc(MEM_HEADER + size, alignment, MEM_HEADER), size);
+}
+
+void mem_aligned_free(void* p) {
+    if (p) {
+        _aligned_free(untrack(p));
+    }
+}
+
+void mem_track_processes(void) {
+    processes = CreateJobObject(NULL, NULL);
+
+    // Processes started from here on land in the same job, nested jobs need Windows 8
+    if (processes && !AssignProcessToJobObject(processes, GetCurrentProcess())) {
+        pwarnf("Could not track the memory of ffmpeg, error %lu\n", GetLastError());
+
+        CloseHandle(processes);
+        processes = NULL;
+    }
+}
+
+mem_usage mem_process_usage(void) {
+    return total;
+}
+
+static double mib(LONG64 bytes) {
+    return bytes / (1024. * 1024.);
+}
+
+void mem_print(void) {
+    printf("\nAllocations per stage:\n");
+    printf("  %-8s %12s %12s %12s\n", "stage", "count", "MiB", "peak MiB");
+
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        if (stages[i].allocations == 0) {
+            continue;
+        }
+
+        printf("  %-8s %12lli %12.1f %12.1f\n", timing_stage_name(i), stages[i].allocations, mib(stages[i].allocated), mib(stages[i].peak));
+    }
+
+    printf("  %-8s %12lli %12.1f %12.1f, %.1f MiB still live\n", "total", total.allocations, mib(total.allocated), mib(total.peak), mib(total.live));
+
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        printf("Peak working set of nme: %.1f MiB, peak commit: %.1f MiB\n", mib(counters.PeakWorkingSetSize), mib(counters.PeakPagefileUsage));
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION job;
+
+    if (processes && QueryInformationJobObject(processes, JobObjectExtendedLimitInformation, &job, sizeof(job), NULL)) {
+        // Jobs only keep the peak commit of their processes, not their working sets
+        printf("Peak commit of the largest process: %.1f MiB, of nme and ffmpeg together: %.1f MiB\n",
+            mib(job.PeakProcessMemoryUsed), mib(job.PeakJobMemoryUsed));
+    }
+}
+#endif
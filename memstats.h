@@ -0,0 +1,45 @@
+#pragma once
+
+// Included by defs.h, so it can't rely on it, and has to pull in every header that declares a wrapped function first
+#include <windows.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+// Allocation counters of a job, a stage or the whole process, in bytes
+typedef struct mem_usage {
+    volatile LONG64 allocated;
+    volatile LONG64 live;
+    volatile LONG64 peak;
+    volatile LONG64 allocations;
+} mem_usage;
+
+// Builds with NME_MEMSTATS count every allocation, against the process, the running stage and the bound job
+#ifdef NME_MEMSTATS
+void* mem_malloc(size_t size);
+void* mem_calloc(size_t count, size_t size);
+void* mem_realloc(void* p, size_t size);
+void mem_free(void* p);
+char* mem_strdup(const char* s);
+void* mem_aligned_malloc(size_t size, size_t alignment);
+void mem_aligned_free(void* p);
+
+#define malloc(size)                     mem_malloc(size)
+#define calloc(count, size)              mem_calloc(count, size)
+#define realloc(p, size)                 mem_realloc(p, size)
+#define free(p)                          mem_free(p)
+#define _strdup(s)                       mem_strdup(s)
+#define _aligned_malloc(size, alignment) mem_aligned_malloc(size, alignment)
+#define _aligned_free(p)                 mem_aligned_free(p)
+
+// Puts nme in a job object, so the peak memory of the ffmpeg processes it starts can be read at the end
+void mem_track_processes(void);
+
+// Prints the counters of the whole process and of each stage, with the peak memory of nme and its children
+void mem_print(void);
+
+// Returns the counters of the whole process, its peak is the one jobs that overlap actually reached together
+mem_usage mem_process_usage(void);
+#endif
@@ -0,0 +1,326 @@
+#include "metrics.h"
+#include "logger.h"
+
+// Indexed by the FORMAT_ defines
+static const char* format_names[] = {
+    "unknown", "usm", "wsp", "wem_pcm", "wem_adpcm", "bnk", "cpk"
+};
+
+#define METRICS_FORMATS (sizeof(format_names) / sizeof(format_names[0]))
+
+typedef struct metrics_codec {
+    const char* name;
+    uint32_t count;
+    int64_t us;
+} metrics_codec;
+
+// Everything is updated under the lock, the writer copies it out before formatting
+static struct {
+    bool open;
+    bool json;
+    char* path;
+    char* temp_path;
+
+    CRITICAL_SECTION lock;
+    HANDLE writer;
+    HANDLE wake;
+    volatile LONG stop;
+
+    int64_t started;
+    metrics_tallies tallies;
+
+    uint32_t files[METRICS_FORMATS];
+    uint64_t read_bytes[METRICS_FORMATS];
+    uint64_t written_bytes;
+    int64_t wait_us;
+
+    metrics_codec codecs[METRICS_CODECS];
+    uint32_t codec_count;
+} metrics;
+
+// The parts of the state a file is written from
+typedef struct metrics_snapshot {
+    bool running;
+    double elapsed;
+    metrics_tallies tallies;
+    uint32_t files[METRICS_FORMATS];
+    uint64_t read_bytes[METRICS_FORMATS];
+    uint64_t written_bytes;
+    int64_t wait_us;
+    metrics_codec codecs[METRICS_CODECS];
+    uint32_t codec_count;
+} metrics_snapshot;
+
+static void take_snapshot(metrics_snapshot* s, bool running) {
+    EnterCriticalSection(&metrics.lock);
+
+    s->running = running;
+    s->elapsed = (logger_clock_us() - metrics.started) / 1e6;
+    s->tallies = metrics.tallies;
+    memcpy(s->files, metrics.files, sizeof(s->files));
+    memcpy(s->read_bytes, metrics.read_bytes, sizeof(s->read_bytes));
+    s->written_bytes = metrics.written_bytes;
+    s->wait_us = metrics.wait_us;
+    memcpy(s->codecs, metrics.codecs, sizeof(s->codecs));
+    s->codec_count = metrics.codec_count;
+
+    LeaveCriticalSection(&metrics.lock);
+}
+
+// Writes the HELP and TYPE lines every series needs once
+static void write_prometheus_header(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_prometheus(FILE* out, const metrics_snapshot* s) {
+    write_prometheus_header(out, "nme_running", "gauge", "1 while the batch runs, 0 once it finished");
+    fprintf(out, "nme_running %i\n", s->running ? 1 : 0);
+
+    write_prometheus_header(out, "nme_elapsed_seconds", "gauge", "Time since the batch started");
+    fprintf(out, "nme_elapsed_seconds %.3f\n", s->elapsed);
+
+    write_prometheus_header(out, "nme_files_total", "counter", "Inputs finished, by format");
+    for (uint32_t i = 0; i < METRICS_FORMATS; i++) {
+        fprintf(out, "nme_files_total{format=\"%s\"} %u\n", format_names[i], s->files[i]);
+    }
+
+    write_prometheus_header(out, "nme_read_bytes_total", "counter", "Input bytes read, by format");
+    for (uint32_t i = 0; i < METRICS_FORMATS; i++) {
+        fprintf(out, "nme_read_bytes_total{format=\"%s\"} %llu\n", format_names[i], s->read_bytes[i]);
+    }
+
+    write_prometheus_header(out, "nme_written_bytes_total", "counter", "Output bytes written");
+    fprintf(out, "nme_written_bytes_total %llu\n", s->written_bytes);
+
+    write_prometheus_header(out, "nme_outputs_total", "counter", "Outputs by result");
+    fprintf(out, "nme_outputs_total{result=\"success\"} %u\n", s->tallies.success);
+    fprintf(out, "nme_outputs_total{result=\"failure\"} %u\n", s->tallies.failure);
+    fprintf(out, "nme_outputs_total{result=\"skipped\"} %u\n", s->tallies.skipped);
+
+    write_prometheus_header(out, "nme_encodes_total", "counter", "Encodes and in-process decodes, by codec");
+    for (uint32_t i = 0; i < s->codec_count; i++) {
+        fprintf(out, "nme_encodes_total{codec=\"%s\"} %u\n", s->codecs[i].name, s->codecs[i].count);
+    }
+
+    write_prometheus_header(out, "nme_encode_seconds_total", "counter", "Time spent encoding, by codec");
+    for (uint32_t i = 0; i < s->codec_count; i++) {
+        fprintf(out, "nme_encode_seconds_total{codec=\"%s\"} %.3f\n", s->codecs[i].name, s->codecs[i].us / 1e6);
+    }
+
+    write_prometheus_header(out, "nme_child_wait_seconds_total", "counter", "Time spent waiting for ffmpeg processes to exit");
+    fprintf(out, "nme_child_wait_seconds_total %.3f\n", s->wait_us / 1e6);
+
+    write_prometheus_header(out, "nme_dedup_links_total", "counter", "Duplicate tracks linked instead of converted");
+    fprintf(out, "nme_dedup_links_total %u\n", s->tallies.duplicates);
+
+    write_prometheus_header(out, "nme_dedup_bytes_total", "counter", "Input bytes of the linked duplicates");
+    fprintf(out, "nme_dedup_bytes_total %llu\n", s->tallies.duplicate_bytes);
+
+    if (s->tallies.cache) {
+        write_prometheus_header(out, "nme_cache_lookups_total", "counter", "Cache lookups by result");
+        fprintf(out, "nme_cache_lookups_total{result=\"hit\"} %u\n", s->tallies.cache_hits);
+        fprintf(out, "nme_cache_lookups_total{result=\"miss\"} %u\n", s->tallies.cache_misses);
+    }
+}
+
+static void write_json(FILE* out, const metrics_snapshot* s) {
+    fprintf(out, "{\n  \"running\": %s,\n  \"elapsed_seconds\": %.3f,\n", s->running ? "true" : "false", s->elapsed);
+
+    fputs("  \"files\": {", out);
+    for (uint32_t i = 0; i < METRICS_FORMATS; i++) {
+        fprintf(out, "%s\"%s\": {\"count\": %u, \"read_bytes\": %llu}", i ? ", " : "", format_names[i], s->files[i], s->read_bytes[i]);
+    }
+    fputs("},\n", out);
+
+    fprintf(out, "  \"written_bytes\": %llu,\n", s->written_bytes);
+    fprintf(out, "  \"outputs\": {\"success\": %u, \"failure\": %u, \"skipped\": %u},\n",
+        s->tallies.success, s->tallies.failure, s->tallies.skipped);
+
+    fputs("  \"encode\": {", out);
+    for (uint32_t i = 0; i < s->codec_count; i++) {
+        fprintf(out, "%s\"%s\": {\"count\": %u, \"seconds\": %.3f}", i ? ", " : "", s->codecs[i].name, s->codecs[i].count, s->codecs[i].us / 1e6);
+    }
+    fputs("},\n", out);
+
+    fprintf(out, "  \"child_wait_seconds\": %.3f,\n", s->wait_us / 1e6);
+    fprintf(out, "  \"dedup\": {\"links\": %u, \"bytes\": %llu}", s->tallies.duplicates, s->tallies.duplicate_bytes);
+
+    if (s->tallies.cache) {
+        fprintf(out, ",\n  \"cache\": {\"hits\": %u, \"misses\": %u}", s->tallies.cache_hits, s->tallies.cache_misses);
+    }
+
+    fputs("\n}\n", out);
+}
+
+// Writes next to the file and renames over it, so a collector never reads half a file
+static errno_t write_file(bool running) {
+    metrics_snapshot s;
+    FILE* out;
+
+    take_snapshot(&s, running);
+
+    if (fopen_s(&out, metrics.temp_path, "w") != 0) {
+        return 1;
+    }
+
+    if (metrics.json) {
+        write_json(out, &s);
+    } else {
+        write_prometheus(out, &s);
+    }
+
+    errno_t err = ferror(out) ? 1 : 0;
+    fclose(out);
+
+    if (err != 0 || !MoveFileExA(metrics.temp_path, metrics.path, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileA(metrics.temp_path);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static DWORD WINAPI writer(LPVOID param) {
+    UNUSED(param);
+
+    while (WaitForSingleObject(metrics.wake, METRICS_INTERVAL) == WAIT_TIMEOUT && metrics.stop == 0) {
+        // A failed write is retried on the next tick, the final one reports it
+        write_file(true);
+    }
+
+    return 0;
+}
+
+errno_t metrics_open(const char* path) {
+    if (metrics.open) {
+        return 0;
+    }
+
+    const char* ext = strrchr(path, '.');
+    size_t size = strlen(path) + 5;
+
+    metrics.json = ext && _stricmp(ext, ".json") == 0;
+    metrics.path = _strdup(path);
+    metrics.temp_path = malloc(size);
+    sprintf_s(metrics.temp_path, size, "%s.tmp", path);
+
+    InitializeCriticalSection(&metrics.lock);
+    metrics.started = logger_clock_us();
+    metrics.open = true;
+
+    // Collectors see the batch as running right away
+    if (write_file(true) != 0) {
+        perrf("Could not write the metrics '%s'\n", path);
+        metrics_close();
+
+        return 1;
+    }
+
+    metrics.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    metrics.writer = metrics.wake ? CreateThread(NULL, 0, writer, NULL, 0, NULL) : NULL;
+
+    if (!metrics.writer) {
+        pwarnf("Could not start the metrics writer, '%s' is only written at the end\n", path);
+    }
+
+    return 0;
+}
+
+void metrics_close(void) {
+    if (!metrics.open) {
+        return;
+    }
+
+    if (metrics.writer) {
+        InterlockedExchange(&metrics.stop, 1);
+        SetEvent(metrics.wake);
+        WaitForSingleObject(metrics.writer, INFINITE);
+
+        CloseHandle(metrics.writer);
+    }
+
+    if (metrics.wake) {
+        CloseHandle(metrics.wake);
+    }
+
+    if (write_file(false) != 0) {
+        perrf("Could not write the metrics '%s'\n", metrics.path);
+    }
+
+    DeleteCriticalSection(&metrics.lock);
+    free(metrics.path);
+    free(metrics.temp_path);
+
+    memset(&metrics, 0, sizeof(metrics));
+}
+
+void metrics_publish(const metrics_tallies* tallies) {
+    if (!metrics.open) {
+        return;
+    }
+
+    EnterCriticalSection(&metrics.lock);
+    metrics.tallies = *tallies;
+    LeaveCriticalSection(&metrics.lock);
+}
+
+void metrics_input(int format, uint64_t bytes_read) {
+    if (!metrics.open) {
+        return;
+    }
+
+    uint32_t i = format > 0 && (uint32_t)format < METRICS_FORMATS ? format : 0;
+
+    EnterCriticalSection(&metrics.lock);
+    metrics.files[i]++;
+    metrics.read_bytes[i] += bytes_read;
+    LeaveCriticalSection(&metrics.lock);
+}
+
+void metrics_written(const char* output) {
+    uint64_t size, mtime;
+
+    if (!metrics.open || !GetFileStamp(output, &size, &mtime)) {
+        return;
+    }
+
+    EnterCriticalSection(&metrics.lock);
+    metrics.written_bytes += size;
+    LeaveCriticalSection(&metrics.lock);
+}
+
+void metrics_encode(const char* codec, int64_t duration_us) {
+    if (!metrics.open) {
+        return;
+    }
+
+    EnterCriticalSection(&metrics.lock);
+
+    uint32_t i = 0;
+    while (i < metrics.codec_count && strcmp(metrics.codecs[i].name, codec) != 0) {
+        i++;
+    }
+
+    // Codec names are the defines from defs.h, they outlive the batch
+    if (i == metrics.codec_count && i < METRICS_CODECS) {
+        metrics.codecs[metrics.codec_count++].name = codec;
+    }
+
+    if (i < metrics.codec_count) {
+        metrics.codecs[i].count++;
+        metrics.codecs[i].us += duration_us;
+    }
+
+    LeaveCriticalSection(&metrics.lock);
+}
+
+void metrics_wait(int64_t duration_us) {
+    if (!metrics.open) {
+        return;
+    }
+
+    EnterCriticalSection(&metrics.lock);
+    metrics.wait_us += duration_us;
+    LeaveCriticalSection(&metrics.lock);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// How often the file is rewritten during a batch, in milliseconds
+#define METRICS_INTERVAL 10000
+
+// Encoders that get their own series, later ones are left out
+#define METRICS_CODECS 16
+
+// Counters main keeps for its own summary, handed over whenever they change
+typedef struct metrics_tallies {
+    uint32_t success;
+    uint32_t failure;
+    uint32_t skipped;
+
+    uint32_t duplicates;
+    uint64_t duplicate_bytes;
+
+    // Only written if a cache is in use
+    bool cache;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+} metrics_tallies;
+
+// Starts rewriting the file every METRICS_INTERVAL, as JSON if the path ends in .json and as a Prometheus textfile otherwise
+errno_t metrics_open(const char* path);
+
+// Stops the writer and writes the file a last time, marked as finished
+void metrics_close(void);
+
+// Replaces the tallies with main's current ones
+void metrics_publish(const metrics_tallies* tallies);
+
+// Counts a finished input of the format, bytes_read is 0 if it was up to date and never read
+void metrics_input(int format, uint64_t bytes_read);
+
+// Adds the size of a finished output
+void metrics_written(const char* output);
+
+// Charges an encode or in-process decode to the codec
+void metrics_encode(const char* codec, int64_t duration_us);
+
+// Adds time spent waiting for a child process to exit
+void metrics_wait(int64_t duration_us);
@@ -0,0 +1,376 @@
+#include "pcm.h"
+
+#include <math.h>
+
+// Largest floats that still convert to a valid integer of the target width
+#define S16_MAX 32767.f
+#define S24_MAX 8388607.f
+#define S32_MAX 2147483520.f
+
+// Number of samples converted at a time when the result has to be repacked
+#define S24_CHUNK 256
+
+uint32_t pcm_format_bytes(pcm_format format) {
+    switch (format) {
+        case PCM_FMT_S16: return 2;
+        case PCM_FMT_S24: return 3;
+        case PCM_FMT_F32:
+        case PCM_FMT_S32: return 4;
+        case PCM_FMT_F64:
+        case PCM_FMT_S64: return 8;
+        default:          return 0;
+    }
+}
+
+void pcm_dither_init(pcm_dither* d, uint32_t seed, bool enabled) {
+    d->enabled = enabled;
+
+    // xorshift32 must never be seeded with 0
+    for (int i = 0; i < 4; i++) {
+        seed = seed * 1664525 + 1013904223;
+        d->state[i] = seed != 0 ? seed : 1;
+    }
+}
+
+static inline uint32_t xorshift(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return x;
+}
+
+// Triangular noise in (-1, 1), the difference of two uniform values in [1, 2)
+static inline float noise(uint32_t* state) {
+    uint32_t a = *state = xorshift(*state);
+    uint32_t b = *state = xorshift(*state);
+    float fa, fb;
+
+    a = (a >> 9) | 0x3F800000;
+    b = (b >> 9) | 0x3F800000;
+    memcpy(&fa, &a, 4);
+    memcpy(&fb, &b, 4);
+
+    return fa - fb;
+}
+
+static inline int32_t quantize(float x, float scale, float max, uint32_t* state, bool dither) {
+    x *= scale;
+
+    if (dither) {
+        x += noise(state);
+    }
+
+    // Also maps NaN to the minimum, like the SIMD path
+    if (!(x >= -scale)) {
+        x = -scale;
+    } else if (x > max) {
+        x = max;
+    }
+
+    return (int32_t)lrintf(x);
+}
+
+#ifdef NME_SSE2
+static inline __m128i xorshift_sse(__m128i x) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+
+    return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+static inline __m128 noise_sse(__m128i* state) {
+    const __m128i one = _mm_set1_epi32(0x3F800000);
+
+    *state = xorshift_sse(*state);
+    __m128 a = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(*state, 9), one));
+    *state = xorshift_sse(*state);
+    __m128 b = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(*state, 9), one));
+
+    return _mm_sub_ps(a, b);
+}
+
+static inline __m128i quantize_sse(__m128 x, __m128 scale, __m128 min, __m128 max, __m128i* state, bool dither) {
+    x = _mm_mul_ps(x, scale);
+
+    if (dither) {
+        x = _mm_add_ps(x, noise_sse(state));
+    }
+
+    // max_ps returns the second operand for NaN
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, min), max));
+}
+#endif
+
+// Scales, dithers, clamps and rounds count samples to 32 bit integers, dst doesn't have to be aligned
+static void quantize_block(uint8_t* dst, const float* src, size_t count, float scale, float max, pcm_dither* d, bool dither) {
+    size_t i = 0;
+
+#ifdef NME_SSE2
+    __m128i state = _mm_loadu_si128((const __m128i*)d->state);
+    __m128 vscale = _mm_set1_ps(scale);
+    __m128 vmin = _mm_set1_ps(-scale);
+    __m128 vmax = _mm_set1_ps(max);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = quantize_sse(_mm_loadu_ps(&src[i]), vscale, vmin, vmax, &state, dither);
+        __m128i b = quantize_sse(_mm_loadu_ps(&src[i + 4]), vscale, vmin, vmax, &state, dither);
+
+        _mm_storeu_si128((__m128i*)&dst[i * 4], a);
+        _mm_storeu_si128((__m128i*)&dst[i * 4 + 16], b);
+    }
+
+    _mm_storeu_si128((__m128i*)d->state, state);
+#endif
+
+    for (; i < count; i++) {
+        int32_t v = quantize(src[i], scale, max, &d->state[i & 3], dither);
+        memcpy(&dst[i * 4], &v, 4);
+    }
+}
+
+static void convert_s16(uint8_t* dst, const float* src, size_t count, pcm_dither* d) {
+    size_t i = 0;
+
+#ifdef NME_SSE2
+    __m128i state = _mm_loadu_si128((const __m128i*)d->state);
+    __m128 scale = _mm_set1_ps(32768.f);
+    __m128 min = _mm_set1_ps(-32768.f);
+    __m128 max = _mm_set1_ps(S16_MAX);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = quantize_sse(_mm_loadu_ps(&src[i]), scale, min, max, &state, d->enabled);
+        __m128i b = quantize_sse(_mm_loadu_ps(&src[i + 4]), scale, min, max, &state, d->enabled);
+
+        _mm_storeu_si128((__m128i*)&dst[i * 2], _mm_packs_epi32(a, b));
+    }
+
+    _mm_storeu_si128((__m128i*)d->state, state);
+#endif
+
+    for (; i < count; i++) {
+        int16_t v = (int16_t)quantize(src[i], 32768.f, S16_MAX, &d->state[i & 3], d->enabled);
+        memcpy(&dst[i * 2], &v, 2);
+    }
+}
+
+static void convert_s24(uint8_t* dst, const float* src, size_t count, pcm_dither* d) {
+    int32_t chunk[S24_CHUNK];
+
+    for (size_t i = 0; i < count; i += S24_CHUNK) {
+        size_t n = count - i < S24_CHUNK ? count - i : S24_CHUNK;
+
+        quantize_block((uint8_t*)chunk, &src[i], n, 8388608.f, S24_MAX, d, d->enabled);
+
+        // SSE2 has no byte shuffle, dropping the high byte is done on the scalar side
+        for (size_t j = 0; j < n; j++) {
+            uint32_t v = (uint32_t)chunk[j];
+
+            dst[0] = v & 0xFF;
+            dst[1] = (v >> 8) & 0xFF;
+            dst[2] = (v >> 16) & 0xFF;
+            dst += 3;
+        }
+    }
+}
+
+static void convert_f64(uint8_t* dst, const float* src, size_t count) {
+    size_t i = 0;
+
+#ifdef NME_SSE2
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(&src[i]);
+
+        _mm_storeu_pd((double*)&dst[i * 8], _mm_cvtps_pd(x));
+        _mm_storeu_pd((double*)&dst[i * 8 + 16], _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        double v = src[i];
+        memcpy(&dst[i * 8], &v, 8);
+    }
+}
+
+// There's no packed 64 bit conversion before AVX-512, the float's 24 bit mantissa never needs dithering here
+static void convert_s64(uint8_t* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        double x = src[i] * 9223372036854775808.;
+        int64_t v;
+
+        if (!(x >= -9223372036854775808.)) {
+            v = INT64_MIN;
+        } else if (x >= 9223372036854775807.) {
+            v = INT64_MAX;
+        } else {
+            v = llrint(x);
+        }
+
+        memcpy(&dst[i * 8], &v, 8);
+    }
+}
+
+void pcm_convert(uint8_t* dst, const float* src, size_t count, pcm_format format, pcm_dither* d) {
+    switch (format) {
+        case PCM_FMT_F32:
+            memcpy(dst, src, count * sizeof(float));
+            break;
+        case PCM_FMT_F64:
+            convert_f64(dst, src, count);
+            break;
+        case PCM_FMT_S16:
+            convert_s16(dst, src, count, d);
+            break;
+        case PCM_FMT_S24:
+            convert_s24(dst, src, count, d);
+            break;
+        case PCM_FMT_S32:
+            // Below the float's precision, dithering would only add noise
+            quantize_block(dst, src, count, 2147483648.f, S32_MAX, d, false);
+            break;
+        case PCM_FMT_S64:
+            convert_s64(dst, src, count);
+            break;
+    }
+}
+
+void pcm_to_float(float* dst, const uint8_t* src, size_t count, uint32_t bits) {
+    size_t i = 0;
+
+    switch (bits) {
+        case 16: {
+#ifdef NME_SSE2
+                __m128 scale = _mm_set1_ps(1.f / 32768.f);
+
+                for (; i + 8 <= count; i += 8) {
+                    __m128i x = _mm_loadu_si128((const __m128i*)&src[i * 2]);
+                    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+                    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+
+                    _mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                    _mm_storeu_ps(&dst[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+                }
+#endif
+                for (; i < count; i++) {
+                    int16_t v;
+                    memcpy(&v, &src[i * 2], 2);
+                    dst[i] = v / 32768.f;
+                }
+                break;
+            }
+        case 24:
+            for (; i < count; i++) {
+                const uint8_t* p = &src[i * 3];
+                int32_t v = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+                dst[i] = v / 8388608.f;
+            }
+            break;
+        case 32: {
+#ifdef NME_SSE2
+                __m128 scale = _mm_set1_ps(1.f / 2147483648.f);
+
+                for (; i + 4 <= count; i += 4) {
+                    __m128i x = _mm_loadu_si128((const __m128i*)&src[i * 4]);
+
+                    _mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+                }
+#endif
+                for (; i < count; i++) {
+                    int32_t v;
+                    memcpy(&v, &src[i * 4], 4);
+                    dst[i] = v / 2147483648.f;
+                }
+                break;
+            }
+    }
+}
+
+void pcm_interleave(float* dst, float** src, uint16_t channels, uint32_t samples) {
+    uint32_t i = 0;
+
+    if (channels == 1) {
+        memcpy(dst, src[0], samples * sizeof(float));
+
+        return;
+    }
+
+#ifdef NME_SSE2
+    if (channels == 2) {
+        for (; i + 4 <= samples; i += 4) {
+            __m128 l = _mm_loadu_ps(&src[0][i]);
+            __m128 r = _mm_loadu_ps(&src[1][i]);
+
+            _mm_storeu_ps(&dst[i * 2], _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(&dst[i * 2 + 4], _mm_unpackhi_ps(l, r));
+        }
+    } else if (channels == 4) {
+        for (; i + 4 <= samples; i += 4) {
+            __m128 a = _mm_loadu_ps(&src[0][i]);
+            __m128 b = _mm_loadu_ps(&src[1][i]);
+            __m128 c = _mm_loadu_ps(&src[2][i]);
+            __m128 e = _mm_loadu_ps(&src[3][i]);
+
+            _MM_TRANSPOSE4_PS(a, b, c, e);
+
+            _mm_storeu_ps(&dst[i * 4], a);
+            _mm_storeu_ps(&dst[i * 4 + 4], b);
+            _mm_storeu_ps(&dst[i * 4 + 8], c);
+            _mm_storeu_ps(&dst[i * 4 + 12], e);
+        }
+    }
+#endif
+
+    for (uint16_t c = 0; c < channels; c++) {
+        const float* s = src[c];
+        float* o = &dst[c];
+
+        for (uint32_t j = i; j < samples; j++) {
+            o[(size_t)j * channels] = s[j];
+        }
+    }
+}
+
+void pcm_deinterleave(float** dst, const float* src, uint16_t channels, uint32_t samples) {
+    uint32_t i = 0;
+
+    if (channels == 1) {
+        memcpy(dst[0], src, samples * sizeof(float));
+
+        return;
+    }
+
+#ifdef NME_SSE2
+    if (channels == 2) {
+        for (; i + 4 <= samples; i += 4) {
+            __m128 a = _mm_loadu_ps(&src[i * 2]);
+            __m128 b = _mm_loadu_ps(&src[i * 2 + 4]);
+
+            _mm_storeu_ps(&dst[0][i], _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(&dst[1][i], _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+    } else if (channels == 4) {
+        for (; i + 4 <= samples; i += 4) {
+            __m128 a = _mm_loadu_ps(&src[i * 4]);
+            __m128 b = _mm_loadu_ps(&src[i * 4 + 4]);
+            __m128 c = _mm_loadu_ps(&src[i * 4 + 8]);
+            __m128 e = _mm_loadu_ps(&src[i * 4 + 12]);
+
+            _MM_TRANSPOSE4_PS(a, b, c, e);
+
+            _mm_storeu_ps(&dst[0][i], a);
+            _mm_storeu_ps(&dst[1][i], b);
+            _mm_storeu_ps(&dst[2][i], c);
+            _mm_storeu_ps(&dst[3][i], e);
+        }
+    }
+#endif
+
+    for (uint16_t c = 0; c < channels; c++) {
+        const float* s = &src[c];
+        float* o = dst[c];
+
+        for (uint32_t j = i; j < samples; j++) {
+            o[j] = s[(size_t)j * channels];
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "defs.h"
+
+// State of the TPDF dither noise, one xorshift32 generator per SIMD lane
+typedef struct pcm_dither {
+    uint32_t state[4];
+    bool enabled;
+} pcm_dither;
+
+// Returns the number of bytes per sample for the given format
+uint32_t pcm_format_bytes(pcm_format format);
+
+// Seeds the dither generator, a fixed seed makes the output reproducible
+void pcm_dither_init(pcm_dither* d, uint32_t seed, bool enabled);
+
+// Interleaves one float buffer per channel into dst
+void pcm_interleave(float* dst, float** src, uint16_t channels, uint32_t samples);
+
+// Splits interleaved floats into one buffer per channel
+void pcm_deinterleave(float** dst, const float* src, uint16_t channels, uint32_t samples);
+
+// Converts count interleaved float samples to the given little endian format, s16 and s24 are dithered if d is enabled
+void pcm_convert(uint8_t* dst, const float* src, size_t count, pcm_format format, pcm_dither* d);
+
+// Converts count little endian integer samples of the given width to floats in [-1, 1)
+void pcm_to_float(float* dst, const uint8_t* src, size_t count, uint32_t bits);
@@ -0,0 +1,601 @@
+#include "process.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timing.h"
+
+// Longest pipeline, nme runs three stages at most
+#define PROCESS_STAGES_MAX 8
+
+// Tells pipe operations from exits on the port
+#define PROCESS_KEY_INPUT 1
+#define PROCESS_KEY_EXIT  2
+
+typedef struct process_chunk {
+    const uint8_t* data;
+    size_t size;
+    void* owned;
+    struct process_chunk* next;
+} process_chunk;
+
+typedef struct process_input {
+    // Has to come first, the port hands it back for connects and writes
+    OVERLAPPED overlapped;
+
+    process* owner;
+
+    // Our end of the pipe, NULL once it's closed
+    HANDLE handle;
+
+    // Named inputs are opened by the child, writes wait until it connected
+    char path[64];
+    bool connected;
+
+    // Queued writes, the first one is in flight while pending is set
+    process_chunk* head;
+    process_chunk* tail;
+    size_t head_written;
+    bool pending;
+    bool ended;
+} process_input;
+
+struct process {
+    // Has to come first, the port hands it back for the exit
+    OVERLAPPED overlapped;
+
+    process_pool* pool;
+    process_done done;
+    void* ctx;
+
+    process_input* inputs;
+    uint32_t input_count;
+    errno_t write_err;
+
+    // The last stage, its exit code stands for the whole pipeline
+    HANDLE last;
+    HANDLE wait;
+    bool exited;
+};
+
+static void free_chunks(process_input* in) {
+    while (in->head) {
+        process_chunk* next = in->head->next;
+
+        free(in->head->owned);
+        free(in->head);
+
+        in->head = next;
+    }
+
+    in->tail = NULL;
+    in->head_written = 0;
+}
+
+static void close_input(process_input* in) {
+    if (in->handle) {
+        CloseHandle(in->handle);
+        in->handle = NULL;
+    }
+}
+
+// Gives up on the input, whatever is still queued has nowhere to go
+static void fail_input(process_input* in) {
+    in->owner->write_err = 1;
+
+    free_chunks(in);
+    close_input(in);
+}
+
+// Waits for the child to open a named input, then starts the next write, or closes the input once nothing is left and no more is coming
+static void issue(process_input* in) {
+    if (in->pending || !in->handle) {
+        return;
+    }
+
+    memset(&in->overlapped, 0, sizeof(in->overlapped));
+
+    if (!in->connected) {
+        // Even a connect that finishes right away is reported on the port, unless the child was first
+        if (ConnectNamedPipe(in->handle, &in->overlapped) || GetLastError() == ERROR_IO_PENDING) {
+            in->pending = true;
+
+            return;
+        }
+
+        if (GetLastError() != ERROR_PIPE_CONNECTED) {
+            fail_input(in);
+
+            return;
+        }
+
+        in->connected = true;
+    }
+
+    if (!in->head) {
+        if (in->ended) {
+            close_input(in);
+        }
+
+        return;
+    }
+
+    size_t left = in->head->size - in->head_written;
+    DWORD size = (DWORD)(left < PROCESS_WRITE_MAX ? left : PROCESS_WRITE_MAX);
+
+    if (WriteFile(in->handle, &in->head->data[in->head_written], size, NULL, &in->overlapped) || GetLastError() == ERROR_IO_PENDING) {
+        in->pending = true;
+
+        return;
+    }
+
+    // The child is gone, the rest of its input has nowhere to go
+    fail_input(in);
+}
+
+// Hands the process to its owner once it exited and all its inputs are closed
+static void try_finish(process* p) {
+    if (!p->exited) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < p->input_count; i++) {
+        if (p->inputs[i].pending || p->inputs[i].handle) {
+            return;
+        }
+    }
+
+    DWORD exit_code;
+    if (!GetExitCodeProcess(p->last, &exit_code)) {
+        exit_code = 1;
+    }
+
+    // Waits for the exit callback to return, it still holds the process
+    UnregisterWaitEx(p->wait, INVALID_HANDLE_VALUE);
+    CloseHandle(p->last);
+
+    p->pool->running--;
+    p->done(p->ctx, (int)exit_code, p->write_err);
+
+    free(p->inputs);
+    free(p);
+}
+
+static void completed(process_input* in, DWORD bytes, bool ok) {
+    in->pending = false;
+
+    if (!ok) {
+        fail_input(in);
+    } else if (!in->connected) {
+        in->connected = true;
+    } else {
+        in->head_written += bytes;
+
+        if (in->head_written == in->head->size) {
+            process_chunk* next = in->head->next;
+
+            free(in->head->owned);
+            free(in->head);
+
+            in->head = next;
+            in->head_written = 0;
+
+            if (!in->head) {
+                in->tail = NULL;
+            }
+        }
+    }
+
+    issue(in);
+    try_finish(in->owner);
+}
+
+// Inputs the child never opened or stopped reading are given up on once it exited
+static void process_exited(process* p) {
+    p->exited = true;
+
+    for (uint32_t i = 0; i < p->input_count; i++) {
+        process_input* in = &p->inputs[i];
+
+        if (in->pending) {
+            CancelIoEx(in->handle, &in->overlapped);
+        } else if (in->handle) {
+            fail_input(in);
+        }
+    }
+
+    try_finish(p);
+}
+
+// Runs on a thread pool thread, so the exit is only passed on to the port
+static VOID CALLBACK exited(PVOID ctx, BOOLEAN timed_out) {
+    process* p = ctx;
+    UNUSED(timed_out);
+
+    PostQueuedCompletionStatus(p->pool->port, 0, PROCESS_KEY_EXIT, (LPOVERLAPPED)p);
+}
+
+// Blocks for the next connect, write or exit and handles it, the wait is charged as time spent on ffmpeg
+static void pump(process_pool* pool) {
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    LPOVERLAPPED overlapped = NULL;
+
+    int64_t started = logger_clock_us();
+    timing_stage previous = timing_enter(TIMING_FFMPEG);
+    BOOL ok = GetQueuedCompletionStatus(pool->port, &bytes, &key, &overlapped, INFINITE);
+    timing_leave(previous);
+
+    metrics_wait(logger_clock_us() - started);
+
+    if (!overlapped) {
+        perrf("Could not wait for the encoders, error %lu\n", GetLastError());
+
+        exit(1);
+    }
+
+    if (key == PROCESS_KEY_EXIT) {
+        process_exited((process*)overlapped);
+    } else {
+        completed((process_input*)overlapped, bytes, ok != 0);
+    }
+}
+
+errno_t process_pool_open(process_pool* pool, uint32_t max_running) {
+    pool->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    pool->max_running = max_running ? max_running : 1;
+    pool->running = 0;
+    pool->started = 0;
+
+    if (!pool->port) {
+        perrf("Could not create a completion port, error %lu\n", GetLastError());
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void process_pool_close(process_pool* pool) {
+    process_drain(pool);
+
+    CloseHandle(pool->port);
+    pool->port = NULL;
+}
+
+// Creates a pipe only we write to, its overlapped end goes on the port, the child opens the other one by its path
+static errno_t create_input(process_pool* pool, process_input* in) {
+    sprintf_s(in->path, sizeof(in->path), "\\\\.\\pipe\\nme-%lu-%u", GetCurrentProcessId(), pool->started++);
+
+    in->handle = CreateNamedPipeA(in->path, PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, PROCESS_PIPE_SIZE, PROCESS_PIPE_SIZE, 0, NULL);
+
+    if (in->handle == INVALID_HANDLE_VALUE) {
+        in->handle = NULL;
+
+        return 1;
+    }
+
+    if (!CreateIoCompletionPort(in->handle, pool->port, PROCESS_KEY_INPUT, 0)) {
+        close_input(in);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Splits cmd in place at every '|' outside double quotes, like cmd.exe would
+static uint32_t split_stages(char* cmd, char** stages) {
+    uint32_t count = 0;
+    bool quoted = false;
+    char* stage = cmd;
+
+    for (char* c = cmd; count < PROCESS_STAGES_MAX; c++) {
+        if (*c == '"') {
+            quoted = !quoted;
+        } else if ((*c == '|' && !quoted) || *c == '\0') {
+            bool last = *c == '\0';
+            *c = '\0';
+
+            while (*stage == ' ') {
+                stage++;
+            }
+
+            if (*stage != '\0') {
+                stages[count++] = stage;
+            }
+
+            if (last) {
+                break;
+            }
+
+            stage = c + 1;
+        }
+    }
+
+    return count;
+}
+
+// Starts one stage with the given stdin and stdout, pipes are only inheritable for the duration of the call
+// Children are only started from the pumping thread, so no other child can inherit them meanwhile
+static HANDLE start_stage(char* stage, HANDLE in, HANDLE out, bool out_is_pipe) {
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    HANDLE err = GetStdHandle(STD_ERROR_HANDLE);
+
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = in;
+    si.hStdOutput = out;
+    si.hStdError = err;
+
+    // Our stdout and stderr are left as they are, they're inheritable unless nme's parent decided otherwise
+    SetHandleInformation(in, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+
+    if (out_is_pipe) {
+        SetHandleInformation(out, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    }
+
+    BOOL ok = CreateProcessA(NULL, stage, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+
+    SetHandleInformation(in, HANDLE_FLAG_INHERIT, 0);
+
+    if (out_is_pipe) {
+        SetHandleInformation(out, HANDLE_FLAG_INHERIT, 0);
+    }
+
+    if (!ok) {
+        perrf("Could not start '%s', error %lu\n", stage, GetLastError());
+
+        return NULL;
+    }
+
+    CloseHandle(pi.hThread);
+
+    return pi.hProcess;
+}
+
+// Starts the stages of cmd with in as the first one's stdin, in is closed either way
+// Returns the last stage, NULL if any of them couldn't be started
+static HANDLE start_stages(const char* cmd, HANDLE in) {
+    char* line = _strdup(cmd);
+    char* stages[PROCESS_STAGES_MAX];
+    uint32_t count = split_stages(line, stages);
+
+    // Each stage reads what the one before it writes, the last one inherits our stdout
+    HANDLE last = NULL;
+
+    if (count == 0) {
+        CloseHandle(in);
+    }
+
+    for (uint32_t i = 0; i < count && in; i++) {
+        HANDLE next = NULL, out = GetStdHandle(STD_OUTPUT_HANDLE);
+
+        if (i + 1 < count && !CreatePipe(&next, &out, NULL, PROCESS_PIPE_SIZE)) {
+            perrf("Could not create a pipe for '%s'\n", stages[i]);
+
+            next = NULL;
+            out = NULL;
+        }
+
+        HANDLE stage = out ? start_stage(stages[i], in, out, i + 1 < count) : NULL;
+
+        // Earlier stages see the pipe break and exit if a later one couldn't start
+        CloseHandle(in);
+
+        if (i + 1 < count && out) {
+            CloseHandle(out);
+        }
+
+        if (i + 1 < count && stage) {
+            CloseHandle(stage);
+        } else if (stage) {
+            last = stage;
+        }
+
+        in = stage ? next : NULL;
+
+        if (!stage && next) {
+            CloseHandle(next);
+        }
+    }
+
+    free(line);
+
+    return last;
+}
+
+// Frees a process that never started, nothing of it is on the port yet
+static void free_process(process* p) {
+    for (uint32_t i = 0; i < p->input_count; i++) {
+        close_input(&p->inputs[i]);
+    }
+
+    free(p->inputs);
+    free(p);
+}
+
+errno_t process_prepare(process_pool* pool, uint32_t inputs, process** p) {
+    while (pool->running >= pool->max_running) {
+        pump(pool);
+    }
+
+    process* proc = calloc(1, sizeof(process));
+    proc->pool = pool;
+    proc->inputs = calloc(inputs ? inputs : 1, sizeof(process_input));
+    proc->input_count = inputs;
+
+    for (uint32_t i = 0; i < inputs; i++) {
+        proc->inputs[i].owner = proc;
+
+        if (create_input(pool, &proc->inputs[i]) != 0) {
+            perrf("Could not create an input pipe, error %lu\n", GetLastError());
+            free_process(proc);
+
+            return 1;
+        }
+    }
+
+    *p = proc;
+
+    return 0;
+}
+
+const char* process_input_path(const process* p, uint32_t input) {
+    return p->inputs[input].path;
+}
+
+// Watches the last stage and starts the writes, or frees the process if the stages didn't start
+static errno_t watch(process* p, HANDLE last, const char* cmd, process_done done, void* ctx) {
+    if (!last) {
+        free_process(p);
+
+        return 1;
+    }
+
+    p->done = done;
+    p->ctx = ctx;
+    p->last = last;
+
+    if (!RegisterWaitForSingleObject(&p->wait, last, exited, p, INFINITE, WT_EXECUTEONLYONCE)) {
+        perrf("Could not watch '%s', error %lu\n", cmd, GetLastError());
+
+        // Without input the pipeline ends on its own
+        CloseHandle(last);
+        free_process(p);
+
+        return 1;
+    }
+
+    p->pool->running++;
+
+    for (uint32_t i = 0; i < p->input_count; i++) {
+        issue(&p->inputs[i]);
+    }
+
+    return 0;
+}
+
+errno_t process_launch(process* p, const char* cmd, process_done done, void* ctx) {
+    // The child only reads its named inputs, its stdin is empty
+    HANDLE in = CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+
+    if (in == INVALID_HANDLE_VALUE) {
+        perrf("Could not open NUL for '%s'\n", cmd);
+        free_process(p);
+
+        return 1;
+    }
+
+    return watch(p, start_stages(cmd, in), cmd, done, ctx);
+}
+
+errno_t process_start(process_pool* pool, const char* cmd, process_done done, void* ctx, process** p) {
+    process* proc;
+
+    if (process_prepare(pool, 1, &proc) != 0) {
+        return 1;
+    }
+
+    // The only input is the first stage's stdin, so it's opened here instead of by the child
+    process_input* input = &proc->inputs[0];
+    HANDLE in = CreateFileA(input->path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+    if (in == INVALID_HANDLE_VALUE) {
+        perrf("Could not open the input pipe for '%s'\n", cmd);
+        free_process(proc);
+
+        return 1;
+    }
+
+    input->connected = true;
+
+    if (watch(proc, start_stages(cmd, in), cmd, done, ctx) != 0) {
+        return 1;
+    }
+
+    *p = proc;
+
+    return 0;
+}
+
+void process_write_input(process* p, uint32_t input, const void* data, size_t size, void* owned) {
+    process_input* in = &p->inputs[input];
+
+    // The pipe broke earlier, the data has nowhere to go
+    if (!in->handle || size == 0) {
+        free(owned);
+
+        return;
+    }
+
+    process_chunk* chunk = malloc(sizeof(process_chunk));
+    chunk->data = data;
+    chunk->size = size;
+    chunk->owned = owned;
+    chunk->next = NULL;
+
+    if (in->tail) {
+        in->tail->next = chunk;
+    } else {
+        in->head = chunk;
+    }
+
+    in->tail = chunk;
+
+    issue(in);
+}
+
+void process_write(process* p, const void* data, size_t size, void* owned) {
+    process_write_input(p, 0, data, size, owned);
+}
+
+void process_end_input(process* p) {
+    for (uint32_t i = 0; i < p->input_count; i++) {
+        p->inputs[i].ended = true;
+
+        issue(&p->inputs[i]);
+    }
+
+    try_finish(p);
+}
+
+void process_drain(process_pool* pool) {
+    while (pool->running != 0) {
+        pump(pool);
+    }
+}
+
+// Result of a process_run
+typedef struct process_result {
+    bool done;
+    int exit_code;
+    errno_t write_err;
+} process_result;
+
+static void run_done(void* ctx, int exit_code, errno_t write_err) {
+    process_result* r = ctx;
+
+    r->done = true;
+    r->exit_code = exit_code;
+    r->write_err = write_err;
+}
+
+int process_run(process_pool* pool, const char* cmd, const void* data, size_t size) {
+    process_result r = { false, 0, 0 };
+    process* p;
+
+    if (process_start(pool, cmd, run_done, &r, &p) != 0) {
+        return -1;
+    }
+
+    process_write(p, data, size, NULL);
+    process_end_input(p);
+
+    while (!r.done) {
+        pump(pool);
+    }
+
+    return r.write_err != 0 ? -1 : r.exit_code;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// Size the pipes into and between the stages are created with
+// Large enough that the stages rarely stall on each other, a whole second of PCM fits in it
+#define PROCESS_PIPE_SIZE (1 << 20)
+
+// Largest single write, longer buffers are fed to the pipe in pieces
+#define PROCESS_WRITE_MAX (1 << 20)
+
+// Called on the thread that pumps the pool, once the last stage exited and all input was written
+// write_err is set if the input couldn't be written, done must not start processes itself
+typedef void (*process_done)(void* ctx, int exit_code, errno_t write_err);
+
+typedef struct process process;
+
+// Processes started by one producer thread, their pipe writes and exits all arrive on one completion port
+typedef struct process_pool {
+    HANDLE port;
+
+    // process_start waits for a slot past this many
+    uint32_t max_running;
+    uint32_t running;
+
+    // Numbers the input pipes
+    uint32_t started;
+} process_pool;
+
+// Opens the completion port, max_running is the number of processes alive at once
+errno_t process_pool_open(process_pool* pool, uint32_t max_running);
+
+// Waits for every process and closes the port
+void process_pool_close(process_pool* pool);
+
+// Starts cmd without a shell, a '|' between stages starts each of them with the pipes between them connected
+// Waits for a free slot first, which finishes earlier processes
+// Its input has to be ended before the pool is pumped again, by starting, draining or running another process
+errno_t process_start(process_pool* pool, const char* cmd, process_done done, void* ctx, process** p);
+
+// Waits for a free slot and creates a process with inputs named pipes, for a command that opens them by their paths
+errno_t process_prepare(process_pool* pool, uint32_t inputs, process** p);
+
+// Path of one of a prepared process's inputs, for its command line
+const char* process_input_path(const process* p, uint32_t input);
+
+// Starts a prepared process like process_start, with an empty stdin, p is freed if it couldn't be started
+errno_t process_launch(process* p, const char* cmd, process_done done, void* ctx);
+
+// Queues data for one of the process's inputs, it has to stay valid until it's written
+// owned is freed once it is, NULL if the caller keeps data alive until done runs
+void process_write_input(process* p, uint32_t input, const void* data, size_t size, void* owned);
+
+// Queues data for the first stage's stdin, or the first input of a prepared process
+void process_write(process* p, const void* data, size_t size, void* owned);
+
+// Closes every input once everything queued for it is written, p may be finished and freed right away
+// Inputs the child never opened or stopped reading count as write errors
+void process_end_input(process* p);
+
+// Finishes every running process
+void process_drain(process_pool* pool);
+
+// Starts cmd, writes data to it and waits for it to exit, other processes keep being finished meanwhile
+// Returns the exit code, or -1 if it couldn't be started or didn't take all of data
+int process_run(process_pool* pool, const char* cmd, const void* data, size_t size);
@@ -0,0 +1,241 @@
+#include "progress.h"
+#include "logger.h"
+
+#define PROGRESS_LINE_MAX 256
+
+static struct {
+    bool open;
+
+    // The line is only drawn when stdout is a console, redirected output gets no carriage returns
+    bool console;
+
+    CRITICAL_SECTION lock;
+    HANDLE drawer;
+    HANDLE wake;
+    volatile LONG stop;
+
+    int64_t started;
+    uint32_t total_inputs;
+    uint64_t total_bytes;
+
+    volatile LONG inputs;
+    volatile LONG queued;
+    volatile LONG running;
+    volatile LONG done;
+    volatile LONG failed;
+
+    // Bytes read by all inputs and by the current one, which are topped up to its size once it's done
+    volatile LONG64 bytes;
+    volatile LONG64 input_bytes;
+
+    // Microseconds, so they can be added atomically
+    volatile LONG64 audio_us;
+
+    // Length of the line on screen, the next one is padded to cover it
+    int drawn;
+} progress;
+
+static int console_width(void) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+
+    if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        return 80;
+    }
+
+    return info.srWindow.Right - info.srWindow.Left + 1;
+}
+
+static int format_line(char* line, size_t size) {
+    double elapsed = (logger_clock_us() - progress.started) / 1e6;
+    double mb = progress.bytes / 1e6;
+    double audio = progress.audio_us / 1e6;
+
+    int n = sprintf_s(line, size, "Inputs %li/%u | jobs %li done", progress.inputs, progress.total_inputs, progress.done);
+
+    if (progress.failed != 0) {
+        n += sprintf_s(&line[n], size - n, " (%li failed)", progress.failed);
+    }
+
+    n += sprintf_s(&line[n], size - n, ", %li running, %li queued", progress.running, progress.queued);
+
+    if (elapsed <= 0) {
+        return n;
+    }
+
+    n += sprintf_s(&line[n], size - n, " | %.1f MB/s | %.1fx realtime", mb / elapsed, audio / elapsed);
+
+    // The rate so far stands for the rest of the batch
+    if (progress.bytes > 0 && (uint64_t)progress.bytes < progress.total_bytes) {
+        uint64_t eta = (uint64_t)((progress.total_bytes - progress.bytes) * elapsed / progress.bytes);
+
+        n += sprintf_s(&line[n], size - n, " | ETA %llu:%02llu:%02llu", eta / 3600, eta / 60 % 60, eta % 60);
+    } else {
+        n += sprintf_s(&line[n], size - n, " | ETA --");
+    }
+
+    return n;
+}
+
+// Draws the line over the last one, the caller holds the lock
+static void draw(void) {
+    char line[PROGRESS_LINE_MAX];
+    int n = format_line(line, sizeof(line));
+
+    // A line that wraps can't be taken back with a carriage return
+    int width = console_width() - 1;
+    if (n > width) {
+        n = width > 0 ? width : 0;
+    }
+
+    printf("\r%.*s%*s", n, line, progress.drawn > n ? progress.drawn - n : 0, "");
+    fflush(stdout);
+
+    progress.drawn = n;
+}
+
+static void erase(void) {
+    if (progress.drawn != 0) {
+        printf("\r%*s\r", progress.drawn, "");
+        fflush(stdout);
+
+        progress.drawn = 0;
+    }
+}
+
+static DWORD WINAPI drawer(LPVOID param) {
+    UNUSED(param);
+
+    while (progress.stop == 0) {
+        WaitForSingleObject(progress.wake, PROGRESS_INTERVAL);
+
+        EnterCriticalSection(&progress.lock);
+
+        if (progress.stop == 0) {
+            draw();
+        }
+
+        LeaveCriticalSection(&progress.lock);
+    }
+
+    return 0;
+}
+
+errno_t progress_open(uint32_t total_inputs, uint64_t total_bytes) {
+    DWORD mode;
+
+    memset(&progress, 0, sizeof(progress));
+
+    progress.console = GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode) != 0;
+    progress.started = logger_clock_us();
+    progress.total_inputs = total_inputs;
+    progress.total_bytes = total_bytes;
+
+    InitializeCriticalSection(&progress.lock);
+    progress.open = true;
+
+    if (!progress.console) {
+        return 0;
+    }
+
+    progress.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    progress.drawer = progress.wake ? CreateThread(NULL, 0, drawer, NULL, 0, NULL) : NULL;
+
+    if (!progress.drawer) {
+        if (progress.wake) {
+            CloseHandle(progress.wake);
+        }
+
+        progress.console = false;
+        pwarnf("Could not start the status line\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void progress_close(void) {
+    if (!progress.open) {
+        return;
+    }
+
+    if (progress.console) {
+        InterlockedExchange(&progress.stop, 1);
+        SetEvent(progress.wake);
+        WaitForSingleObject(progress.drawer, INFINITE);
+
+        CloseHandle(progress.drawer);
+        CloseHandle(progress.wake);
+
+        // The final numbers stay on screen
+        draw();
+        printf("\n");
+    }
+
+    DeleteCriticalSection(&progress.lock);
+    progress.open = false;
+}
+
+void progress_queue(uint32_t jobs) {
+    InterlockedExchangeAdd(&progress.queued, jobs);
+}
+
+void progress_skip(void) {
+    InterlockedDecrement(&progress.queued);
+}
+
+void progress_begin(void) {
+    InterlockedDecrement(&progress.queued);
+    InterlockedIncrement(&progress.running);
+}
+
+void progress_end(bool ok, uint64_t bytes, double audio_seconds) {
+    InterlockedExchangeAdd64(&progress.bytes, bytes);
+    InterlockedExchangeAdd64(&progress.input_bytes, bytes);
+    InterlockedExchangeAdd64(&progress.audio_us, (LONG64)(audio_seconds * 1e6));
+
+    InterlockedIncrement(&progress.done);
+
+    if (!ok) {
+        InterlockedIncrement(&progress.failed);
+    }
+
+    InterlockedDecrement(&progress.running);
+}
+
+void progress_input_done(uint64_t size) {
+    LONG64 read = InterlockedExchange64(&progress.input_bytes, 0);
+
+    // Containers have headers and skipped entries that no job reads
+    if ((uint64_t)read < size) {
+        InterlockedExchangeAdd64(&progress.bytes, size - read);
+    }
+
+    InterlockedExchange(&progress.queued, 0);
+    InterlockedIncrement(&progress.inputs);
+}
+
+void progress_hide(void) {
+    if (!progress.open) {
+        return;
+    }
+
+    // Held until progress_show, so the drawer can't draw over the message
+    EnterCriticalSection(&progress.lock);
+
+    if (progress.console) {
+        erase();
+    }
+}
+
+void progress_show(void) {
+    if (!progress.open) {
+        return;
+    }
+
+    if (progress.console) {
+        draw();
+    }
+
+    LeaveCriticalSection(&progress.lock);
+}
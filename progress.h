@@ -0,0 +1,35 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// How often the status line is redrawn, in milliseconds
+#define PROGRESS_INTERVAL 250
+
+// Starts redrawing the status line, total_bytes is the size of all inputs and drives the ETA
+// Without a console on stdout nothing is drawn, but the counters still run
+errno_t progress_open(uint32_t total_inputs, uint64_t total_bytes);
+
+// Draws the line a last time with the final numbers and moves below it
+void progress_close(void);
+
+// Queues the jobs found in the current input
+void progress_queue(uint32_t jobs);
+
+// Takes a queued job off the queue because its output is up to date
+void progress_skip(void);
+
+// Moves a queued job to the running ones
+void progress_begin(void);
+
+// Finishes a running job with the bytes of input it consumed and the seconds of audio it produced
+void progress_end(bool ok, uint64_t bytes, double audio_seconds);
+
+// Finishes the current input, jobs that never started leave the queue and the rest of its size counts as read
+void progress_input_done(uint64_t size);
+
+// Erases the status line and keeps it away until progress_show, so messages can be printed in between
+void progress_hide(void);
+
+// Draws the status line again after progress_hide
+void progress_show(void);
@@ -0,0 +1,103 @@
+#include "queue.h"
+
+errno_t queue_open(queue* q, uint32_t capacity) {
+    uint64_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    q->cells = malloc(size * sizeof(queue_cell));
+    q->mask = size - 1;
+    q->tail = 0;
+    q->head = 0;
+    q->items = CreateSemaphore(NULL, 0, (LONG)size, NULL);
+
+    if (!q->cells || !q->items) {
+        perrf("Could not create a queue of %llu items\n", size);
+
+        free(q->cells);
+
+        return 1;
+    }
+
+    // A cell's sequence equals the position that may write it next
+    for (uint64_t i = 0; i < size; i++) {
+        q->cells[i].sequence = (LONG64)i;
+    }
+
+    return 0;
+}
+
+void queue_close(queue* q) {
+    CloseHandle(q->items);
+    free(q->cells);
+}
+
+bool queue_push(queue* q, void* item) {
+    LONG64 pos = q->tail;
+    queue_cell* cell;
+
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        LONG64 diff = cell->sequence - pos;
+
+        if (diff == 0) {
+            LONG64 seen = InterlockedCompareExchange64(&q->tail, pos + 1, pos);
+
+            if (seen == pos) {
+                break;
+            }
+
+            pos = seen;
+        } else if (diff < 0) {
+            // The consumer a lap behind hasn't taken this cell yet
+            return false;
+        } else {
+            pos = q->tail;
+        }
+    }
+
+    cell->item = item;
+
+    // Publishes the item, the consumer reads it once it sees the new sequence
+    InterlockedExchange64(&cell->sequence, pos + 1);
+    ReleaseSemaphore(q->items, 1, NULL);
+
+    return true;
+}
+
+void* queue_pop(queue* q) {
+    WaitForSingleObject(q->items, INFINITE);
+
+    LONG64 pos = q->head;
+    queue_cell* cell;
+
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        LONG64 diff = cell->sequence - (pos + 1);
+
+        if (diff == 0) {
+            LONG64 seen = InterlockedCompareExchange64(&q->head, pos + 1, pos);
+
+            if (seen == pos) {
+                break;
+            }
+
+            pos = seen;
+        } else if (diff < 0) {
+            // A producer claimed the cell but hasn't published it, the semaphore promises it will
+            YieldProcessor();
+
+            pos = q->head;
+        } else {
+            pos = q->head;
+        }
+    }
+
+    void* item = cell->item;
+
+    // Hands the cell to the producer one lap ahead
+    InterlockedExchange64(&cell->sequence, pos + (LONG64)q->mask + 1);
+
+    return item;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// One slot of the ring, its sequence tells producers and consumers whose turn it is
+typedef struct queue_cell {
+    volatile LONG64 sequence;
+    void* item;
+} queue_cell;
+
+// Bounded ring for any number of producers and consumers, pushing and popping only take a compare-and-swap
+// Consumers sleep on a semaphore that counts the items, producers never wait and are bounded by the caller
+typedef struct queue {
+    queue_cell* cells;
+    uint64_t mask;
+
+    // Kept apart, so producers and consumers don't invalidate each other's cache line
+    volatile LONG64 tail;
+    uint8_t padding[64];
+    volatile LONG64 head;
+
+    HANDLE items;
+} queue;
+
+// Allocates a ring of at least capacity items, rounded up to a power of two
+errno_t queue_open(queue* q, uint32_t capacity);
+
+void queue_close(queue* q);
+
+// Adds item, false if the ring is full
+bool queue_push(queue* q, void* item);
+
+// Waits for an item and removes it, items come out in the order they went in
+void* queue_pop(queue* q);
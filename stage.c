@@ -0,0 +1,102 @@
+#include "stage.h"
+#include "trace.h"
+
+static DWORD WINAPI stage_thread(LPVOID param) {
+    stage* s = param;
+
+    trace_thread_name(s->name);
+
+    // A NULL item tells the thread to stop
+    for (void* item = queue_pop(&s->in); item; item = queue_pop(&s->in)) {
+        s->work(item);
+
+        // Never full, there are at most depth items in flight and the ring holds at least that many
+        queue_push(&s->out, item);
+    }
+
+    return 0;
+}
+
+errno_t stage_open(stage* s, const char* name, uint32_t threads, uint32_t depth, stage_work work, stage_done done) {
+    s->name = name;
+    s->work = work;
+    s->done = done;
+    s->depth = depth > threads ? depth : threads;
+    s->pending = 0;
+    s->thread_count = 0;
+    s->threads = malloc(threads * sizeof(HANDLE));
+
+    // The inbound ring also takes a stop item for every thread
+    if (queue_open(&s->in, s->depth + threads) != 0) {
+        free(s->threads);
+
+        return 1;
+    }
+
+    if (queue_open(&s->out, s->depth) != 0) {
+        queue_close(&s->in);
+        free(s->threads);
+
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        HANDLE thread = CreateThread(NULL, 0, stage_thread, s, 0, NULL);
+
+        if (thread) {
+            s->threads[s->thread_count++] = thread;
+        }
+    }
+
+    if (s->thread_count == 0) {
+        perrf("Could not start the %s threads\n", name);
+
+        queue_close(&s->in);
+        queue_close(&s->out);
+        free(s->threads);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void stage_close(stage* s) {
+    stage_drain(s);
+
+    for (uint32_t i = 0; i < s->thread_count; i++) {
+        queue_push(&s->in, NULL);
+    }
+
+    // One at a time, there may be more threads than WaitForMultipleObjects takes
+    for (uint32_t i = 0; i < s->thread_count; i++) {
+        WaitForSingleObject(s->threads[i], INFINITE);
+        CloseHandle(s->threads[i]);
+    }
+
+    queue_close(&s->in);
+    queue_close(&s->out);
+    free(s->threads);
+}
+
+void stage_submit(stage* s, void* item) {
+    while (s->pending >= s->depth) {
+        stage_collect(s);
+    }
+
+    s->pending++;
+    queue_push(&s->in, item);
+}
+
+void stage_collect(stage* s) {
+    void* item = queue_pop(&s->out);
+
+    s->pending--;
+    s->done(item);
+}
+
+void stage_drain(stage* s) {
+    while (s->pending != 0) {
+        stage_collect(s);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+#include "queue.h"
+
+// Runs on one of the stage's threads
+typedef void (*stage_work)(void* item);
+
+// Runs on the thread that submits, once the item's work is done
+typedef void (*stage_done)(void* item);
+
+// Worker threads between two bounded queues, submitted by one thread that also collects the results
+typedef struct stage {
+    const char* name;
+    stage_work work;
+    stage_done done;
+
+    queue in;
+    queue out;
+
+    HANDLE* threads;
+    uint32_t thread_count;
+
+    // Items submitted and not collected yet, stage_submit waits for one to finish past depth
+    uint32_t depth;
+    uint32_t pending;
+} stage;
+
+// Starts threads workers, name is what their threads are called in the trace
+errno_t stage_open(stage* s, const char* name, uint32_t threads, uint32_t depth, stage_work work, stage_done done);
+
+// Collects every item and stops the threads
+void stage_close(stage* s);
+
+// Hands item to the workers, collects finished items first while depth of them are in flight
+void stage_submit(stage* s, void* item);
+
+// Waits for the next finished item and runs done for it
+void stage_collect(stage* s);
+
+// Collects every item in flight
+void stage_drain(stage* s);
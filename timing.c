@@ -0,0 +1,292 @@
+#include "timing.h"
+
+// MSVC only knows _Thread_local in its newer C11 mode
+#ifdef _MSC_VER
+#define TIMING_THREAD __declspec(thread)
+#else
+#define TIMING_THREAD _Thread_local
+#endif
+
+static const char* stage_names[TIMING_COUNT] = {
+    "other", "read", "extract", "split", "setup", "pages", "decode", "pipe", "ffmpeg", "write"
+};
+
+// What the calling thread is charged to and since when
+static TIMING_THREAD struct {
+    timing* record;
+    timing_stage stage;
+    LONGLONG mark;
+} current;
+
+static LONGLONG frequency;
+
+static LONGLONG now(void) {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+// Charges the time since the last switch to the running stage
+static void charge(void) {
+    LONGLONG t = now();
+
+    if (current.record) {
+        InterlockedExchangeAdd64(&current.record->ticks[current.stage], t - current.mark);
+    }
+
+    current.mark = t;
+}
+
+void timing_reset(timing* t) {
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        t->ticks[i] = 0;
+        t->calls[i] = 0;
+    }
+
+    memset(&t->memory, 0, sizeof(t->memory));
+}
+
+void timing_bind(timing* t) {
+    charge();
+
+    current.record = t;
+    current.stage = TIMING_OTHER;
+}
+
+timing* timing_bound(void) {
+    return current.record;
+}
+
+timing_stage timing_current(void) {
+    return current.record ? current.stage : TIMING_OTHER;
+}
+
+timing_stage timing_enter(timing_stage stage) {
+    timing_stage previous = current.stage;
+
+    charge();
+    current.stage = stage;
+
+    if (current.record) {
+        InterlockedIncrement(&current.record->calls[stage]);
+    }
+
+    return previous;
+}
+
+void timing_leave(timing_stage previous) {
+    charge();
+    current.stage = previous;
+}
+
+void timing_add(timing* dst, const timing* src) {
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        dst->ticks[i] += src->ticks[i];
+        dst->calls[i] += src->calls[i];
+    }
+
+    // Inputs read ahead allocate while the current one converts, so peaks don't add up, the largest is only a lower bound
+    // Totals written to the reports take the process-wide peak instead
+    dst->memory.allocated += src->memory.allocated;
+    dst->memory.allocations += src->memory.allocations;
+    dst->memory.live += src->memory.live;
+    dst->memory.peak = src->memory.peak > dst->memory.peak ? src->memory.peak : dst->memory.peak;
+}
+
+double timing_ms(const timing* t, timing_stage stage) {
+    if (frequency == 0) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+
+        frequency = f.QuadPart;
+    }
+
+    return t->ticks[stage] * 1000. / frequency;
+}
+
+double timing_total_ms(const timing* t) {
+    double total = 0;
+
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        total += timing_ms(t, i);
+    }
+
+    return total;
+}
+
+const char* timing_stage_name(timing_stage stage) {
+    return stage_names[stage];
+}
+
+void timing_print(const timing* total, uint32_t files) {
+    double sum = timing_total_ms(total);
+
+    printf("\nTime per stage over %u files:\n", files);
+    printf("  %-8s %12s %7s %9s\n", "stage", "ms", "share", "calls");
+
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        // Stages that never ran only clutter the table
+        if (total->calls[i] == 0 && total->ticks[i] == 0) {
+            continue;
+        }
+
+        double ms = timing_ms(total, i);
+
+        printf("  %-8s %12.1f %6.1f%% %9li\n", stage_names[i], ms, sum > 0 ? 100. * ms / sum : 0., total->calls[i]);
+    }
+
+    printf("  %-8s %12.1f\n", "total", sum);
+}
+
+// Quotes a CSV field, doubling the quotes inside
+static void write_csv_field(FILE* out, const char* s) {
+    fputc('"', out);
+
+    for (; *s; s++) {
+        if (*s == '"') {
+            fputc('"', out);
+        }
+
+        fputc(*s, out);
+    }
+
+    fputc('"', out);
+}
+
+static void write_csv_row(FILE* out, const char* name, const timing* t) {
+    write_csv_field(out, name);
+
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        fprintf(out, ",%.3f,%li", timing_ms(t, i), t->calls[i]);
+    }
+
+    fprintf(out, ",%.3f", timing_total_ms(t));
+
+#ifdef NME_MEMSTATS
+    fprintf(out, ",%lli,%lli,%lli", t->memory.allocations, t->memory.allocated, t->memory.peak);
+#endif
+
+    fputs("\n", out);
+}
+
+errno_t timing_write_csv(const char* path, char** names, const timing* records, uint32_t count) {
+    FILE* out;
+
+    if (fopen_s(&out, path, "w") != 0) {
+        perrf("Could not open '%s' for writing\n", path);
+
+        return 1;
+    }
+
+    fputs("file", out);
+
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        fprintf(out, ",%s_ms,%s_calls", stage_names[i], stage_names[i]);
+    }
+
+    fputs(",total_ms", out);
+
+#ifdef NME_MEMSTATS
+    fputs(",allocations,allocated_bytes,peak_bytes", out);
+#endif
+
+    fputs("\n", out);
+
+    timing total;
+    timing_reset(&total);
+
+    for (uint32_t i = 0; i < count; i++) {
+        write_csv_row(out, names[i], &records[i]);
+        timing_add(&total, &records[i]);
+    }
+
+#ifdef NME_MEMSTATS
+    total.memory.peak = mem_process_usage().peak;
+#endif
+
+    write_csv_row(out, "total", &total);
+
+    errno_t err = ferror(out) ? 1 : 0;
+    fclose(out);
+
+    if (err != 0) {
+        perrf("Could not write '%s'\n", path);
+    }
+
+    return err;
+}
+
+// Writes a JSON string, paths are full of backslashes
+static void write_json_string(FILE* out, const char* s) {
+    fputc('"', out);
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+static void write_json_stages(FILE* out, const timing* t) {
+    fputs("{", out);
+
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        fprintf(out, "%s\"%s\": {\"ms\": %.3f, \"calls\": %li}", i ? ", " : "", stage_names[i], timing_ms(t, i), t->calls[i]);
+    }
+
+    fprintf(out, "}, \"total_ms\": %.3f", timing_total_ms(t));
+
+#ifdef NME_MEMSTATS
+    fprintf(out, ", \"memory\": {\"allocations\": %lli, \"allocated_bytes\": %lli, \"peak_bytes\": %lli}",
+        t->memory.allocations, t->memory.allocated, t->memory.peak);
+#endif
+}
+
+errno_t timing_write_json(const char* path, char** names, const timing* records, uint32_t count) {
+    FILE* out;
+
+    if (fopen_s(&out, path, "w") != 0) {
+        perrf("Could not open '%s' for writing\n", path);
+
+        return 1;
+    }
+
+    timing total;
+    timing_reset(&total);
+
+    fputs("{\n  \"files\": [\n", out);
+
+    for (uint32_t i = 0; i < count; i++) {
+        fputs("    {\"file\": ", out);
+        write_json_string(out, names[i]);
+        fputs(", \"stages\": ", out);
+        write_json_stages(out, &records[i]);
+        fprintf(out, "}%s\n", i + 1 < count ? "," : "");
+
+        timing_add(&total, &records[i]);
+    }
+
+#ifdef NME_MEMSTATS
+    total.memory.peak = mem_process_usage().peak;
+#endif
+
+    fputs("  ],\n  \"total\": {\"stages\": ", out);
+    write_json_stages(out, &total);
+    fputs("}\n}\n", out);
+
+    errno_t err = ferror(out) ? 1 : 0;
+    fclose(out);
+
+    if (err != 0) {
+        perrf("Could not write '%s'\n", path);
+    }
+
+    return err;
+}
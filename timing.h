@@ -0,0 +1,87 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// Stages of the conversion pipeline, every moment a thread is bound to a record is charged to exactly one of them
+typedef enum timing_stage {
+    // Bound time that isn't part of another stage, like hashing or waiting for extraction
+    TIMING_OTHER,
+
+    // Reading inputs from disk
+    TIMING_READ,
+
+    // Decompressing CPK entries, summed over the extraction threads
+    TIMING_EXTRACT,
+
+    // Finding the embedded tracks with split_bytes
+    TIMING_SPLIT,
+
+    // Rebuilding the Vorbis identification, comment and setup headers with their codebooks
+    TIMING_SETUP,
+
+    // Rewriting the audio packets into Ogg pages
+    TIMING_PAGES,
+
+    // Decoding in-process to WAV
+    TIMING_DECODE,
+
+    // Writing to ffmpeg's input, including the time blocked on a full pipe
+    TIMING_PIPE,
+
+    // ffmpeg running on its own, after its input was written or for the whole conversion of a USM
+    TIMING_FFMPEG,
+
+    // Writing in-process outputs to disk, summed over the writer threads
+    TIMING_WRITE,
+
+    TIMING_COUNT
+} timing_stage;
+
+// Time spent in each stage, stages can be charged from several threads at once
+typedef struct timing {
+    volatile LONG64 ticks[TIMING_COUNT];
+    volatile LONG calls[TIMING_COUNT];
+
+    // Allocations made while bound to the record, only counted in NME_MEMSTATS builds
+    mem_usage memory;
+} timing;
+
+// Clears all stages
+void timing_reset(timing* t);
+
+// Charges the calling thread's time to t from now on, NULL stops charging
+void timing_bind(timing* t);
+
+// Returns the record the calling thread is bound to, so worker threads can be bound to it as well
+timing* timing_bound(void);
+
+// Returns the stage the calling thread is in, TIMING_OTHER if it isn't bound
+timing_stage timing_current(void);
+
+// Switches the calling thread to stage, returns the stage that was running to pass to timing_leave
+timing_stage timing_enter(timing_stage stage);
+
+// Switches the calling thread back to the stage that was running before timing_enter
+void timing_leave(timing_stage previous);
+
+// Adds every stage of src to dst
+void timing_add(timing* dst, const timing* src);
+
+// Returns the stage's time in milliseconds
+double timing_ms(const timing* t, timing_stage stage);
+
+// Returns the time of all stages in milliseconds
+double timing_total_ms(const timing* t);
+
+// Returns the stage's name as used in the table and in the reports
+const char* timing_stage_name(timing_stage stage);
+
+// Prints a table of the batch's stages with their share of the total
+void timing_print(const timing* total, uint32_t files);
+
+// Writes one row per file and a total row as CSV, names and records are indexed alike
+errno_t timing_write_csv(const char* path, char** names, const timing* records, uint32_t count);
+
+// Writes the same report as JSON
+errno_t timing_write_json(const char* path, char** names, const timing* records, uint32_t count);
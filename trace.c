@@ -0,0 +1,170 @@
+#include "trace.h"
+#include "logger.h"
+
+// Room for an escaped detail, every character may turn into a \u escape
+#define TRACE_ESCAPED_MAX (TRACE_DETAIL_MAX * 6 + 1)
+
+// Events are rare compared to the work they describe, so they're written straight to the file under a lock
+static struct {
+    FILE* file;
+    CRITICAL_SECTION lock;
+    int64_t origin;
+    DWORD pid;
+    bool first;
+} trace;
+
+// Escapes src as the inside of a JSON string
+static void escape(char* dst, size_t size, const char* src) {
+    size_t n = 0;
+
+    for (; *src && n + 7 < size; src++) {
+        unsigned char c = (unsigned char)*src;
+
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20) {
+            n += sprintf_s(&dst[n], size - n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+
+    dst[n] = '\0';
+}
+
+// Writes one event, the caller holds the lock
+static void write_event(const char* line) {
+    fputs(trace.first ? "\n" : ",\n", trace.file);
+    fputs(line, trace.file);
+
+    trace.first = false;
+}
+
+errno_t trace_open(const char* path) {
+    if (trace.file) {
+        return 0;
+    }
+
+    if (fopen_s(&trace.file, path, "w") != 0) {
+        perrf("Could not open the trace '%s'\n", path);
+
+        trace.file = NULL;
+
+        return 1;
+    }
+
+    InitializeCriticalSection(&trace.lock);
+
+    trace.origin = logger_clock_us();
+    trace.pid = GetCurrentProcessId();
+    trace.first = true;
+
+    fputs("[", trace.file);
+
+    char line[128];
+    sprintf_s(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":\"nme\"}}", trace.pid);
+    write_event(line);
+
+    trace_thread_name("main");
+
+    return 0;
+}
+
+void trace_close(void) {
+    if (!trace.file) {
+        return;
+    }
+
+    EnterCriticalSection(&trace.lock);
+    fputs("\n]\n", trace.file);
+    fclose(trace.file);
+    trace.file = NULL;
+    LeaveCriticalSection(&trace.lock);
+
+    DeleteCriticalSection(&trace.lock);
+}
+
+bool trace_enabled(void) {
+    return trace.file != NULL;
+}
+
+int64_t trace_clock(void) {
+    return logger_clock_us();
+}
+
+static void record(const char* category, const char* name, int64_t start, const int* exit_code, const char* f, va_list args) {
+    int64_t end = logger_clock_us();
+    char detail[TRACE_DETAIL_MAX];
+    char escaped[TRACE_ESCAPED_MAX];
+    char line[TRACE_ESCAPED_MAX + 256];
+
+    detail[0] = '\0';
+
+    if (f) {
+        vsnprintf(detail, sizeof(detail), f, args);
+    }
+
+    escape(escaped, sizeof(escaped), detail);
+
+    int n = sprintf_s(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lli,\"dur\":%lli,\"pid\":%lu,\"tid\":%lu,\"args\":{\"detail\":\"%s\"",
+        name, category, start - trace.origin, end - start, trace.pid, GetCurrentThreadId(), escaped);
+
+    if (exit_code) {
+        n += sprintf_s(&line[n], sizeof(line) - n, ",\"exit\":%i", *exit_code);
+    }
+
+    sprintf_s(&line[n], sizeof(line) - n, "}}");
+
+    EnterCriticalSection(&trace.lock);
+
+    // Another thread may have closed the trace in the meantime
+    if (trace.file) {
+        write_event(line);
+    }
+
+    LeaveCriticalSection(&trace.lock);
+}
+
+void trace_span(const char* category, const char* name, int64_t start, const char* f, ...) {
+    if (!trace.file) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, f);
+    record(category, name, start, NULL, f, args);
+    va_end(args);
+}
+
+void trace_exit(const char* category, const char* name, int64_t start, int exit_code, const char* f, ...) {
+    if (!trace.file) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, f);
+    record(category, name, start, &exit_code, f, args);
+    va_end(args);
+}
+
+void trace_thread_name(const char* name) {
+    if (!trace.file) {
+        return;
+    }
+
+    char escaped[TRACE_ESCAPED_MAX];
+    char line[TRACE_ESCAPED_MAX + 128];
+
+    escape(escaped, sizeof(escaped), name);
+    sprintf_s(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+        trace.pid, GetCurrentThreadId(), escaped);
+
+    EnterCriticalSection(&trace.lock);
+
+    if (trace.file) {
+        write_event(line);
+    }
+
+    LeaveCriticalSection(&trace.lock);
+}
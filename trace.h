@@ -0,0 +1,29 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// Longest detail text kept for one event
+#define TRACE_DETAIL_MAX 512
+
+// Starts writing trace events to path in Chrome's trace event format, viewable in Perfetto or chrome://tracing
+errno_t trace_open(const char* path);
+
+// Finishes the JSON array and closes the file
+void trace_close(void);
+
+// Returns true between trace_open and trace_close, so callers can skip building details nobody reads
+bool trace_enabled(void);
+
+// Microseconds on the same monotonic clock as logger_clock_us, pass the value to trace_span when the span is over
+int64_t trace_clock(void);
+
+// Records a span on the calling thread from start until now, category and name have to be string literals
+// The formatted detail shows up in the event's arguments, f may be NULL
+void trace_span(const char* category, const char* name, int64_t start, const char* f, ...);
+
+// Records a span that ended with a process' exit code
+void trace_exit(const char* category, const char* name, int64_t start, int exit_code, const char* f, ...);
+
+// Names the calling thread's row in the timeline
+void trace_thread_name(const char* name);
@@ -0,0 +1,267 @@
+#include "utf.h"
+
+// The payload starts after the signature and the table size
+#define UTF_HEADER_SIZE 8
+#define UTF_SCHEMA      0x18
+
+// Tables that don't start with @UTF are scrambled with this LCG
+#define UTF_KEY_SEED 0x655F
+#define UTF_KEY_MULT 0x4115
+
+static uint16_t be16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t be64(const uint8_t* p) {
+    return (uint64_t)be32(p) << 32 | be32(&p[4]);
+}
+
+static uint32_t type_size(uint8_t type) {
+    switch (type) {
+        case UTF_TYPE_U8:
+        case UTF_TYPE_S8:     return 1;
+        case UTF_TYPE_U16:
+        case UTF_TYPE_S16:    return 2;
+        case UTF_TYPE_U32:
+        case UTF_TYPE_S32:
+        case UTF_TYPE_FLOAT:
+        case UTF_TYPE_STRING: return 4;
+        case UTF_TYPE_U64:
+        case UTF_TYPE_S64:
+        case UTF_TYPE_DOUBLE:
+        case UTF_TYPE_DATA:   return 8;
+        case UTF_TYPE_U128:   return 16;
+        default:              return 0;
+    }
+}
+
+// Returns the string at the offset in the string pool, or an empty string if it's out of bounds
+static const char* pool_string(const utf_table* t, uint32_t offset) {
+    if ((uint64_t)t->strings_offset + offset >= t->size) {
+        return "";
+    }
+
+    return (const char*)&t->data[t->strings_offset + offset];
+}
+
+errno_t utf_open(utf_table* t, const uint8_t* data, uint64_t size) {
+    memset(t, 0, sizeof(utf_table));
+
+    if (size < UTF_HEADER_SIZE + UTF_SCHEMA) {
+        perrf("@UTF table truncated\n");
+
+        return 1;
+    }
+
+    if (memcmp(data, "@UTF", 4) != 0) {
+        t->decrypted = malloc(size);
+
+        uint32_t key = UTF_KEY_SEED;
+        for (uint64_t i = 0; i < size; i++) {
+            t->decrypted[i] = data[i] ^ (uint8_t)key;
+            key *= UTF_KEY_MULT;
+        }
+
+        if (memcmp(t->decrypted, "@UTF", 4) != 0) {
+            perrf("Missing @UTF signature\n");
+
+            utf_close(t);
+
+            return 1;
+        }
+
+        data = t->decrypted;
+    }
+
+    t->size = be32(&data[4]);
+    t->data = &data[UTF_HEADER_SIZE];
+
+    if (t->size + (uint64_t)UTF_HEADER_SIZE > size || t->size < UTF_SCHEMA) {
+        perrf("@UTF table truncated\n");
+
+        utf_close(t);
+
+        return 1;
+    }
+
+    const uint8_t* h = t->data;
+    t->rows_offset = be16(&h[2]);
+    t->strings_offset = be32(&h[4]);
+    t->data_offset = be32(&h[8]);
+    t->column_count = be16(&h[16]);
+    t->row_width = be16(&h[18]);
+    t->row_count = be32(&h[20]);
+    t->name = pool_string(t, be32(&h[12]));
+
+    if (t->rows_offset > t->size || t->strings_offset > t->size || t->data_offset > t->size ||
+        (uint64_t)t->rows_offset + (uint64_t)t->row_width * t->row_count > t->size) {
+        perrf("@UTF table '%s' has invalid offsets\n", t->name);
+
+        utf_close(t);
+
+        return 1;
+    }
+
+    t->columns = malloc((t->column_count ? t->column_count : 1) * sizeof(utf_column));
+
+    uint32_t pos = UTF_SCHEMA;
+    uint32_t row_pos = 0;
+
+    for (uint16_t i = 0; i < t->column_count; i++) {
+        utf_column* c = &t->columns[i];
+
+        if (pos + 5 > t->size) {
+            perrf("@UTF schema of '%s' truncated\n", t->name);
+
+            utf_close(t);
+
+            return 1;
+        }
+
+        c->flags = h[pos] & 0xF0;
+        c->type = h[pos] & 0x0F;
+        c->name = (c->flags & UTF_COLUMN_NAME) ? pool_string(t, be32(&h[pos + 1])) : "";
+        pos += 5;
+
+        uint32_t value_size = type_size(c->type);
+
+        if (value_size == 0) {
+            perrf("Unknown @UTF column type %u in '%s'\n", c->type, t->name);
+
+            utf_close(t);
+
+            return 1;
+        }
+
+        // Constants are stored in the schema, row values one after another in each row
+        if (c->flags & UTF_COLUMN_CONSTANT) {
+            c->offset = pos;
+            pos += value_size;
+        } else if (c->flags & UTF_COLUMN_ROW) {
+            c->offset = row_pos;
+            row_pos += value_size;
+        } else {
+            c->offset = 0;
+        }
+    }
+
+    if (pos > t->size || row_pos > t->row_width) {
+        perrf("@UTF schema of '%s' truncated\n", t->name);
+
+        utf_close(t);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void utf_close(utf_table* t) {
+    free(t->columns);
+    free(t->decrypted);
+
+    t->columns = NULL;
+    t->decrypted = NULL;
+    t->column_count = 0;
+    t->row_count = 0;
+}
+
+int utf_find_column(const utf_table* t, const char* name) {
+    for (uint16_t i = 0; i < t->column_count; i++) {
+        if (strcmp(t->columns[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Returns a pointer to the column's value, NULL for columns without storage
+static const uint8_t* column_value(const utf_table* t, uint32_t row, const char* name, const utf_column** column) {
+    int i = utf_find_column(t, name);
+
+    if (i == -1 || row >= t->row_count) {
+        return NULL;
+    }
+
+    *column = &t->columns[i];
+
+    if ((*column)->flags & UTF_COLUMN_CONSTANT) {
+        return &t->data[(*column)->offset];
+    } else if ((*column)->flags & UTF_COLUMN_ROW) {
+        return &t->data[t->rows_offset + row * t->row_width + (*column)->offset];
+    }
+
+    return NULL;
+}
+
+bool utf_get_uint(const utf_table* t, uint32_t row, const char* name, uint64_t* value) {
+    const utf_column* c = NULL;
+    const uint8_t* v = column_value(t, row, name, &c);
+
+    if (!c || c->type > UTF_TYPE_S64) {
+        return false;
+    }
+
+    // Columns without storage are zero
+    if (!v) {
+        *value = 0;
+
+        return true;
+    }
+
+    switch (c->type) {
+        case UTF_TYPE_U8:
+        case UTF_TYPE_S8:  *value = v[0]; break;
+        case UTF_TYPE_U16:
+        case UTF_TYPE_S16: *value = be16(v); break;
+        case UTF_TYPE_U32:
+        case UTF_TYPE_S32: *value = be32(v); break;
+        default:           *value = be64(v); break;
+    }
+
+    return true;
+}
+
+bool utf_get_string(const utf_table* t, uint32_t row, const char* name, const char** value) {
+    const utf_column* c = NULL;
+    const uint8_t* v = column_value(t, row, name, &c);
+
+    if (!c || c->type != UTF_TYPE_STRING) {
+        return false;
+    }
+
+    *value = v ? pool_string(t, be32(v)) : "";
+
+    return true;
+}
+
+bool utf_get_data(const utf_table* t, uint32_t row, const char* name, const uint8_t** data, uint32_t* size) {
+    const utf_column* c = NULL;
+    const uint8_t* v = column_value(t, row, name, &c);
+
+    if (!c || c->type != UTF_TYPE_DATA) {
+        return false;
+    }
+
+    *data = NULL;
+    *size = 0;
+
+    if (v) {
+        uint32_t offset = be32(v);
+        uint32_t length = be32(&v[4]);
+
+        if ((uint64_t)t->data_offset + offset + length > t->size) {
+            return false;
+        }
+
+        *data = &t->data[t->data_offset + offset];
+        *size = length;
+    }
+
+    return true;
+}
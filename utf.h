@@ -0,0 +1,71 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// Column storage flags
+#define UTF_COLUMN_NAME     0x10
+#define UTF_COLUMN_CONSTANT 0x20
+#define UTF_COLUMN_ROW      0x40
+
+// Column value types
+#define UTF_TYPE_U8     0x00
+#define UTF_TYPE_S8     0x01
+#define UTF_TYPE_U16    0x02
+#define UTF_TYPE_S16    0x03
+#define UTF_TYPE_U32    0x04
+#define UTF_TYPE_S32    0x05
+#define UTF_TYPE_U64    0x06
+#define UTF_TYPE_S64    0x07
+#define UTF_TYPE_FLOAT  0x08
+#define UTF_TYPE_DOUBLE 0x09
+#define UTF_TYPE_STRING 0x0A
+#define UTF_TYPE_DATA   0x0B
+#define UTF_TYPE_U128   0x0C
+
+typedef struct utf_column {
+    uint8_t flags;
+    uint8_t type;
+    const char* name;
+
+    // Position of the value, within the row for row columns or within the table for constants
+    uint32_t offset;
+} utf_column;
+
+// A CRI @UTF table as used by CPK and USM headers, all values are big endian
+typedef struct utf_table {
+    // Table payload, all offsets are relative to it
+    const uint8_t* data;
+    uint32_t size;
+
+    // Decrypted copy of the table, owned by the table
+    uint8_t* decrypted;
+
+    uint32_t rows_offset;
+    uint32_t strings_offset;
+    uint32_t data_offset;
+    const char* name;
+
+    uint16_t column_count;
+    uint16_t row_width;
+    uint32_t row_count;
+    utf_column* columns;
+} utf_table;
+
+// Parses the table starting at the @UTF signature, encrypted tables are decrypted into a copy
+errno_t utf_open(utf_table* table, const uint8_t* data, uint64_t size);
+
+// Frees the column list and the decrypted copy
+void utf_close(utf_table* table);
+
+// Returns the index of the named column, -1 if the table has no such column
+int utf_find_column(const utf_table* table, const char* name);
+
+// Reads an integer column, false if it's missing or not an integer
+bool utf_get_uint(const utf_table* table, uint32_t row, const char* name, uint64_t* value);
+
+// Reads a string column, false if it's missing or not a string
+bool utf_get_string(const utf_table* table, uint32_t row, const char* name, const char** value);
+
+// Reads a data column, false if it's missing or not a data column
+bool utf_get_data(const utf_table* table, uint32_t row, const char* name, const uint8_t** data, uint32_t* size);
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include "logger.h"
+#include "progress.h"
 
 VersionInfo PrintVersionInfo(void) {
     VersionInfo version;
@@ -17,11 +19,14 @@ void perrf(const char* f, ...) {
     va_start(args, f);
     hErr = GetStdHandle(STD_ERROR_HANDLE);
 
+    // Keeps the status line from being drawn into the message
+    progress_hide();
     SetConsoleTextAttribute(hErr, 12);
 
     vfprintf(stderr, f, args);
 
     SetConsoleTextAttribute(hErr, 7);
+    progress_show();
 
     va_end(args);
 }
@@ -33,11 +38,13 @@ void pwarnf(const char* f, ...) {
     va_start(args, f);
     hErr = GetStdHandle(STD_ERROR_HANDLE);
 
+    progress_hide();
     SetConsoleTextAttribute(hErr, 14);
 
     vfprintf(stdout, f, args);
 
     SetConsoleTextAttribute(hErr, 7);
+    progress_show();
 
     va_end(args);
 }
@@ -237,6 +244,14 @@ char* ConstructCommand(File* file) {
 
     switch (file->format) {
         case FORMAT_USM:
+            if (file->piped) {
+                sprintf_s(cmd, CMD_MAX_LENGTH, CMD_BASE_VIDEO_PIPE,
+                    file->args.video_args.encoder, file->args.video_args.quality,
+                    file->args.video_args.filters, thread_count,
+                    file->args.video_args.format, MakePath(file->output));
+                break;
+            }
+
             sprintf_s(cmd, CMD_MAX_LENGTH, CMD_BASE_VIDEO,
                 MakePath(file->input), file->args.video_args.encoder,
                 file->args.video_args.quality, file->args.video_args.filters,
@@ -248,6 +263,13 @@ char* ConstructCommand(File* file) {
                 file->args.audio_args.sample_fmt, thread_count,
                 MakePath(file->output));
             break;
+        case FORMAT_WEM_PCM:
+        case FORMAT_WEM_ADPCM:
+            sprintf_s(cmd, CMD_MAX_LENGTH, CMD_BASE_AUDIO_WAV,
+                file->args.audio_args.encoder, file->args.audio_args.quality,
+                file->args.audio_args.sample_fmt, thread_count,
+                MakePath(file->output));
+            break;
         default:
             perrf("Unknown format %i\n%s\n%s\n", file->format, MakePath(file->input), MakePath(file->output));
 
@@ -259,19 +281,95 @@ char* ConstructCommand(File* file) {
     return cmd;
 }
 
+char* ConstructBatchCommand(File** files, const char** inputs, uint32_t count) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    int thread_count = info.dwNumberOfProcessors;
+
+    // Every output gets a full path's worth of room on top of its arguments
+    size_t size = sizeof(CMD_BATCH_AUDIO_WAV);
+    for (uint32_t i = 0; i < count; i++) {
+        AudioArgs* args = &files[i]->args.audio_args;
+
+        size += sizeof(CMD_BATCH_INPUT_WAV) + strlen(inputs[i]) + sizeof(CMD_BATCH_OUTPUT_AUDIO) + 20 +
+            strlen(args->encoder) + strlen(args->quality) + strlen(args->sample_fmt) + _MAX_PATH;
+    }
+
+    char* cmd = malloc(size);
+    int pos = sprintf_s(cmd, size, CMD_BATCH_AUDIO_WAV);
+
+    // ffmpeg wants all the inputs before the first output
+    for (uint32_t i = 0; i < count; i++) {
+        pos += sprintf_s(&cmd[pos], size - pos, CMD_BATCH_INPUT_WAV, inputs[i]);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        AudioArgs* args = &files[i]->args.audio_args;
+        char* output = MakePath(files[i]->output);
+
+        pos += sprintf_s(&cmd[pos], size - pos, CMD_BATCH_OUTPUT_AUDIO,
+            i, args->encoder, args->quality, args->sample_fmt, thread_count, output);
+
+        free(output);
+    }
+
+    return cmd;
+}
+
 void WriteToLog(const char* str) {
-    FILE* log;
-    SYSTEMTIME t;
-    char* msg = malloc(30 + strlen(str));
+    logger_write(LOGGER_NO_JOB, NULL, LOGGER_NO_DURATION, LOGGER_NO_EXIT, "%s", str);
+}
 
-    GetSystemTime(&t);
+// Reads the codec ID from the fmt chunk of a RIFF file, 0 if there is none
+static uint16_t ReadRiffCodec(const fpath path) {
+    char* path_str = MakePath(path);
+    uint16_t codec = 0;
+    FILE* file;
+
+    if (fopen_s(&file, path_str, "rb") != 0) {
+        free(path_str);
+
+        return 0;
+    }
 
-    sprintf_s(msg, 30 + strlen(str), "\n[%04d-%d-%d %02d:%02d:%02d:%03d]: %s\n", t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond, t.wMilliseconds, str);
-    msg = TRIM(msg);
+    unsigned char chunk[8];
 
-    fopen_s(&log, "conversion.log", "a");
-    fwrite(msg, strlen(msg) - 1, 1, log);
-    fclose(log);
+    _fseeki64(file, 12, SEEK_SET);
+    while (fread(chunk, 8, 1, file) == 1) {
+        uint32_t size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            unsigned char id[2];
+
+            if (fread(id, 2, 1, file) == 1) {
+                codec = id[0] | id[1] << 8;
+            }
+
+            break;
+        }
+
+        if (_fseeki64(file, size, SEEK_CUR) != 0) {
+            break;
+        }
+    }
+
+    fclose(file);
+    free(path_str);
+
+    return codec;
+}
+
+format GetWemFormat(uint16_t codec) {
+    switch (codec) {
+        case WEM_CODEC_PCM:
+        case WEM_CODEC_PCM_EX:
+            return FORMAT_WEM_PCM;
+        case WEM_CODEC_IMA_ADPCM:
+            return FORMAT_WEM_ADPCM;
+        default:
+            return FORMAT_WSP;
+    }
 }
 
 format GetFileFormat(const fpath path) {
@@ -285,13 +383,209 @@ format GetFileFormat(const fpath path) {
         }
     } else if(_stricmp(path.ext, ".wsp") == 0 || _stricmp(path.ext, ".wem") == 0){
         if (CheckFileSignature(path, "RIFF")) {
+            // A single WEM can hold PCM or ADPCM instead of Vorbis, WSPs are checked per embedded file
+            if (_stricmp(path.ext, ".wem") == 0) {
+                return GetWemFormat(ReadRiffCodec(path));
+            }
+
             return FORMAT_WSP;
         } else {
             perrf("Incomplete format for '%s'", MakePath(path));
 
+            exit(1);
+        }
+    } else if (_stricmp(path.ext, ".bnk") == 0) {
+        if (CheckFileSignature(path, "BKHD")) {
+            return FORMAT_BNK;
+        } else {
+            perrf("Incomplete format for '%s'", MakePath(path));
+
+            exit(1);
+        }
+    } else if (_stricmp(path.ext, ".cpk") == 0) {
+        if (CheckFileSignature(path, "CPK ")) {
+            return FORMAT_CPK;
+        } else {
+            perrf("Incomplete format for '%s'", MakePath(path));
+
             exit(1);
         }
     } else {
         return FORMAT_NIL;
     }
 }
+
+char* ReadFileToMemory(const fpath path, uint64_t* size) {
+    char* path_str = MakePath(path);
+    FILE* file;
+
+    if (fopen_s(&file, path_str, "rb") != 0) {
+        perrf("Could not open '%s'\n", path_str);
+        free(path_str);
+
+        return NULL;
+    }
+
+    _fseeki64(file, 0, SEEK_END);
+    *size = _ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    char* data = malloc(*size != 0 ? *size : 1);
+
+    if (*size != 0 && fread(data, *size, 1, file) != 1) {
+        perrf("Error reading file '%s'\n", path_str);
+
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    free(path_str);
+
+    return data;
+}
+
+uint64_t WarmFile(const fpath path) {
+    char* path_str = MakePath(path);
+    HANDLE file = CreateFileA(path_str, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    free(path_str);
+
+    // Errors are left to the conversion, which opens the file again
+    if (file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    char* chunk = malloc(READ_AHEAD_CHUNK);
+    uint64_t total = 0;
+    DWORD n = 0;
+
+    while (ReadFile(file, chunk, READ_AHEAD_CHUNK, &n, NULL) && n != 0) {
+        total += n;
+    }
+
+    free(chunk);
+    CloseHandle(file);
+
+    return total;
+}
+
+pcm_format GetPcmFormat(const char* encoder) {
+    if (strcmp(encoder, PCM_F32_CODEC) == 0) {
+        return PCM_FMT_F32;
+    } else if (strcmp(encoder, PCM_F64_CODEC) == 0) {
+        return PCM_FMT_F64;
+    } else if (strcmp(encoder, PCM_S16_CODEC) == 0) {
+        return PCM_FMT_S16;
+    } else if (strcmp(encoder, PCM_S24_CODEC) == 0) {
+        return PCM_FMT_S24;
+    } else if (strcmp(encoder, PCM_S32_CODEC) == 0) {
+        return PCM_FMT_S32;
+    } else if (strcmp(encoder, PCM_S64_CODEC) == 0) {
+        return PCM_FMT_S64;
+    } else {
+        return PCM_FMT_NIL;
+    }
+}
+
+bool GetFileStamp(const char* path, uint64_t* size, uint64_t* mtime) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attr) || (attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return false;
+    }
+
+    *size = (uint64_t)attr.nFileSizeHigh << 32 | attr.nFileSizeLow;
+    *mtime = (uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32 | attr.ftLastWriteTime.dwLowDateTime;
+
+    return true;
+}
+
+bool HashFile(const char* path, uint64_t seed, uint64_t* hash) {
+    FILE* file;
+
+    if (fopen_s(&file, path, "rb") != 0) {
+        perrf("Could not open '%s'\n", path);
+
+        return false;
+    }
+
+    char* chunk = malloc(HASH_FILE_CHUNK);
+    hash_state h;
+    size_t read;
+
+    hash_init(&h, seed);
+
+    while ((read = fread(chunk, 1, HASH_FILE_CHUNK, file)) != 0) {
+        hash_update(&h, chunk, read);
+    }
+
+    bool success = ferror(file) == 0;
+
+    fclose(file);
+    free(chunk);
+
+    *hash = hash_digest(&h);
+
+    return success;
+}
+
+void HashArgs(hash_state* h, const File* file) {
+    if (file->format == FORMAT_USM) {
+        hash_update_string(h, file->args.video_args.encoder);
+        hash_update_string(h, file->args.video_args.quality);
+        hash_update_string(h, file->args.video_args.filters);
+        hash_update_string(h, file->args.video_args.format);
+    } else {
+        hash_update_string(h, file->args.audio_args.encoder);
+        hash_update_string(h, file->args.audio_args.quality);
+        hash_update_string(h, file->args.audio_args.sample_fmt);
+    }
+
+    hash_update_string(h, file->output.ext);
+}
+
+bool LinkOrCopyFile(const char* source, const char* target) {
+    // Hard links can't replace an existing file
+    DeleteFileA(target);
+
+    if (CreateHardLinkA(target, source, NULL)) {
+        return true;
+    }
+
+    return CopyFileA(source, target, FALSE) != 0;
+}
+
+bool GetFileDiskPosition(const char* path, uint64_t* lcn, uint64_t* file_id) {
+    HANDLE file = CreateFileA(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    STARTING_VCN_INPUT_BUFFER start;
+    RETRIEVAL_POINTERS_BUFFER extents;
+    BY_HANDLE_FILE_INFORMATION info;
+    DWORD n = 0;
+
+    start.StartingVcn.QuadPart = 0;
+
+    // Only the first extent is asked for, ERROR_MORE_DATA just means the file has more of them
+    if ((DeviceIoControl(file, FSCTL_GET_RETRIEVAL_POINTERS, &start, sizeof(start), &extents, sizeof(extents), &n, NULL) ||
+        GetLastError() == ERROR_MORE_DATA) && extents.ExtentCount != 0) {
+        // Sparse and compressed extents have an LCN of -1, which sorts them last as well
+        *lcn = (uint64_t)extents.Extents[0].Lcn.QuadPart;
+    } else {
+        *lcn = UINT64_MAX;
+    }
+
+    if (GetFileInformationByHandle(file, &info)) {
+        *file_id = (uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+    } else {
+        *file_id = UINT64_MAX;
+    }
+
+    CloseHandle(file);
+
+    return true;
+}
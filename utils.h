@@ -1,6 +1,7 @@
 #pragma once
 
 #include "defs.h"
+#include "hash.h"
 
 // A custom printf function that outputs red text to stderr
 void perrf(const char* f, ...);
@@ -39,9 +40,39 @@ wchar_t* MakePathW(fpath path);
 // Constructs the conversion command from a given File struct
 char* ConstructCommand(File* file);
 
-// Writes the buffer to the log, prepended with a timestamp
+// Constructs one command that encodes the WAV read from each of inputs to the output of the File with the same index
+char* ConstructBatchCommand(File** files, const char** inputs, uint32_t count);
+
+// Queues the buffer for the log, prepended with a timestamp
 void WriteToLog(const char* str);
 
 // Check if we support the given file and set the format
 format GetFileFormat(const fpath path);
 
+// Reads the whole file into a newly allocated buffer, NULL on failure
+char* ReadFileToMemory(const fpath path, uint64_t* size);
+
+// Reads the file once without keeping it, so opening it later finds it in the system cache, returns the bytes read
+uint64_t WarmFile(const fpath path);
+
+// Returns the format a WEM with the given codec ID is converted as
+format GetWemFormat(uint16_t codec);
+
+// Returns the PCM sample format written by the given ffmpeg encoder, PCM_FMT_NIL if it's not a PCM codec
+pcm_format GetPcmFormat(const char* encoder);
+
+// Reads the file's size and last write time, false if it doesn't exist
+bool GetFileStamp(const char* path, uint64_t* size, uint64_t* mtime);
+
+// Hashes the file's content without reading it into memory at once, false if it couldn't be read
+bool HashFile(const char* path, uint64_t seed, uint64_t* hash);
+
+// Adds the resolved encoder arguments and output extension to the hash
+void HashArgs(hash_state* h, const File* file);
+
+// Makes target a hard link to source, or a copy if they're on different volumes
+bool LinkOrCopyFile(const char* source, const char* target);
+
+// Finds the first cluster of the file on its volume and its file ID, false if it can't be opened
+// lcn is UINT64_MAX for files without clusters of their own, like small files kept in the MFT or files on a share
+bool GetFileDiskPosition(const char* path, uint64_t* lcn, uint64_t* file_id);
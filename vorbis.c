@@ -0,0 +1,1644 @@
+#include "vorbis.h"
+#include "bitmanip.h"
+
+#include <math.h>
+
+#define FAST_BITS           10
+#define FAST_SIZE           (1 << FAST_BITS)
+#define FLOOR1_MAX_VALUES   256
+#define MAX_SUBMAPS         16
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Reads individual bits from a packet, LSB first
+typedef struct vorbis_bits {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t pos;
+
+    // Bits that have been fetched but not consumed yet
+    uint64_t acc;
+    int count;
+
+    // Set when reading past the end of the packet
+    bool eop;
+} vorbis_bits;
+
+typedef struct vorbis_codebook {
+    uint32_t dimensions;
+    uint32_t entries;
+
+    // Codeword length for each entry, 0 if the entry is unused
+    uint8_t* lengths;
+
+    // Bit-reversed codewords, so they can be compared with the LSB first stream
+    uint32_t* codewords;
+
+    // Entry for each FAST_BITS wide prefix, -1 if the codeword is longer
+    int32_t fast[FAST_SIZE];
+
+    // Entries whose codewords are longer than FAST_BITS
+    uint32_t* long_entries;
+    uint32_t long_count;
+
+    // Unpacked VQ vectors (entries * dimensions), NULL if the lookup type is 0
+    float* vq;
+} vorbis_codebook;
+
+typedef struct vorbis_floor {
+    uint8_t partitions;
+    uint8_t partition_class[32];
+    uint8_t class_dimensions[16];
+    uint8_t class_subclasses[16];
+    int16_t class_masterbook[16];
+    int16_t subclass_books[16][8];
+    uint8_t multiplier;
+
+    uint32_t values;
+    uint16_t X[FLOOR1_MAX_VALUES];
+
+    // Indices into X, sorted by value
+    uint8_t sorted[FLOOR1_MAX_VALUES];
+    uint8_t low_neighbor[FLOOR1_MAX_VALUES];
+    uint8_t high_neighbor[FLOOR1_MAX_VALUES];
+} vorbis_floor;
+
+typedef struct vorbis_residue {
+    uint16_t type;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t partition_size;
+    uint8_t classifications;
+    uint8_t classbook;
+    int16_t books[64][8];
+} vorbis_residue;
+
+typedef struct vorbis_mapping {
+    uint8_t submaps;
+    uint16_t coupling_steps;
+    uint8_t magnitude[256];
+    uint8_t angle[256];
+    uint8_t mux[256];
+    uint8_t submap_floor[MAX_SUBMAPS];
+    uint8_t submap_residue[MAX_SUBMAPS];
+} vorbis_mapping;
+
+typedef struct vorbis_mode {
+    bool blockflag;
+    uint8_t mapping;
+} vorbis_mode;
+
+// Tables for an IMDCT of size n, computed through an n/4 point complex FFT
+typedef struct vorbis_imdct {
+    uint32_t n;
+
+    // Pre- and post-twiddle factors e^(-i*pi*(k + 1/8)/(n/2))
+    float* twiddle_re;
+    float* twiddle_im;
+
+    // FFT twiddle factors, stage h starts at index h - 1
+    float* fft_re;
+    float* fft_im;
+
+    uint32_t* bitrev;
+
+    // Scratch space
+    float* z_re;
+    float* z_im;
+    float* u;
+} vorbis_imdct;
+
+struct vorbis_decoder {
+    // Number of header packets decoded so far
+    int headers;
+
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t blocksize[2];
+
+    unsigned int codebook_count;
+    vorbis_codebook* codebooks;
+
+    unsigned int floor_count;
+    vorbis_floor* floors;
+
+    unsigned int residue_count;
+    vorbis_residue* residues;
+
+    unsigned int mapping_count;
+    vorbis_mapping* mappings;
+
+    unsigned int mode_count;
+    vorbis_mode modes[64];
+    int mode_bits;
+
+    vorbis_imdct imdct[2];
+
+    // Rising and falling window slopes for both block sizes
+    float* window_rise[2];
+    float* window_fall[2];
+
+    // Per channel buffers
+    float** residue;
+    float** prev;
+    float** out;
+    int32_t** floor_y;
+    bool* floor_unused;
+    bool* no_residue;
+
+    // Scratch space shared by all channels
+    float* block;
+    float* curve;
+    float* interleaved;
+    float** vectors;
+    bool* skip;
+    uint8_t* classifications;
+    uint32_t classifications_size;
+
+    // Size of the previous block, 0 before the first audio packet
+    uint32_t prev_n;
+
+    uint32_t pcm_samples;
+};
+
+static const float floor1_inverse_db[256] = {
+    1.06498564e-07F, 1.13419440e-07F, 1.20790075e-07F, 1.28639694e-07F, 1.36999427e-07F, 1.45902422e-07F,
+    1.55383983e-07F, 1.65481710e-07F, 1.76235644e-07F, 1.87688429e-07F, 1.99885481e-07F, 2.12875166e-07F,
+    2.26708994e-07F, 2.41441822e-07F, 2.57132072e-07F, 2.73841963e-07F, 2.91637757e-07F, 3.10590022e-07F,
+    3.30773912e-07F, 3.52269465e-07F, 3.75161920e-07F, 3.99542056e-07F, 4.25506550e-07F, 4.53158364e-07F,
+    4.82607148e-07F, 5.13969680e-07F, 5.47370326e-07F, 5.82941535e-07F, 6.20824361e-07F, 6.61169026e-07F,
+    7.04135515e-07F, 7.49894209e-07F, 7.98626561e-07F, 8.50525815e-07F, 9.05797776e-07F, 9.64661620e-07F,
+    1.02735077e-06F, 1.09411381e-06F, 1.16521549e-06F, 1.24093776e-06F, 1.32158089e-06F, 1.40746466e-06F,
+    1.49892965e-06F, 1.59633854e-06F, 1.70007762e-06F, 1.81055824e-06F, 1.92821852e-06F, 2.05352503e-06F,
+    2.18697466e-06F, 2.32909659e-06F, 2.48045441e-06F, 2.64164832e-06F, 2.81331751e-06F, 2.99614274e-06F,
+    3.19084898e-06F, 3.39820833e-06F, 3.61904306e-06F, 3.85422887e-06F, 4.10469838e-06F, 4.37144481e-06F,
+    4.65552593e-06F, 4.95806824e-06F, 5.28027146e-06F, 5.62341325e-06F, 5.98885433e-06F, 6.37804384e-06F,
+    6.79252507e-06F, 7.23394163e-06F, 7.70404392e-06F, 8.20469611e-06F, 8.73788350e-06F, 9.30572041e-06F,
+    9.91045856e-06F, 1.05544960e-05F, 1.12403866e-05F, 1.19708503e-05F, 1.27487836e-05F, 1.35772714e-05F,
+    1.44595990e-05F, 1.53992653e-05F, 1.63999963e-05F, 1.74657605e-05F, 1.86007840e-05F, 1.98095678e-05F,
+    2.10969051e-05F, 2.24679009e-05F, 2.39279917e-05F, 2.54829675e-05F, 2.71389943e-05F, 2.89026391e-05F,
+    3.07808955e-05F, 3.27812115e-05F, 3.49115194e-05F, 3.71802666e-05F, 3.95964499e-05F, 4.21696503e-05F,
+    4.49100719e-05F, 4.78285814e-05F, 5.09367522e-05F, 5.42469094e-05F, 5.77721792e-05F, 6.15265410e-05F,
+    6.55248824e-05F, 6.97830585e-05F, 7.43179549e-05F, 7.91475544e-05F, 8.42910085e-05F, 8.97687132e-05F,
+    9.56023901e-05F, 1.01815172e-04F, 1.08431696e-04F, 1.15478198e-04F, 1.22982623e-04F, 1.30974726e-04F,
+    1.39486202e-04F, 1.48550802e-04F, 1.58204470e-04F, 1.68485488e-04F, 1.79434624e-04F, 1.91095297e-04F,
+    2.03513747e-04F, 2.16739217e-04F, 2.30824153e-04F, 2.45824407e-04F, 2.61799462e-04F, 2.78812667e-04F,
+    2.96931485e-04F, 3.16227766e-04F, 3.36778028e-04F, 3.58663762e-04F, 3.81971755e-04F, 4.06794432e-04F,
+    4.33230227e-04F, 4.61383968e-04F, 4.91367299e-04F, 5.23299115e-04F, 5.57306040e-04F, 5.93522927e-04F,
+    6.32093392e-04F, 6.73170382e-04F, 7.16916787e-04F, 7.63506080e-04F, 8.13123008e-04F, 8.65964323e-04F,
+    9.22239565e-04F, 9.82171889e-04F, 1.04599895e-03F, 1.11397386e-03F, 1.18636616e-03F, 1.26346292e-03F,
+    1.34556986e-03F, 1.43301257e-03F, 1.52613780e-03F, 1.62531484e-03F, 1.73093695e-03F, 1.84342299e-03F,
+    1.96321901e-03F, 2.09080004e-03F, 2.22667201e-03F, 2.37137371e-03F, 2.52547893e-03F, 2.68959879e-03F,
+    2.86438407e-03F, 3.05052789e-03F, 3.24876838e-03F, 3.45989166e-03F, 3.68473492e-03F, 3.92418976e-03F,
+    4.17920572e-03F, 4.45079406e-03F, 4.74003174e-03F, 5.04806572e-03F, 5.37611747e-03F, 5.72548788e-03F,
+    6.09756235e-03F, 6.49381632e-03F, 6.91582109e-03F, 7.36525012e-03F, 7.84388558e-03F, 8.35362547e-03F,
+    8.89649113e-03F, 9.47463526e-03F, 1.00903504e-02F, 1.07460783e-02F, 1.14444190e-02F, 1.21881418e-02F,
+    1.29801960e-02F, 1.38237223e-02F, 1.47220656e-02F, 1.56787884e-02F, 1.66976845e-02F, 1.77827941e-02F,
+    1.89384203e-02F, 2.01691455e-02F, 2.14798503e-02F, 2.28757320e-02F, 2.43623260e-02F, 2.59455272e-02F,
+    2.76316138e-02F, 2.94272718e-02F, 3.13396217e-02F, 3.33762469e-02F, 3.55452236e-02F, 3.78551525e-02F,
+    4.03151936e-02F, 4.29351021e-02F, 4.57252670e-02F, 4.86967525e-02F, 5.18613419e-02F, 5.52315842e-02F,
+    5.88208438e-02F, 6.26433537e-02F, 6.67142718e-02F, 7.10497411e-02F, 7.56669537e-02F, 8.05842188e-02F,
+    8.58210354e-02F, 9.13981699e-02F, 9.73377381e-02F, 1.03663293e-01F, 1.10399918e-01F, 1.17574327e-01F,
+    1.25214969e-01F, 1.33352143e-01F, 1.42018117e-01F, 1.51247255e-01F, 1.61076153e-01F, 1.71543790e-01F,
+    1.82691672e-01F, 1.94564006e-01F, 2.07207872e-01F, 2.20673407e-01F, 2.35014008e-01F, 2.50286543e-01F,
+    2.66551573e-01F, 2.83873596e-01F, 3.02321303e-01F, 3.21967844e-01F, 3.42891129e-01F, 3.65174127e-01F,
+    3.88905200e-01F, 4.14178451e-01F, 4.41094101e-01F, 4.69758882e-01F, 5.00286461e-01F, 5.32797895e-01F,
+    5.67422104e-01F, 6.04296390e-01F, 6.43566975e-01F, 6.85389584e-01F, 7.29930061e-01F, 7.77365030e-01F,
+    8.27882591e-01F, 8.81683067e-01F, 9.38979801e-01F, 1.00000000e+00F
+};
+
+static void bits_init(vorbis_bits* b, const uint8_t* data, uint32_t size) {
+    b->data = data;
+    b->size = size;
+    b->pos = 0;
+    b->acc = 0;
+    b->count = 0;
+    b->eop = false;
+}
+
+static void bits_refill(vorbis_bits* b) {
+    while (b->count <= 56 && b->pos < b->size) {
+        b->acc |= (uint64_t)b->data[b->pos++] << b->count;
+        b->count += 8;
+    }
+}
+
+static uint32_t bits_read(vorbis_bits* b, int n) {
+    if (n == 0) {
+        return 0;
+    }
+
+    bits_refill(b);
+
+    if (b->count < n) {
+        b->eop = true;
+        b->acc = 0;
+        b->count = 0;
+
+        return 0;
+    }
+
+    uint32_t v = (uint32_t)(b->acc & ((UINT64_C(1) << n) - 1));
+    b->acc >>= n;
+    b->count -= n;
+
+    return v;
+}
+
+static uint32_t bit_reverse(uint32_t n) {
+    n = ((n & 0xAAAAAAAA) >> 1) | ((n & 0x55555555) << 1);
+    n = ((n & 0xCCCCCCCC) >> 2) | ((n & 0x33333333) << 2);
+    n = ((n & 0xF0F0F0F0) >> 4) | ((n & 0x0F0F0F0F) << 4);
+    n = ((n & 0xFF00FF00) >> 8) | ((n & 0x00FF00FF) << 8);
+
+    return (n >> 16) | (n << 16);
+}
+
+// Decodes a single entry number, -1 on error or end of packet
+static int32_t codebook_decode(const vorbis_codebook* cb, vorbis_bits* b) {
+    bits_refill(b);
+
+    int32_t entry = cb->fast[b->acc & (FAST_SIZE - 1)];
+
+    if (entry >= 0) {
+        int length = cb->lengths[entry];
+
+        if (length <= b->count) {
+            b->acc >>= length;
+            b->count -= length;
+
+            return entry;
+        }
+    } else {
+        for (uint32_t i = 0; i < cb->long_count; i++) {
+            uint32_t e = cb->long_entries[i];
+            int length = cb->lengths[e];
+
+            if (length <= b->count && (b->acc & ((UINT64_C(1) << length) - 1)) == cb->codewords[e]) {
+                b->acc >>= length;
+                b->count -= length;
+
+                return (int32_t)e;
+            }
+        }
+    }
+
+    b->eop = true;
+
+    return -1;
+}
+
+static float float32_unpack(uint32_t x) {
+    uint32_t mantissa = x & 0x1FFFFF;
+    uint32_t exponent = (x & 0x7FE00000) >> 21;
+    double value = (x & 0x80000000) ? -(double)mantissa : (double)mantissa;
+
+    return (float)ldexp(value, (int)exponent - 788);
+}
+
+// Assigns the Huffman codewords in entry order and fills the lookup tables
+static errno_t codebook_build(vorbis_codebook* cb) {
+    uint32_t available[33] = { 0 };
+    uint32_t first = 0;
+
+    cb->codewords = calloc(cb->entries, sizeof(uint32_t));
+    cb->long_entries = malloc(cb->entries * sizeof(uint32_t));
+    cb->long_count = 0;
+
+    for (int i = 0; i < FAST_SIZE; i++) {
+        cb->fast[i] = -1;
+    }
+
+    while (first < cb->entries && cb->lengths[first] == 0) {
+        first++;
+    }
+
+    // A codebook without any used entries can't be decoded from, but is valid
+    if (first == cb->entries) {
+        return 0;
+    }
+
+    cb->codewords[first] = 0;
+    for (int i = 1; i <= cb->lengths[first]; i++) {
+        available[i] = UINT32_C(1) << (32 - i);
+    }
+
+    for (uint32_t i = first + 1; i < cb->entries; i++) {
+        int length = cb->lengths[i];
+
+        if (length == 0) {
+            continue;
+        }
+
+        int z = length;
+        while (z > 0 && !available[z]) {
+            z--;
+        }
+
+        if (z == 0) {
+            perrf("Overspecified Huffman tree\n");
+
+            return 1;
+        }
+
+        uint32_t res = available[z];
+        available[z] = 0;
+        cb->codewords[i] = bit_reverse(res);
+
+        for (int y = length; y > z; y--) {
+            available[y] = res + (UINT32_C(1) << (32 - y));
+        }
+    }
+
+    for (uint32_t i = 0; i < cb->entries; i++) {
+        int length = cb->lengths[i];
+
+        if (length == 0) {
+            continue;
+        }
+
+        if (length <= FAST_BITS) {
+            for (uint32_t j = cb->codewords[i]; j < FAST_SIZE; j += 1U << length) {
+                cb->fast[j] = (int32_t)i;
+            }
+        } else {
+            cb->long_entries[cb->long_count++] = i;
+        }
+    }
+
+    return 0;
+}
+
+static errno_t parse_codebook_header(vorbis_codebook* cb, vorbis_bits* b) {
+    if (bits_read(b, 24) != 0x564342) {
+        perrf("Invalid codebook sync pattern\n");
+
+        return 1;
+    }
+
+    cb->dimensions = bits_read(b, 16);
+    cb->entries = bits_read(b, 24);
+    cb->lengths = calloc(cb->entries ? cb->entries : 1, 1);
+
+    if (bits_read(b, 1)) {
+        // Ordered
+        uint32_t current_entry = 0;
+        uint32_t current_length = bits_read(b, 5) + 1;
+
+        while (current_entry < cb->entries) {
+            uint32_t number = bits_read(b, ilog(cb->entries - current_entry));
+
+            if (current_entry + number > cb->entries || current_length > 32) {
+                perrf("Invalid ordered codebook\n");
+
+                return 1;
+            }
+
+            memset(&cb->lengths[current_entry], current_length, number);
+
+            current_entry += number;
+            current_length++;
+        }
+    } else {
+        bool sparse = bits_read(b, 1) != 0;
+
+        for (uint32_t i = 0; i < cb->entries; i++) {
+            if (!sparse || bits_read(b, 1)) {
+                cb->lengths[i] = (uint8_t)(bits_read(b, 5) + 1);
+            }
+        }
+    }
+
+    uint32_t lookup_type = bits_read(b, 4);
+
+    if (lookup_type == 1 || lookup_type == 2) {
+        float minimum = float32_unpack(bits_read(b, 32));
+        float delta = float32_unpack(bits_read(b, 32));
+        int value_bits = bits_read(b, 4) + 1;
+        bool sequence_p = bits_read(b, 1) != 0;
+
+        if (cb->dimensions == 0) {
+            perrf("Codebook with lookup has no dimensions\n");
+
+            return 1;
+        }
+
+        uint32_t lookup_values = (lookup_type == 1) ? _book_maptype1_quantvals(cb->entries, cb->dimensions) : cb->entries * cb->dimensions;
+        uint32_t* multiplicands = malloc((lookup_values ? lookup_values : 1) * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < lookup_values; i++) {
+            multiplicands[i] = bits_read(b, value_bits);
+        }
+
+        cb->vq = malloc((size_t)cb->entries * cb->dimensions * sizeof(float));
+
+        for (uint32_t e = 0; e < cb->entries; e++) {
+            float last = 0.f;
+            uint32_t index_divisor = 1;
+
+            for (uint32_t j = 0; j < cb->dimensions; j++) {
+                uint32_t offset = (lookup_type == 1) ? (e / index_divisor) % lookup_values : e * cb->dimensions + j;
+                float value = multiplicands[offset] * delta + minimum + last;
+
+                if (sequence_p) {
+                    last = value;
+                }
+
+                cb->vq[e * cb->dimensions + j] = value;
+                index_divisor *= lookup_values;
+            }
+        }
+
+        free(multiplicands);
+    } else if (lookup_type != 0) {
+        perrf("Invalid codebook lookup type %u\n", lookup_type);
+
+        return 1;
+    }
+
+    if (b->eop) {
+        perrf("Setup header truncated in codebook\n");
+
+        return 1;
+    }
+
+    return codebook_build(cb);
+}
+
+static errno_t parse_floor(vorbis_decoder* vd, vorbis_floor* f, vorbis_bits* b) {
+    if (bits_read(b, 16) != 1) {
+        perrf("Only floor type 1 is supported\n");
+
+        return 1;
+    }
+
+    f->partitions = (uint8_t)bits_read(b, 5);
+
+    int maximum_class = -1;
+    for (unsigned int i = 0; i < f->partitions; i++) {
+        f->partition_class[i] = (uint8_t)bits_read(b, 4);
+
+        if (f->partition_class[i] > maximum_class) {
+            maximum_class = f->partition_class[i];
+        }
+    }
+
+    for (int i = 0; i <= maximum_class; i++) {
+        f->class_dimensions[i] = (uint8_t)(bits_read(b, 3) + 1);
+        f->class_subclasses[i] = (uint8_t)bits_read(b, 2);
+        f->class_masterbook[i] = -1;
+
+        if (f->class_subclasses[i] != 0) {
+            f->class_masterbook[i] = (int16_t)bits_read(b, 8);
+
+            if ((unsigned int)f->class_masterbook[i] >= vd->codebook_count) {
+                perrf("Invalid floor1 masterbook\n");
+
+                return 1;
+            }
+        }
+
+        for (int j = 0; j < (1 << f->class_subclasses[i]); j++) {
+            f->subclass_books[i][j] = (int16_t)bits_read(b, 8) - 1;
+
+            if (f->subclass_books[i][j] >= (int)vd->codebook_count) {
+                perrf("Invalid floor1 subclass book\n");
+
+                return 1;
+            }
+        }
+    }
+
+    f->multiplier = (uint8_t)(bits_read(b, 2) + 1);
+
+    int rangebits = bits_read(b, 4);
+
+    f->X[0] = 0;
+    f->X[1] = (uint16_t)(1 << rangebits);
+    f->values = 2;
+
+    for (unsigned int i = 0; i < f->partitions; i++) {
+        unsigned int current_class = f->partition_class[i];
+
+        for (unsigned int j = 0; j < f->class_dimensions[current_class]; j++) {
+            if (f->values >= FLOOR1_MAX_VALUES) {
+                perrf("Too many floor1 values\n");
+
+                return 1;
+            }
+
+            f->X[f->values++] = (uint16_t)bits_read(b, rangebits);
+        }
+    }
+
+    // Sort by X, the list is short so an insertion sort does fine
+    for (uint32_t i = 0; i < f->values; i++) {
+        f->sorted[i] = (uint8_t)i;
+    }
+
+    for (uint32_t i = 1; i < f->values; i++) {
+        uint8_t v = f->sorted[i];
+        uint32_t j = i;
+
+        while (j > 0 && f->X[f->sorted[j - 1]] > f->X[v]) {
+            f->sorted[j] = f->sorted[j - 1];
+            j--;
+        }
+
+        f->sorted[j] = v;
+    }
+
+    for (uint32_t i = 1; i < f->values; i++) {
+        if (f->X[f->sorted[i]] == f->X[f->sorted[i - 1]]) {
+            perrf("Duplicate floor1 X value\n");
+
+            return 1;
+        }
+    }
+
+    for (uint32_t i = 2; i < f->values; i++) {
+        int low = 0;
+        int high = 1;
+
+        for (uint32_t j = 0; j < i; j++) {
+            if (f->X[j] < f->X[i] && f->X[j] > f->X[low]) {
+                low = j;
+            }
+
+            if (f->X[j] > f->X[i] && f->X[j] < f->X[high]) {
+                high = j;
+            }
+        }
+
+        f->low_neighbor[i] = (uint8_t)low;
+        f->high_neighbor[i] = (uint8_t)high;
+    }
+
+    return 0;
+}
+
+static errno_t parse_residue(vorbis_decoder* vd, vorbis_residue* r, vorbis_bits* b) {
+    r->type = (uint16_t)bits_read(b, 16);
+
+    if (r->type > 2) {
+        perrf("Invalid residue type\n");
+
+        return 1;
+    }
+
+    r->begin = bits_read(b, 24);
+    r->end = bits_read(b, 24);
+    r->partition_size = bits_read(b, 24) + 1;
+    r->classifications = (uint8_t)(bits_read(b, 6) + 1);
+    r->classbook = (uint8_t)bits_read(b, 8);
+
+    if (r->classbook >= vd->codebook_count) {
+        perrf("Invalid residue classbook\n");
+
+        return 1;
+    }
+
+    uint8_t cascade[64];
+    for (unsigned int i = 0; i < r->classifications; i++) {
+        uint8_t high_bits = 0;
+        uint8_t low_bits = (uint8_t)bits_read(b, 3);
+
+        if (bits_read(b, 1)) {
+            high_bits = (uint8_t)bits_read(b, 5);
+        }
+
+        cascade[i] = high_bits * 8 + low_bits;
+    }
+
+    for (unsigned int i = 0; i < r->classifications; i++) {
+        for (int j = 0; j < 8; j++) {
+            r->books[i][j] = -1;
+
+            if (cascade[i] & (1 << j)) {
+                r->books[i][j] = (int16_t)bits_read(b, 8);
+
+                if ((unsigned int)r->books[i][j] >= vd->codebook_count) {
+                    perrf("Invalid residue book\n");
+
+                    return 1;
+                }
+
+                if (vd->codebooks[r->books[i][j]].vq == NULL) {
+                    perrf("Residue book without a lookup table\n");
+
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static errno_t parse_mapping(vorbis_decoder* vd, vorbis_mapping* m, vorbis_bits* b) {
+    if (bits_read(b, 16) != 0) {
+        perrf("Invalid mapping type\n");
+
+        return 1;
+    }
+
+    m->submaps = 1;
+    if (bits_read(b, 1)) {
+        m->submaps = (uint8_t)(bits_read(b, 4) + 1);
+    }
+
+    m->coupling_steps = 0;
+    if (bits_read(b, 1)) {
+        m->coupling_steps = (uint16_t)(bits_read(b, 8) + 1);
+
+        for (unsigned int i = 0; i < m->coupling_steps; i++) {
+            m->magnitude[i] = (uint8_t)bits_read(b, ilog(vd->channels - 1));
+            m->angle[i] = (uint8_t)bits_read(b, ilog(vd->channels - 1));
+
+            if (m->magnitude[i] == m->angle[i] || m->magnitude[i] >= vd->channels || m->angle[i] >= vd->channels) {
+                perrf("Invalid coupling\n");
+
+                return 1;
+            }
+        }
+    }
+
+    if (bits_read(b, 2) != 0) {
+        perrf("Mapping reserved field nonzero\n");
+
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < vd->channels; i++) {
+        m->mux[i] = 0;
+
+        if (m->submaps > 1) {
+            m->mux[i] = (uint8_t)bits_read(b, 4);
+
+            if (m->mux[i] >= m->submaps) {
+                perrf("mapping_mux >= submaps\n");
+
+                return 1;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < m->submaps; i++) {
+        bits_read(b, 8);
+
+        m->submap_floor[i] = (uint8_t)bits_read(b, 8);
+        if (m->submap_floor[i] >= vd->floor_count) {
+            perrf("Invalid floor mapping\n");
+
+            return 1;
+        }
+
+        m->submap_residue[i] = (uint8_t)bits_read(b, 8);
+        if (m->submap_residue[i] >= vd->residue_count) {
+            perrf("Invalid residue mapping\n");
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void imdct_init(vorbis_imdct* m, uint32_t n) {
+    uint32_t half = n / 2;
+    uint32_t quarter = n / 4;
+    int bits = ilog(quarter) - 1;
+
+    m->n = n;
+    m->twiddle_re = malloc(quarter * sizeof(float));
+    m->twiddle_im = malloc(quarter * sizeof(float));
+    m->fft_re = malloc(quarter * sizeof(float));
+    m->fft_im = malloc(quarter * sizeof(float));
+    m->bitrev = malloc(quarter * sizeof(uint32_t));
+    m->z_re = malloc(quarter * sizeof(float));
+    m->z_im = malloc(quarter * sizeof(float));
+    m->u = malloc(half * sizeof(float));
+
+    for (uint32_t k = 0; k < quarter; k++) {
+        double angle = -M_PI * (k + 0.125) / half;
+
+        m->twiddle_re[k] = (float)cos(angle);
+        m->twiddle_im[k] = (float)sin(angle);
+        m->bitrev[k] = bit_reverse(k) >> (32 - bits);
+    }
+
+    for (uint32_t h = 1; h < quarter; h <<= 1) {
+        for (uint32_t j = 0; j < h; j++) {
+            double angle = -M_PI * j / h;
+
+            m->fft_re[h - 1 + j] = (float)cos(angle);
+            m->fft_im[h - 1 + j] = (float)sin(angle);
+        }
+    }
+}
+
+static void imdct_free(vorbis_imdct* m) {
+    free(m->twiddle_re);
+    free(m->twiddle_im);
+    free(m->fft_re);
+    free(m->fft_im);
+    free(m->bitrev);
+    free(m->z_re);
+    free(m->z_im);
+    free(m->u);
+}
+
+// Radix-2 decimation in time FFT over the bit-reversed z_re/z_im
+static void fft(vorbis_imdct* m) {
+    uint32_t length = m->n / 4;
+    float* re = m->z_re;
+    float* im = m->z_im;
+
+    for (uint32_t h = 1; h < length; h <<= 1) {
+        const float* wr = &m->fft_re[h - 1];
+        const float* wi = &m->fft_im[h - 1];
+
+        for (uint32_t g = 0; g < length; g += 2 * h) {
+            uint32_t j = 0;
+
+#ifdef NME_SSE2
+            for (; j + 4 <= h; j += 4) {
+                __m128 w_re = _mm_loadu_ps(&wr[j]);
+                __m128 w_im = _mm_loadu_ps(&wi[j]);
+                __m128 a_re = _mm_loadu_ps(&re[g + j]);
+                __m128 a_im = _mm_loadu_ps(&im[g + j]);
+                __m128 c_re = _mm_loadu_ps(&re[g + j + h]);
+                __m128 c_im = _mm_loadu_ps(&im[g + j + h]);
+                __m128 b_re = _mm_sub_ps(_mm_mul_ps(c_re, w_re), _mm_mul_ps(c_im, w_im));
+                __m128 b_im = _mm_add_ps(_mm_mul_ps(c_re, w_im), _mm_mul_ps(c_im, w_re));
+
+                _mm_storeu_ps(&re[g + j], _mm_add_ps(a_re, b_re));
+                _mm_storeu_ps(&im[g + j], _mm_add_ps(a_im, b_im));
+                _mm_storeu_ps(&re[g + j + h], _mm_sub_ps(a_re, b_re));
+                _mm_storeu_ps(&im[g + j + h], _mm_sub_ps(a_im, b_im));
+            }
+#endif
+
+            for (; j < h; j++) {
+                float b_re = re[g + j + h] * wr[j] - im[g + j + h] * wi[j];
+                float b_im = re[g + j + h] * wi[j] + im[g + j + h] * wr[j];
+                float a_re = re[g + j];
+                float a_im = im[g + j];
+
+                re[g + j] = a_re + b_re;
+                im[g + j] = a_im + b_im;
+                re[g + j + h] = a_re - b_re;
+                im[g + j + h] = a_im - b_im;
+            }
+        }
+    }
+}
+
+// Computes n output samples from n/2 coefficients: a DCT-IV through an n/4 point FFT, unfolded
+static void imdct(vorbis_imdct* m, const float* in, float* out) {
+    uint32_t n = m->n;
+    uint32_t half = n / 2;
+    uint32_t quarter = n / 4;
+    float* re = m->z_re;
+    float* im = m->z_im;
+    float* u = m->u;
+
+    for (uint32_t k = 0; k < quarter; k++) {
+        float x_re = in[2 * k];
+        float x_im = in[half - 1 - 2 * k];
+        uint32_t r = m->bitrev[k];
+
+        re[r] = x_re * m->twiddle_re[k] - x_im * m->twiddle_im[k];
+        im[r] = x_re * m->twiddle_im[k] + x_im * m->twiddle_re[k];
+    }
+
+    fft(m);
+
+    uint32_t k = 0;
+
+#ifdef NME_SSE2
+    for (; k + 4 <= quarter; k += 4) {
+        __m128 t_re = _mm_loadu_ps(&m->twiddle_re[k]);
+        __m128 t_im = _mm_loadu_ps(&m->twiddle_im[k]);
+        __m128 z_re = _mm_loadu_ps(&re[k]);
+        __m128 z_im = _mm_loadu_ps(&im[k]);
+
+        _mm_storeu_ps(&re[k], _mm_sub_ps(_mm_mul_ps(z_re, t_re), _mm_mul_ps(z_im, t_im)));
+        _mm_storeu_ps(&im[k], _mm_add_ps(_mm_mul_ps(z_re, t_im), _mm_mul_ps(z_im, t_re)));
+    }
+#endif
+
+    for (; k < quarter; k++) {
+        float s_re = re[k] * m->twiddle_re[k] - im[k] * m->twiddle_im[k];
+        float s_im = re[k] * m->twiddle_im[k] + im[k] * m->twiddle_re[k];
+
+        re[k] = s_re;
+        im[k] = s_im;
+    }
+
+    for (k = 0; k < quarter; k++) {
+        u[2 * k] = re[k];
+        u[half - 1 - 2 * k] = -im[k];
+    }
+
+    for (k = 0; k < quarter; k++) {
+        out[k] = u[k + quarter];
+    }
+
+    for (; k < 3 * quarter; k++) {
+        out[k] = -u[3 * quarter - 1 - k];
+    }
+
+    for (; k < n; k++) {
+        out[k] = -u[k - 3 * quarter];
+    }
+}
+
+// dst[i] += src[i]
+static void vec_add(float* dst, const float* src, uint32_t n) {
+    uint32_t i = 0;
+
+#ifdef NME_SSE2
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(&dst[i], _mm_add_ps(_mm_loadu_ps(&dst[i]), _mm_loadu_ps(&src[i])));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] += src[i];
+    }
+}
+
+// dst[i] *= src[i]
+static void vec_mul(float* dst, const float* src, uint32_t n) {
+    uint32_t i = 0;
+
+#ifdef NME_SSE2
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_loadu_ps(&dst[i]), _mm_loadu_ps(&src[i])));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] *= src[i];
+    }
+}
+
+// Square polar to cartesian channel coupling
+static void inverse_coupling(float* magnitude, float* angle, uint32_t n) {
+    uint32_t i = 0;
+
+#ifdef NME_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.f);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 m = _mm_loadu_ps(&magnitude[i]);
+        __m128 a = _mm_loadu_ps(&angle[i]);
+        __m128 m_positive = _mm_cmpgt_ps(m, zero);
+        __m128 a_positive = _mm_cmpgt_ps(a, zero);
+
+        // t = m > 0 ? a : -a
+        __m128 t = _mm_xor_ps(a, _mm_andnot_ps(m_positive, sign));
+        __m128 new_m = _mm_or_ps(_mm_and_ps(a_positive, m), _mm_andnot_ps(a_positive, _mm_add_ps(m, t)));
+        __m128 new_a = _mm_or_ps(_mm_and_ps(a_positive, _mm_sub_ps(m, t)), _mm_andnot_ps(a_positive, m));
+
+        _mm_storeu_ps(&magnitude[i], new_m);
+        _mm_storeu_ps(&angle[i], new_a);
+    }
+#endif
+
+    for (; i < n; i++) {
+        float m = magnitude[i];
+        float a = angle[i];
+        float t = (m > 0.f) ? a : -a;
+
+        if (a > 0.f) {
+            angle[i] = m - t;
+        } else {
+            magnitude[i] = m + t;
+            angle[i] = m;
+        }
+    }
+}
+
+static bool floor1_decode(vorbis_decoder* vd, vorbis_bits* b, const vorbis_floor* f, int32_t* y) {
+    static const int ranges[4] = { 256, 128, 86, 64 };
+
+    if (bits_read(b, 1) == 0) {
+        return false;
+    }
+
+    int range_bits = ilog(ranges[f->multiplier - 1] - 1);
+
+    y[0] = bits_read(b, range_bits);
+    y[1] = bits_read(b, range_bits);
+
+    uint32_t offset = 2;
+    for (unsigned int i = 0; i < f->partitions; i++) {
+        unsigned int current_class = f->partition_class[i];
+        unsigned int cdim = f->class_dimensions[current_class];
+        unsigned int cbits = f->class_subclasses[current_class];
+        unsigned int csub = (1U << cbits) - 1;
+        unsigned int cval = 0;
+
+        if (cbits > 0) {
+            int32_t entry = codebook_decode(&vd->codebooks[f->class_masterbook[current_class]], b);
+
+            if (entry < 0) {
+                return false;
+            }
+
+            cval = (unsigned int)entry;
+        }
+
+        for (unsigned int j = 0; j < cdim; j++) {
+            int book = f->subclass_books[current_class][cval & csub];
+            cval >>= cbits;
+
+            if (book >= 0) {
+                int32_t entry = codebook_decode(&vd->codebooks[book], b);
+
+                if (entry < 0) {
+                    return false;
+                }
+
+                y[offset + j] = entry;
+            } else {
+                y[offset + j] = 0;
+            }
+        }
+
+        offset += cdim;
+    }
+
+    return !b->eop;
+}
+
+static int render_point(int x0, int y0, int x1, int y1, int x) {
+    int dy = y1 - y0;
+    int adx = x1 - x0;
+    int off = abs(dy) * (x - x0) / adx;
+
+    return (dy < 0) ? y0 - off : y0 + off;
+}
+
+static float inverse_db(int y) {
+    return floor1_inverse_db[y < 0 ? 0 : (y > 255 ? 255 : y)];
+}
+
+static void render_line(int x0, int y0, int x1, int y1, float* v, int n) {
+    int dy = y1 - y0;
+    int adx = x1 - x0;
+
+    if (adx <= 0 || x0 >= n) {
+        return;
+    }
+
+    int base = dy / adx;
+    int sy = (dy < 0) ? base - 1 : base + 1;
+    int ady = abs(dy) - abs(base) * adx;
+    int y = y0;
+    int err = 0;
+
+    if (x1 > n) {
+        x1 = n;
+    }
+
+    v[x0] = inverse_db(y);
+
+    for (int x = x0 + 1; x < x1; x++) {
+        err += ady;
+
+        if (err >= adx) {
+            err -= adx;
+            y += sy;
+        } else {
+            y += base;
+        }
+
+        v[x] = inverse_db(y);
+    }
+}
+
+static void floor1_render(const vorbis_floor* f, const int32_t* y, float* curve, uint32_t n) {
+    static const int ranges[4] = { 256, 128, 86, 64 };
+    int range = ranges[f->multiplier - 1];
+    int32_t final_y[FLOOR1_MAX_VALUES];
+    bool step2[FLOOR1_MAX_VALUES];
+
+    step2[0] = true;
+    step2[1] = true;
+    final_y[0] = y[0];
+    final_y[1] = y[1];
+
+    for (uint32_t i = 2; i < f->values; i++) {
+        int low = f->low_neighbor[i];
+        int high = f->high_neighbor[i];
+        int predicted = render_point(f->X[low], final_y[low], f->X[high], final_y[high], f->X[i]);
+        int val = y[i];
+        int highroom = range - predicted;
+        int lowroom = predicted;
+        int room = ((highroom < lowroom) ? highroom : lowroom) * 2;
+
+        if (val != 0) {
+            step2[low] = true;
+            step2[high] = true;
+            step2[i] = true;
+
+            if (val >= room) {
+                if (highroom > lowroom) {
+                    final_y[i] = val - lowroom + predicted;
+                } else {
+                    final_y[i] = predicted - val + highroom - 1;
+                }
+            } else if (val & 1) {
+                final_y[i] = predicted - (val + 1) / 2;
+            } else {
+                final_y[i] = predicted + val / 2;
+            }
+        } else {
+            step2[i] = false;
+            final_y[i] = predicted;
+        }
+    }
+
+    int lx = 0;
+    int ly = final_y[0] * f->multiplier;
+
+    for (uint32_t k = 1; k < f->values; k++) {
+        int i = f->sorted[k];
+
+        if (step2[i]) {
+            int hx = f->X[i];
+            int hy = final_y[i] * f->multiplier;
+
+            render_line(lx, ly, hx, hy, curve, (int)n);
+
+            lx = hx;
+            ly = hy;
+        }
+    }
+
+    if (lx < (int)n) {
+        render_line(lx, ly, (int)n, ly, curve, (int)n);
+    }
+}
+
+// Decodes a single partition into v, returns false on end of packet
+static bool residue_partition(const vorbis_codebook* cb, vorbis_bits* b, float* v, uint32_t size, int type) {
+    uint32_t dim = cb->dimensions;
+
+    if (type == 0) {
+        uint32_t step = size / dim;
+
+        for (uint32_t i = 0; i < step; i++) {
+            int32_t entry = codebook_decode(cb, b);
+
+            if (entry < 0) {
+                return false;
+            }
+
+            const float* vq = &cb->vq[entry * dim];
+            for (uint32_t k = 0; k < dim; k++) {
+                v[i + k * step] += vq[k];
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < size; i += dim) {
+            int32_t entry = codebook_decode(cb, b);
+
+            if (entry < 0) {
+                return false;
+            }
+
+            vec_add(&v[i], &cb->vq[entry * dim], (size - i < dim) ? size - i : dim);
+        }
+    }
+
+    return true;
+}
+
+static void residue_decode_vectors(vorbis_decoder* vd, vorbis_bits* b, const vorbis_residue* r, float** v, const bool* skip, int ch, uint32_t actual_size, int type) {
+    const vorbis_codebook* classbook = &vd->codebooks[r->classbook];
+    uint32_t classwords = classbook->dimensions;
+    uint32_t begin = (r->begin < actual_size) ? r->begin : actual_size;
+    uint32_t end = (r->end < actual_size) ? r->end : actual_size;
+
+    if (end <= begin || classwords == 0) {
+        return;
+    }
+
+    uint32_t partitions = (end - begin) / r->partition_size;
+    uint32_t stride = partitions + classwords;
+
+    if (stride * ch > vd->classifications_size) {
+        vd->classifications_size = stride * ch;
+        vd->classifications = realloc(vd->classifications, vd->classifications_size);
+    }
+
+    uint8_t* classifications = vd->classifications;
+
+    for (int pass = 0; pass < 8; pass++) {
+        uint32_t partition = 0;
+
+        while (partition < partitions) {
+            if (pass == 0) {
+                for (int j = 0; j < ch; j++) {
+                    if (skip[j]) {
+                        continue;
+                    }
+
+                    int32_t temp = codebook_decode(classbook, b);
+
+                    if (temp < 0) {
+                        return;
+                    }
+
+                    for (uint32_t i = classwords; i-- > 0;) {
+                        classifications[j * stride + partition + i] = (uint8_t)(temp % r->classifications);
+                        temp /= r->classifications;
+                    }
+                }
+            }
+
+            for (uint32_t i = 0; i < classwords && partition < partitions; i++, partition++) {
+                for (int j = 0; j < ch; j++) {
+                    if (skip[j]) {
+                        continue;
+                    }
+
+                    int book = r->books[classifications[j * stride + partition]][pass];
+
+                    if (book < 0) {
+                        continue;
+                    }
+
+                    float* target = &v[j][begin + partition * r->partition_size];
+
+                    if (!residue_partition(&vd->codebooks[book], b, target, r->partition_size, type)) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void residue_decode(vorbis_decoder* vd, vorbis_bits* b, const vorbis_residue* r, float** v, const bool* skip, int ch, uint32_t n) {
+    if (r->type != 2) {
+        residue_decode_vectors(vd, b, r, v, skip, ch, n, r->type);
+
+        return;
+    }
+
+    // Type 2 interleaves all channels into a single vector
+    bool any = false;
+    for (int j = 0; j < ch; j++) {
+        any |= !skip[j];
+    }
+
+    if (!any) {
+        return;
+    }
+
+    bool decode = false;
+    float* interleaved = vd->interleaved;
+
+    memset(interleaved, 0, (size_t)n * ch * sizeof(float));
+
+    residue_decode_vectors(vd, b, r, &interleaved, &decode, 1, n * ch, 1);
+
+    if (ch == 1) {
+        memcpy(v[0], interleaved, n * sizeof(float));
+
+        return;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        for (int j = 0; j < ch; j++) {
+            v[j][i] = interleaved[i * ch + j];
+        }
+    }
+}
+
+static errno_t parse_identification(vorbis_decoder* vd, vorbis_bits* b) {
+    if (bits_read(b, 32) != 0) {
+        perrf("Unsupported Vorbis version\n");
+
+        return 1;
+    }
+
+    vd->channels = (uint16_t)bits_read(b, 8);
+    vd->sample_rate = bits_read(b, 32);
+
+    // Bitrates
+    bits_read(b, 32);
+    bits_read(b, 32);
+    bits_read(b, 32);
+
+    int blocksize_0_pow = bits_read(b, 4);
+    int blocksize_1_pow = bits_read(b, 4);
+
+    if (vd->channels == 0 || vd->sample_rate == 0) {
+        perrf("Invalid channel count or sample rate\n");
+
+        return 1;
+    }
+
+    if (blocksize_0_pow < 6 || blocksize_1_pow > 13 || blocksize_0_pow > blocksize_1_pow) {
+        perrf("Invalid block sizes %i, %i\n", blocksize_0_pow, blocksize_1_pow);
+
+        return 1;
+    }
+
+    vd->blocksize[0] = 1U << blocksize_0_pow;
+    vd->blocksize[1] = 1U << blocksize_1_pow;
+
+    if (bits_read(b, 1) != 1 || b->eop) {
+        perrf("Identification header framing error\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static errno_t parse_setup(vorbis_decoder* vd, vorbis_bits* b) {
+    vd->codebook_count = bits_read(b, 8) + 1;
+    vd->codebooks = calloc(vd->codebook_count, sizeof(vorbis_codebook));
+
+    for (unsigned int i = 0; i < vd->codebook_count; i++) {
+        if (parse_codebook_header(&vd->codebooks[i], b) != 0) {
+            return 1;
+        }
+    }
+
+    unsigned int time_count = bits_read(b, 6) + 1;
+    for (unsigned int i = 0; i < time_count; i++) {
+        if (bits_read(b, 16) != 0) {
+            perrf("Invalid time domain transform\n");
+
+            return 1;
+        }
+    }
+
+    vd->floor_count = bits_read(b, 6) + 1;
+    vd->floors = calloc(vd->floor_count, sizeof(vorbis_floor));
+
+    for (unsigned int i = 0; i < vd->floor_count; i++) {
+        if (parse_floor(vd, &vd->floors[i], b) != 0) {
+            return 1;
+        }
+    }
+
+    vd->residue_count = bits_read(b, 6) + 1;
+    vd->residues = calloc(vd->residue_count, sizeof(vorbis_residue));
+
+    for (unsigned int i = 0; i < vd->residue_count; i++) {
+        if (parse_residue(vd, &vd->residues[i], b) != 0) {
+            return 1;
+        }
+    }
+
+    vd->mapping_count = bits_read(b, 6) + 1;
+    vd->mappings = calloc(vd->mapping_count, sizeof(vorbis_mapping));
+
+    for (unsigned int i = 0; i < vd->mapping_count; i++) {
+        if (parse_mapping(vd, &vd->mappings[i], b) != 0) {
+            return 1;
+        }
+    }
+
+    vd->mode_count = bits_read(b, 6) + 1;
+    vd->mode_bits = ilog(vd->mode_count - 1);
+
+    for (unsigned int i = 0; i < vd->mode_count; i++) {
+        vd->modes[i].blockflag = bits_read(b, 1) != 0;
+
+        // Window and transform type, both have to be 0
+        if (bits_read(b, 16) != 0 || bits_read(b, 16) != 0) {
+            perrf("Invalid mode window or transform type\n");
+
+            return 1;
+        }
+
+        vd->modes[i].mapping = (uint8_t)bits_read(b, 8);
+        if (vd->modes[i].mapping >= vd->mapping_count) {
+            perrf("Invalid mode mapping\n");
+
+            return 1;
+        }
+    }
+
+    if (bits_read(b, 1) != 1 || b->eop) {
+        perrf("Setup header framing error\n");
+
+        return 1;
+    }
+
+    // Allocate the transforms and buffers now that the sizes are known
+    uint32_t half = vd->blocksize[1] / 2;
+    uint16_t ch = vd->channels;
+
+    for (int i = 0; i < 2; i++) {
+        uint32_t slope = vd->blocksize[i] / 2;
+
+        imdct_init(&vd->imdct[i], vd->blocksize[i]);
+
+        vd->window_rise[i] = malloc(slope * sizeof(float));
+        vd->window_fall[i] = malloc(slope * sizeof(float));
+
+        for (uint32_t j = 0; j < slope; j++) {
+            double s = sin((j + 0.5) / slope * M_PI / 2);
+
+            vd->window_rise[i][j] = (float)sin(M_PI / 2 * s * s);
+        }
+
+        for (uint32_t j = 0; j < slope; j++) {
+            vd->window_fall[i][j] = vd->window_rise[i][slope - 1 - j];
+        }
+    }
+
+    vd->residue = malloc(ch * sizeof(float*));
+    vd->prev = malloc(ch * sizeof(float*));
+    vd->out = malloc(ch * sizeof(float*));
+    vd->floor_y = malloc(ch * sizeof(int32_t*));
+
+    for (uint16_t i = 0; i < ch; i++) {
+        vd->residue[i] = malloc(half * sizeof(float));
+        vd->prev[i] = calloc(half, sizeof(float));
+        vd->out[i] = malloc(half * sizeof(float));
+        vd->floor_y[i] = malloc(FLOOR1_MAX_VALUES * sizeof(int32_t));
+    }
+
+    vd->floor_unused = malloc(ch * sizeof(bool));
+    vd->no_residue = malloc(ch * sizeof(bool));
+    vd->block = malloc(vd->blocksize[1] * sizeof(float));
+    vd->curve = malloc(half * sizeof(float));
+    vd->interleaved = malloc((size_t)half * ch * sizeof(float));
+    vd->vectors = malloc(ch * sizeof(float*));
+    vd->skip = malloc(ch * sizeof(bool));
+
+    return 0;
+}
+
+static errno_t decode_header(vorbis_decoder* vd, vorbis_bits* b) {
+    static const int types[3] = { 1, 3, 5 };
+    const char vorbis[6] = { 'v', 'o', 'r', 'b', 'i', 's' };
+
+    if ((int)bits_read(b, 8) != types[vd->headers]) {
+        perrf("Expected Vorbis header packet %i\n", types[vd->headers]);
+
+        return 1;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        if (bits_read(b, 8) != (uint8_t)vorbis[i]) {
+            perrf("Missing Vorbis header signature\n");
+
+            return 1;
+        }
+    }
+
+    errno_t err = 0;
+
+    switch (vd->headers) {
+        case 0:
+            err = parse_identification(vd, b);
+            break;
+        case 1:
+            // Nothing in the comment header affects decoding
+            break;
+        case 2:
+            err = parse_setup(vd, b);
+            break;
+    }
+
+    if (err == 0) {
+        vd->headers++;
+    }
+
+    return err;
+}
+
+static errno_t decode_audio(vorbis_decoder* vd, vorbis_bits* b) {
+    vd->pcm_samples = 0;
+
+    // Empty packets carry no audio
+    if (b->size == 0) {
+        return 0;
+    }
+
+    if (bits_read(b, 1) != 0) {
+        perrf("Not an audio packet\n");
+
+        return 1;
+    }
+
+    uint32_t mode_number = bits_read(b, vd->mode_bits);
+    if (mode_number >= vd->mode_count) {
+        perrf("Invalid mode number %u\n", mode_number);
+
+        return 1;
+    }
+
+    const vorbis_mode* mode = &vd->modes[mode_number];
+    const vorbis_mapping* mapping = &vd->mappings[mode->mapping];
+    uint32_t n = vd->blocksize[mode->blockflag];
+    uint32_t half = n / 2;
+    bool prev_window = true;
+    bool next_window = true;
+
+    if (mode->blockflag) {
+        prev_window = bits_read(b, 1) != 0;
+        next_window = bits_read(b, 1) != 0;
+    }
+
+    uint16_t ch = vd->channels;
+
+    // Floors
+    for (uint16_t i = 0; i < ch; i++) {
+        const vorbis_floor* f = &vd->floors[mapping->submap_floor[mapping->mux[i]]];
+
+        vd->floor_unused[i] = !floor1_decode(vd, b, f, vd->floor_y[i]);
+        vd->no_residue[i] = vd->floor_unused[i];
+
+        memset(vd->residue[i], 0, half * sizeof(float));
+    }
+
+    // Coupled channels are decoded together if either of them is used
+    for (unsigned int i = 0; i < mapping->coupling_steps; i++) {
+        if (!vd->no_residue[mapping->magnitude[i]] || !vd->no_residue[mapping->angle[i]]) {
+            vd->no_residue[mapping->magnitude[i]] = false;
+            vd->no_residue[mapping->angle[i]] = false;
+        }
+    }
+
+    // Residues
+    for (unsigned int s = 0; s < mapping->submaps; s++) {
+        int count = 0;
+
+        for (uint16_t i = 0; i < ch; i++) {
+            if (mapping->mux[i] == s) {
+                vd->vectors[count] = vd->residue[i];
+                vd->skip[count] = vd->no_residue[i];
+                count++;
+            }
+        }
+
+        residue_decode(vd, b, &vd->residues[mapping->submap_residue[s]], vd->vectors, vd->skip, count, half);
+    }
+
+    for (unsigned int i = mapping->coupling_steps; i-- > 0;) {
+        inverse_coupling(vd->residue[mapping->magnitude[i]], vd->residue[mapping->angle[i]], half);
+    }
+
+    uint32_t left_start = 0;
+    uint32_t left_n = half;
+    uint32_t right_start = half;
+    uint32_t right_n = half;
+    int left_slope = mode->blockflag;
+    int right_slope = mode->blockflag;
+
+    if (mode->blockflag && !prev_window) {
+        left_start = n / 4 - vd->blocksize[0] / 4;
+        left_n = vd->blocksize[0] / 2;
+        left_slope = 0;
+    }
+
+    if (mode->blockflag && !next_window) {
+        right_start = n * 3 / 4 - vd->blocksize[0] / 4;
+        right_n = vd->blocksize[0] / 2;
+        right_slope = 0;
+    }
+
+    uint32_t samples = vd->prev_n / 4 + n / 4;
+    int offset = (int)(n / 4) - (int)(vd->prev_n / 4);
+    uint32_t prev_half = vd->prev_n / 2;
+
+    for (uint16_t i = 0; i < ch; i++) {
+        float* block = vd->block;
+
+        // Floor curve times residue, or silence if the floor is unused
+        if (vd->floor_unused[i]) {
+            memset(block, 0, n * sizeof(float));
+        } else {
+            floor1_render(&vd->floors[mapping->submap_floor[mapping->mux[i]]], vd->floor_y[i], vd->curve, half);
+            vec_mul(vd->residue[i], vd->curve, half);
+
+            imdct(&vd->imdct[mode->blockflag], vd->residue[i], block);
+
+            memset(block, 0, left_start * sizeof(float));
+            vec_mul(&block[left_start], vd->window_rise[left_slope], left_n);
+            vec_mul(&block[right_start], vd->window_fall[right_slope], right_n);
+            memset(&block[right_start + right_n], 0, (n - right_start - right_n) * sizeof(float));
+        }
+
+        // Overlap-add the right half of the previous block with the left half of this one
+        if (vd->prev_n != 0) {
+            float* out = vd->out[i];
+            uint32_t copied = (samples < prev_half) ? samples : prev_half;
+            uint32_t start = (offset < 0) ? (uint32_t)-offset : 0;
+
+            memcpy(out, vd->prev[i], copied * sizeof(float));
+            memset(&out[copied], 0, (samples - copied) * sizeof(float));
+
+            vec_add(&out[start], &block[(int)start + offset], samples - start);
+        }
+
+        memcpy(vd->prev[i], &block[half], half * sizeof(float));
+    }
+
+    vd->pcm_samples = (vd->prev_n != 0) ? samples : 0;
+    vd->prev_n = n;
+
+    return 0;
+}
+
+vorbis_decoder* vorbis_decoder_new(void) {
+    return calloc(1, sizeof(vorbis_decoder));
+}
+
+void vorbis_decoder_free(vorbis_decoder* vd) {
+    if (!vd) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < vd->codebook_count && vd->codebooks; i++) {
+        free(vd->codebooks[i].lengths);
+        free(vd->codebooks[i].codewords);
+        free(vd->codebooks[i].long_entries);
+        free(vd->codebooks[i].vq);
+    }
+
+    free(vd->codebooks);
+    free(vd->floors);
+    free(vd->residues);
+    free(vd->mappings);
+
+    if (vd->residue) {
+        for (int i = 0; i < 2; i++) {
+            imdct_free(&vd->imdct[i]);
+            free(vd->window_rise[i]);
+            free(vd->window_fall[i]);
+        }
+
+        for (uint16_t i = 0; i < vd->channels; i++) {
+            free(vd->residue[i]);
+            free(vd->prev[i]);
+            free(vd->out[i]);
+            free(vd->floor_y[i]);
+        }
+    }
+
+    free(vd->residue);
+    free(vd->prev);
+    free(vd->out);
+    free(vd->floor_y);
+    free(vd->floor_unused);
+    free(vd->no_residue);
+    free(vd->block);
+    free(vd->curve);
+    free(vd->interleaved);
+    free(vd->vectors);
+    free(vd->skip);
+    free(vd->classifications);
+    free(vd);
+}
+
+errno_t vorbis_decode_packet(vorbis_decoder* vd, const uint8_t* data, uint32_t size) {
+    vorbis_bits b;
+    bits_init(&b, data, size);
+
+    if (vd->headers < 3) {
+        return decode_header(vd, &b);
+    }
+
+    return decode_audio(vd, &b);
+}
+
+uint32_t vorbis_decoder_pcm(vorbis_decoder* vd, float*** pcm) {
+    *pcm = vd->out;
+
+    return vd->pcm_samples;
+}
+
+uint16_t vorbis_decoder_channels(vorbis_decoder* vd) {
+    return vd->channels;
+}
+
+uint32_t vorbis_decoder_sample_rate(vorbis_decoder* vd) {
+    return vd->sample_rate;
+}
+
+void vorbis_decoder_reset(vorbis_decoder* vd) {
+    vd->prev_n = 0;
+    vd->pcm_samples = 0;
+}
+
+bool vorbis_decoder_ready(vorbis_decoder* vd) {
+    return vd->headers == 3;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "defs.h"
+
+// A Vorbis I decoder for the packets rebuilt by create_ogg
+typedef struct vorbis_decoder vorbis_decoder;
+
+// Creates a decoder, the first three packets passed to it must be the identification, comment and setup headers
+vorbis_decoder* vorbis_decoder_new(void);
+
+// Frees the decoder and all of its tables
+void vorbis_decoder_free(vorbis_decoder* vd);
+
+// Decodes a single header or audio packet
+errno_t vorbis_decode_packet(vorbis_decoder* vd, const uint8_t* data, uint32_t size);
+
+// Returns the number of samples produced by the last audio packet, pcm points to one planar buffer per channel
+uint32_t vorbis_decoder_pcm(vorbis_decoder* vd, float*** pcm);
+
+// Returns the number of channels, valid once the identification header was decoded
+uint16_t vorbis_decoder_channels(vorbis_decoder* vd);
+
+// Returns the sample rate, valid once the identification header was decoded
+uint32_t vorbis_decoder_sample_rate(vorbis_decoder* vd);
+
+// Forgets the previous block, the next audio packet produces no samples and only primes the overlap
+void vorbis_decoder_reset(vorbis_decoder* vd);
+
+// Returns true once all three header packets were decoded
+bool vorbis_decoder_ready(vorbis_decoder* vd);
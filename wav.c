@@ -0,0 +1,327 @@
+#include "wav.h"
+#include "bitmanip.h"
+
+#include <malloc.h>
+
+// KSDATAFORMAT_SUBTYPE_PCM and KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, minus the first two bytes
+static const uint8_t subformat_guid[14] = {
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
+
+static void write_16(unsigned char b[2], uint16_t v) {
+    b[0] = v & 0xFF;
+    b[1] = v >> 8;
+}
+
+// Default speaker positions for the channel counts Vorbis defines
+static uint32_t channel_mask(uint16_t channels) {
+    switch (channels) {
+        case 1:  return 0x4;
+        case 2:  return 0x3;
+        case 3:  return 0x7;
+        case 4:  return 0x33;
+        case 5:  return 0x37;
+        case 6:  return 0x3F;
+        case 7:  return 0x70F;
+        case 8:  return 0x63F;
+        default: return 0;
+    }
+}
+
+// Sets up the writer for either target, out_buffer wins if both are set
+static errno_t open_writer(wav_writer* w, FILE* out, membuf* out_buffer, pcm_format format, uint16_t channels, uint32_t sample_rate, uint64_t frames) {
+    uint32_t bytes = pcm_format_bytes(format);
+
+    if (bytes == 0 || channels == 0) {
+        perrf("Unsupported WAV format %i with %i channels\n", format, channels);
+
+        return 1;
+    }
+
+    w->out = out;
+    w->out_buffer = out_buffer;
+    w->format = format;
+    w->channels = channels;
+    w->sample_rate = sample_rate;
+    w->frames = 0;
+    w->max_frames = frames;
+    w->block = _aligned_malloc(WAV_BLOCK_SIZE, WAV_BLOCK_ALIGN);
+    w->block_fill = 0;
+    w->scratch = NULL;
+    w->scratch_size = 0;
+    w->buffer = NULL;
+    w->buffer_size = 0;
+
+    // Dithering is deterministic so repeated conversions give identical files
+    pcm_dither_init(&w->dither, sample_rate ^ channels, true);
+
+    // Everything is written in whole blocks, the CRT buffer would only add a copy
+    // A buffer gets room for the whole file up front, so the blocks are never moved once they're in it
+    if (!out_buffer) {
+        setvbuf(out, NULL, _IONBF, 0);
+    } else {
+        membuf_reserve(out_buffer, out_buffer->pos + WAV_HEADER_MAX + frames * channels * bytes);
+    }
+
+    bool is_float = format == PCM_FMT_F32 || format == PCM_FMT_F64;
+    bool extensible = channels > 2 || bytes > 2;
+    uint16_t tag = extensible ? WAVE_FORMAT_EXTENSIBLE : (is_float ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
+    uint32_t fmt_size = extensible ? 40 : (is_float ? 18 : 16);
+    unsigned char* header = w->block;
+    unsigned int pos = 0;
+
+    memset(header, 0, WAV_HEADER_MAX);
+
+    memcpy(&header[pos], "RIFF", 4);
+    pos += 8;
+    memcpy(&header[pos], "WAVE", 4);
+    pos += 4;
+
+    memcpy(&header[pos], "fmt ", 4);
+    write_32(&header[pos + 4], fmt_size);
+    pos += 8;
+
+    write_16(&header[pos], tag);
+    write_16(&header[pos + 2], channels);
+    write_32(&header[pos + 4], sample_rate);
+    write_32(&header[pos + 8], sample_rate * channels * bytes);
+    write_16(&header[pos + 12], (uint16_t)(channels * bytes));
+    write_16(&header[pos + 14], (uint16_t)(bytes * 8));
+    pos += 16;
+
+    if (extensible) {
+        write_16(&header[pos], 22);
+        write_16(&header[pos + 2], (uint16_t)(bytes * 8));
+        write_32(&header[pos + 4], channel_mask(channels));
+        write_16(&header[pos + 8], is_float ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
+        memcpy(&header[pos + 10], subformat_guid, sizeof subformat_guid);
+        pos += 24;
+    } else if (is_float) {
+        write_16(&header[pos], 0);
+        pos += 2;
+    }
+
+    memcpy(&header[pos], "data", 4);
+    pos += 8;
+
+    w->header_size = pos;
+    w->block_fill = pos;
+
+    // With a known length the header is final right away, which also allows writing to pipes
+    uint64_t data_size = frames * channels * bytes;
+
+    if (data_size + pos - 8 <= UINT32_MAX) {
+        write_32(&header[4], (uint32_t)(pos - 8 + data_size + (data_size & 1)));
+        write_32(&header[pos - 4], (uint32_t)data_size);
+    }
+
+    return 0;
+}
+
+errno_t wav_open(wav_writer* w, FILE* out, pcm_format format, uint16_t channels, uint32_t sample_rate, uint64_t frames) {
+    return open_writer(w, out, NULL, format, channels, sample_rate, frames);
+}
+
+errno_t wav_open_buffer(wav_writer* w, membuf* out, pcm_format format, uint16_t channels, uint32_t sample_rate, uint64_t frames) {
+    return open_writer(w, NULL, out, format, channels, sample_rate, frames);
+}
+
+static errno_t flush_block(wav_writer* w) {
+    if (w->out_buffer) {
+        membuf_write(w->out_buffer, w->block, w->block_fill);
+    } else if (w->block_fill != 0 && fwrite(w->block, w->block_fill, 1, w->out) != 1) {
+        perrf("Could not write WAV data\n");
+
+        return 1;
+    }
+
+    w->block_fill = 0;
+
+    return 0;
+}
+
+static errno_t append_block(wav_writer* w, const uint8_t* data, size_t size) {
+    while (size != 0) {
+        size_t n = WAV_BLOCK_SIZE - w->block_fill;
+
+        if (n > size) {
+            n = size;
+        }
+
+        memcpy(&w->block[w->block_fill], data, n);
+        w->block_fill += n;
+        data += n;
+        size -= n;
+
+        if (w->block_fill == WAV_BLOCK_SIZE && flush_block(w) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Grows an aligned buffer, the old contents are not kept
+static void* reserve(void* buffer, size_t* buffer_size, size_t size) {
+    if (size > *buffer_size) {
+        _aligned_free(buffer);
+        buffer = _aligned_malloc(size, WAV_BLOCK_ALIGN);
+        *buffer_size = size;
+    }
+
+    return buffer;
+}
+
+// Returns how many of the given frames still fit before max_frames
+static uint32_t limit_frames(wav_writer* w, uint32_t samples) {
+    if (w->max_frames != 0) {
+        if (w->frames >= w->max_frames) {
+            return 0;
+        } else if (w->frames + samples > w->max_frames) {
+            return (uint32_t)(w->max_frames - w->frames);
+        }
+    }
+
+    return samples;
+}
+
+errno_t wav_write_interleaved(wav_writer* w, const float* pcm, uint32_t samples) {
+    samples = limit_frames(w, samples);
+
+    size_t count = (size_t)samples * w->channels;
+    size_t size = count * pcm_format_bytes(w->format);
+
+    // Convert straight into the output block if it fits, otherwise go through the buffer
+    if (size <= WAV_BLOCK_SIZE - w->block_fill) {
+        pcm_convert(&w->block[w->block_fill], pcm, count, w->format, &w->dither);
+        w->block_fill += size;
+
+        if (w->block_fill == WAV_BLOCK_SIZE && flush_block(w) != 0) {
+            return 1;
+        }
+    } else {
+        w->buffer = reserve(w->buffer, &w->buffer_size, size);
+        pcm_convert(w->buffer, pcm, count, w->format, &w->dither);
+
+        if (append_block(w, w->buffer, size) != 0) {
+            return 1;
+        }
+    }
+
+    w->frames += samples;
+
+    return 0;
+}
+
+errno_t wav_write_planar(wav_writer* w, float** pcm, uint32_t samples) {
+    size_t size = (size_t)samples * w->channels * sizeof(float);
+
+    w->scratch = reserve(w->scratch, &w->scratch_size, size);
+    pcm_interleave(w->scratch, pcm, w->channels, samples);
+
+    return wav_write_interleaved(w, w->scratch, samples);
+}
+
+errno_t wav_write_pcm(wav_writer* w, const uint8_t* pcm, uint32_t bits, uint32_t samples) {
+    uint32_t bytes = pcm_format_bytes(w->format);
+    bool is_int = w->format != PCM_FMT_F32 && w->format != PCM_FMT_F64;
+
+    samples = limit_frames(w, samples);
+
+    // Same width, the samples are copied as they are
+    if (is_int && bits == bytes * 8) {
+        if (append_block(w, pcm, (size_t)samples * w->channels * bytes) != 0) {
+            return 1;
+        }
+
+        w->frames += samples;
+
+        return 0;
+    }
+
+    // Only dither when the output loses precision
+    bool dither = w->dither.enabled;
+    w->dither.enabled = dither && bits > bytes * 8;
+
+    errno_t err = 0;
+    uint32_t frame_bytes = w->channels * bits / 8;
+
+    for (uint32_t i = 0; i < samples && err == 0; i += WAV_PCM_CHUNK) {
+        uint32_t n = samples - i < WAV_PCM_CHUNK ? samples - i : WAV_PCM_CHUNK;
+        float* scratch;
+
+        w->scratch = reserve(w->scratch, &w->scratch_size, (size_t)n * w->channels * sizeof(float));
+        scratch = w->scratch;
+        pcm_to_float(scratch, &pcm[(size_t)i * frame_bytes], (size_t)n * w->channels, bits);
+
+        err = wav_write_interleaved(w, scratch, n);
+    }
+
+    w->dither.enabled = dither;
+
+    return err;
+}
+
+errno_t wav_close(wav_writer* w) {
+    uint64_t data_size = w->frames * w->channels * pcm_format_bytes(w->format);
+    unsigned char size[4];
+    const uint8_t pad = 0;
+    errno_t err = 0;
+
+    // Pad the data chunk to an even size
+    if (data_size & 1) {
+        err = append_block(w, &pad, 1);
+    }
+
+    if (err == 0) {
+        err = flush_block(w);
+    }
+
+    _aligned_free(w->block);
+    _aligned_free(w->scratch);
+    _aligned_free(w->buffer);
+    w->block = NULL;
+    w->scratch = NULL;
+    w->buffer = NULL;
+    w->block_fill = 0;
+    w->scratch_size = 0;
+    w->buffer_size = 0;
+
+    if (err != 0) {
+        return 1;
+    }
+
+    // The header written by wav_open is already correct
+    if (w->max_frames != 0 && w->frames == w->max_frames) {
+        return 0;
+    }
+
+    if (data_size + w->header_size - 8 > UINT32_MAX) {
+        perrf("WAV output exceeds 4 GiB\n");
+
+        return 1;
+    }
+
+    if (w->out_buffer) {
+        write_32((unsigned char*)&w->out_buffer->data[4], (uint32_t)(w->header_size - 8 + data_size + (data_size & 1)));
+        write_32((unsigned char*)&w->out_buffer->data[w->header_size - 4], (uint32_t)data_size);
+
+        return 0;
+    }
+
+    write_32(size, (uint32_t)(w->header_size - 8 + data_size + (data_size & 1)));
+    if (_fseeki64(w->out, 4, SEEK_SET) != 0 || fwrite(size, 4, 1, w->out) != 1) {
+        err = 1;
+    }
+
+    write_32(size, (uint32_t)data_size);
+    if (_fseeki64(w->out, w->header_size - 4, SEEK_SET) != 0 || fwrite(size, 4, 1, w->out) != 1) {
+        err = 1;
+    }
+
+    if (err != 0) {
+        perrf("Could not update the WAV header\n");
+    }
+
+    return err;
+}
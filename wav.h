@@ -0,0 +1,74 @@
+#pragma once
+
+#include "defs.h"
+#include "pcm.h"
+#include "bitmanip.h"
+
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+#define WAV_HEADER_MAX 68
+
+// Output is collected and written in blocks of this size, aligned for the SIMD kernels
+#define WAV_BLOCK_SIZE  (1 << 20)
+#define WAV_BLOCK_ALIGN 64
+
+// Number of integer frames converted at a time
+#define WAV_PCM_CHUNK 4096
+
+// Writes PCM samples to a RIFF WAVE file
+typedef struct wav_writer {
+    // Final output stream, has to be seekable to patch the sizes on close
+    FILE* out;
+
+    // If set, the file is built in out_buffer instead, and the sizes are patched in place
+    membuf* out_buffer;
+
+    pcm_format format;
+    uint16_t channels;
+    uint32_t sample_rate;
+
+    // Number of sample frames written so far
+    uint64_t frames;
+
+    // Stop writing after this many frames, 0 for no limit
+    uint64_t max_frames;
+
+    // Size of the header, the data chunk starts right after it
+    uint32_t header_size;
+
+    // Output block, starts with the header and is written once full
+    uint8_t* block;
+    size_t block_fill;
+
+    // Interleaved float samples waiting for conversion
+    float* scratch;
+    size_t scratch_size;
+
+    // Converted samples
+    uint8_t* buffer;
+    size_t buffer_size;
+
+    // Dither for the s16 and s24 formats
+    pcm_dither dither;
+} wav_writer;
+
+// Prepares the writer and buffers the WAVE header, out is switched to unbuffered mode so it has to be freshly opened
+// frames limits the output length, if it's known and reached out doesn't have to be seekable
+errno_t wav_open(wav_writer* w, FILE* out, pcm_format format, uint16_t channels, uint32_t sample_rate, uint64_t frames);
+
+// Same as wav_open, but the file is appended to out with membuf_write, which has to be empty
+errno_t wav_open_buffer(wav_writer* w, membuf* out, pcm_format format, uint16_t channels, uint32_t sample_rate, uint64_t frames);
+
+// Converts and writes samples from one float buffer per channel
+errno_t wav_write_planar(wav_writer* w, float** pcm, uint32_t samples);
+
+// Converts and writes interleaved float samples
+errno_t wav_write_interleaved(wav_writer* w, const float* pcm, uint32_t samples);
+
+// Writes interleaved little endian integer samples of the given width, copied as they are if the width matches
+errno_t wav_write_pcm(wav_writer* w, const uint8_t* pcm, uint32_t bits, uint32_t samples);
+
+// Writes the last block, patches the RIFF and data chunk sizes and frees the writer's buffers
+errno_t wav_close(wav_writer* w);
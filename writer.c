@@ -0,0 +1,188 @@
+#include "writer.h"
+#include "timing.h"
+
+typedef struct writer_request {
+    char* path;
+    void* data;
+    size_t size;
+
+    writer_done done;
+    void* ctx;
+    errno_t err;
+
+    // The submitter's record, the write is charged to it
+    timing* timing;
+} writer_request;
+
+// Requests go to the threads through one completion port and come back through another
+static struct {
+    bool open;
+
+    HANDLE requests;
+    HANDLE results;
+    HANDLE threads[WRITER_THREADS];
+    uint32_t thread_count;
+
+    // Submitted and not handed back yet, only touched by the submitting thread
+    uint32_t pending;
+} writer;
+
+static errno_t write_output(const writer_request* r) {
+    HANDLE file = CreateFileA(r->path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        perrf("Could not open %s for writing\n", r->path);
+
+        return 1;
+    }
+
+    errno_t err = 0;
+    const char* data = r->data;
+
+    // The whole output is one write, unless it's larger than WriteFile takes at once
+    for (size_t written = 0; written < r->size && err == 0;) {
+        size_t left = r->size - written;
+        DWORD chunk = (DWORD)(left < (1 << 30) ? left : (1 << 30));
+        DWORD n = 0;
+
+        if (!WriteFile(file, &data[written], chunk, &n, NULL) || n == 0) {
+            perrf("Could not write %s, error %lu\n", r->path, GetLastError());
+
+            err = 1;
+        }
+
+        written += n;
+    }
+
+    CloseHandle(file);
+
+    return err;
+}
+
+static DWORD WINAPI writer_thread(LPVOID param) {
+    UNUSED(param);
+
+    DWORD bytes;
+    ULONG_PTR key;
+    LPOVERLAPPED overlapped;
+
+    // A NULL request tells the thread to stop
+    while (GetQueuedCompletionStatus(writer.requests, &bytes, &key, &overlapped, INFINITE) && overlapped) {
+        writer_request* r = (writer_request*)overlapped;
+
+        timing_bind(r->timing);
+        timing_stage previous = timing_enter(TIMING_WRITE);
+
+        r->err = write_output(r);
+
+        timing_leave(previous);
+        timing_bind(NULL);
+
+        free(r->data);
+        r->data = NULL;
+
+        PostQueuedCompletionStatus(writer.results, 0, 0, (LPOVERLAPPED)r);
+    }
+
+    return 0;
+}
+
+errno_t writer_open(void) {
+    writer.requests = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, WRITER_THREADS);
+    writer.results = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    writer.thread_count = 0;
+    writer.pending = 0;
+
+    if (!writer.requests || !writer.results) {
+        perrf("Could not create the writer's completion ports, error %lu\n", GetLastError());
+
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < WRITER_THREADS; i++) {
+        HANDLE thread = CreateThread(NULL, 0, writer_thread, NULL, 0, NULL);
+
+        if (thread) {
+            writer.threads[writer.thread_count++] = thread;
+        }
+    }
+
+    if (writer.thread_count == 0) {
+        perrf("Could not start the writer threads\n");
+
+        return 1;
+    }
+
+    writer.open = true;
+
+    return 0;
+}
+
+void writer_close(void) {
+    if (!writer.open) {
+        return;
+    }
+
+    writer_drain();
+
+    for (uint32_t i = 0; i < writer.thread_count; i++) {
+        PostQueuedCompletionStatus(writer.requests, 0, 0, NULL);
+    }
+
+    WaitForMultipleObjects(writer.thread_count, writer.threads, TRUE, INFINITE);
+
+    for (uint32_t i = 0; i < writer.thread_count; i++) {
+        CloseHandle(writer.threads[i]);
+    }
+
+    CloseHandle(writer.requests);
+    CloseHandle(writer.results);
+
+    writer.open = false;
+}
+
+// Waits for the next finished output and hands it back
+static void collect(void) {
+    DWORD bytes;
+    ULONG_PTR key;
+    LPOVERLAPPED overlapped = NULL;
+
+    if (!GetQueuedCompletionStatus(writer.results, &bytes, &key, &overlapped, INFINITE) || !overlapped) {
+        perrf("Could not wait for the writer, error %lu\n", GetLastError());
+
+        exit(1);
+    }
+
+    writer_request* r = (writer_request*)overlapped;
+    writer.pending--;
+
+    r->done(r->ctx, r->err);
+
+    free(r->path);
+    free(r);
+}
+
+void writer_submit(const char* path, void* data, size_t size, writer_done done, void* ctx) {
+    while (writer.pending >= WRITER_QUEUE_DEPTH) {
+        collect();
+    }
+
+    writer_request* r = malloc(sizeof(writer_request));
+    r->path = _strdup(path);
+    r->data = data;
+    r->size = size;
+    r->done = done;
+    r->ctx = ctx;
+    r->err = 0;
+    r->timing = timing_bound();
+
+    writer.pending++;
+
+    PostQueuedCompletionStatus(writer.requests, 0, 0, (LPOVERLAPPED)r);
+}
+
+void writer_drain(void) {
+    while (writer.pending != 0) {
+        collect();
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "defs.h"
+#include "utils.h"
+
+// Threads opening, writing and closing outputs
+#define WRITER_THREADS 4
+
+// Outputs queued or being written at once, writer_submit waits for one to finish past this
+#define WRITER_QUEUE_DEPTH 64
+
+// Called on the thread that submits, once the output is written and closed or failed
+typedef void (*writer_done)(void* ctx, errno_t err);
+
+// Starts the writer threads
+errno_t writer_open(void);
+
+// Waits for every output and stops the threads
+void writer_close(void);
+
+// Queues data to be written to path, which is replaced if it exists, data is freed once it's written
+// Waits for a free slot first, which runs the done callbacks of finished outputs
+void writer_submit(const char* path, void* data, size_t size, writer_done done, void* ctx);
+
+// Runs the done callbacks of every output, once all of them are finished
+void writer_drain(void);
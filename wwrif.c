@@ -1,6 +1,11 @@
 #include "wwriff.h"
+#include "vorbis.h"
+#include "wav.h"
+#include "adpcm.h"
+#include "timing.h"
 
-errno_t create_ogg(membuf* data, FILE* out) {
+// Rebuilds the Wwise Vorbis data into standard Vorbis packets written to os
+static errno_t rebuild_vorbis(membuf* data, ogg_output_stream* os) {
     // Check if the RIFF header is valid
     long riff_size = -1;
 
@@ -136,7 +141,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
         // Reads some miscellaneous values
         data->pos = fmt_offset;
-        if (read_16_membuf(data) != UINT16_C(0xFFFF)) {
+        if (read_16_membuf(data) != WEM_CODEC_VORBIS) {
             perrf("Invalid codec id\n");
 
             return 1;
@@ -284,61 +289,59 @@ errno_t create_ogg(membuf* data, FILE* out) {
         }
     }
 
-    ogg_output_stream os = new_ogg_output_stream(out);
-
     // ID packet
     {
-        ogg_write_vph(&os, 1);
+        ogg_write_vph(os, 1);
 
         uint_var version = new_uint_var(0, 32);
-        ogg_write(&os, version);
+        ogg_write(os, version);
 
         uint_var ch = new_uint_var(channels, 8);
-        ogg_write(&os, ch);
+        ogg_write(os, ch);
 
         uint_var srate = new_uint_var(sample_rate, 32);
-        ogg_write(&os, srate);
+        ogg_write(os, srate);
 
         uint_var bitrate_max = new_uint_var(0, 32);
-        ogg_write(&os, bitrate_max);
+        ogg_write(os, bitrate_max);
 
         uint_var bitrate_nominal = new_uint_var(avg_bytes_per_second * 8, 32);
-        ogg_write(&os, bitrate_nominal);
+        ogg_write(os, bitrate_nominal);
 
         uint_var bitrate_minimum = new_uint_var(0, 32);
-        ogg_write(&os, bitrate_minimum);
+        ogg_write(os, bitrate_minimum);
 
         uint_var blocksize_0 = new_uint_var(blocksize_0_pow, 4);
-        ogg_write(&os, blocksize_0);
+        ogg_write(os, blocksize_0);
 
         uint_var blocksize_1 = new_uint_var(blocksize_1_pow, 4);
-        ogg_write(&os, blocksize_1);
+        ogg_write(os, blocksize_1);
 
         uint_var framing = new_uint_var(1, 1);
-        ogg_write(&os, framing);
+        ogg_write(os, framing);
 
-        flush_page(&os, false, false);
+        flush_page(os, false, false);
     }
 
     // Comment packet
     {
-        ogg_write_vph(&os, 3);
+        ogg_write_vph(os, 3);
 
         const char vendor[] = "Converted using NME2";
         uint_var vendor_size = new_uint_var((uint32_t)strlen(vendor), 32);
-        ogg_write(&os, vendor_size);
+        ogg_write(os, vendor_size);
 
         for (unsigned int i = 0; i < vendor_size.value; i++) {
             uint_var c = new_uint_var(vendor[i], 8);
-            ogg_write(&os, c);
+            ogg_write(os, c);
         }
 
         if (loop_count == 0) {
             uint_var user_comment_count = new_uint_var(0, 32);
-            ogg_write(&os, user_comment_count);
+            ogg_write(os, user_comment_count);
         } else {
             uint_var user_comment_count = new_uint_var(2, 32);
-            ogg_write(&os, user_comment_count);
+            ogg_write(os, user_comment_count);
 
             char* loop_start_str = malloc(21);
             char* loop_end_str = malloc(19);
@@ -347,18 +350,18 @@ errno_t create_ogg(membuf* data, FILE* out) {
             sprintf_s(loop_end_str, 19, "LoopEnd=%i", loop_end);
 
             uint_var loop_start_comment_length = new_uint_var((uint32_t)strlen(loop_start_str), 32);
-            ogg_write(&os, loop_start_comment_length);
+            ogg_write(os, loop_start_comment_length);
 
             for (unsigned int i = 0; i < loop_start_comment_length.value; i++) {
                 uint_var c = new_uint_var(loop_start_str[i], 8);
-                ogg_write(&os, c);
+                ogg_write(os, c);
             }
         }
 
         uint_var framing = new_uint_var(1, 1);
-        ogg_write(&os, framing);
+        ogg_write(os, framing);
 
-        flush_page(&os, false, false);
+        flush_page(os, false, false);
     }
 
     bool* mode_blockflag = NULL;
@@ -366,7 +369,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
     bool prev_blockflag = false;
     // Setup packet
     {
-        ogg_write_vph(&os, 5);
+        ogg_write_vph(os, 5);
 
         Packet setup_packet = packet(data, data_offset + setup_packet_offset);
 
@@ -385,7 +388,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
         unsigned int codebook_count = codebook_count_less1.value + 1;
 
-        ogg_write(&os, codebook_count_less1);
+        ogg_write(os, codebook_count_less1);
 
         codebook_library cbl;
         cbl.codebook_count = CODEBOOK_COUNT;
@@ -401,6 +404,16 @@ errno_t create_ogg(membuf* data, FILE* out) {
         for (unsigned int i = 0; i < codebook_count; i++) {
             uint_var codebook_id = new_uint_var(0, 10);
             bs_read(&ss, &codebook_id);
+
+            if (codebook_id.value + 1 >= CODEBOOK_COUNT) {
+                perrf("Invalid codebook id %u\n", codebook_id.value);
+
+                free(cbl.codebook_data);
+                free(cbl.codebook_offsets);
+
+                return 1;
+            }
+
             unsigned long cb_size = cbl.codebook_offsets[codebook_id.value + 1] - cbl.codebook_offsets[codebook_id.value];
 
             //bit_stream_mem bsm = bit_stream_mem(&cbl.codebook_data[cbl.codebook_offsets[codebook_id.value]], cb_size);
@@ -411,27 +424,35 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
             bit_stream stream = new_bit_stream(&buf);
 
-            parse_codebook(&stream, cb_size, &os);
+            if (parse_codebook(&stream, cb_size, os) != 0) {
+                free(cbl.codebook_data);
+                free(cbl.codebook_offsets);
+
+                return 1;
+            }
         }
 
+        free(cbl.codebook_data);
+        free(cbl.codebook_offsets);
+
         uint_var time_count_less1 = new_uint_var(0, 6);
-        ogg_write(&os, time_count_less1);
+        ogg_write(os, time_count_less1);
         uint_var dummy_time_value = new_uint_var(0, 16);
-        ogg_write(&os, dummy_time_value);
+        ogg_write(os, dummy_time_value);
         {
             uint_var floor_count_less1 = new_uint_var(0, 6);
             bs_read(&ss, &floor_count_less1);
             unsigned int floor_count = floor_count_less1.value + 1;
-            ogg_write(&os, floor_count_less1);
+            ogg_write(os, floor_count_less1);
 
 
             for (unsigned int i = 0; i < floor_count; i++) {
                 uint_var floor_type = new_uint_var(1, 16);
-                ogg_write(&os, floor_type);
+                ogg_write(os, floor_type);
 
                 uint_var floor1_partitions = new_uint_var(0, 5);
                 bs_read(&ss, &floor1_partitions);
-                ogg_write(&os, floor1_partitions);
+                ogg_write(os, floor1_partitions);
 
                 unsigned int* floor1_partition_class_list = malloc(floor1_partitions.value * sizeof(unsigned int));
 
@@ -439,7 +460,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
                 for (unsigned int j = 0; j < floor1_partitions.value; j++) {
                     uint_var floor1_partition_class = new_uint_var(0, 4);
                     bs_read(&ss, &floor1_partition_class);
-                    ogg_write(&os, floor1_partition_class);
+                    ogg_write(os, floor1_partition_class);
 
                     floor1_partition_class_list[j] = floor1_partition_class.value;
 
@@ -453,18 +474,18 @@ errno_t create_ogg(membuf* data, FILE* out) {
                 for (unsigned int j = 0; j <= maximum_class; j++) {
                     uint_var class_dimensions_less_1 = new_uint_var(0, 3);
                     bs_read(&ss, &class_dimensions_less_1);
-                    ogg_write(&os, class_dimensions_less_1);
+                    ogg_write(os, class_dimensions_less_1);
 
                     floor1_class_dimensions_list[j] = class_dimensions_less_1.value + 1;
 
                     uint_var class_subclasses = new_uint_var(0, 2);
                     bs_read(&ss, &class_subclasses);
-                    ogg_write(&os, class_subclasses);
+                    ogg_write(os, class_subclasses);
 
                     if (class_subclasses.value != 0) {
                         uint_var masterbook = new_uint_var(0, 8);
                         bs_read(&ss, &masterbook);
-                        ogg_write(&os, masterbook);
+                        ogg_write(os, masterbook);
 
                         if (masterbook.value >= codebook_count) {
                             perrf("Invalid floor1 masterbook\n");
@@ -476,7 +497,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
                     for (unsigned int k = 0; k < (1U << class_subclasses.value); k++) {
                         uint_var subclass_book_plus1 = new_uint_var(0, 8);
                         bs_read(&ss, &subclass_book_plus1);
-                        ogg_write(&os, subclass_book_plus1);
+                        ogg_write(os, subclass_book_plus1);
 
                         int subclass_book = ((int)subclass_book_plus1.value) - 1;
 
@@ -490,11 +511,11 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
                 uint_var floor1_multiplier_less1 = new_uint_var(0, 2);
                 bs_read(&ss, &floor1_multiplier_less1);
-                ogg_write(&os, floor1_multiplier_less1);
+                ogg_write(os, floor1_multiplier_less1);
 
                 uint_var rangebits = new_uint_var(0, 4);
                 bs_read(&ss, &rangebits);
-                ogg_write(&os, rangebits);
+                ogg_write(os, rangebits);
 
                 for (unsigned int j = 0; j < floor1_partitions.value; j++) {
                     unsigned int current_class_number = floor1_partition_class_list[j];
@@ -502,7 +523,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
                     for (unsigned int k = 0; k < floor1_class_dimensions_list[current_class_number]; k++) {
                         uint_var X = new_uint_var(0, rangebits.value);
                         bs_read(&ss, &X);
-                        ogg_write(&os, X);
+                        ogg_write(os, X);
                     }
                 }
 
@@ -514,13 +535,13 @@ errno_t create_ogg(membuf* data, FILE* out) {
             uint_var residue_count_less1 = new_uint_var(0, 6);
             bs_read(&ss, &residue_count_less1);
             unsigned int residue_count = residue_count_less1.value + 1;
-            ogg_write(&os, residue_count_less1);
+            ogg_write(os, residue_count_less1);
 
             // Rebuild residues
             for (unsigned int i = 0; i < residue_count; i++) {
                 uint_var residue_type = new_uint_var(0, 2);
                 bs_read(&ss, &residue_type);
-                ogg_write(&os, new_uint_var(residue_type.value, 16));
+                ogg_write(os, new_uint_var(residue_type.value, 16));
 
                 if (residue_type.value > 2) {
                     perrf("Invalid residue type");
@@ -542,11 +563,11 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
                 unsigned int residue_classifications = residue_classifications_less1.value + 1;
 
-                ogg_write(&os, residue_begin);
-                ogg_write(&os, residue_end);
-                ogg_write(&os, residue_partition_size_less1);
-                ogg_write(&os, residue_classifications_less1);
-                ogg_write(&os, residue_classbook);
+                ogg_write(os, residue_begin);
+                ogg_write(os, residue_end);
+                ogg_write(os, residue_partition_size_less1);
+                ogg_write(os, residue_classifications_less1);
+                ogg_write(os, residue_classbook);
 
                 if (residue_classbook.value >= codebook_count) {
                     perrf("Invalid residue classbook\n");
@@ -561,15 +582,15 @@ errno_t create_ogg(membuf* data, FILE* out) {
                     uint_var low_bits = new_uint_var(0, 3);
 
                     bs_read(&ss, &low_bits);
-                    ogg_write(&os, low_bits);
+                    ogg_write(os, low_bits);
 
                     uint_var bitflag = new_uint_var(0, 1);
                     bs_read(&ss, &bitflag);
-                    ogg_write(&os, bitflag);
+                    ogg_write(os, bitflag);
 
                     if (bitflag.value) {
                         bs_read(&ss, &high_bits);
-                        ogg_write(&os, high_bits);
+                        ogg_write(os, high_bits);
                     }
 
                     residue_cascade[j] = high_bits.value * 8 + low_bits.value;
@@ -580,7 +601,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
                         if (residue_cascade[j] & (1 << k)) {
                             uint_var residue_book = new_uint_var(0, 8);
                             bs_read(&ss, &residue_book);
-                            ogg_write(&os, residue_book);
+                            ogg_write(os, residue_book);
 
                             if (residue_book.value >= codebook_count) {
                                 perrf("Invalid residue book\n");
@@ -598,15 +619,15 @@ errno_t create_ogg(membuf* data, FILE* out) {
             uint_var mapping_count_less1 = new_uint_var(0, 6);
             bs_read(&ss, &mapping_count_less1);
             unsigned int mapping_count = mapping_count_less1.value + 1;
-            ogg_write(&os, mapping_count_less1);
+            ogg_write(os, mapping_count_less1);
 
             for (unsigned int i = 0; i < mapping_count; i++) {
                 uint_var mapping_type = new_uint_var(0, 16);
-                ogg_write(&os, mapping_type);
+                ogg_write(os, mapping_type);
 
                 uint_var submaps_flag = new_uint_var(0, 1);
                 bs_read(&ss, &submaps_flag);
-                ogg_write(&os, submaps_flag);
+                ogg_write(os, submaps_flag);
 
                 unsigned int submaps = 1;
                 if (submaps_flag.value) {
@@ -614,18 +635,18 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
                     bs_read(&ss, &submaps_less1);
                     submaps = submaps_less1.value + 1;
-                    ogg_write(&os, submaps_less1);
+                    ogg_write(os, submaps_less1);
                 }
 
                 uint_var square_polar_flag = new_uint_var(0, 1);
                 bs_read(&ss, &square_polar_flag);
-                ogg_write(&os, square_polar_flag);
+                ogg_write(os, square_polar_flag);
 
                 if (square_polar_flag.value) {
                     uint_var coupling_steps_less1 = new_uint_var(0, 8);
                     bs_read(&ss, &coupling_steps_less1);
                     unsigned int coupling_steps = coupling_steps_less1.value + 1;
-                    ogg_write(&os, coupling_steps_less1);
+                    ogg_write(os, coupling_steps_less1);
 
                     for (unsigned int j = 0; j < coupling_steps; j++) {
                         uint_var magnitude = new_uint_var(0, ilog(channels - 1));
@@ -634,8 +655,8 @@ errno_t create_ogg(membuf* data, FILE* out) {
                         bs_read(&ss, &magnitude);
                         bs_read(&ss, &angle);
 
-                        ogg_write(&os, magnitude);
-                        ogg_write(&os, angle);
+                        ogg_write(os, magnitude);
+                        ogg_write(os, angle);
 
 
                         if (angle.value == magnitude.value || magnitude.value >= channels || angle.value >= channels) {
@@ -648,7 +669,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
                 uint_var mapping_reserved = new_uint_var(0, 2);
                 bs_read(&ss, &mapping_reserved);
-                ogg_write(&os, mapping_reserved);
+                ogg_write(os, mapping_reserved);
                 if (mapping_reserved.value != 0) {
                     perrf("Mapping reserved field nonzero\n");
 
@@ -659,7 +680,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
                     for (unsigned int j = 0; j < channels; j++) {
                         uint_var mapping_mux = new_uint_var(0, 4);
                         bs_read(&ss, &mapping_mux);
-                        ogg_write(&os, mapping_mux);
+                        ogg_write(os, mapping_mux);
 
                         if (mapping_mux.value >= submaps) {
                             perrf("mapping_mux >= submaps\n");
@@ -672,11 +693,11 @@ errno_t create_ogg(membuf* data, FILE* out) {
                 for (unsigned int j = 0; j < submaps; j++) {
                     uint_var time_config = new_uint_var(0, 8);
                     bs_read(&ss, &time_config);
-                    ogg_write(&os, time_config);
+                    ogg_write(os, time_config);
 
                     uint_var floor_number = new_uint_var(0, 8);
                     bs_read(&ss, &floor_number);
-                    ogg_write(&os, floor_number);
+                    ogg_write(os, floor_number);
                     if (floor_number.value >= floor_count) {
                         perrf("Invalid floor mapping\n");
 
@@ -685,7 +706,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
 
                     uint_var residue_number = new_uint_var(0, 8);
                     bs_read(&ss, &residue_number);
-                    ogg_write(&os, residue_number);
+                    ogg_write(os, residue_number);
                     if (residue_number.value >= residue_count) {
                         perrf("Invalid residue mapping\n");
 
@@ -698,7 +719,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
             uint_var mode_count_less1 = new_uint_var(0, 6);
             bs_read(&ss, &mode_count_less1);
             unsigned int mode_count = mode_count_less1.value + 1;
-            ogg_write(&os, mode_count_less1);
+            ogg_write(os, mode_count_less1);
 
 
             mode_blockflag = malloc(mode_count * sizeof(bool));
@@ -707,18 +728,18 @@ errno_t create_ogg(membuf* data, FILE* out) {
             for (unsigned int i = 0; i < mode_count; i++) {
                 uint_var block_flag = new_uint_var(0, 1);
                 bs_read(&ss, &block_flag);
-                ogg_write(&os, block_flag);
+                ogg_write(os, block_flag);
 
                 mode_blockflag[i] = (block_flag.value != 0);
 
                 uint_var windowtype = new_uint_var(0, 16);
                 uint_var transformtype = new_uint_var(0, 16);
-                ogg_write(&os, windowtype);
-                ogg_write(&os, transformtype);
+                ogg_write(os, windowtype);
+                ogg_write(os, transformtype);
 
                 uint_var mapping = new_uint_var(0, 8);
                 bs_read(&ss, &mapping);
-                ogg_write(&os, mapping);
+                ogg_write(os, mapping);
                 if (mapping.value >= mapping_count) {
                     perrf("Invalid mode mapping\n");
 
@@ -727,9 +748,9 @@ errno_t create_ogg(membuf* data, FILE* out) {
             }
 
             uint_var framing = new_uint_var(1, 1);
-            ogg_write(&os, framing);
+            ogg_write(os, framing);
         }
-        flush_page(&os, false, false);
+        flush_page(os, false, false);
 
         if ((ss.total_bits_read + 7) / 8 != setup_packet.size) {
             perrf("Didn't fully read setup packet\n");
@@ -744,7 +765,8 @@ errno_t create_ogg(membuf* data, FILE* out) {
         }
     }
 
-    // Audio pages
+    // Audio pages, the headers before were charged to the setup stage
+    timing_enter(TIMING_PAGES);
     {
         long offset = data_offset + first_audio_packet_offset;
 
@@ -767,9 +789,9 @@ errno_t create_ogg(membuf* data, FILE* out) {
             data->pos = offset;
 
             if (granule == UINT32_C(0xFFFFFFFF)) {
-                os.granule = 1;
+                os->granule = 1;
             } else {
-                os.granule = granule;
+                os->granule = granule;
             }
 
             // First byte
@@ -780,7 +802,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
             }
 
             uint_var packet_type = new_uint_var(0, 1);
-            ogg_write(&os, packet_type);
+            ogg_write(os, packet_type);
 
             uint_var* mode_number_p = malloc(sizeof(uint_var));
             uint_var* remainder_p = malloc(sizeof(uint_var));
@@ -790,7 +812,7 @@ errno_t create_ogg(membuf* data, FILE* out) {
                 *mode_number_p = new_uint_var(0, mode_bits);
 
                 bs_read(&ss, mode_number_p);
-                ogg_write(&os, *mode_number_p);
+                ogg_write(os, *mode_number_p);
 
                 *remainder_p = new_uint_var(0, 8 - mode_bits);
                 bs_read(&ss, remainder_p);
@@ -816,16 +838,16 @@ errno_t create_ogg(membuf* data, FILE* out) {
                 }
 
                 uint_var prev_window_type = new_uint_var(prev_blockflag, 1);
-                ogg_write(&os, prev_window_type);
+                ogg_write(os, prev_window_type);
 
                 uint_var next_window_type = new_uint_var(next_blockflag, 1);
-                ogg_write(&os, next_window_type);
+                ogg_write(os, next_window_type);
                 data->pos = offset + 1;
             }
 
             prev_blockflag = mode_blockflag[mode_number_p->value];
             free(mode_number_p);
-            ogg_write(&os, *remainder_p);
+            ogg_write(os, *remainder_p);
             free(remainder_p);
 
             for (unsigned int i = 1; i < size; i++) {
@@ -837,11 +859,11 @@ errno_t create_ogg(membuf* data, FILE* out) {
                 }
 
                 uint_var c = new_uint_var(v, 8);
-                ogg_write(&os, c);
+                ogg_write(os, c);
             }
 
             offset = next_offset;
-            flush_page(&os, (offset == data_offset + data_size), false);
+            flush_page(os, (offset == data_offset + data_size), false);
         }
 
         if (offset > data_offset + data_size) {
@@ -853,4 +875,660 @@ errno_t create_ogg(membuf* data, FILE* out) {
     free(mode_blockflag);
 
     return 0;
-}
\ No newline at end of file
+}
+
+errno_t read_wem_info(membuf* data, wem_info* info) {
+    uint64_t pos = data->pos;
+
+    // Offsets of the chunks' payloads, 0 if a chunk is missing
+    uint64_t fmt_offset = 0;
+    uint64_t fmt_size = 0;
+    uint64_t vorb_offset = 0;
+
+    memset(info, 0, sizeof(wem_info));
+
+    if (data->size < 12 || memcmp(data->data, "RIFF", 4) != 0 || memcmp(&data->data[8], "WAVE", 4) != 0) {
+        perrf("Missing RIFF/WAVE header\n");
+
+        return 1;
+    }
+
+    data->pos = 4;
+    uint64_t riff_size = (uint64_t)read_32_membuf(data) + 8;
+    uint64_t chunk_offset = 12;
+
+    if (riff_size > data->size) {
+        riff_size = data->size;
+    }
+
+    while (chunk_offset + 8 <= riff_size) {
+        data->pos = chunk_offset + 4;
+        uint64_t chunk_size = read_32_membuf(data);
+
+        if (memcmp(&data->data[chunk_offset], "fmt ", 4) == 0) {
+            fmt_offset = chunk_offset + 8;
+            fmt_size = chunk_size;
+        } else if (memcmp(&data->data[chunk_offset], "vorb", 4) == 0) {
+            vorb_offset = chunk_offset + 8;
+        } else if (memcmp(&data->data[chunk_offset], "data", 4) == 0) {
+            info->data_offset = chunk_offset + 8;
+            info->data_size = chunk_size;
+        }
+
+        // A corrupt size must never send the walk back to a chunk it has already seen
+        uint64_t next = chunk_offset + 8 + chunk_size;
+
+        if (next <= chunk_offset) {
+            break;
+        }
+
+        chunk_offset = next;
+    }
+
+    if (fmt_offset == 0 || fmt_offset + 16 > riff_size) {
+        perrf("fmt chunk is required\n");
+
+        data->pos = pos;
+
+        return 1;
+    }
+
+    data->pos = fmt_offset;
+    info->codec = read_16_membuf(data);
+    info->channels = read_16_membuf(data);
+    info->sample_rate = read_32_membuf(data);
+    data->pos += 4;
+    info->block_align = read_16_membuf(data);
+    info->bits_per_sample = read_16_membuf(data);
+
+    // A truncated data chunk is read as far as it goes
+    if (info->data_offset != 0) {
+        uint64_t available = info->data_offset < riff_size ? riff_size - info->data_offset : 0;
+
+        if (info->data_size > available) {
+            info->data_size = available;
+        }
+    }
+
+    // The vorb data is embedded in the fmt chunk if there's no separate chunk
+    if (vorb_offset == 0 && fmt_size == 0x42) {
+        vorb_offset = fmt_offset + 0x18;
+    }
+
+    if (info->codec == WEM_CODEC_VORBIS && vorb_offset != 0 && vorb_offset + 4 <= riff_size) {
+        data->pos = vorb_offset;
+        info->sample_count = read_32_membuf(data);
+    } else if ((info->codec == WEM_CODEC_PCM || info->codec == WEM_CODEC_PCM_EX) && info->channels != 0 && info->bits_per_sample >= 8) {
+        info->sample_count = (uint32_t)(info->data_size / (info->channels * (info->bits_per_sample / 8)));
+    } else if (info->codec == WEM_CODEC_IMA_ADPCM && info->block_align != 0) {
+        uint32_t block_samples = wwise_ima_block_samples(info->block_align, info->channels);
+        uint32_t tail_samples = wwise_ima_block_samples((uint32_t)(info->data_size % info->block_align), info->channels);
+
+        info->sample_count = (uint32_t)(info->data_size / info->block_align) * block_samples + tail_samples;
+    }
+
+    data->pos = pos;
+
+    return 0;
+}
+
+errno_t create_ogg(membuf* data, FILE* out) {
+    ogg_output_stream os = new_ogg_output_stream(out);
+    timing_stage previous = timing_enter(TIMING_SETUP);
+
+    errno_t err = rebuild_vorbis(data, &os);
+
+    timing_leave(previous);
+
+    return err;
+}
+
+errno_t create_ogg_buffer(membuf* data, membuf* out) {
+    ogg_output_stream os = new_ogg_buffer_stream(out);
+    timing_stage previous = timing_enter(TIMING_SETUP);
+
+    // The audio packets are copied as they are, only the rebuilt headers and the page headers come on top
+    membuf_reserve(out, out->pos + data->size + MEMBUF_MIN_CAPACITY);
+
+    errno_t err = rebuild_vorbis(data, &os);
+
+    timing_leave(previous);
+
+    return err;
+}
+
+errno_t create_ogg_packets(membuf* data, packet_sink sink, void* ctx) {
+    ogg_output_stream os = new_ogg_packet_stream(sink, ctx);
+    timing_stage previous = timing_enter(TIMING_SETUP);
+
+    errno_t err = rebuild_vorbis(data, &os);
+
+    timing_leave(previous);
+
+    return err;
+}
+
+// Number of IMA ADPCM blocks decoded at a time
+#define ADPCM_DECODE_BLOCKS 256
+
+// Number of audio packets decoded by one worker at a time
+#define DECODE_RANGE_PACKETS 256
+#define DECODE_MAX_THREADS   16
+
+// Vorbis channel order to WAV channel order, for up to 8 channels
+static const uint8_t vorbis_to_wav[8][8] = {
+    { 0 },
+    { 0, 1 },
+    { 0, 2, 1 },
+    { 0, 1, 2, 3 },
+    { 0, 2, 1, 3, 4 },
+    { 0, 2, 1, 5, 3, 4 },
+    { 0, 2, 1, 6, 5, 3, 4 },
+    { 0, 2, 1, 7, 5, 6, 3, 4 }
+};
+
+// Rebuilt packets of one track, stored back to back
+typedef struct packet_list {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+
+    size_t* offsets;
+    uint32_t* sizes;
+    uint32_t count;
+    uint32_t max_count;
+} packet_list;
+
+// One range of packets decoded by a worker, kept until it's written
+typedef struct decode_range {
+    // Vorbis stores the channel count in 8 bits
+    float* pcm[255];
+    uint32_t samples;
+    uint32_t capacity;
+    bool done;
+    errno_t err;
+} decode_range;
+
+typedef struct parallel_decode {
+    const packet_list* packets;
+    uint16_t channels;
+    uint32_t range_count;
+
+    // Ring of ranges in flight, workers don't get further ahead than this
+    decode_range* slots;
+    uint32_t window;
+
+    volatile LONG next_range;
+    uint32_t written;
+    bool abort;
+
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+} parallel_decode;
+
+static void collect_packet(void* ctx, const uint8_t* data, uint32_t size, uint32_t granule) {
+    packet_list* pl = ctx;
+    UNUSED(granule);
+
+    if (pl->count == pl->max_count) {
+        pl->max_count = pl->max_count ? pl->max_count * 2 : 1024;
+        pl->offsets = realloc(pl->offsets, pl->max_count * sizeof(size_t));
+        pl->sizes = realloc(pl->sizes, pl->max_count * sizeof(uint32_t));
+    }
+
+    if (size != 0 && pl->size + size > pl->capacity) {
+        while (pl->size + size > pl->capacity) {
+            pl->capacity = pl->capacity ? pl->capacity * 2 : 0x10000;
+        }
+
+        pl->data = realloc(pl->data, pl->capacity);
+    }
+
+    if (size != 0) {
+        memcpy(&pl->data[pl->size], data, size);
+    }
+
+    pl->offsets[pl->count] = pl->size;
+    pl->sizes[pl->count] = size;
+    pl->size += size;
+    pl->count++;
+}
+
+static errno_t decode_packet(vorbis_decoder* vd, const packet_list* pl, uint32_t i) {
+    return vorbis_decode_packet(vd, &pl->data[pl->offsets[i]], pl->sizes[i]);
+}
+
+// Writes the decoded samples in WAV channel order
+static errno_t write_pcm(wav_writer* wav, float** pcm, uint32_t samples) {
+    uint16_t channels = wav->channels;
+
+    if (samples == 0) {
+        return 0;
+    }
+
+    if (channels <= 8) {
+        float* ordered[8];
+
+        for (uint16_t i = 0; i < channels; i++) {
+            ordered[i] = pcm[vorbis_to_wav[channels - 1][i]];
+        }
+
+        return wav_write_planar(wav, ordered, samples);
+    }
+
+    return wav_write_planar(wav, pcm, samples);
+}
+
+static errno_t decode_sequential(vorbis_decoder* vd, const packet_list* pl, wav_writer* wav) {
+    for (uint32_t i = 3; i < pl->count; i++) {
+        if (decode_packet(vd, pl, i) != 0) {
+            return 1;
+        }
+
+        float** pcm;
+        uint32_t samples = vorbis_decoder_pcm(vd, &pcm);
+
+        if (write_pcm(wav, pcm, samples) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Decodes one range into its slot, starting one non-empty packet early so the first block has its overlap
+static errno_t decode_range_packets(vorbis_decoder* vd, parallel_decode* pd, uint32_t r, decode_range* slot) {
+    const packet_list* pl = pd->packets;
+    uint32_t first = 3 + r * DECODE_RANGE_PACKETS;
+    uint32_t last = first + DECODE_RANGE_PACKETS < pl->count ? first + DECODE_RANGE_PACKETS : pl->count;
+    uint32_t prime = first;
+
+    // Empty packets don't touch the decoder state, so they can be skipped when priming
+    while (prime > 3 && pl->sizes[prime - 1] == 0) {
+        prime--;
+    }
+
+    vorbis_decoder_reset(vd);
+    slot->samples = 0;
+
+    if (prime > 3 && decode_packet(vd, pl, prime - 1) != 0) {
+        return 1;
+    }
+
+    for (uint32_t i = first; i < last; i++) {
+        if (decode_packet(vd, pl, i) != 0) {
+            return 1;
+        }
+
+        float** pcm;
+        uint32_t samples = vorbis_decoder_pcm(vd, &pcm);
+
+        if (samples == 0) {
+            continue;
+        }
+
+        if (slot->samples + samples > slot->capacity) {
+            while (slot->samples + samples > slot->capacity) {
+                slot->capacity = slot->capacity ? slot->capacity * 2 : 0x10000;
+            }
+
+            for (uint16_t c = 0; c < pd->channels; c++) {
+                slot->pcm[c] = realloc(slot->pcm[c], slot->capacity * sizeof(float));
+            }
+        }
+
+        for (uint16_t c = 0; c < pd->channels; c++) {
+            memcpy(&slot->pcm[c][slot->samples], pcm[c], samples * sizeof(float));
+        }
+
+        slot->samples += samples;
+    }
+
+    return 0;
+}
+
+static DWORD WINAPI decode_worker(LPVOID param) {
+    parallel_decode* pd = param;
+    vorbis_decoder* vd = vorbis_decoder_new();
+    errno_t err = 0;
+
+    // Every worker parses the headers itself, the tables are read only afterwards but not shared
+    for (uint32_t i = 0; i < 3 && err == 0; i++) {
+        err = decode_packet(vd, pd->packets, i);
+    }
+
+    while (true) {
+        uint32_t r = (uint32_t)InterlockedIncrement(&pd->next_range) - 1;
+
+        if (r >= pd->range_count) {
+            break;
+        }
+
+        EnterCriticalSection(&pd->lock);
+        while (r >= pd->written + pd->window && !pd->abort) {
+            SleepConditionVariableCS(&pd->changed, &pd->lock, INFINITE);
+        }
+        bool abort = pd->abort;
+        LeaveCriticalSection(&pd->lock);
+
+        if (abort) {
+            break;
+        }
+
+        decode_range* slot = &pd->slots[r % pd->window];
+
+        if (err == 0) {
+            err = decode_range_packets(vd, pd, r, slot);
+        }
+
+        EnterCriticalSection(&pd->lock);
+        slot->err = err;
+        slot->done = true;
+        if (err != 0) {
+            pd->abort = true;
+        }
+        WakeAllConditionVariable(&pd->changed);
+        LeaveCriticalSection(&pd->lock);
+    }
+
+    vorbis_decoder_free(vd);
+
+    return 0;
+}
+
+// Decodes ranges of packets on the claimed threads and writes them back in order
+static errno_t decode_parallel(const packet_list* pl, uint16_t channels, uint32_t range_count, uint32_t threads, wav_writer* wav) {
+    parallel_decode pd;
+    pd.packets = pl;
+    pd.channels = channels;
+    pd.range_count = range_count;
+    pd.window = threads * 2;
+    pd.slots = calloc(pd.window, sizeof(decode_range));
+    pd.next_range = 0;
+    pd.written = 0;
+    pd.abort = false;
+
+    InitializeCriticalSection(&pd.lock);
+    InitializeConditionVariable(&pd.changed);
+
+    HANDLE* workers = malloc(threads * sizeof(HANDLE));
+    uint32_t started = 0;
+
+    for (uint32_t i = 0; i < threads; i++) {
+        if ((workers[started] = CreateThread(NULL, 0, decode_worker, &pd, 0, NULL)) != NULL) {
+            started++;
+        }
+    }
+
+    errno_t err = 0;
+
+    if (started == 0) {
+        perrf("Could not start any decoder threads\n");
+
+        err = 1;
+    }
+
+    for (uint32_t r = 0; r < range_count && err == 0; r++) {
+        decode_range* slot = &pd.slots[r % pd.window];
+
+        EnterCriticalSection(&pd.lock);
+        while (!slot->done && !pd.abort) {
+            SleepConditionVariableCS(&pd.changed, &pd.lock, INFINITE);
+        }
+        LeaveCriticalSection(&pd.lock);
+
+        if (!slot->done || slot->err != 0) {
+            err = 1;
+
+            break;
+        }
+
+        err = write_pcm(wav, slot->pcm, slot->samples);
+
+        EnterCriticalSection(&pd.lock);
+        slot->done = false;
+        pd.written++;
+        if (err != 0) {
+            pd.abort = true;
+        }
+        WakeAllConditionVariable(&pd.changed);
+        LeaveCriticalSection(&pd.lock);
+    }
+
+    // Release workers still waiting for a free slot
+    EnterCriticalSection(&pd.lock);
+    pd.abort = true;
+    WakeAllConditionVariable(&pd.changed);
+    LeaveCriticalSection(&pd.lock);
+
+    WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+
+    for (uint32_t i = 0; i < started; i++) {
+        CloseHandle(workers[i]);
+    }
+
+    for (uint32_t i = 0; i < pd.window; i++) {
+        for (uint16_t c = 0; c < channels; c++) {
+            free(pd.slots[i].pcm[c]);
+        }
+    }
+
+    DeleteCriticalSection(&pd.lock);
+    free(workers);
+    free(pd.slots);
+
+    return err;
+}
+
+// Threads decoding Vorbis right now across all tracks, the callers included
+static volatile LONG decode_busy = 0;
+
+// Claims the calling thread and up to wanted - 1 more threads from the budget shared by all tracks, returns how many it got
+// Every caller gets at least its own thread, so tracks decoded on all rebuild workers at once don't start any more
+static uint32_t claim_decode_threads(uint32_t wanted) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    LONG budget = (LONG)info.dwNumberOfProcessors;
+
+    while (true) {
+        LONG busy = decode_busy;
+        LONG extra = (LONG)wanted - 1;
+
+        if (extra > budget - busy - 1) {
+            extra = budget - busy - 1;
+        }
+
+        if (extra < 0) {
+            extra = 0;
+        }
+
+        if (InterlockedCompareExchange(&decode_busy, busy + 1 + extra, busy) == busy) {
+            return (uint32_t)(1 + extra);
+        }
+    }
+}
+
+static void release_decode_threads(uint32_t threads) {
+    InterlockedExchangeAdd(&decode_busy, -(LONG)threads);
+}
+
+// Opens the writer on whichever of the targets is set
+static errno_t open_wav(wav_writer* w, FILE* out, membuf* out_buffer, pcm_format format, uint16_t channels, uint32_t sample_rate, uint64_t frames) {
+    if (out_buffer) {
+        return wav_open_buffer(w, out_buffer, format, channels, sample_rate, frames);
+    }
+
+    return wav_open(w, out, format, channels, sample_rate, frames);
+}
+
+static errno_t create_wav_vorbis(membuf* data, const wem_info info, FILE* out, membuf* out_buffer, pcm_format format) {
+    packet_list packets = { 0 };
+    errno_t err = create_ogg_packets(data, collect_packet, &packets);
+
+    if (err == 0 && packets.count < 3) {
+        perrf("Missing Vorbis header packets\n");
+
+        err = 1;
+    }
+
+    // The headers are decoded here first to learn the output format
+    vorbis_decoder* vd = vorbis_decoder_new();
+
+    for (uint32_t i = 0; i < 3 && err == 0; i++) {
+        err = decode_packet(vd, &packets, i);
+    }
+
+    wav_writer wav;
+    bool opened = false;
+
+    if (err == 0 && (err = open_wav(&wav, out, out_buffer, format, vorbis_decoder_channels(vd), vorbis_decoder_sample_rate(vd), info.sample_count)) == 0) {
+        opened = true;
+    }
+
+    if (err == 0) {
+        uint32_t range_count = (packets.count - 3 + DECODE_RANGE_PACKETS - 1) / DECODE_RANGE_PACKETS;
+        uint32_t threads = claim_decode_threads(range_count < DECODE_MAX_THREADS ? range_count : DECODE_MAX_THREADS);
+
+        // Short tracks aren't worth the extra header parsing per thread
+        if (threads > 1) {
+            err = decode_parallel(&packets, vorbis_decoder_channels(vd), range_count, threads, &wav);
+        } else {
+            err = decode_sequential(vd, &packets, &wav);
+        }
+
+        release_decode_threads(threads);
+    }
+
+    if (opened && wav_close(&wav) != 0) {
+        err = 1;
+    }
+
+    vorbis_decoder_free(vd);
+    free(packets.data);
+    free(packets.offsets);
+    free(packets.sizes);
+
+    return err;
+}
+
+// PCM data is already interleaved little endian, it's copied or converted block by block
+static errno_t create_wav_pcm(membuf* data, const wem_info info, FILE* out, membuf* out_buffer, pcm_format format) {
+    uint32_t bits = info.bits_per_sample;
+
+    if (bits != 16 && bits != 24 && bits != 32) {
+        perrf("Unsupported PCM sample size %u\n", bits);
+
+        return 1;
+    }
+
+    if (info.data_offset == 0) {
+        perrf("data chunk is required\n");
+
+        return 1;
+    }
+
+    if (format == PCM_FMT_NIL) {
+        format = bits == 16 ? PCM_FMT_S16 : (bits == 24 ? PCM_FMT_S24 : PCM_FMT_S32);
+    }
+
+    wav_writer wav;
+
+    if (open_wav(&wav, out, out_buffer, format, info.channels, info.sample_rate, info.sample_count) != 0) {
+        return 1;
+    }
+
+    errno_t err = wav_write_pcm(&wav, (const uint8_t*)&data->data[info.data_offset], bits, info.sample_count);
+
+    if (wav_close(&wav) != 0) {
+        err = 1;
+    }
+
+    return err;
+}
+
+static errno_t create_wav_adpcm(membuf* data, const wem_info info, FILE* out, membuf* out_buffer, pcm_format format) {
+    uint32_t block_samples = wwise_ima_block_samples(info.block_align, info.channels);
+
+    if (block_samples == 0) {
+        perrf("Invalid IMA ADPCM block size %u for %u channels\n", info.block_align, info.channels);
+
+        return 1;
+    }
+
+    if (info.data_offset == 0) {
+        perrf("data chunk is required\n");
+
+        return 1;
+    }
+
+    if (format == PCM_FMT_NIL) {
+        format = PCM_FMT_S16;
+    }
+
+    wav_writer wav;
+
+    if (open_wav(&wav, out, out_buffer, format, info.channels, info.sample_rate, info.sample_count) != 0) {
+        return 1;
+    }
+
+    const uint8_t* blocks = (const uint8_t*)&data->data[info.data_offset];
+    uint32_t block_count = (uint32_t)(info.data_size / info.block_align);
+    uint32_t tail = (uint32_t)(info.data_size % info.block_align);
+    int16_t* pcm = malloc((size_t)ADPCM_DECODE_BLOCKS * block_samples * info.channels * sizeof(int16_t));
+    errno_t err = 0;
+
+    for (uint32_t i = 0; i < block_count && err == 0; i += ADPCM_DECODE_BLOCKS) {
+        uint32_t n = block_count - i < ADPCM_DECODE_BLOCKS ? block_count - i : ADPCM_DECODE_BLOCKS;
+
+        wwise_ima_decode(&blocks[(size_t)i * info.block_align], n, info.block_align, info.channels, pcm);
+        err = wav_write_pcm(&wav, (const uint8_t*)pcm, 16, n * block_samples);
+    }
+
+    // The last block can be shorter, it's laid out the same way with less nibbles per channel
+    uint32_t tail_samples = wwise_ima_block_samples(tail, info.channels);
+
+    if (err == 0 && tail_samples != 0) {
+        wwise_ima_decode(&blocks[(size_t)block_count * info.block_align], 1, tail, info.channels, pcm);
+        err = wav_write_pcm(&wav, (const uint8_t*)pcm, 16, tail_samples);
+    }
+
+    free(pcm);
+
+    if (wav_close(&wav) != 0) {
+        err = 1;
+    }
+
+    return err;
+}
+
+// Decodes to whichever of the targets is set
+static errno_t convert_wav(membuf* data, FILE* out, membuf* out_buffer, pcm_format format) {
+    wem_info info;
+
+    if (read_wem_info(data, &info) != 0) {
+        return 1;
+    }
+
+    switch (info.codec) {
+        case WEM_CODEC_VORBIS:
+            return create_wav_vorbis(data, info, out, out_buffer, format == PCM_FMT_NIL ? PCM_FMT_F32 : format);
+        case WEM_CODEC_PCM:
+        case WEM_CODEC_PCM_EX:
+            return create_wav_pcm(data, info, out, out_buffer, format);
+        case WEM_CODEC_IMA_ADPCM:
+            return create_wav_adpcm(data, info, out, out_buffer, format);
+        default:
+            perrf("Unsupported WEM codec 0x%04X\n", info.codec);
+
+            return 1;
+    }
+}
+
+errno_t create_wav(membuf* data, FILE* out, pcm_format format) {
+    return convert_wav(data, out, NULL, format);
+}
+
+errno_t create_wav_buffer(membuf* data, membuf* out, pcm_format format) {
+    return convert_wav(data, NULL, out, format);
+}
@@ -3,5 +3,37 @@
 #include "defs.h"
 #include "bitmanip.h"
 
+// Basic stream information from a WEM's fmt, vorb and data chunks
+typedef struct wem_info {
+    uint16_t codec;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+
+    // Location of the data chunk's payload, data_offset is 0 if there's none
+    uint64_t data_offset;
+    uint64_t data_size;
+
+    // Number of sample frames, 0 if unknown
+    uint32_t sample_count;
+} wem_info;
+
+// Reads the stream information without rebuilding anything
+errno_t read_wem_info(membuf* data, wem_info* info);
+
 // Creates an ogg
-errno_t create_ogg(membuf* data, FILE* out);
\ No newline at end of file
+errno_t create_ogg(membuf* data, FILE* out);
+
+// Creates an ogg in memory, appended to out with membuf_write
+errno_t create_ogg_buffer(membuf* data, membuf* out);
+
+// Rebuilds the Vorbis packets and passes each one to sink instead of writing Ogg pages
+errno_t create_ogg_packets(membuf* data, packet_sink sink, void* ctx);
+
+// Decodes a Vorbis, PCM or IMA ADPCM WEM in-process and writes it to out as a WAV file
+// PCM_FMT_NIL keeps the codec's own sample format, out only has to be seekable for Vorbis
+errno_t create_wav(membuf* data, FILE* out, pcm_format format);
+
+// Same as create_wav, but the file is built in memory, appended to out with membuf_write, which has to be empty
+errno_t create_wav_buffer(membuf* data, membuf* out, pcm_format format);